@@ -16,6 +16,7 @@
 #include "u_file.h"
 #include "u_misc.h"
 #include "u_set.h"
+#include "u_thread.h"
 
 #include "m_vec.h"
 
@@ -1068,6 +1069,10 @@ static int entryPoint(int argc, char **argv) {
     int status = neoMain(gEngine.m_frameTimer, argc, argv, (bool &)gShutdown);
     writeConfig(gEngine.userPath());
 
+    // Jobs still on the worker pool use statics of other translation units,
+    // it has to stop before those are destroyed
+    u::stopWorkers();
+
     // Instance must be released before OpenGL context is lost
     r::geomMethods::instance().release();
 
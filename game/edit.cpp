@@ -78,8 +78,11 @@ void move() {
     if (gWorld.trace(q, &h, kMaxTraceDistance, false) && h.fraction > 0.01f) {
         direction *= (kMaxTraceDistance * h.fraction);
         m::vec3 *position = getEntityPosition();
-        if (position)
+        if (position) {
             *position = q.start + direction;
+            if (gSelected->type == entity::kMapModel)
+                gWorld.getMapModel(gSelected->index).dirty = true;
+        }
     }
 }
 
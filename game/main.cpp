@@ -7,8 +7,10 @@
 #include "cvar.h"
 #include "edit.h"
 
+#include "r_common.h"
 #include "r_pipeline.h"
 #include "r_gui.h"
+#include "r_texture.h"
 
 #include "u_file.h"
 #include "u_misc.h"
@@ -25,6 +27,7 @@ m::perspective gPerspective;
 VAR(float, cl_fov, "field of view", 45.0f, 270.0f, 90.0f);
 VAR(float, cl_nearp, "near plane", 0.0f, 10.0f, 0.1f);
 VAR(float, cl_farp, "far plane", 128.0f, 4096.0f, 2048.0f);
+VAR(int, cl_stats, "show rendering statistics", 0, 1, 0);
 
 static void setBinds() {
     neoBindSet("MouseDnL", []() {
@@ -208,6 +211,10 @@ int neoMain(frameTimer &timer, int, char **, bool &shutdown) {
         if (mouse.button & mouseState::kMouseButtonLeft && gSelected && !(gMenuState & kMenuEdit))
             edit::move();
 
+        // Whatever the worker pool decoded goes up before anything draws with
+        // it, the menu and GUI models load textures too
+        r::texture2D::uploadDecoded();
+
         if (gPlaying && gWorld.isLoaded()) {
             gWorld.upload(gPerspective);
             gl::ClearColor(0.0f, 0.0f, 0.0f, 0.0f);
@@ -283,6 +290,20 @@ int neoMain(frameTimer &timer, int, char **, bool &shutdown) {
             u::format("%d fps : %.2f mspf\n", timer.fps(), timer.mspf()).c_str(),
             gui::RGBA(255, 255, 255, 255));
 
+        // Everything since the last reset is one frame
+        if (cl_stats) {
+            gui::drawText(neoWidth(), 30, gui::kAlignRight,
+                u::format("%zu matrix multiplies : %zu saved\n", r::pipeline::multiplies(),
+                    r::pipeline::multipliesSaved()).c_str(),
+                gui::RGBA(255, 255, 255, 255));
+            gui::drawText(neoWidth(), 50, gui::kAlignRight,
+                u::format("%zu GL calls : %zu elided\n", gl::calls(),
+                    gl::callsElided()).c_str(),
+                gui::RGBA(255, 255, 255, 255));
+        }
+        r::pipeline::resetStats();
+        gl::resetStats();
+
         if (varGet<int>("cl_edit").get() && !(gMenuState & kMenuEdit)) {
             gui::drawText(neoWidth() / 2, neoHeight() - 20, gui::kAlignCenter, "F12 to toggle edit menu",
                 gui::RGBA(0, 0, 0, 255));
@@ -6,6 +6,8 @@
 #include "cvar.h"
 #include "grader.h"
 
+#include "r_texture.h"
+
 #include "u_set.h"
 #include "u_misc.h"
 #include "u_file.h"
@@ -230,12 +232,7 @@ static void menuDeveloper() {
             if (gui::check("Texture compression cache (on disk compression)", texcompcachezlib))
                 texcompcachezlib.toggle();
             if (gui::button("Clear texture cache")) {
-                const u::string cachePath = neoUserPath() + "cache";
-                for (const auto &it : u::dir(cachePath)) {
-                    const u::string cacheFile = cachePath + u::kPathSep + it;
-                    if (u::remove(cacheFile))
-                        u::print("[cache] => removed cache%c%.50s...\n", u::kPathSep, it);
-                }
+                r::texture2D::clearCache();
                 u::print("[cache] => cleared\n");
             }
             gui::label("Texture filtering");
@@ -415,12 +412,14 @@ static void menuEdit() {
                 gui::value("Model");
                 gui::label("Scale");
                 gui::indent();
-                    gui::slider("X", mm.scale.x, 0.0f, 10.0f, 0.1f);
-                    gui::slider("Y", D(lockScale) ? mm.scale.x : mm.scale.y, 0.0f, 10.0f, 0.1f);
-                    gui::slider("Z", D(lockScale) ? mm.scale.x : mm.scale.z, 0.0f, 10.0f, 0.1f);
+                    mm.dirty |= gui::slider("X", mm.scale.x, 0.0f, 10.0f, 0.1f);
+                    mm.dirty |= gui::slider("Y", D(lockScale) ? mm.scale.x : mm.scale.y, 0.0f, 10.0f, 0.1f);
+                    mm.dirty |= gui::slider("Z", D(lockScale) ? mm.scale.x : mm.scale.z, 0.0f, 10.0f, 0.1f);
                     gui::separator();
-                    if (gui::check("Lock", D(lockScale)))
+                    if (gui::check("Lock", D(lockScale))) {
                         D(lockScale) = !D(lockScale);
+                        mm.dirty = true;
+                    }
                     if (D(lockScale)) {
                         mm.scale.y = mm.scale.x;
                         mm.scale.z = mm.scale.x;
@@ -428,9 +427,9 @@ static void menuEdit() {
                 gui::dedent();
                 gui::label("Rotate");
                 gui::indent();
-                    gui::slider("X", mm.rotate.x, 0.0f, 360.0f, 0.1f);
-                    gui::slider("Y", mm.rotate.y, 0.0f, 360.0f, 0.1f);
-                    gui::slider("Z", mm.rotate.z, 0.0f, 360.0f, 0.1f);
+                    mm.dirty |= gui::slider("X", mm.rotate.x, 0.0f, 360.0f, 0.1f);
+                    mm.dirty |= gui::slider("Y", mm.rotate.y, 0.0f, 360.0f, 0.1f);
+                    mm.dirty |= gui::slider("Z", mm.rotate.z, 0.0f, 360.0f, 0.1f);
                 gui::dedent();
                 gui::separator();
                 if (gui::button("Delete")) {
@@ -8,6 +8,13 @@ in vec4 weights;
 in vec4 bones;
 #endif
 
+#ifdef USE_INSTANCED
+// The world matrix of the instance. It arrives transposed as the rows are
+// uploaded where the columns are expected, so it multiplies on the right
+in mat4 instanceWorld;
+#endif
+
+// The view-projection alone when instanced
 uniform mat4 gWVP;
 uniform mat4 gWorld;
 
@@ -44,8 +51,12 @@ void main() {
     normal0 = (gWorld * vec4(normal * trans, 0.0f)).xyz;
     tangent0 = (gWorld * vec4(tangent.xyz * trans, 0.0f)).xyz;
     bitangent0 = tangent.w * cross(normal0, tangent0);
+#else
+#ifdef USE_INSTANCED
+    gl_Position = gWVP * (vec4(position, 1.0f) * instanceWorld);
 #else
     gl_Position = gWVP * vec4(position, 1.0f);
+#endif
     texCoord0 = texCoord;
     normal0 = (gWorld * vec4(normal, 0.0f)).xyz;
     tangent0 = (gWorld * vec4(tangent.xyz, 0.0f)).xyz;
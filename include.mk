@@ -33,9 +33,11 @@ RENDERER_SOURCES = \
 UTIL_SOURCES = \
 	u_file.cpp \
 	u_misc.cpp \
+	u_murmur3.cpp \
 	u_new.cpp \
 	u_sha512.cpp \
 	u_string.cpp \
+	u_thread.cpp \
 	u_zlib.cpp \
 
 ENGINE_SOURCES = \
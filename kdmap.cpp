@@ -1,10 +1,70 @@
 #include <string.h>
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "kdmap.h"
 
 #include "u_zlib.h"
+#include "u_file.h"
 #include "u_misc.h"
 
+///!kdCollisionTriangles
+void kdCollisionTriangles::resize(size_t count) {
+    for (size_t i = 0; i < 3; i++) {
+        x[i].resize(count + kPadding, 0.0f);
+        y[i].resize(count + kPadding, 0.0f);
+        z[i].resize(count + kPadding, 0.0f);
+    }
+    nx.resize(count + kPadding, 0.0f);
+    ny.resize(count + kPadding, 0.0f);
+    nz.resize(count + kPadding, 0.0f);
+    d.resize(count + kPadding, 0.0f);
+    q1q2.resize(count + kPadding, 0.0f);
+    q1Squared.resize(count + kPadding, 0.0f);
+    q2Squared.resize(count + kPadding, 0.0f);
+    invertDet.resize(count + kPadding, 0.0f);
+}
+
+void kdCollisionTriangles::destroy() {
+    for (size_t i = 0; i < 3; i++) {
+        x[i].destroy();
+        y[i].destroy();
+        z[i].destroy();
+    }
+    nx.destroy();
+    ny.destroy();
+    nz.destroy();
+    d.destroy();
+    q1q2.destroy();
+    q1Squared.destroy();
+    q2Squared.destroy();
+    invertDet.destroy();
+}
+
+void kdCollisionTriangles::set(size_t index, const m::vec3 &p0, const m::vec3 &p1, const m::vec3 &p2) {
+    const m::vec3 *const p[3] = { &p0, &p1, &p2 };
+    for (size_t i = 0; i < 3; i++) {
+        x[i][index] = p[i]->x;
+        y[i][index] = p[i]->y;
+        z[i][index] = p[i]->z;
+    }
+    const m::plane plane(p0, p1, p2);
+    nx[index] = plane.n.x;
+    ny[index] = plane.n.y;
+    nz[index] = plane.n.z;
+    d[index] = plane.d;
+    const m::vec3 q1 = p1 - p0;
+    const m::vec3 q2 = p2 - p0;
+    q1q2[index] = q1 * q2;
+    q1Squared[index] = q1*q1;
+    q2Squared[index] = q2*q2;
+    invertDet[index] = 1.0f / (q1Squared[index] * q2Squared[index] - q1q2[index] * q1q2[index]);
+}
+
 ///!kdMap
 kdMap::kdMap() {
     // nothing
@@ -15,10 +75,10 @@ kdMap::~kdMap() {
 }
 
 void kdMap::unload() {
-    planes.destroy();
     textures.destroy();
     nodes.destroy();
-    leafs.destroy();
+    leafTriangles.destroy();
+    collision.destroy();
     triangles.destroy();
     vertices.destroy();
     entities.destroy();
@@ -39,7 +99,39 @@ bool kdMap::load(const u::vector<unsigned char> &compressedData) {
     u::vector<unsigned char> data;
     if (!u::zlib::decompress(data, compressedData))
         return false;
+    return unserialize(data);
+}
 
+bool kdMap::load(u::file &fp) {
+    // Only one chunk of the compressed map is resident at any time
+    static constexpr size_t kChunkSize = 64 << 10;
+    u::vector<unsigned char> chunk(kChunkSize);
+    u::vector<unsigned char> data(kChunkSize);
+    u::zlib::inflateStream stream;
+    size_t pos = 0;
+    for (;;) {
+        size_t written;
+        const auto status = stream.inflate(&data[pos], data.size() - pos, &written);
+        pos += written;
+        if (status == u::zlib::inflateStream::kFinished)
+            break;
+        if (status == u::zlib::inflateStream::kError)
+            return false;
+        if (status == u::zlib::inflateStream::kNeedOutput) {
+            data.resize(data.size() * 2);
+            continue;
+        }
+        const size_t read = fread(&chunk[0], 1, kChunkSize, fp);
+        if (read == 0) // truncated
+            return false;
+        stream.input(&chunk[0], read);
+    }
+    chunk.destroy();
+    data.resize(pos);
+    return unserialize(data);
+}
+
+bool kdMap::unserialize(const u::vector<unsigned char> &data) {
     size_t seek;
     kdBinHeader header;
     seek = mapUnserialize(&header, data);
@@ -78,53 +170,52 @@ bool kdMap::load(const u::vector<unsigned char> &compressedData) {
     entEntry.endianSwap();
     leafEntry.endianSwap();
 
-    planes.resize(planeEntry.length / sizeof(kdBinPlane));
+    u::vector<kdBinPlane> planes(planeEntry.length / sizeof(kdBinPlane));
+    u::vector<kdBinNode> binNodes(nodeEntry.length / sizeof(kdBinNode));
     textures.resize(textureEntry.length / sizeof(kdBinTexture));
-    nodes.resize(nodeEntry.length / sizeof(kdBinNode));
     triangles.resize(triangleEntry.length / sizeof(kdBinTriangle));
     vertices.resize(vertexEntry.length / sizeof(kdBinVertex));
     entities.resize(entEntry.length / sizeof(kdBinEnt));
-    leafs.resize(leafEntry.length);
 
     // read all planes
-    kdBinPlane plane;
     seek = planeEntry.offset;
     for (size_t i = 0; i < planes.size(); i++) {
-        seek = mapUnserialize(&plane, data, seek);
-        plane.endianSwap();
-        if (plane.type > 2) {
+        seek = mapUnserialize(&planes[i], data, seek);
+        planes[i].endianSwap();
+        if (planes[i].type > 2) {
             // The only valid planes are 0, 1, 2 (x, y, z)
             unload();
             return false;
         }
-        planes[i].d = plane.d;
-        planes[i].n = m::vec3::getAxis((m::axis)plane.type);
     }
 
     mapUnserialize(&textures[0], data, textureEntry.offset, textures.size());
-    mapUnserialize(&nodes[0], data, nodeEntry.offset, nodes.size());
+    mapUnserialize(&binNodes[0], data, nodeEntry.offset, binNodes.size());
     mapUnserialize(&triangles[0], data, triangleEntry.offset, triangles.size());
     mapUnserialize(&vertices[0], data, vertexEntry.offset, vertices.size());
     mapUnserialize(&entities[0], data, entEntry.offset, entities.size());
 
     //for (auto &it : textures)  it.endianSwap();
-    for (auto &it : nodes)     it.endianSwap();
+    for (auto &it : binNodes)  it.endianSwap();
     for (auto &it : triangles) it.endianSwap();
     for (auto &it : vertices)  it.endianSwap();
     for (auto &it : entities)  it.endianSwap();
 
-    // triangle indices of the leafs
+    // triangle indices of the leafs, gathered into one array
+    u::vector<uint32_t> leafFirst(leafEntry.length);
+    u::vector<uint32_t> leafCount(leafEntry.length);
     seek = leafEntry.offset;
     uint32_t triangleCount;
     uint32_t triangleIndex;
     for (size_t i = 0; i < leafEntry.length; i++) {
         seek = mapUnserialize(&triangleCount, data, seek);
         triangleCount = u::endianSwap(triangleCount);
-        leafs[i].triangles.reserve(triangleCount);
+        leafFirst[i] = leafTriangles.size();
+        leafCount[i] = triangleCount;
         for (size_t j = 0; j < triangleCount; j++) {
             seek = mapUnserialize(&triangleIndex, data, seek);
             triangleIndex = u::endianSwap(triangleIndex);
-            leafs[i].triangles.push_back(triangleIndex);
+            leafTriangles.push_back(triangleIndex);
         }
     }
 
@@ -136,17 +227,22 @@ bool kdMap::load(const u::vector<unsigned char> &compressedData) {
         return false;
 
     // verify the indices are within a valid range
-    for (size_t i = 0; i < nodes.size(); i++) {
+    for (size_t i = 0; i < binNodes.size(); i++) {
+        if (binNodes[i].plane >= planes.size()) {
+            unload();
+            return false;
+        }
         for (size_t k = 0; k < 2; k++) {
-            if (nodes[i].children[k] < 0) {
+            if (binNodes[i].children[k] < 0) {
                 // leaf index
-                if (-nodes[i].children[k]-1 >= (int32_t)leafs.size()) {
+                if (-binNodes[i].children[k]-1 >= (int32_t)leafEntry.length) {
                     // invalid leaf pointer
                     unload();
                     return false;
                 }
             } else {
-                if (nodes[i].children[k] >= (int32_t)nodes.size()) {
+                // children always follow their parent, which also rules out cycles
+                if (binNodes[i].children[k] >= (int32_t)binNodes.size() || binNodes[i].children[k] <= (int32_t)i) {
                     // invalid node pointer
                     unload();
                     return false;
@@ -154,16 +250,62 @@ bool kdMap::load(const u::vector<unsigned char> &compressedData) {
             }
         }
     }
+
+    for (const auto &it : triangles) {
+        if (it.v[0] >= vertices.size() || it.v[1] >= vertices.size() || it.v[2] >= vertices.size()) {
+            unload();
+            return false;
+        }
+    }
+
+    // gather the collision data of the leaf triangles
+    collision.resize(leafTriangles.size());
+    for (size_t i = 0; i < leafTriangles.size(); i++) {
+        if (leafTriangles[i] >= triangles.size()) {
+            unload();
+            return false;
+        }
+        const kdBinTriangle &it = triangles[leafTriangles[i]];
+        collision.set(i, vertices[it.v[0]].vertex, vertices[it.v[1]].vertex, vertices[it.v[2]].vertex);
+    }
+
+    // flatten into the runtime layout
+    if (binNodes.size()) {
+        nodes.resize(1);
+        if (!flatten(binNodes, planes, leafFirst, leafCount, 0, 0, 0)) {
+            // too deep for the traversal stack
+            unload();
+            return false;
+        }
+    }
     return true;
 }
 
-bool kdMap::sphereTriangleIntersectStatic(size_t triangleIndex, const m::vec3 &spherePosition, float sphereRadius) const {
-    const size_t vertexIndex1 = triangles[triangleIndex].v[0];
-    const size_t vertexIndex2 = triangles[triangleIndex].v[1];
-    const size_t vertexIndex3 = triangles[triangleIndex].v[2];
-    const m::vec3 &oa = vertices[vertexIndex1].vertex;
-    const m::vec3 &ob = vertices[vertexIndex2].vertex;
-    const m::vec3 &oc = vertices[vertexIndex3].vertex;
+bool kdMap::flatten(const u::vector<kdBinNode> &binNodes, const u::vector<kdBinPlane> &planes,
+    const u::vector<uint32_t> &leafFirst, const u::vector<uint32_t> &leafCount, int32_t binNode,
+    size_t node, size_t depth)
+{
+    if (depth > kMaxDepth)
+        return false;
+    if (binNode < 0) {
+        const size_t leaf = -binNode - 1;
+        nodes[node].firstTriangle = leafFirst[leaf];
+        nodes[node].data = (leafCount[leaf] << 2) | kdMapNode::kLeaf;
+        return true;
+    }
+    const kdBinNode &it = binNodes[binNode];
+    const size_t children = nodes.size();
+    nodes.resize(children + 2);
+    nodes[node].distance = planes[it.plane].d;
+    nodes[node].data = (children << 2) | planes[it.plane].type;
+    return flatten(binNodes, planes, leafFirst, leafCount, it.children[0], children, depth + 1)
+        && flatten(binNodes, planes, leafFirst, leafCount, it.children[1], children + 1, depth + 1);
+}
+
+bool kdMap::sphereTriangleIntersectStatic(size_t index, const m::vec3 &spherePosition, float sphereRadius) const {
+    const m::vec3 oa = collision.vertex(index, 0);
+    const m::vec3 ob = collision.vertex(index, 1);
+    const m::vec3 oc = collision.vertex(index, 2);
     const m::vec3 A = oa - spherePosition;
     const m::vec3 B = ob - spherePosition;
     const m::vec3 C = oc - spherePosition;
@@ -202,19 +344,17 @@ bool kdMap::sphereTriangleIntersectStatic(size_t triangleIndex, const m::vec3 &s
     return !(sep1 | sep2 | sep3 | sep4 | sep5 | sep6 | sep7);
 }
 
-bool kdMap::sphereTriangleIntersect(size_t triangleIndex, const m::vec3 &spherePosition,
+bool kdMap::sphereTriangleIntersect(size_t index, const m::vec3 &spherePosition,
     float sphereRadius, const m::vec3 &direction, float *fraction, m::vec3 *hitNormal, m::vec3 *hitPoint) const
 {
     // sweeping collision check
+    const m::vec3 p[3] = {
+        collision.vertex(index, 0),
+        collision.vertex(index, 1),
+        collision.vertex(index, 2)
+    };
 
-    const size_t v1 = triangles[triangleIndex].v[0];
-    const size_t v2 = triangles[triangleIndex].v[1];
-    const size_t v3 = triangles[triangleIndex].v[2];
-    const m::vec3 &p0 = vertices[v1].vertex;
-    const m::vec3 &p1 = vertices[v2].vertex;
-    const m::vec3 &p2 = vertices[v3].vertex;
-
-    m::plane plane(p0, p1, p2); // triangle plane
+    m::plane plane = collision.plane(index); // triangle plane
     plane.d -= sphereRadius;
 
     *fraction = kdTree::kMaxTraceDistance;
@@ -227,13 +367,13 @@ bool kdMap::sphereTriangleIntersect(size_t triangleIndex, const m::vec3 &sphereP
         const m::vec3 checkHitPoint = spherePosition + direction * fractional - plane.n * sphereRadius;
 
         // check if inside the triangle using barycentric coordinates
-        const m::vec3 r = checkHitPoint - p0;
-        const m::vec3 q1 = p1 - p0;
-        const m::vec3 q2 = p2 - p0;
-        const float q1q2 = q1 * q2;
-        const float q1Squared = q1*q1;
-        const float q2Squared = q2*q2;
-        const float invertDet = 1.0f / (q1Squared * q2Squared - q1q2 * q1q2);
+        const m::vec3 r = checkHitPoint - p[0];
+        const m::vec3 q1 = p[1] - p[0];
+        const m::vec3 q2 = p[2] - p[0];
+        const float q1q2 = collision.q1q2[index];
+        const float q1Squared = collision.q1Squared[index];
+        const float q2Squared = collision.q2Squared[index];
+        const float invertDet = collision.invertDet[index];
         const float rq1 = r * q1;
         const float rq2 = r * q2;
         const float w1 = invertDet * (q2Squared * rq1 - q1q2 * rq2);
@@ -249,9 +389,8 @@ bool kdMap::sphereTriangleIntersect(size_t triangleIndex, const m::vec3 &sphereP
 
     // edge detection (for all edges of a triangle)
     for (size_t i = 0; i < 3; i++) {
-        const m::vec3 &from = vertices[triangles[triangleIndex].v[i]].vertex;
-        const size_t nextIndex = (i + 1) % 3;
-        const m::vec3 &to = vertices[triangles[triangleIndex].v[nextIndex]].vertex;
+        const m::vec3 &from = p[i];
+        const m::vec3 &to = p[(i + 1) % 3];
 
         if (!m::vec3::rayCylinderIntersect(spherePosition, direction, from, to, sphereRadius, &fractional))
             continue;
@@ -268,7 +407,7 @@ bool kdMap::sphereTriangleIntersect(size_t triangleIndex, const m::vec3 &sphereP
 
     // vertex detection
     for (size_t i = 0; i < 3; i++) {
-        const m::vec3 &vertex = vertices[triangles[triangleIndex].v[i]].vertex;
+        const m::vec3 &vertex = p[i];
 
         if (!m::vec3::raySphereIntersect(spherePosition, direction, vertex, sphereRadius, &fractional))
             continue;
@@ -284,76 +423,439 @@ bool kdMap::sphereTriangleIntersect(size_t triangleIndex, const m::vec3 &sphereP
     return *fraction != kdTree::kMaxTraceDistance;
 }
 
+#if defined(__AVX__) || defined(__SSE2__)
+// Sweeps a sphere against kdSweepLanes::kCount consecutive entries of the
+// collision data at once. Every lane does exactly what sphereTriangleIntersect
+// does for one triangle, only the face, edge and vertex tests are all evaluated
+// and the winner selected with masks instead of branches.
+#if defined(__AVX__)
+struct kdLanes { __m256 v; };
+static constexpr size_t kLaneCount = 8;
+static inline kdLanes kdSplat(float f) { return { _mm256_set1_ps(f) }; }
+static inline kdLanes kdLoad(const float *p) { return { _mm256_loadu_ps(p) }; }
+static inline void kdStore(float *p, kdLanes v) { _mm256_storeu_ps(p, v.v); }
+static inline kdLanes operator+(kdLanes a, kdLanes b) { return { _mm256_add_ps(a.v, b.v) }; }
+static inline kdLanes operator-(kdLanes a, kdLanes b) { return { _mm256_sub_ps(a.v, b.v) }; }
+static inline kdLanes operator*(kdLanes a, kdLanes b) { return { _mm256_mul_ps(a.v, b.v) }; }
+static inline kdLanes operator/(kdLanes a, kdLanes b) { return { _mm256_div_ps(a.v, b.v) }; }
+static inline kdLanes kdSqrt(kdLanes a) { return { _mm256_sqrt_ps(a.v) }; }
+static inline kdLanes kdAnd(kdLanes a, kdLanes b) { return { _mm256_and_ps(a.v, b.v) }; }
+static inline kdLanes kdAndNot(kdLanes a, kdLanes b) { return { _mm256_andnot_ps(a.v, b.v) }; } // ~a & b
+static inline kdLanes kdOr(kdLanes a, kdLanes b) { return { _mm256_or_ps(a.v, b.v) }; }
+static inline kdLanes kdLess(kdLanes a, kdLanes b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+static inline kdLanes kdLessEqual(kdLanes a, kdLanes b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+static inline kdLanes kdEqual(kdLanes a, kdLanes b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ) }; }
+static inline int kdMask(kdLanes a) { return _mm256_movemask_ps(a.v); }
+static inline kdLanes kdNeg(kdLanes a) { return { _mm256_xor_ps(a.v, _mm256_set1_ps(-0.0f)) }; }
+#else
+struct kdLanes { __m128 v; };
+static constexpr size_t kLaneCount = 4;
+static inline kdLanes kdSplat(float f) { return { _mm_set1_ps(f) }; }
+static inline kdLanes kdLoad(const float *p) { return { _mm_loadu_ps(p) }; }
+static inline void kdStore(float *p, kdLanes v) { _mm_storeu_ps(p, v.v); }
+static inline kdLanes operator+(kdLanes a, kdLanes b) { return { _mm_add_ps(a.v, b.v) }; }
+static inline kdLanes operator-(kdLanes a, kdLanes b) { return { _mm_sub_ps(a.v, b.v) }; }
+static inline kdLanes operator*(kdLanes a, kdLanes b) { return { _mm_mul_ps(a.v, b.v) }; }
+static inline kdLanes operator/(kdLanes a, kdLanes b) { return { _mm_div_ps(a.v, b.v) }; }
+static inline kdLanes kdSqrt(kdLanes a) { return { _mm_sqrt_ps(a.v) }; }
+static inline kdLanes kdAnd(kdLanes a, kdLanes b) { return { _mm_and_ps(a.v, b.v) }; }
+static inline kdLanes kdAndNot(kdLanes a, kdLanes b) { return { _mm_andnot_ps(a.v, b.v) }; } // ~a & b
+static inline kdLanes kdOr(kdLanes a, kdLanes b) { return { _mm_or_ps(a.v, b.v) }; }
+static inline kdLanes kdLess(kdLanes a, kdLanes b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+static inline kdLanes kdLessEqual(kdLanes a, kdLanes b) { return { _mm_cmple_ps(a.v, b.v) }; }
+static inline kdLanes kdEqual(kdLanes a, kdLanes b) { return { _mm_cmpeq_ps(a.v, b.v) }; }
+static inline int kdMask(kdLanes a) { return _mm_movemask_ps(a.v); }
+static inline kdLanes kdNeg(kdLanes a) { return { _mm_xor_ps(a.v, _mm_set1_ps(-0.0f)) }; }
+#endif
+
+static inline kdLanes kdSelect(kdLanes mask, kdLanes a, kdLanes b) {
+    return kdOr(kdAnd(mask, a), kdAndNot(mask, b));
+}
+
+static inline kdLanes kdAbs(kdLanes a) {
+    return kdAndNot(kdSplat(-0.0f), a);
+}
+
+struct kdVecLanes {
+    kdLanes x, y, z;
+};
+
+static inline kdVecLanes operator+(const kdVecLanes &a, const kdVecLanes &b) {
+    return { a.x + b.x, a.y + b.y, a.z + b.z };
+}
+
+static inline kdVecLanes operator-(const kdVecLanes &a, const kdVecLanes &b) {
+    return { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+static inline kdVecLanes operator*(const kdVecLanes &a, kdLanes value) {
+    return { a.x * value, a.y * value, a.z * value };
+}
+
+static inline kdLanes operator*(const kdVecLanes &a, const kdVecLanes &b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static inline kdVecLanes operator^(const kdVecLanes &a, const kdVecLanes &b) {
+    return { a.y * b.z - a.z * b.y,
+             a.z * b.x - a.x * b.z,
+             a.x * b.y - a.y * b.x };
+}
+
+static inline kdVecLanes kdSelect(kdLanes mask, const kdVecLanes &a, const kdVecLanes &b) {
+    return { kdSelect(mask, a.x, b.x), kdSelect(mask, a.y, b.y), kdSelect(mask, a.z, b.z) };
+}
+
+static inline kdVecLanes kdNormalized(const kdVecLanes &a) {
+    return a * (kdSplat(1.0f) / kdSqrt(a * a));
+}
+
+struct kdSweepLanes {
+    static constexpr size_t kCount = kLaneCount;
+
+    float fraction[kCount];
+    float normal[3][kCount];
+    float point[3][kCount];
+    int hits; // bit set for every lane which hit
+};
+
+static void kdSweepTriangles(const kdCollisionTriangles &collision, size_t index,
+    const kdSphereTrace &trace, kdSweepLanes *out)
+{
+    const kdLanes zero = kdSplat(0.0f);
+    const kdLanes one = kdSplat(1.0f);
+    const kdLanes radius = kdSplat(trace.radius);
+    const kdLanes radiusSquared = radius * radius;
+    const kdVecLanes start = { kdSplat(trace.start.x), kdSplat(trace.start.y), kdSplat(trace.start.z) };
+    const kdVecLanes direction = { kdSplat(trace.direction.x), kdSplat(trace.direction.y), kdSplat(trace.direction.z) };
+    const kdLanes directionSquared = direction * direction;
+
+    kdVecLanes p[3];
+    for (size_t i = 0; i < 3; i++)
+        p[i] = { kdLoad(&collision.x[i][index]), kdLoad(&collision.y[i][index]), kdLoad(&collision.z[i][index]) };
+
+    // triangle face check
+    const kdVecLanes n = { kdLoad(&collision.nx[index]), kdLoad(&collision.ny[index]), kdLoad(&collision.nz[index]) };
+    const kdLanes d = kdLoad(&collision.d[index]) - radius;
+    const kdLanes q = n * direction;
+    const kdLanes parallel = kdLess(kdAbs(q), kdSplat(m::kEpsilon));
+    const kdLanes fractional = kdNeg(n * start + d) / q;
+    const kdVecLanes faceHitPoint = (start + direction * fractional) - n * radius;
+
+    // check if inside the triangle using barycentric coordinates
+    const kdVecLanes r = faceHitPoint - p[0];
+    const kdLanes q1q2 = kdLoad(&collision.q1q2[index]);
+    const kdLanes q1Squared = kdLoad(&collision.q1Squared[index]);
+    const kdLanes q2Squared = kdLoad(&collision.q2Squared[index]);
+    const kdLanes invertDet = kdLoad(&collision.invertDet[index]);
+    const kdLanes rq1 = r * (p[1] - p[0]);
+    const kdLanes rq2 = r * (p[2] - p[0]);
+    const kdLanes w1 = invertDet * (q2Squared * rq1 - q1q2 * rq2);
+    const kdLanes w2 = invertDet * (kdNeg(q1q2) * rq1 + q1Squared * rq2);
+    const kdLanes face = kdAndNot(parallel,
+        kdAnd(kdAnd(kdLessEqual(zero, fractional), kdLessEqual(zero, w1)),
+              kdAnd(kdLessEqual(zero, w2), kdLessEqual(w1 + w2, one))));
+
+    kdLanes fraction = kdSplat(kdTree::kMaxTraceDistance);
+    kdVecLanes hitNormal = { zero, zero, zero };
+    kdVecLanes hitPoint = { zero, zero, zero };
+
+    // edge detection (for all edges of a triangle)
+    for (size_t i = 0; i < 3; i++) {
+        const kdVecLanes &from = p[i];
+        const kdVecLanes &to = p[(i + 1) % 3];
+
+        // m::vec3::rayCylinderIntersect
+        const kdVecLanes pa = to - from;
+        const kdVecLanes s0 = start - from;
+        const kdLanes paSquared = pa * pa;
+        const kdLanes paInvSquared = one / paSquared;
+        const kdLanes pva = direction * pa;
+        const kdLanes a = directionSquared - pva * pva * paInvSquared;
+        const kdLanes ps0a = s0 * pa;
+        const kdLanes b = s0 * direction - ps0a * pva * paInvSquared;
+        const kdLanes c = (s0 * s0) - radiusSquared - ps0a * ps0a * paInvSquared;
+        const kdLanes distance = b * b - a * c;
+        const kdLanes edgeFraction = (kdNeg(b) - kdSqrt(distance)) / a;
+        const kdLanes collide = ((start + direction * edgeFraction) - from) * pa;
+        const kdLanes miss = kdOr(kdLess(distance, zero), kdEqual(a, zero));
+        const kdLanes take = kdAndNot(miss,
+            kdAnd(kdAnd(kdLessEqual(zero, collide), kdLessEqual(collide, paSquared)),
+                  kdAnd(kdLess(edgeFraction, fraction), kdLessEqual(zero, edgeFraction))));
+
+        const kdVecLanes edgeHitPoint = start + direction * edgeFraction;
+        const kdVecLanes normal = (from - edgeHitPoint) ^ (to - edgeHitPoint);
+        fraction = kdSelect(take, edgeFraction, fraction);
+        hitPoint = kdSelect(take, edgeHitPoint, hitPoint);
+        hitNormal = kdSelect(take, kdNormalized(normal ^ pa), hitNormal);
+    }
+
+    // vertex detection
+    for (size_t i = 0; i < 3; i++) {
+        // m::vec3::raySphereIntersect
+        const kdVecLanes s = start - p[i];
+        const kdLanes b = direction * s;
+        const kdLanes c = (s * s) - radiusSquared;
+        const kdLanes t = b * b - directionSquared * c;
+        const kdLanes vertexFraction = kdNeg(b + kdAbs(kdSqrt(t))) / directionSquared;
+        const kdLanes take = kdAndNot(kdLessEqual(t, zero),
+            kdAnd(kdLess(vertexFraction, fraction), kdLessEqual(zero, vertexFraction)));
+
+        const kdVecLanes vertexHitPoint = start + direction * vertexFraction;
+        fraction = kdSelect(take, vertexFraction, fraction);
+        hitPoint = kdSelect(take, vertexHitPoint, hitPoint);
+        hitNormal = kdSelect(take, kdNormalized(vertexHitPoint - p[i]), hitNormal);
+    }
+
+    // a face hit returns before the edges and vertices are looked at
+    fraction = kdSelect(face, fractional, fraction);
+    hitPoint = kdSelect(face, faceHitPoint, hitPoint);
+    hitNormal = kdSelect(face, n, hitNormal);
+
+    kdStore(out->fraction, fraction);
+    kdStore(out->normal[0], hitNormal.x);
+    kdStore(out->normal[1], hitNormal.y);
+    kdStore(out->normal[2], hitNormal.z);
+    kdStore(out->point[0], hitPoint.x);
+    kdStore(out->point[1], hitPoint.y);
+    kdStore(out->point[2], hitPoint.z);
+    out->hits = kdMask(kdOr(face, kdLess(fraction, kdSplat(kdTree::kMaxTraceDistance))));
+}
+#endif
+
+#ifdef DEBUG_KDMAP
+#ifdef __FAST_MATH__
+#warning "DEBUG_KDMAP needs -fno-fast-math, otherwise the sweeps round differently"
+#endif
+// The vector sweep has to agree with sphereTriangleIntersect. Both evaluate
+// the same expressions in the same order so only the rounding of sqrt and
+// division may differ between them. Every trace of a DEBUG_KDMAP build is
+// checked against every triangle it sweeps, a disagreement prints the sphere
+// so it can be traced again on its own. With -ffast-math spheres grazing an
+// edge hit in one and miss in the other, no tolerance on the fraction hides
+// that, so the check is only meaningful without it.
+static bool kdSweepAgrees(bool hit, float fraction, const m::vec3 &normal,
+    bool checkHit, float checkFraction, const m::vec3 &checkNormal)
+{
+    if (hit != checkHit)
+        return false;
+    if (!hit)
+        return true;
+    const float tolerance = 1e-5f * u::max(1.0f, m::abs(checkFraction));
+    return m::abs(fraction - checkFraction) <= tolerance && normal * checkNormal >= 0.9999f;
+}
+#endif
+
 void kdMap::traceSphere(kdSphereTrace *trace) const {
     trace->fraction = kdTree::kMaxTraceDistance;
-    traceSphere(trace, 0);
+    if (nodes.size())
+        tracePacket(&trace, 1);
 }
 
-void kdMap::traceSphere(kdSphereTrace *trace, int32_t node) const {
-    if (node < 0) {
-        // leaf node
-        const size_t leafIndex = -node - 1;
-        const size_t triangleCount = leafs[leafIndex].triangles.size();
+// Spreads the low ten bits of `x' out to every third bit
+static uint32_t kdMapMortonSpread(uint32_t x) {
+    x = (x | (x << 16)) & 0x030000FF;
+    x = (x | (x << 8)) & 0x0300F00F;
+    x = (x | (x << 4)) & 0x030C30C3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+}
 
-        float fraction = 0.0f;
-        float minFraction = trace->fraction;
-        m::plane hitPlane;
-        m::vec3 hitNormal;
-        m::vec3 hitPoint;
-        m::vec3 normal;
+void kdMap::traceSpheres(kdSphereTrace *traces, size_t count) const {
+    for (size_t i = 0; i < count; i++)
+        traces[i].fraction = kdTree::kMaxTraceDistance;
+    if (nodes.empty() || count == 0)
+        return;
 
-        // check every triangle in the leaf
-        for (size_t i = 0; i < triangleCount; i++) {
-            const size_t triangleIndex = leafs[leafIndex].triangles[i];
-            // did we collide against a triangle in this leaf?
-            if (sphereTriangleIntersect(triangleIndex, trace->start, trace->radius,
-                    trace->direction, &fraction, &hitNormal, &hitPoint))
-            {
-                // safely shift along the traced path, keeping the sphere kDistEpsilon
-                // away from the plane along the planes normal.
-                fraction += kDistEpsilon / (hitNormal * trace->direction);
-                if (fraction < kMinFraction)
-                    fraction = 0.0f; // prevent small noise
-                if (fraction < minFraction) {
-                    hitPlane.setupPlane(hitPoint, hitNormal);
-                    trace->plane = hitPlane;
-                    trace->fraction = fraction;
-                    minFraction = fraction;
-                }
-            }
+    // order the queries along a morton curve through their start points so a
+    // packet covers one small region of the map
+    m::vec3 min = traces[0].start;
+    m::vec3 max = traces[0].start;
+    for (size_t i = 1; i < count; i++) {
+        min = m::vec3::min(min, traces[i].start);
+        max = m::vec3::max(max, traces[i].start);
+    }
+    m::vec3 scale = max - min;
+    for (size_t i = 0; i < 3; i++)
+        scale[i] = scale[i] > 0.0f ? 1023.0f / scale[i] : 0.0f;
+
+    u::vector<uint32_t> keys(count);
+    u::vector<uint32_t> order(count);
+    for (size_t i = 0; i < count; i++) {
+        const m::vec3 cell = (traces[i].start - min);
+        keys[i] = kdMapMortonSpread(uint32_t(cell.x * scale.x))
+               | (kdMapMortonSpread(uint32_t(cell.y * scale.y)) << 1)
+               | (kdMapMortonSpread(uint32_t(cell.z * scale.z)) << 2);
+        order[i] = i;
+    }
+
+    // least significant digit radix sort on the 30-bit keys
+    u::vector<uint32_t> swapKeys(count);
+    u::vector<uint32_t> swapOrder(count);
+    for (size_t shift = 0; shift < 30; shift += 10) {
+        size_t offsets[1024] = { 0 };
+        for (size_t i = 0; i < count; i++)
+            offsets[(keys[i] >> shift) & 1023]++;
+        for (size_t i = 0, total = 0; i < 1024; i++) {
+            const size_t bucket = offsets[i];
+            offsets[i] = total;
+            total += bucket;
         }
-        return;
+        for (size_t i = 0; i < count; i++) {
+            const size_t j = offsets[(keys[i] >> shift) & 1023]++;
+            swapKeys[j] = keys[i];
+            swapOrder[j] = order[i];
+        }
+        keys.swap(swapKeys);
+        order.swap(swapOrder);
     }
-    // not a leaf node
-    m::pointPlane start;
-    m::pointPlane end;
-
-    // check if everything is infront of the splitting plane
-    m::plane checkPlane = planes[nodes[node].plane];
-    checkPlane.d -= trace->radius;
-    start = checkPlane.classify(trace->start, kdTree::kEpsilon);
-    end = checkPlane.classify(trace->start + trace->direction, kdTree::kEpsilon);
-    if (start > m::kPointPlaneOnPlane && end > m::kPointPlaneOnPlane) {
-        traceSphere(trace, nodes[node].children[0]);
-        return;
+
+    kdSphereTrace *packet[kPacketSize];
+    for (size_t i = 0; i < count; i += kPacketSize) {
+        const size_t packetSize = u::min(kPacketSize, count - i);
+        for (size_t j = 0; j < packetSize; j++)
+            packet[j] = &traces[order[i + j]];
+        tracePacket(packet, packetSize);
     }
+}
 
-    // check if everything is behind of the splitting plane
-    checkPlane.d = planes[nodes[node].plane].d + trace->radius;
-    start = checkPlane.classify(trace->start, kdTree::kEpsilon);
-    end = checkPlane.classify(trace->start + trace->direction, kdTree::kEpsilon);
-    if (start < m::kPointPlaneOnPlane && end < m::kPointPlaneOnPlane) {
-        traceSphere(trace, nodes[node].children[1]);
-        return;
+// Records a triangle hit of `trace'
+static inline void kdMapTraceHit(kdSphereTrace *trace, float fraction, const m::vec3 &hitNormal,
+    const m::vec3 &hitPoint, bool *hit)
+{
+    // safely shift along the traced path, keeping the sphere kDistEpsilon
+    // away from the plane along the planes normal.
+    fraction += kdMap::kDistEpsilon / (hitNormal * trace->direction);
+    if (fraction < kdMap::kMinFraction)
+        fraction = 0.0f; // prevent small noise
+    if (fraction < trace->fraction || (!*hit && fraction == trace->fraction)) {
+        trace->plane.setupPlane(hitPoint, hitNormal);
+        trace->fraction = fraction;
+        *hit = true;
     }
+}
+
+void kdMap::tracePacket(kdSphereTrace *const *traces, size_t count) const {
+    // every trace in the packet visits its leafs in the same order as a
+    // recursive front to back descent would. `mask' has a bit set for each
+    // trace which still has to walk the subtree.
+    struct entry {
+        uint32_t node;
+        uint32_t mask;
+    };
+    entry stack[kMaxDepth + 2];
+    size_t top = 0;
+    stack[top++] = { 0, (1u << count) - 1 };
+
+    while (top) {
+        const entry current = stack[--top];
+        const kdMapNode &it = nodes[current.node];
+        if (it.isLeaf()) {
+            const size_t triangleCount = it.triangleCount();
+
+            float fraction = 0.0f;
+            m::vec3 hitNormal;
+            m::vec3 hitPoint;
+
+            // on a tie the earliest triangle of the latest leaf wins, which is
+            // what the recursive descent picked
+            bool hit[kPacketSize] = { false };
+
+            // check every triangle in the leaf against each trace
+#if defined(__AVX__) || defined(__SSE2__)
+            for (size_t i = 0; i < triangleCount; i += kdSweepLanes::kCount) {
+                const size_t lanes = u::min(kdSweepLanes::kCount, triangleCount - i);
+                for (size_t j = 0; j < count; j++) {
+                    if (!(current.mask & (1u << j)))
+                        continue;
+                    kdSphereTrace *const trace = traces[j];
+                    kdSweepLanes sweep;
+                    kdSweepTriangles(collision, it.firstTriangle + i, *trace, &sweep);
+#ifdef DEBUG_KDMAP
+                    for (size_t k = 0; k < lanes; k++) {
+                        const size_t index = it.firstTriangle + i + k;
+                        const bool vectorHit = sweep.hits & (1 << k);
+                        const m::vec3 vectorNormal = { sweep.normal[0][k], sweep.normal[1][k], sweep.normal[2][k] };
+                        float checkFraction = 0.0f;
+                        m::vec3 checkNormal;
+                        m::vec3 checkPoint;
+                        const bool checkHit = sphereTriangleIntersect(index, trace->start, trace->radius,
+                            trace->direction, &checkFraction, &checkNormal, &checkPoint);
+                        if (!kdSweepAgrees(vectorHit, sweep.fraction[k], vectorNormal, checkHit, checkFraction, checkNormal))
+                            u::print("[kdmap] => vector sweep disagrees on triangle %zu: %s %f, scalar %s %f"
+                                " (sphere %.9g %.9g %.9g radius %.9g moving %.9g %.9g %.9g)\n",
+                                index, vectorHit ? "hit" : "miss", sweep.fraction[k],
+                                checkHit ? "hit" : "miss", checkFraction,
+                                trace->start.x, trace->start.y, trace->start.z, trace->radius,
+                                trace->direction.x, trace->direction.y, trace->direction.z);
+                    }
+#endif
+                    // lanes past the end of the leaf read the padding or the
+                    // next leaf and are ignored
+                    for (size_t k = 0; k < lanes; k++) {
+                        if (!(sweep.hits & (1 << k)))
+                            continue;
+                        fraction = sweep.fraction[k];
+                        hitNormal = { sweep.normal[0][k], sweep.normal[1][k], sweep.normal[2][k] };
+                        hitPoint = { sweep.point[0][k], sweep.point[1][k], sweep.point[2][k] };
+                        kdMapTraceHit(trace, fraction, hitNormal, hitPoint, &hit[j]);
+                    }
+                }
+            }
+#else
+            for (size_t i = 0; i < triangleCount; i++) {
+                for (size_t j = 0; j < count; j++) {
+                    if (!(current.mask & (1u << j)))
+                        continue;
+                    kdSphereTrace *const trace = traces[j];
+                    // did we collide against a triangle in this leaf?
+                    if (!sphereTriangleIntersect(it.firstTriangle + i, trace->start, trace->radius,
+                            trace->direction, &fraction, &hitNormal, &hitPoint))
+                        continue;
+                    kdMapTraceHit(trace, fraction, hitNormal, hitPoint, &hit[j]);
+                }
+            }
+#endif
+            continue;
+        }
 
-    kdSphereTrace traceFront = *trace;
-    kdSphereTrace traceBack = *trace;
+        // not a leaf node, sort the traces to the sides of the splitting plane
+        // they touch
+        const size_t axis = it.axis();
+        uint32_t frontMask = 0;
+        uint32_t backMask = 0;
+        for (size_t j = 0; j < count; j++) {
+            const uint32_t bit = 1u << j;
+            if (!(current.mask & bit))
+                continue;
+            const kdSphereTrace *const trace = traces[j];
+            const float start = trace->start[axis];
+            const float end = trace->start[axis] + trace->direction[axis];
+
+            // check if everything is infront of the splitting plane
+            float distance = it.distance - trace->radius;
+            if (start + distance > kdTree::kEpsilon && end + distance > kdTree::kEpsilon) {
+                frontMask |= bit;
+                continue;
+            }
 
-    traceSphere(&traceFront, nodes[node].children[0]);
-    traceSphere(&traceBack, nodes[node].children[1]);
+            // check if everything is behind of the splitting plane
+            distance = it.distance + trace->radius;
+            if (start + distance < -kdTree::kEpsilon && end + distance < -kdTree::kEpsilon) {
+                backMask |= bit;
+                continue;
+            }
 
-    *trace = (traceFront.fraction < traceBack.fraction) ? traceFront : traceBack;
+            frontMask |= bit;
+            backMask |= bit;
+        }
+
+        // the front side is popped first
+        if (backMask)
+            stack[top++] = { uint32_t(it.children() + 1), backMask };
+        if (frontMask)
+            stack[top++] = { uint32_t(it.children()), frontMask };
+    }
 }
 
 bool kdMap::isSphereStuck(const m::vec3 &position, float radius) const {
@@ -362,38 +864,32 @@ bool kdMap::isSphereStuck(const m::vec3 &position, float radius) const {
     return isSphereStuck(position, radius, 0);
 }
 
-bool kdMap::isSphereStuck(const m::vec3 &position, float radius, int32_t node) const {
+bool kdMap::isSphereStuck(const m::vec3 &position, float radius, size_t node) const {
+    const kdMapNode &it = nodes[node];
     // this is a leaf node?
-    if (node < 0) {
-        size_t leafIndex = -node - 1;
-        const size_t triangleCount = leafs[leafIndex].triangles.size();
+    if (it.isLeaf()) {
+        const size_t triangleCount = it.triangleCount();
         for (size_t i = 0; i < triangleCount; i++) {
-            size_t triangleIndex = leafs[leafIndex].triangles[i];
-            if (sphereTriangleIntersectStatic(triangleIndex, position, radius))
+            if (sphereTriangleIntersectStatic(it.firstTriangle + i, position, radius))
                 return true;
         }
         return false;
     }
 
-    m::pointPlane location;
-    m::plane plane = planes[nodes[node].plane];
+    const float coordinate = position[it.axis()];
 
     // check if everything is in front of the plane
-    plane.d -= radius;
-    location = plane.classify(position, kdTree::kEpsilon);
-    if (location == m::kPointPlaneFront)
-        return isSphereStuck(position, radius, nodes[node].children[0]);
+    if (coordinate + (it.distance - radius) > kdTree::kEpsilon)
+        return isSphereStuck(position, radius, it.children());
 
     // check if everything is behind the plane
-    plane.d = planes[nodes[node].plane].d + radius;
-    location = plane.classify(position, kdTree::kEpsilon);
-    if (location == m::kPointPlaneBack)
-        return isSphereStuck(position, radius, nodes[node].children[1]);
+    if (coordinate + (it.distance + radius) < -kdTree::kEpsilon)
+        return isSphereStuck(position, radius, it.children() + 1);
 
     // check both
-    if (isSphereStuck(position, radius, nodes[node].children[0]))
+    if (isSphereStuck(position, radius, it.children()))
         return true;
-    return isSphereStuck(position, radius, nodes[node].children[1]);
+    return isSphereStuck(position, radius, it.children() + 1);
 }
 
 void kdMap::clipVelocity(const m::vec3 &in, const m::vec3 &normal, m::vec3 &out, float overBounce) {
@@ -2,6 +2,10 @@
 #define MAP_HDR
 #include "kdtree.h"
 
+namespace u {
+struct file;
+}
+
 struct kdSphereTrace {
     m::vec3 start;
     m::vec3 direction;
@@ -10,25 +14,100 @@ struct kdSphereTrace {
     m::plane plane;
 };
 
+// Runtime node, flattened from the kdBinNodes at load time. Every splitting
+// plane is axis aligned so only the axis and distance are kept inline, and the
+// two children of a node are adjacent: front at children(), back right after.
+struct kdMapNode {
+    static constexpr uint32_t kLeaf = 3; // stored in place of the axis
+
+    bool isLeaf() const;
+    size_t axis() const;
+    size_t children() const; // interior nodes only
+    size_t triangleCount() const; // leafs only
+
+    union {
+        float distance; // plane distance along the axis
+        uint32_t firstTriangle; // leafs: offset into kdMap::leafTriangles
+    };
+    uint32_t data; // axis (or kLeaf) in the low two bits, child index or triangle count above
+};
+
+inline bool kdMapNode::isLeaf() const {
+    return (data & 3) == kLeaf;
+}
+
+inline size_t kdMapNode::axis() const {
+    return data & 3;
+}
+
+inline size_t kdMapNode::children() const {
+    return data >> 2;
+}
+
+inline size_t kdMapNode::triangleCount() const {
+    return data >> 2;
+}
+
+// Collision data of the leaf triangles, precomputed at load time. Entries
+// follow kdMap::leafTriangles so the triangles of a leaf are adjacent, and
+// every component lives in its own array. The arrays are padded with kPadding
+// zeroed entries so vector code can load a full group past the last triangle.
+struct kdCollisionTriangles {
+    static constexpr size_t kPadding = 8;
+
+    void resize(size_t count);
+    void destroy();
+
+    void set(size_t index, const m::vec3 &p0, const m::vec3 &p1, const m::vec3 &p2);
+
+    m::vec3 vertex(size_t index, size_t which) const;
+    m::plane plane(size_t index) const;
+
+    u::vector<float> x[3]; // vertices
+    u::vector<float> y[3];
+    u::vector<float> z[3];
+    u::vector<float> nx; // triangle plane
+    u::vector<float> ny;
+    u::vector<float> nz;
+    u::vector<float> d;
+    u::vector<float> q1q2; // barycentric terms of the edges p1-p0 and p2-p0
+    u::vector<float> q1Squared;
+    u::vector<float> q2Squared;
+    u::vector<float> invertDet;
+};
+
+inline m::vec3 kdCollisionTriangles::vertex(size_t index, size_t which) const {
+    return { x[which][index], y[which][index], z[which][index] };
+}
+
+inline m::plane kdCollisionTriangles::plane(size_t index) const {
+    return m::plane(m::vec3(nx[index], ny[index], nz[index]), d[index]);
+}
+
 struct kdMap {
     kdMap();
     ~kdMap();
 
-    bool load(const u::vector<unsigned char> &data);
+    bool load(const u::vector<unsigned char> &compressedData);
+    bool load(u::file &fp); // inflates straight from the file
     void unload();
 
     void traceSphere(kdSphereTrace *trace) const;
+    // Traces `count' spheres. Nearby queries are grouped into packets that walk
+    // the tree together and share the leaf triangle loads; the results are the
+    // same as tracing each of them alone.
+    void traceSpheres(kdSphereTrace *traces, size_t count) const;
     bool isSphereStuck(const m::vec3 &position, float radius) const;
 
     bool isLoaded() const;
 
-    u::vector<m::plane>      planes;
     u::vector<kdBinTexture>  textures;
-    u::vector<kdBinNode>     nodes;
+    u::vector<kdMapNode>     nodes; // nodes[0] is the root
     u::vector<kdBinTriangle> triangles;
     u::vector<kdBinVertex>   vertices;
     u::vector<kdBinEnt>      entities;
-    u::vector<kdBinLeaf>     leafs;
+    u::vector<uint32_t>      leafTriangles; // triangle indices of every leaf back to back
+    kdCollisionTriangles     collision; // one entry for each of leafTriangles
 
     static constexpr float kDistEpsilon = 0.02f; // 2cm epsilon for triangle collisions
     static constexpr float kMinFraction = 0.005f; // no less than 0.5% movement along a direction vector
@@ -37,20 +116,29 @@ struct kdMap {
     static constexpr float kFractionScale = 0.95f; // Collision response fractional scale
     static constexpr float kOverClip = 1.01f; // percentage * 100 of overclip allowed in collision detection against planes (lower values == more sticky)
     static constexpr float kStopEpsilon = 0.2f; // minimum velocity size for clipping
+    static constexpr size_t kPacketSize = 8; // sphere traces walking the tree together
+    static constexpr size_t kMaxDepth = 64; // deepest tree accepted by load
 
     // clips the velocity for collision handling
     static void clipVelocity(const m::vec3 &in, const m::vec3 &normal, m::vec3 &out, float overBounce);
 
 private:
+    bool unserialize(const u::vector<unsigned char> &data);
+    bool flatten(const u::vector<kdBinNode> &binNodes, const u::vector<kdBinPlane> &planes,
+        const u::vector<uint32_t> &leafFirst, const u::vector<uint32_t> &leafCount, int32_t binNode,
+        size_t node, size_t depth);
+
+    // both take an index into `collision'
+
     // sweeping
-    bool sphereTriangleIntersect(size_t triangleIndex, const m::vec3 &spherePosition,
+    bool sphereTriangleIntersect(size_t index, const m::vec3 &spherePosition,
         float sphereRadius, const m::vec3 &direction, float *fraction, m::vec3 *hitNormal, m::vec3 *hitPoint) const;
 
     // static
-    bool sphereTriangleIntersectStatic(size_t triangleIndex, const m::vec3 &spherePosition, float sphereRadius) const;
+    bool sphereTriangleIntersectStatic(size_t index, const m::vec3 &spherePosition, float sphereRadius) const;
 
-    void traceSphere(kdSphereTrace *trace, int32_t node) const;
-    bool isSphereStuck(const m::vec3 &position, float radius, int32_t node) const;
+    void tracePacket(kdSphereTrace *const *traces, size_t count) const;
+    bool isSphereStuck(const m::vec3 &position, float radius, size_t node) const;
 };
 
 #endif
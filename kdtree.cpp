@@ -5,6 +5,7 @@
 #include "u_file.h"
 #include "u_algorithm.h"
 #include "u_misc.h"
+#include "u_thread.h"
 
 ///! triangle
 m::vec3 kdTriangle::getNormal(const kdTree *const tree) {
@@ -19,43 +20,169 @@ void kdTriangle::generatePlane(const kdTree *const tree) {
                      tree->vertices[vertices[2]]);
 }
 
+///! build arena
+// Scratch memory for one build task. Index lists are carved out of `indices'
+// stack-wise: a node allocates its children's lists on top of its own and
+// releases them once both subtrees are built, so a warmed up arena builds a
+// whole subtree without touching the allocator. Tasks never share an arena.
+struct kdBuildArena {
+    kdBuildArena()
+        : top(0)
+    {
+    }
+
+    kdBuildRange allocate(size_t count);
+    void release(size_t mark);
+
+    int *operator()(const kdBuildRange &range);
+
+    u::vector<int> indices;
+    size_t top;
+
+    // per node scratch, only live until a node has picked its plane
+    u::vector<unsigned char> classes; // polyPlane of every triangle for all three axes
+    u::vector<float> coords;
+    u::vector<m::vec3> extents;
+};
+
+kdBuildRange kdBuildArena::allocate(size_t count) {
+    kdBuildRange range = { top, count };
+    top += count;
+    if (top > indices.size())
+        indices.resize(u::max(top, indices.size() * 2));
+    return range;
+}
+
+void kdBuildArena::release(size_t mark) {
+    top = mark;
+}
+
+int *kdBuildArena::operator()(const kdBuildRange &range) {
+    return indices.data() + range.first;
+}
+
 ///! node
 kdNode::~kdNode() {
     delete front;
     delete back;
 }
 
-kdNode::kdNode(kdTree *tree, const u::vector<int> &tris, size_t recursionDepth)
+kdNode::kdNode(const kdTree *tree, kdBuildArena *arena, const kdBuildRange &tris,
+    size_t recursionDepth, const m::bbox &bounds)
     : front(nullptr)
     , back(nullptr)
     , sphereRadius(0.0f)
 {
-    size_t triangleCount = tris.size();
-
-    if (recursionDepth > tree->depth)
-        tree->depth = recursionDepth;
     if (recursionDepth > kdTree::kMaxRecursionDepth)
         return;
 
-    tree->nodeCount++;
-    calculateSphere(tree, tris);
+    calculateSphere(tree, (*arena)(tris), tris.count);
+
+    const size_t mark = arena->top;
+    kdBuildRange frontList;
+    kdBuildRange backList;
+    const bool subdivide = tree->build == kBuildSurfaceArea
+        ? splitSurfaceArea(tree, arena, tris, recursionDepth, bounds, &frontList, &backList)
+        : splitBalanced(tree, arena, tris, recursionDepth, &frontList, &backList);
+
+    if (!subdivide) {
+        // create subspace with `triangleCount` polygons
+        const int *const list = (*arena)(tris);
+        triangles.insert(triangles.begin(), list, list + tris.count);
+        arena->release(mark);
+        return;
+    }
+
+    // the children are bounded by this node cut at the splitting plane
+    size_t axis = 0;
+    for (size_t i = 1; i < 3; i++)
+        if (m::abs(splitPlane.n[i]) > m::abs(splitPlane.n[axis]))
+            axis = i;
+    const float position = -splitPlane.d;
+    m::vec3 frontMin = bounds.min();
+    m::vec3 backMax = bounds.max();
+    frontMin[axis] = u::min(u::max(position, frontMin[axis]), backMax[axis]);
+    backMax[axis] = frontMin[axis];
+    const m::bbox frontBounds(frontMin, bounds.max());
+    const m::bbox backBounds(bounds.min(), backMax);
+
+    // recurse, large subtrees are built side by side on the worker pool. The
+    // back task gets its own arena so nothing in it depends on scheduling.
+    if (tris.count >= kdTree::kParallelTriangles) {
+        kdBuildArena backArena;
+        const kdBuildRange backTask = backArena.allocate(backList.count);
+        memcpy(backArena(backTask), (*arena)(backList), sizeof(int) * backList.count);
+        u::parallelFor(2, [this, tree, arena, &frontList, &frontBounds,
+                           &backArena, &backTask, &backBounds, recursionDepth](size_t index) {
+            if (index == 0)
+                front = new kdNode(tree, arena, frontList, recursionDepth + 1, frontBounds);
+            else
+                back = new kdNode(tree, &backArena, backTask, recursionDepth + 1, backBounds);
+        });
+    } else {
+        front = new kdNode(tree, arena, frontList, recursionDepth + 1, frontBounds);
+        back = new kdNode(tree, arena, backList, recursionDepth + 1, backBounds);
+    }
+
+    arena->release(mark);
+}
+
+bool kdNode::isLeaf() const {
+    return !front && !back;
+}
+
+void kdNode::count(size_t *nodeCount, size_t *leafCount, size_t *depth, size_t recursionDepth) const {
+    if (recursionDepth > *depth)
+        *depth = recursionDepth;
+    (*nodeCount)++;
+    if (isLeaf()) {
+        (*leafCount)++;
+        return;
+    }
+    front->count(nodeCount, leafCount, depth, recursionDepth + 1);
+    back->count(nodeCount, leafCount, depth, recursionDepth + 1);
+}
+
+bool kdNode::splitBalanced(const kdTree *tree, kdBuildArena *arena, const kdBuildRange &tris,
+    size_t recursionDepth, kdBuildRange *frontList, kdBuildRange *backList)
+{
+    const size_t triangleCount = tris.count;
+    if (triangleCount == 0)
+        return false;
 
-    u::vector<int> fx, fy, fz; // front
-    u::vector<int> bx, by, bz; // back
-    u::vector<int> sx, sy, sz; // split
-    u::vector<int>* frontList[3] = { &fx, &fy, &fz };
-    u::vector<int>* backList[3] = { &bx, &by, &bz };
-    u::vector<int>* splitList[3] = { &sx, &sy, &sz };
+    // classify every triangle against the candidate plane of each axis
+    arena->classes.resize(triangleCount * 3);
+    unsigned char *const classes = arena->classes.data();
 
     m::plane plane[3];
+    size_t frontCount[3] = { 0, 0, 0 };
+    size_t backCount[3] = { 0, 0, 0 };
+    size_t splitCount[3] = { 0, 0, 0 };
     float ratio[3];
     size_t best = recursionDepth % 3;
 
     // find a plane which gives a good balanced node
     for (size_t i = 0; i < 3; i++) {
-        split(tree, tris, (m::axis)i, *frontList[i], *backList[i], *splitList[i], plane[i]);
-        const size_t fsize = (*frontList[i]).size();
-        const size_t bsize = (*backList[i]).size();
+        const int *const list = (*arena)(tris);
+        plane[i] = findSplittingPlane(tree, arena, list, triangleCount, (m::axis)i);
+        for (size_t j = 0; j < triangleCount; j++) {
+            const polyPlane side = tree->testTriangle(list[j], plane[i]);
+            classes[i*triangleCount + j] = side;
+            switch (side) {
+            case kPolyPlaneCoplanar:
+            case kPolyPlaneSplit:
+                splitCount[i]++;
+                break;
+            case kPolyPlaneFront:
+                frontCount[i]++;
+                break;
+            case kPolyPlaneBack:
+                backCount[i]++;
+                break;
+            }
+        }
+        const size_t fsize = frontCount[i];
+        const size_t bsize = backCount[i];
         if (fsize > bsize)
             ratio[i] = (float)bsize / (float)fsize;
         else
@@ -74,53 +201,181 @@ kdNode::kdNode(kdTree *tree, const u::vector<int> &tris, size_t recursionDepth)
 
     // when there isn't many triangles left, create a leaf. In doing so we can
     // continue to create further subdivisions.
-    if (frontList[best]->size() == 0 || backList[best]->size() == 0 || triangleCount <= kdTree::kMaxTrianglesPerLeaf) {
-        // create subspace with `triangleCount` polygons
-        triangles.insert(triangles.begin(), tris.begin(), tris.end());
-        tree->leafCount++;
-        return;
+    if (frontCount[best] == 0 || backCount[best] == 0 || triangleCount <= kdTree::kMaxTrianglesPerLeaf)
+        return false;
+
+    // the split triangles go on both sides of the plane, after the ones which
+    // are entirely on that side
+    *frontList = arena->allocate(frontCount[best] + splitCount[best]);
+    *backList = arena->allocate(backCount[best] + splitCount[best]);
+    const int *const list = (*arena)(tris);
+    int *const frontIndices = (*arena)(*frontList);
+    int *const backIndices = (*arena)(*backList);
+    const unsigned char *const sides = classes + best*triangleCount;
+    size_t f = 0;
+    size_t b = 0;
+    for (size_t i = 0; i < triangleCount; i++) {
+        if (sides[i] == kPolyPlaneFront)
+            frontIndices[f++] = list[i];
+        else if (sides[i] == kPolyPlaneBack)
+            backIndices[b++] = list[i];
     }
+    for (size_t i = 0; i < triangleCount; i++) {
+        if (sides[i] == kPolyPlaneSplit || sides[i] == kPolyPlaneCoplanar) {
+            frontIndices[f++] = list[i];
+            backIndices[b++] = list[i];
+        }
+    }
+    return true;
+}
 
-    // insert the split triangles on both sides of the plane.
-    frontList[best]->insert(frontList[best]->end(), splitList[best]->begin(), splitList[best]->end());
-    backList[best]->insert(backList[best]->end(), splitList[best]->begin(), splitList[best]->end());
+bool kdNode::splitSurfaceArea(const kdTree *tree, kdBuildArena *arena, const kdBuildRange &tris,
+    size_t recursionDepth, const m::bbox &bounds, kdBuildRange *frontList, kdBuildRange *backList)
+{
+    static constexpr size_t kBins = kdTree::kSurfaceAreaBins;
+    const size_t triangleCount = tris.count;
 
-    // recurse
-    front = new kdNode(tree, *frontList[best], recursionDepth + 1);
-    back = new kdNode(tree, *backList[best], recursionDepth + 1);
-}
+    // nodes past the recursion limit are dropped, so stop one short of it
+    if (triangleCount <= kdTree::kMaxTrianglesPerLeaf || recursionDepth >= kdTree::kMaxRecursionDepth)
+        return false;
 
-bool kdNode::isLeaf() const {
-    return !front && !back;
-}
+    const float area = bounds.area();
+    if (area <= m::kEpsilon)
+        return false;
 
-void kdNode::split(const kdTree *tree, const u::vector<int> &tris, m::axis axis,
-    u::vector<int> &frontList, u::vector<int> &backList, u::vector<int> &splitList, m::plane &plane) const
-{
-    size_t triangleCount = tris.size();
-    plane = findSplittingPlane(tree, tris, axis);
+    // per triangle extents, shared by all three axes
+    arena->extents.resize(triangleCount * 2);
+    m::vec3 *const triangleMin = arena->extents.data();
+    m::vec3 *const triangleMax = triangleMin + triangleCount;
+    const int *const list = (*arena)(tris);
     for (size_t i = 0; i < triangleCount; i++) {
-        switch (tree->testTriangle(tris[i], plane)) {
-        case kPolyPlaneCoplanar:
-        case kPolyPlaneSplit:
-            splitList.push_back(tris[i]);
-            break;
-        case kPolyPlaneFront:
-            frontList.push_back(tris[i]);
-            break;
-        case kPolyPlaneBack:
-            backList.push_back(tris[i]);
-            break;
+        const kdTriangle &triangle = tree->triangles[list[i]];
+        triangleMin[i] = tree->vertices[triangle.vertices[0]];
+        triangleMax[i] = triangleMin[i];
+        for (size_t j = 1; j < 3; j++) {
+            const m::vec3 &vertex = tree->vertices[triangle.vertices[j]];
+            triangleMin[i] = m::vec3::min(triangleMin[i], vertex);
+            triangleMax[i] = m::vec3::max(triangleMax[i], vertex);
+        }
+    }
+
+    // splitting is only worth it if it beats intersecting everything here
+    float bestCost = kdTree::kIntersectCost * triangleCount;
+    float bestPosition = 0.0f;
+    size_t bestAxis = 3;
+
+    const m::vec3 &boundsMin = bounds.min();
+    const m::vec3 &boundsMax = bounds.max();
+    const m::vec3 size = bounds.size();
+    for (size_t axis = 0; axis < 3; axis++) {
+        const float extent = size[axis];
+        if (extent <= kdTree::kEpsilon)
+            continue;
+
+        // count the bins where each triangle starts and ends
+        size_t starts[kBins] = { 0 };
+        size_t ends[kBins] = { 0 };
+        const float scale = kBins / extent;
+        for (size_t i = 0; i < triangleCount; i++) {
+            const float lo = (triangleMin[i][axis] - boundsMin[axis]) * scale;
+            const float hi = (triangleMax[i][axis] - boundsMin[axis]) * scale;
+            starts[u::min(size_t(u::max(lo, 0.0f)), kBins - 1)]++;
+            ends[u::min(size_t(u::max(hi, 0.0f)), kBins - 1)]++;
+        }
+
+        // the other two sides of the child boxes do not depend on the plane
+        const size_t axis1 = (axis + 1) % 3;
+        const size_t axis2 = (axis + 2) % 3;
+        const float capArea = 2.0f * size[axis1] * size[axis2];
+        const float sideLength = 2.0f * (size[axis1] + size[axis2]);
+
+        // sweep the bin boundaries: triangles which end before a boundary are
+        // behind it, triangles which start past it are in front and the rest
+        // straddle it and land on both sides
+        size_t backCount = 0;
+        size_t frontCount = triangleCount;
+        for (size_t i = 1; i < kBins; i++) {
+            backCount += ends[i - 1];
+            frontCount -= starts[i - 1];
+            const size_t straddleCount = triangleCount - backCount - frontCount;
+            const float position = boundsMin[axis] + extent * i / kBins;
+            const float backArea = capArea + sideLength * (position - boundsMin[axis]);
+            const float frontArea = capArea + sideLength * (boundsMax[axis] - position);
+            float cost = kdTree::kIntersectCost * (backArea * (backCount + straddleCount)
+                                                 + frontArea * (frontCount + straddleCount)) / area;
+            if (backCount + straddleCount == 0 || frontCount + straddleCount == 0)
+                cost *= 1.0f - kdTree::kEmptyBonus;
+            cost += kdTree::kTraversalCost;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestPosition = position;
+                bestAxis = axis;
+            }
+        }
+    }
+
+    if (bestAxis == 3)
+        return false;
+
+    // bin boundaries rarely line up with geometry; snap to the nearest
+    // triangle edge within the bin so fewer triangles straddle the plane
+    float snapDistance = 0.5f * size[bestAxis] / kBins;
+    const float binPosition = bestPosition;
+    for (size_t i = 0; i < triangleCount; i++) {
+        const float edges[2] = { triangleMin[i][bestAxis], triangleMax[i][bestAxis] };
+        for (size_t j = 0; j < 2; j++) {
+            const float distance = m::abs(edges[j] - binPosition);
+            if (distance < snapDistance) {
+                snapDistance = distance;
+                bestPosition = edges[j];
+            }
         }
     }
+
+    const m::vec3 normal(m::vec3::getAxis((m::axis)bestAxis));
+    splitPlane = m::plane(normal * bestPosition, normal);
+
+    // the bins only estimate the sides; classify against the real plane
+    arena->classes.resize(triangleCount);
+    unsigned char *const sides = arena->classes.data();
+    size_t frontCount = 0;
+    size_t backCount = 0;
+    for (size_t i = 0; i < triangleCount; i++) {
+        sides[i] = tree->testTriangle(list[i], splitPlane);
+        if (sides[i] != kPolyPlaneBack)
+            frontCount++;
+        if (sides[i] != kPolyPlaneFront)
+            backCount++;
+    }
+
+    // a plane which cuts nothing away from either side would recurse forever
+    if (frontCount == triangleCount && backCount == triangleCount)
+        return false;
+
+    *frontList = arena->allocate(frontCount);
+    *backList = arena->allocate(backCount);
+    int *const frontIndices = (*arena)(*frontList);
+    int *const backIndices = (*arena)(*backList);
+    const int *const source = (*arena)(tris);
+    size_t f = 0;
+    size_t b = 0;
+    for (size_t i = 0; i < triangleCount; i++) {
+        if (sides[i] != kPolyPlaneBack)
+            frontIndices[f++] = source[i];
+        if (sides[i] != kPolyPlaneFront)
+            backIndices[b++] = source[i];
+    }
+    return true;
 }
 
-m::plane kdNode::findSplittingPlane(const kdTree *tree, const u::vector<int> &tris, m::axis axis) const {
-    const size_t triangleCount = tris.size();
+m::plane kdNode::findSplittingPlane(const kdTree *tree, kdBuildArena *arena, const int *tris,
+    size_t triangleCount, m::axis axis) const
+{
     // every vertex component is stored depending on `axis' axis in the following
     // vector. The vector gets sorted and the median is chosen as the splitting
     // plane.
-    u::vector<float> coords(triangleCount * 3); // 3 vertices for a triangle
+    arena->coords.resize(triangleCount * 3); // 3 vertices for a triangle
+    float *const coords = arena->coords.data();
 
     size_t k = 0;
     for (size_t i = 0; i < triangleCount; i++) {
@@ -135,14 +390,13 @@ m::plane kdNode::findSplittingPlane(const kdTree *tree, const u::vector<int> &tr
     // robust against vertex outliers.
     // TODO: radix sort coords
     //u::sort(coords.begin(), coords.end());
-    const float split = coords[coords.size() / 2]; // median like
+    const float split = coords[k / 2]; // median like
     const m::vec3 point(m::vec3::getAxis(axis) * split);
     const m::vec3 normal(m::vec3::getAxis(axis));
     return m::plane(point, normal);
 }
 
-void kdNode::calculateSphere(const kdTree *tree, const u::vector<int> &tris) {
-    const size_t triangleCount = tris.size();
+void kdNode::calculateSphere(const kdTree *tree, const int *tris, size_t triangleCount) {
     m::vec3 min;
     m::vec3 max;
     for (size_t i = 0; i < triangleCount; i++) {
@@ -222,6 +476,7 @@ kdTree::kdTree()
     , leafCount(0)
     , textureCount(0)
     , depth(0)
+    , build(kBuildBalanced)
 { }
 
 kdTree::~kdTree() {
@@ -235,6 +490,7 @@ void kdTree::unload() {
     vertices.destroy();
     texCoords.destroy();
     triangles.destroy();
+    textures.destroy();
     nodeCount = 0;
     leafCount = 0;
     textureCount = 0;
@@ -264,14 +520,16 @@ polyPlane kdTree::testTriangle(size_t index, const m::plane &plane) const {
     return (polyPlane)(frontBits | backBits);
 }
 
-bool kdTree::load(const u::string &file) {
+bool kdTree::load(const u::string &file, kdBuild method) {
     unload();
+    build = method;
 
     auto fp = u::fopen(file, "rt");
     if (!fp.get())
         return false;
 
-    u::string texturePath;
+    // triangles before the first texture command reference an empty path
+    textures.push_back("");
     while (auto getline = u::getline(fp)) {
         u::string& line = *getline;
         float x0, y0, z0, x1, y1, z1, w;
@@ -297,7 +555,7 @@ bool kdTree::load(const u::string &file) {
                         &v0, &t0, &s0, &v1, &t1, &s1, &v2, &t2, &s2) == 9)
         {
             kdTriangle triangle;
-            triangle.texturePath = texturePath;
+            triangle.texture = textures.size() - 1;
             triangle.vertices[0] = v0 - 1;
             triangle.vertices[1] = v1 - 1;
             triangle.vertices[2] = v2 - 1;
@@ -308,33 +566,43 @@ bool kdTree::load(const u::string &file) {
             triangles.push_back(triangle);
         } else if (u::sscanf(line, "f %i %i %i", &v0, &v1, &v2) == 3) {
             kdTriangle triangle;
-            triangle.texturePath = texturePath;
+            triangle.texture = textures.size() - 1;
             triangle.vertices[0] = v0 - 1;
             triangle.vertices[1] = v1 - 1;
             triangle.vertices[2] = v2 - 1;
             triangle.generatePlane(this);
             triangles.push_back(triangle);
         } else if (u::sscanf(line, "tex %s", texture) == 1) {
-            texturePath = texture;
+            textures.push_back(texture);
             textureCount++;
         }
     }
 
-    nodeCount = 0;
-    leafCount = 0;
-    u::vector<int> indices;
-    indices.reserve(triangles.size());
+    kdBuildArena arena;
+    const kdBuildRange indices = arena.allocate(triangles.size());
     for (size_t i = 0; i < triangles.size(); i++)
-        indices.push_back(i);
+        arena(indices)[i] = i;
+
+    m::bbox bounds;
+    if (vertices.size()) {
+        bounds = m::bbox(vertices[0]);
+        for (const auto &it : vertices)
+            bounds.expand(it);
+    }
 
-    root = new kdNode(this, indices, 0);
+    root = new kdNode(this, &arena, indices, 0, bounds);
+
+    nodeCount = 0;
+    leafCount = 0;
+    depth = 0;
+    root->count(&nodeCount, &leafCount, &depth, 0);
     return true;
 }
 
 static uint32_t kdBinAddTexture(u::vector<kdBinTexture> &textures, const u::string &texturePath) {
     uint32_t index = 0;
     for (auto &it : textures) {
-        if (it.name == texturePath)
+        if (!strcmp(it.name, texturePath.c_str()))
             return index;
         index++;
     }
@@ -439,6 +707,81 @@ static bool kdBinCompare(const kdBinVertex &lhs, const kdBinVertex &rhs, float e
         && (m::abs(lhs.tv - rhs.tv) < epsilon);
 }
 
+// Spatial hash over vertex positions quantized to kdTree::kEpsilon sized cells.
+// Any vertex kdBinCompare considers equal lives in one of the 27 cells around
+// the query, so welding only has to look at those instead of every vertex.
+struct kdBinVertexHash {
+    kdBinVertexHash(size_t capacity);
+
+    // The most recently inserted vertex equal to `vertex' or -1
+    int32_t find(const u::vector<kdBinVertex> &vertices, const kdBinVertex &vertex) const;
+    void insert(const u::vector<kdBinVertex> &vertices, int32_t index);
+
+private:
+    static int64_t cell(float value);
+    size_t bucket(int64_t x, int64_t y, int64_t z) const;
+
+    u::vector<int32_t> m_heads; // newest vertex in each bucket
+    u::vector<int32_t> m_next; // next older vertex in the same bucket
+};
+
+kdBinVertexHash::kdBinVertexHash(size_t capacity) {
+    size_t size = 1024;
+    while (size < capacity * 2)
+        size <<= 1;
+    m_heads.resize(size, -1);
+    m_next.reserve(capacity);
+}
+
+inline int64_t kdBinVertexHash::cell(float value) {
+    return (int64_t)m::floor(value * (1.0f / kdTree::kEpsilon));
+}
+
+inline size_t kdBinVertexHash::bucket(int64_t x, int64_t y, int64_t z) const {
+    const uint64_t hash = uint64_t(x) * 73856093u
+                        ^ uint64_t(y) * 19349663u
+                        ^ uint64_t(z) * 83492791u;
+    return size_t(hash ^ (hash >> 29)) & (m_heads.size() - 1);
+}
+
+int32_t kdBinVertexHash::find(const u::vector<kdBinVertex> &vertices, const kdBinVertex &vertex) const {
+    const int64_t x = cell(vertex.vertex.x);
+    const int64_t y = cell(vertex.vertex.y);
+    const int64_t z = cell(vertex.vertex.z);
+    size_t visited[27];
+    size_t count = 0;
+    int32_t best = -1;
+    for (int64_t i = -1; i <= 1; i++) {
+        for (int64_t j = -1; j <= 1; j++) {
+            for (int64_t k = -1; k <= 1; k++) {
+                const size_t index = bucket(x + i, y + j, z + k);
+                // neighbouring cells can share a bucket
+                bool seen = false;
+                for (size_t n = 0; n < count && !seen; n++)
+                    seen = visited[n] == index;
+                if (seen)
+                    continue;
+                visited[count++] = index;
+                // chains are newest first, the first match is the best in it
+                for (int32_t it = m_heads[index]; it > best; it = m_next[it]) {
+                    if (kdBinCompare(vertices[it], vertex, kdTree::kEpsilon)) {
+                        best = it;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return best;
+}
+
+void kdBinVertexHash::insert(const u::vector<kdBinVertex> &vertices, int32_t index) {
+    const m::vec3 &position = vertices[index].vertex;
+    const size_t where = bucket(cell(position.x), cell(position.y), cell(position.z));
+    m_next.push_back(m_heads[where]);
+    m_heads[where] = index;
+}
+
 static int32_t kdBinInsertLeaf(const kdNode *leaf, u::vector<kdBinLeaf> &leafs) {
     kdBinLeaf binLeaf;
     binLeaf.triangles.insert(binLeaf.triangles.begin(), leaf->triangles.begin(), leaf->triangles.end());
@@ -524,26 +867,26 @@ u::vector<unsigned char> kdTree::serialize() {
     compiledVertices.reserve(triangles.size() * 3);
     compiledLeafs.reserve(leafCount);
 
+    kdBinVertexHash vertexHash(triangles.size() * 3);
     for (size_t i = 0; i < triangles.size(); i++) {
         kdBinTriangle triangle;
-        triangle.texture = kdBinAddTexture(compiledTextures, triangles[i].texturePath);
+        triangle.texture = kdBinAddTexture(compiledTextures, textures[triangles[i].texture]);
         for (size_t j = 0; j < 3; j++) {
             kdBinVertex vertex;
             vertex.vertex = vertices[triangles[i].vertices[j]];
+            vertex.tu = 0.0f;
+            vertex.tv = 0.0f;
             if (!texCoords.empty()) {
                 vertex.tu = texCoords[triangles[i].texCoords[j]].x;
                 vertex.tv = texCoords[triangles[i].texCoords[j]].y;
             }
             // If we can reuse vertices for several faces, then do so
-            int k = 0;
-            for (k = compiledVertices.size() - 1; k >= 0; k--) {
-                if (kdBinCompare(compiledVertices[k], vertex, kEpsilon))
-                    break;
-            }
-            if ((size_t)k >= compiledVertices.size()) {
-                // no mathing vertex found
+            int32_t k = vertexHash.find(compiledVertices, vertex);
+            if (k == -1) {
+                // no matching vertex found
+                k = compiledVertices.size();
                 compiledVertices.push_back(vertex);
-                k = compiledVertices.size() - 1;
+                vertexHash.insert(compiledVertices, k);
             }
             triangle.v[j] = k;
         }
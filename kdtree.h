@@ -7,6 +7,7 @@
 
 #include "m_plane.h"
 #include "m_quat.h"
+#include "m_bbox.h"
 
 struct kdTree;
 
@@ -27,7 +28,7 @@ private:
     int vertices[3];
     int texCoords[3];
     m::plane plane;
-    u::string texturePath;
+    size_t texture; // index into kdTree::textures
 };
 
 enum polyPlane : size_t {
@@ -37,22 +38,44 @@ enum polyPlane : size_t {
     kPolyPlaneCoplanar
 };
 
+// How the compiler picks splitting planes
+enum kdBuild : size_t {
+    kBuildBalanced,   // balance front/back triangle counts around a median
+    kBuildSurfaceArea // binned surface area heuristic
+};
+
+// A run of triangle indices inside a kdBuildArena
+struct kdBuildRange {
+    size_t first;
+    size_t count;
+};
+
+struct kdBuildArena;
+
 struct kdNode {
-    kdNode(kdTree *tree, const u::vector<int> &triangles, size_t recursionDepth);
+    kdNode(const kdTree *tree, kdBuildArena *arena, const kdBuildRange &triangles,
+        size_t recursionDepth, const m::bbox &bounds);
     ~kdNode();
 
     // Calculate bounding sphere for node
-    void calculateSphere(const kdTree *tree, const u::vector<int> &triangles);
+    void calculateSphere(const kdTree *tree, const int *triangles, size_t count);
 
     // Is the node a leaf?
     bool isLeaf() const;
 
+    // Gather statistics for the subtree
+    void count(size_t *nodeCount, size_t *leafCount, size_t *depth, size_t recursionDepth) const;
+
     // Find the best plane to split on
-    m::plane findSplittingPlane(const kdTree *tree, const u::vector<int> &triangles, m::axis axis) const;
+    m::plane findSplittingPlane(const kdTree *tree, kdBuildArena *arena, const int *triangles,
+        size_t count, m::axis axis) const;
 
-    // Split triangles along `axis' axis.
-    void split(const kdTree *tree, const u::vector<int> &triangles, m::axis axis,
-        u::vector<int> &front, u::vector<int> &back, u::vector<int> &splitlist, m::plane &splitplane) const;
+    // Choose `splitPlane' and carve the front and back lists out of `arena'.
+    // Returns false when the node should become a leaf instead.
+    bool splitBalanced(const kdTree *tree, kdBuildArena *arena, const kdBuildRange &triangles,
+        size_t recursionDepth, kdBuildRange *front, kdBuildRange *back);
+    bool splitSurfaceArea(const kdTree *tree, kdBuildArena *arena, const kdBuildRange &triangles,
+        size_t recursionDepth, const m::bbox &bounds, kdBuildRange *front, kdBuildRange *back);
 
     // Flatten tree representation into a disk-writable medium.
     u::vector<unsigned char> serialize();
@@ -74,7 +97,15 @@ struct kdTree {
     static constexpr size_t kMaxTrianglesPerLeaf = 5;
     static constexpr size_t kMaxRecursionDepth = 35;
 
-    bool load(const u::string &file);
+    // Surface area heuristic costs are relative to one another
+    static constexpr size_t kSurfaceAreaBins = 32; // candidate planes per axis
+    static constexpr float kTraversalCost = 1.0f;
+    static constexpr float kIntersectCost = 2.0f; // sphere-triangle tests dominate traversal
+    static constexpr float kEmptyBonus = 0.2f; // favor planes which cut off empty space
+
+    static constexpr size_t kParallelTriangles = 2048; // larger subtrees are built on the worker pool
+
+    bool load(const u::string &file, kdBuild build = kBuildBalanced);
     polyPlane testTriangle(size_t index, const m::plane &plane) const;
     void unload();
     u::vector<unsigned char> serialize();
@@ -88,10 +119,12 @@ private:
     u::vector<m::vec3>      texCoords;
     u::vector<kdTriangle>   triangles;
     u::vector<kdEnt>        entities;
+    u::vector<u::string>    textures;
     size_t                  nodeCount;
     size_t                  leafCount;
     size_t                  textureCount;
     size_t                  depth;
+    kdBuild                 build;
 };
 
 // Serialized version for storing on disk
@@ -16,6 +16,9 @@ struct bbox {
     vec3 center() const;
     vec3 size() const;
 
+    const vec3 &min() const;
+    const vec3 &max() const;
+
 private:
     vec3 m_min;
     vec3 m_max;
@@ -61,6 +64,14 @@ inline vec3 bbox::size() const {
     return m_extent;
 }
 
+inline const vec3 &bbox::min() const {
+    return m_min;
+}
+
+inline const vec3 &bbox::max() const {
+    return m_max;
+}
+
 }
 
 #endif
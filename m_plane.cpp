@@ -2,6 +2,7 @@
 #include "m_const.h"
 #include "m_mat.h"
 #include "m_quat.h"
+#include "m_bbox.h"
 
 namespace m {
 
@@ -45,4 +46,34 @@ void frustum::setup(const m::vec3 &origin, const m::quat &orient, const m::persp
     m_planes[kPlaneFar].setupPlane(fbr, ftr, ftl);
 }
 
+void frustum::setup(const m::mat4 &viewProjection) {
+    // Points inside have -w <= x, y, z <= w after the transform so every plane
+    // is the last row plus or minus one of the others
+    const m::vec4 &x = viewProjection.a;
+    const m::vec4 &y = viewProjection.b;
+    const m::vec4 &z = viewProjection.c;
+    const m::vec4 &w = viewProjection.d;
+    m_planes[kPlaneLeft].setupPlane(w.x + x.x, w.y + x.y, w.z + x.z, w.w + x.w);
+    m_planes[kPlaneRight].setupPlane(w.x - x.x, w.y - x.y, w.z - x.z, w.w - x.w);
+    m_planes[kPlaneDown].setupPlane(w.x + y.x, w.y + y.y, w.z + y.z, w.w + y.w);
+    m_planes[kPlaneUp].setupPlane(w.x - y.x, w.y - y.y, w.z - y.z, w.w - y.w);
+    m_planes[kPlaneNear].setupPlane(w.x + z.x, w.y + z.y, w.z + z.z, w.w + z.w);
+    m_planes[kPlaneFar].setupPlane(w.x - z.x, w.y - z.y, w.z - z.z, w.w - z.w);
+}
+
+bool frustum::testBox(const m::bbox &box) const {
+    const m::vec3 &min = box.min();
+    const m::vec3 &max = box.max();
+    for (size_t i = 0; i < kPlanes; i++) {
+        // The corner furthest along the plane normal
+        const m::plane &p = m_planes[i];
+        const m::vec3 corner(p.n.x > 0.0f ? max.x : min.x,
+                             p.n.y > 0.0f ? max.y : min.y,
+                             p.n.z > 0.0f ? max.z : min.z);
+        if (p.getDistanceFromPlane(corner) < 0.0f)
+            return false;
+    }
+    return true;
+}
+
 }
@@ -6,6 +6,8 @@ namespace m {
 
 struct quat;
 struct perspective;
+struct mat4;
+struct bbox;
 
 enum pointPlane {
     kPointPlaneBack,
@@ -105,7 +107,11 @@ struct plane {
 
 struct frustum {
     void setup(const m::vec3 &origin, const m::quat &orient, const m::perspective &project);
+    // The clip volume of `viewProjection' in the space it transforms from
+    void setup(const m::mat4 &viewProjection);
     bool testSphere(const m::vec3 &point, float radius) const;
+    // Conservative: boxes crossing the corner of two planes pass
+    bool testBox(const m::bbox &box) const;
 private:
     enum {
         kPlaneNear,
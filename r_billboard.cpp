@@ -120,7 +120,7 @@ void billboard::render(const pipeline &pl, float size) {
     gl::BufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), &indices[0], GL_DYNAMIC_DRAW);
 
     m_method.enable();
-    m_method.setVP(p.projection() * p.view());
+    m_method.setVP(p.viewProjection());
     m_texture.bind(GL_TEXTURE0);
     gl::DrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, nullptr);
     m_positions.clear();
@@ -5,6 +5,8 @@
 
 #include "u_string.h"
 #include "u_set.h"
+#include "u_map.h"
+#include "u_vector.h"
 #include "u_misc.h"
 
 #include "engine.h"
@@ -42,6 +44,7 @@ typedef void (APIENTRYP MYPFNGLUNIFORMMATRIX4FVPROC)(GLint, GLsizei, GLboolean,
 typedef void (APIENTRYP MYPFNGLBINDBUFFERPROC)(GLenum, GLuint);
 typedef void (APIENTRYP MYPFNGLGENBUFFERSPROC)(GLsizei, GLuint*);
 typedef void (APIENTRYP MYPFNGLVERTEXATTRIBPOINTERPROC)(GLuint, GLint, GLenum, GLboolean, GLsizei, const GLvoid*);
+typedef void (APIENTRYP MYPFNGLVERTEXATTRIBDIVISORPROC)(GLuint, GLuint);
 typedef void (APIENTRYP MYPFNGLBUFFERDATAPROC)(GLenum, GLsizeiptr, const GLvoid*, GLenum);
 typedef void (APIENTRYP MYPFNGLVALIDATEPROGRAMPROC)(GLuint);
 typedef void (APIENTRYP MYPFNGLGENVERTEXARRAYSPROC)(GLsizei, GLuint*);
@@ -74,6 +77,8 @@ typedef void (APIENTRYP MYPFNGLCULLFACEPROC)(GLenum);
 typedef void (APIENTRYP MYPFNGLENABLEPROC)(GLenum);
 typedef void (APIENTRYP MYPFNGLDISABLEPROC)(GLenum);
 typedef void (APIENTRYP MYPFNGLDRAWELEMENTSPROC)(GLenum, GLsizei, GLenum, const GLvoid*);
+typedef void (APIENTRYP MYPFNGLMULTIDRAWELEMENTSPROC)(GLenum, const GLsizei*, GLenum, const GLvoid* const*, GLsizei);
+typedef void (APIENTRYP MYPFNGLDRAWELEMENTSINSTANCEDPROC)(GLenum, GLsizei, GLenum, const GLvoid*, GLsizei);
 typedef void (APIENTRYP MYPFNGLDEPTHMASKPROC)(GLboolean);
 typedef void (APIENTRYP MYPFNGLBINDTEXTUREPROC)(GLenum, GLuint);
 typedef void (APIENTRYP MYPFNGLTEXIMAGE2DPROC)(GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum, const GLvoid*);
@@ -129,6 +134,7 @@ static MYPFNGLUNIFORMMATRIX4FVPROC          glUniformMatrix4fv_         = nullpt
 static MYPFNGLBINDBUFFERPROC                glBindBuffer_               = nullptr;
 static MYPFNGLGENBUFFERSPROC                glGenBuffers_               = nullptr;
 static MYPFNGLVERTEXATTRIBPOINTERPROC       glVertexAttribPointer_      = nullptr;
+static MYPFNGLVERTEXATTRIBDIVISORPROC       glVertexAttribDivisor_      = nullptr;
 static MYPFNGLBUFFERDATAPROC                glBufferData_               = nullptr;
 static MYPFNGLVALIDATEPROGRAMPROC           glValidateProgram_          = nullptr;
 static MYPFNGLGENVERTEXARRAYSPROC           glGenVertexArrays_          = nullptr;
@@ -161,6 +167,8 @@ static MYPFNGLCULLFACEPROC                  glCullFace_                 = nullpt
 static MYPFNGLENABLEPROC                    glEnable_                   = nullptr;
 static MYPFNGLDISABLEPROC                   glDisable_                  = nullptr;
 static MYPFNGLDRAWELEMENTSPROC              glDrawElements_             = nullptr;
+static MYPFNGLMULTIDRAWELEMENTSPROC         glMultiDrawElements_        = nullptr;
+static MYPFNGLDRAWELEMENTSINSTANCEDPROC     glDrawElementsInstanced_    = nullptr;
 static MYPFNGLDEPTHMASKPROC                 glDepthMask_                = nullptr;
 static MYPFNGLBINDTEXTUREPROC               glBindTexture_              = nullptr;
 static MYPFNGLTEXIMAGE2DPROC                glTexImage2D_               = nullptr;
@@ -429,7 +437,9 @@ static const char *kExtensions[] = {
     "GL_ARB_texture_compression_bptc",
     "GL_ARB_texture_rectangle",
     "GL_ARB_debug_output",
-    "GL_ARB_half_float_vertex"
+    "GL_ARB_half_float_vertex",
+    "GL_ARB_instanced_arrays",
+    "GL_ARB_draw_instanced"
 };
 
 static int gGLSLVersion = -1;
@@ -460,6 +470,201 @@ bool has(size_t ext) {
     return gExtensions.find(ext) != gExtensions.end();
 }
 
+///! Shadow state
+// Mirrors the state last handed to the driver so redundant calls can be
+// dropped. Anything which is not known yet is kUnknown which never
+// compares equal to a real value.
+static constexpr GLuint kUnknown = ~0u;
+static constexpr size_t kTextureUnits = 32;
+static constexpr size_t kTextureTargets = 4;
+
+static constexpr GLenum kCapabilities[] = {
+    GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST, GL_SCISSOR_TEST,
+    GL_STENCIL_TEST, GL_LINE_SMOOTH
+};
+
+static constexpr size_t kCapabilityCount = sizeof kCapabilities / sizeof *kCapabilities;
+
+static struct {
+    GLuint program;
+    GLuint textureUnit;
+    GLuint textures[kTextureUnits][kTextureTargets];
+    GLuint capabilities[kCapabilityCount];
+    GLuint cullFace;
+    GLuint depthMask;
+    GLuint blendEquation;
+    GLuint blendSource;
+    GLuint blendDestination;
+    GLuint depthFunc;
+} gState;
+
+// Uniform values per program, indexed by location. The first byte of
+// every value is the transpose flag for matrices and zero otherwise.
+static u::map<GLuint, u::vector<u::vector<unsigned char>>> gUniforms;
+
+static size_t gCalls = 0;
+static size_t gCallsElided = 0;
+
+size_t calls() {
+    return gCalls;
+}
+
+size_t callsElided() {
+    return gCallsElided;
+}
+
+void resetStats() {
+    gCalls = 0;
+    gCallsElided = 0;
+}
+
+static void stateReset() {
+    memset(&gState, 0xFF, sizeof gState);
+    gUniforms.clear();
+}
+
+// Records `value' and returns true when it differs from `state'
+static inline bool stateChange(GLuint &state, GLuint value) {
+    if (state == value)
+        return false;
+    state = value;
+    return true;
+}
+
+static inline size_t stateTextureTarget(GLenum target) {
+    switch (target) {
+    case GL_TEXTURE_2D:        return 0;
+    case GL_TEXTURE_3D:        return 1;
+    case GL_TEXTURE_RECTANGLE: return 2;
+    case GL_TEXTURE_CUBE_MAP:  return 3;
+    }
+    return kTextureTargets;
+}
+
+static inline bool stateCapability(GLenum cap, GLuint enabled) {
+    for (size_t i = 0; i < kCapabilityCount; i++)
+        if (kCapabilities[i] == cap)
+            return stateChange(gState.capabilities[i], enabled);
+    return true;
+}
+
+static bool stateUniform(GLint location, const void *data, size_t size, unsigned char transpose = 0) {
+    if (location < 0 || gState.program == kUnknown)
+        return true;
+    auto &values = gUniforms[gState.program];
+    if (size_t(location) >= values.size())
+        values.resize(location + 1);
+    auto &value = values[location];
+    if (value.size() == size + 1 && value[0] == transpose && !memcmp(&value[1], data, size))
+        return false;
+    value.resize(size + 1);
+    value[0] = transpose;
+    memcpy(&value[1], data, size);
+    return true;
+}
+
+static inline bool stateUseProgram(GLuint program) {
+    return stateChange(gState.program, program);
+}
+
+static inline bool stateUniform1i(GLint location, GLint v0) {
+    return stateUniform(location, &v0, sizeof v0);
+}
+
+static inline bool stateUniform2i(GLint location, GLint v0, GLint v1) {
+    const GLint v[] = { v0, v1 };
+    return stateUniform(location, v, sizeof v);
+}
+
+static inline bool stateUniform1f(GLint location, GLfloat v0) {
+    return stateUniform(location, &v0, sizeof v0);
+}
+
+static inline bool stateUniform2f(GLint location, GLfloat v0, GLfloat v1) {
+    const GLfloat v[] = { v0, v1 };
+    return stateUniform(location, v, sizeof v);
+}
+
+static inline bool stateUniform3fv(GLint location, GLsizei count, const GLfloat *value) {
+    return stateUniform(location, value, sizeof(GLfloat) * 3 * count);
+}
+
+static inline bool stateUniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value) {
+    return stateUniform(location, value, sizeof(GLfloat) * 16 * count, transpose);
+}
+
+static inline bool stateUniformMatrix3x4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value) {
+    return stateUniform(location, value, sizeof(GLfloat) * 12 * count, transpose);
+}
+
+static inline bool stateActiveTexture(GLenum texture) {
+    return stateChange(gState.textureUnit, texture - GL_TEXTURE0);
+}
+
+static inline bool stateBindTexture(GLenum target, GLuint texture) {
+    const size_t index = stateTextureTarget(target);
+    if (gState.textureUnit >= kTextureUnits || index == kTextureTargets)
+        return true;
+    return stateChange(gState.textures[gState.textureUnit][index], texture);
+}
+
+static inline bool stateCullFace(GLenum mode) {
+    return stateChange(gState.cullFace, mode);
+}
+
+static inline bool stateEnable(GLenum cap) {
+    return stateCapability(cap, GL_TRUE);
+}
+
+static inline bool stateDisable(GLenum cap) {
+    return stateCapability(cap, GL_FALSE);
+}
+
+static inline bool stateDepthMask(GLboolean flag) {
+    return stateChange(gState.depthMask, flag);
+}
+
+static inline bool stateBlendEquation(GLenum mode) {
+    return stateChange(gState.blendEquation, mode);
+}
+
+static inline bool stateBlendFunc(GLenum sfactor, GLenum dfactor) {
+    // Evaluate both to record them
+    const bool source = stateChange(gState.blendSource, sfactor);
+    const bool destination = stateChange(gState.blendDestination, dfactor);
+    return source || destination;
+}
+
+static inline bool stateDepthFunc(GLenum func) {
+    return stateChange(gState.depthFunc, func);
+}
+
+static inline void stateForgetUniforms(GLuint program) {
+    auto find = gUniforms.find(program);
+    if (find != gUniforms.end())
+        gUniforms.erase(find);
+}
+
+// Linking resets every uniform of the program to zero
+static inline void stateLinkProgram(GLuint program) {
+    stateForgetUniforms(program);
+}
+
+// The name can be handed out again for a different program
+static inline void stateDeleteProgram(GLuint program) {
+    stateForgetUniforms(program);
+    if (gState.program == program)
+        gState.program = kUnknown;
+}
+
+static inline void stateDeleteTextures(GLsizei n, const GLuint *textures) {
+    for (GLsizei i = 0; i < n; i++)
+        for (auto &unit : gState.textures)
+            for (auto &bound : unit)
+                if (bound == textures[i])
+                    bound = kUnknown;
+}
+
 void init() {
     glCreateShader_             = (MYPFNGLCREATESHADERPROC)neoGetProcAddress("glCreateShader");
     glShaderSource_             = (MYPFNGLSHADERSOURCEPROC)neoGetProcAddress("glShaderSource");
@@ -475,6 +680,7 @@ void init() {
     glBindBuffer_               = (MYPFNGLBINDBUFFERPROC)neoGetProcAddress("glBindBuffer");
     glGenBuffers_               = (MYPFNGLGENBUFFERSPROC)neoGetProcAddress("glGenBuffers");
     glVertexAttribPointer_      = (MYPFNGLVERTEXATTRIBPOINTERPROC)neoGetProcAddress("glVertexAttribPointer");
+    glVertexAttribDivisor_      = (MYPFNGLVERTEXATTRIBDIVISORPROC)neoGetProcAddress("glVertexAttribDivisor");
     glBufferData_               = (MYPFNGLBUFFERDATAPROC)neoGetProcAddress("glBufferData");
     glValidateProgram_          = (MYPFNGLVALIDATEPROGRAMPROC)neoGetProcAddress("glValidateProgram");
     glGenVertexArrays_          = (MYPFNGLGENVERTEXARRAYSPROC)neoGetProcAddress("glGenVertexArrays");
@@ -507,6 +713,8 @@ void init() {
     glEnable_                   = (MYPFNGLENABLEPROC)neoGetProcAddress("glEnable");
     glDisable_                  = (MYPFNGLDISABLEPROC)neoGetProcAddress("glDisable");
     glDrawElements_             = (MYPFNGLDRAWELEMENTSPROC)neoGetProcAddress("glDrawElements");
+    glMultiDrawElements_        = (MYPFNGLMULTIDRAWELEMENTSPROC)neoGetProcAddress("glMultiDrawElements");
+    glDrawElementsInstanced_    = (MYPFNGLDRAWELEMENTSINSTANCEDPROC)neoGetProcAddress("glDrawElementsInstanced");
     glDepthMask_                = (MYPFNGLDEPTHMASKPROC)neoGetProcAddress("glDepthMask");
     glBindTexture_              = (MYPFNGLBINDTEXTUREPROC)neoGetProcAddress("glBindTexture");
     glTexImage2D_               = (MYPFNGLTEXIMAGE2DPROC)neoGetProcAddress("glTexImage2D");
@@ -558,6 +766,17 @@ void init() {
             if (!strcmp(kExtensions[j], (const char *)glGetStringi_(GL_EXTENSIONS, i)))
                 gExtensions.insert(j);
 
+    // The instancing entry points are core from 3.1 and 3.3 on, older contexts
+    // only have the ARB ones. Without either the extension is as good as missing
+    if (!glVertexAttribDivisor_)
+        glVertexAttribDivisor_ = (MYPFNGLVERTEXATTRIBDIVISORPROC)neoGetProcAddress("glVertexAttribDivisorARB");
+    if (!glDrawElementsInstanced_)
+        glDrawElementsInstanced_ = (MYPFNGLDRAWELEMENTSINSTANCEDPROC)neoGetProcAddress("glDrawElementsInstancedARB");
+    if (!glVertexAttribDivisor_)
+        gExtensions.erase(gl::ARB_instanced_arrays);
+    if (!glDrawElementsInstanced_)
+        gExtensions.erase(gl::ARB_draw_instanced);
+
     auto &aniso = varGet<int>("r_aniso");
     if (has(gl::EXT_texture_filter_anisotropic)) {
         float largest;
@@ -588,6 +807,8 @@ void init() {
     if (gGLSLVersion == -1)
         neoFatal("Failed to initialize OpenGL\n");
 
+    stateReset();
+
 #ifdef DEBUG_GL
     if (has(gl::ARB_debug_output)) {
         glEnable_(GL_DEBUG_OUTPUT_SYNCHRONOUS_ARB);
@@ -598,438 +819,613 @@ void init() {
 
 
 GLuint CreateShader(GLenum shaderType GL_INFOP) {
+    gCalls++;
     GLuint result = glCreateShader_(shaderType);
     GL_CHECK("2", shaderType);
     return result;
 }
 
 void ShaderSource(GLuint shader, GLsizei count, const GLchar** string, const GLint* length GL_INFOP) {
+    gCalls++;
     glShaderSource_(shader, count, string, length);
     GL_CHECK("b8*0*7", shader, count, string, length);
 }
 
 void CompileShader(GLuint shader GL_INFOP) {
+    gCalls++;
     glCompileShader_(shader);
     GL_CHECK("b", shader);
 }
 
 void AttachShader(GLuint program, GLuint shader GL_INFOP) {
+    gCalls++;
     glAttachShader_(program, shader);
     GL_CHECK("bb", program, shader);
 }
 
 GLuint CreateProgram(GL_INFO) {
+    gCalls++;
     GLuint result = glCreateProgram_();
     GL_CHECK("",0);
     return result;
 }
 
 void LinkProgram(GLuint program GL_INFOP) {
+    stateLinkProgram(program);
+    gCalls++;
     glLinkProgram_(program);
     GL_CHECK("b", program);
 }
 
 void UseProgram(GLuint program GL_INFOP) {
+    if (!stateUseProgram(program)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glUseProgram_(program);
     GL_CHECK("b", program);
 }
 
 GLint GetUniformLocation(GLuint program, const GLchar* name GL_INFOP) {
+    gCalls++;
     GLint result = glGetUniformLocation_(program, name);
     GL_CHECK("b*1", program, name);
     return result;
 }
 
 void EnableVertexAttribArray(GLuint index GL_INFOP) {
+    gCalls++;
     glEnableVertexAttribArray_(index);
     GL_CHECK("b", index);
 }
 
 void DisableVertexAttribArray(GLuint index GL_INFOP) {
+    gCalls++;
     glDisableVertexAttribArray_(index);
     GL_CHECK("b", index);
 }
 
 void UniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value GL_INFOP) {
+    if (!stateUniformMatrix4fv(location, count, transpose, value)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glUniformMatrix4fv_(location, count, transpose, value);
     GL_CHECK("783*c", location, count, transpose, value);
 }
 
 void BindBuffer(GLenum target, GLuint buffer GL_INFOP) {
+    gCalls++;
     glBindBuffer_(target, buffer);
     GL_CHECK("2b", target, buffer);
 }
 
 void GenBuffers(GLsizei n, GLuint* buffers GL_INFOP) {
+    gCalls++;
     glGenBuffers_(n, buffers);
     GL_CHECK("8*b", n, buffers);
 }
 
 void VertexAttribPointer(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const GLvoid* pointer GL_INFOP) {
+    gCalls++;
     glVertexAttribPointer_(index, size, type, normalized, stride, pointer);
     GL_CHECK("b7238*0", index, size, type, normalized, stride, pointer);
 }
 
+void VertexAttribDivisor(GLuint index, GLuint divisor GL_INFOP) {
+    gCalls++;
+    glVertexAttribDivisor_(index, divisor);
+    GL_CHECK("bb", index, divisor);
+}
+
 void BufferData(GLenum target, GLsizeiptr size, const GLvoid* data, GLenum usage GL_INFOP) {
+    gCalls++;
     glBufferData_(target, size, data, usage);
     GL_CHECK("2f*02", target, size, data, usage);
 }
 
 void ValidateProgram(GLuint program GL_INFOP) {
+    gCalls++;
     glValidateProgram_(program);
     GL_CHECK("b", program);
 }
 
 void GenVertexArrays(GLsizei n, GLuint* arrays GL_INFOP) {
+    gCalls++;
     glGenVertexArrays_(n, arrays);
     GL_CHECK("8*b", n, arrays);
 }
 
 void BindVertexArray(GLuint array GL_INFOP) {
+    gCalls++;
     glBindVertexArray_(array);
     GL_CHECK("b", array);
 }
 
 void DeleteProgram(GLuint program GL_INFOP) {
+    stateDeleteProgram(program);
+    gCalls++;
     glDeleteProgram_(program);
     GL_CHECK("b", program);
 }
 
 void DeleteBuffers(GLsizei n, const GLuint* buffers GL_INFOP) {
+    gCalls++;
     glDeleteBuffers_(n, buffers);
     GL_CHECK("8*b", n, buffers);
 }
 
 void DeleteVertexArrays(GLsizei n, const GLuint* arrays GL_INFOP) {
+    gCalls++;
     glDeleteVertexArrays_(n, arrays);
     GL_CHECK("8*b", n, arrays);
 }
 
 void Uniform1i(GLint location, GLint v0 GL_INFOP) {
+    if (!stateUniform1i(location, v0)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glUniform1i_(location, v0);
     GL_CHECK("77", location, v0);
 }
 
 void Uniform2i(GLint location, GLint v0, GLint v1 GL_INFOP) {
+    if (!stateUniform2i(location, v0, v1)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glUniform2i_(location, v0, v1);
     GL_CHECK("777", location, v0, v1);
 }
 
 void Uniform1f(GLint location, GLfloat v0 GL_INFOP) {
+    if (!stateUniform1f(location, v0)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glUniform1f_(location, v0);
     GL_CHECK("7c", location, v0);
 }
 
 void Uniform2f(GLint location, GLfloat v0, GLfloat v1 GL_INFOP) {
+    if (!stateUniform2f(location, v0, v1)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glUniform2f_(location, v0, v1);
     GL_CHECK("7cc", location, v0, v1);
 }
 
 void Uniform3fv(GLint location, GLsizei count, const GLfloat* value GL_INFOP) {
+    if (!stateUniform3fv(location, count, value)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glUniform3fv_(location, count, value);
     GL_CHECK("78*c", location, count, value);
 }
 
 void UniformMatrix3x4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value GL_INFOP) {
+    if (!stateUniformMatrix3x4fv(location, count, transpose, value)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glUniformMatrix3x4fv_(location, count, transpose, value);
     GL_CHECK("783*c", location, count, transpose, value);
 }
 
 void GenerateMipmap(GLenum target GL_INFOP) {
+    gCalls++;
     glGenerateMipmap_(target);
     GL_CHECK("2", target);
 }
 
 void DeleteShader(GLuint shader GL_INFOP) {
+    gCalls++;
     glDeleteShader_(shader);
     GL_CHECK("b", shader);
 }
 
 void GetShaderiv(GLuint shader, GLenum pname, GLint* params GL_INFOP) {
+    gCalls++;
     glGetShaderiv_(shader, pname, params);
     GL_CHECK("b2*7", shader, pname, params);
 }
 
 void GetProgramiv(GLuint program, GLenum pname, GLint* params GL_INFOP) {
+    gCalls++;
     glGetProgramiv_(program, pname, params);
     GL_CHECK("b2*7", program, pname, params);
 }
 
 void GetShaderInfoLog(GLuint shader, GLsizei maxLength, GLsizei* length, GLchar* infoLog GL_INFOP) {
+    gCalls++;
     glGetShaderInfoLog_(shader, maxLength, length, infoLog);
     GL_CHECK("b8*8*1", shader, maxLength, length, infoLog);
 }
 
 void ActiveTexture(GLenum texture GL_INFOP) {
+    if (!stateActiveTexture(texture)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glActiveTexture_(texture);
     GL_CHECK("2", texture);
 }
 
 void GenFramebuffers(GLsizei n, GLuint* ids GL_INFOP) {
+    gCalls++;
     glGenFramebuffers_(n, ids);
     GL_CHECK("8*b", n, ids);
 }
 
 void BindFramebuffer(GLenum target, GLuint framebuffer GL_INFOP) {
+    gCalls++;
     glBindFramebuffer_(target, framebuffer);
     GL_CHECK("2b", target, framebuffer);
 }
 
 void FramebufferTexture2D(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level GL_INFOP) {
+    gCalls++;
     glFramebufferTexture2D_(target, attachment, textarget, texture, level);
     GL_CHECK("222b7", target, attachment, textarget, texture, level);
 }
 
 void DrawBuffers(GLsizei n, const GLenum* bufs GL_INFOP) {
+    gCalls++;
     glDrawBuffers_(n, bufs);
     GL_CHECK("8*2", n, bufs);
 }
 
 GLenum CheckFramebufferStatus(GLenum target GL_INFOP) {
+    gCalls++;
     GLenum result = glCheckFramebufferStatus_(target);
     GL_CHECK("2", target);
     return result;
 }
 
 void DeleteFramebuffers(GLsizei n, const GLuint* framebuffers GL_INFOP) {
+    gCalls++;
     glDeleteFramebuffers_(n, framebuffers);
     GL_CHECK("8*b", n, framebuffers);
 }
 
 void Clear(GLbitfield mask GL_INFOP) {
+    gCalls++;
     glClear_(mask);
     GL_CHECK("4", mask);
 }
 
 void ClearColor(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha GL_INFOP) {
+    gCalls++;
     glClearColor_(red, green, blue, alpha);
     GL_CHECK("cccc", red, green, blue, alpha);
 }
 
 void FrontFace(GLenum mode GL_INFOP) {
+    gCalls++;
     glFrontFace_(mode);
     GL_CHECK("2", mode);
 }
 
 void CullFace(GLenum mode GL_INFOP) {
+    if (!stateCullFace(mode)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glCullFace_(mode);
     GL_CHECK("2", mode);
 }
 
 void Enable(GLenum cap GL_INFOP) {
+    if (!stateEnable(cap)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glEnable_(cap);
     GL_CHECK("2", cap);
 }
 
 void Disable(GLenum cap GL_INFOP) {
+    if (!stateDisable(cap)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glDisable_(cap);
     GL_CHECK("2", cap);
 }
 
 void DrawElements(GLenum mode, GLsizei count, GLenum type, const GLvoid* indices GL_INFOP) {
+    gCalls++;
     glDrawElements_(mode, count, type, indices);
     GL_CHECK("282*0", mode, count, type, indices);
 }
 
+void MultiDrawElements(GLenum mode, const GLsizei* count, GLenum type, const GLvoid* const* indices, GLsizei drawcount GL_INFOP) {
+    gCalls++;
+    glMultiDrawElements_(mode, count, type, indices, drawcount);
+    GL_CHECK("2*82*08", mode, count, type, indices, drawcount);
+}
+
+void DrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const GLvoid* indices, GLsizei primcount GL_INFOP) {
+    gCalls++;
+    glDrawElementsInstanced_(mode, count, type, indices, primcount);
+    GL_CHECK("282*08", mode, count, type, indices, primcount);
+}
+
 void DepthMask(GLboolean flag GL_INFOP) {
+    if (!stateDepthMask(flag)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glDepthMask_(flag);
     GL_CHECK("3", flag);
 }
 
 void BindTexture(GLenum target, GLuint texture GL_INFOP) {
+    if (!stateBindTexture(target, texture)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glBindTexture_(target, texture);
     GL_CHECK("2b", target, texture);
 }
 
 void TexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const GLvoid* data GL_INFOP) {
+    gCalls++;
     glTexImage2D_(target, level, internalFormat, width, height, border, format, type, data);
     GL_CHECK("27788722*0", target, level, internalFormat, width, height, border, format, type, data);
 }
 
 void DeleteTextures(GLsizei n, const GLuint* textures GL_INFOP) {
+    stateDeleteTextures(n, textures);
+    gCalls++;
     glDeleteTextures_(n, textures);
     GL_CHECK("8*b", n, textures);
 }
 
 void GenTextures(GLsizei n, GLuint* textures GL_INFOP) {
+    gCalls++;
     glGenTextures_(n, textures);
     GL_CHECK("8*b", n, textures);
 }
 
 void TexParameterf(GLenum target, GLenum pname, GLfloat param GL_INFOP) {
+    gCalls++;
     glTexParameterf_(target, pname, param);
     GL_CHECK("22c", target, pname, param);
 }
 
 void TexParameteri(GLenum target, GLenum pname, GLint param GL_INFOP) {
+    gCalls++;
     glTexParameteri_(target, pname, param);
     GL_CHECK("227", target, pname, param);
 }
 
 void DrawArrays(GLenum mode, GLint first, GLsizei count GL_INFOP) {
+    gCalls++;
     glDrawArrays_(mode, first, count);
     GL_CHECK("278", mode, first, count);
 }
 
 void BlendEquation(GLenum mode GL_INFOP) {
+    if (!stateBlendEquation(mode)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glBlendEquation_(mode);
     GL_CHECK("2", mode);
 }
 
 void BlendFunc(GLenum sfactor, GLenum dfactor GL_INFOP) {
+    if (!stateBlendFunc(sfactor, dfactor)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glBlendFunc_(sfactor, dfactor);
     GL_CHECK("22", sfactor, dfactor);
 }
 
 void DepthFunc(GLenum func GL_INFOP) {
+    if (!stateDepthFunc(func)) {
+        gCallsElided++;
+        return;
+    }
+    gCalls++;
     glDepthFunc_(func);
     GL_CHECK("2", func);
 }
 
 void ColorMask(GLboolean red, GLboolean green, GLboolean blue, GLboolean alpha GL_INFOP) {
+    gCalls++;
     glColorMask_(red, green, blue, alpha);
     GL_CHECK("3333", red, green, blue, alpha);
 }
 
 void ReadPixels(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, GLvoid* data GL_INFOP) {
+    gCalls++;
     glReadPixels_(x, y, width, height, format, type, data);
     GL_CHECK("778822*0", x, y, width, height, format, type, data);
 }
 
 void Viewport(GLint x, GLint y, GLsizei width, GLsizei height GL_INFOP) {
+    gCalls++;
     glViewport_(x, y, width, height);
     GL_CHECK("7788", x, y, width, height);
 }
 
 void GetIntegerv(GLenum pname, GLint* data GL_INFOP) {
+    gCalls++;
     glGetIntegerv_(pname, data);
     GL_CHECK("2*7", pname, data);
 }
 
 const GLubyte* GetString(GLenum name GL_INFOP) {
+    gCalls++;
     const GLubyte* result = glGetString_(name);
     GL_CHECK("2", name);
     return result;
 }
 
 const GLubyte* GetStringi(GLenum name, GLuint index GL_INFOP) {
+    gCalls++;
     const GLubyte* result = glGetStringi_(name, index);
     GL_CHECK("2b", name, index);
     return result;
 }
 
 void GetFloatv(GLenum pname, GLfloat* params GL_INFOP) {
+    gCalls++;
     glGetFloatv_(pname, params);
     GL_CHECK("2*c", pname, params);
 }
 
 GLenum GetError(GL_INFO) {
+    gCalls++;
     GLenum result = glGetError_();
     GL_CHECK("",0);
     return result;
 }
 
 void GetTexLevelParameteriv(GLenum target, GLint level, GLenum pname, GLint* params GL_INFOP) {
+    gCalls++;
     glGetTexLevelParameteriv_(target, level, pname, params);
     GL_CHECK("272*7", target, level, pname, params);
 }
 
 void GetCompressedTexImage(GLenum target, GLint lod, GLvoid* img GL_INFOP) {
+    gCalls++;
     glGetCompressedTexImage_(target, lod, img);
     GL_CHECK("27*0", target, lod, img);
 }
 
 void CompressedTexImage2D(GLenum target, GLint level, GLenum internalformat, GLsizei width, GLsizei height, GLint border, GLsizei imageSize, const GLvoid* data GL_INFOP) {
+    gCalls++;
     glCompressedTexImage2D_(target, level, internalformat, width, height, border, imageSize, data);
     GL_CHECK("2728878*0", target, level, internalformat, width, height, border, imageSize, data);
 }
 
 void PixelStorei(GLenum pname, GLint param GL_INFOP) {
+    gCalls++;
     glPixelStorei_(pname, param);
     GL_CHECK("27", pname, param);
 }
 
 void Scissor(GLint x, GLint y, GLsizei width, GLsizei height GL_INFOP) {
+    gCalls++;
     glScissor_(x, y, width, height);
     GL_CHECK("7788", x, y, width, height);
 }
 
 void PolygonMode(GLenum face, GLenum mode GL_INFOP) {
+    gCalls++;
     glPolygonMode_(face, mode);
     GL_CHECK("22", face, mode);
 }
 
 void Hint(GLenum target, GLenum mode GL_INFOP) {
+    gCalls++;
     glHint_(target, mode);
     GL_CHECK("22", target, mode);
 }
 
 void GenQueries(GLsizei n, GLuint* ids GL_INFOP) {
+    gCalls++;
     glGenQueries_(n, ids);
     GL_CHECK("8*b", n, ids);
 }
 
 void BeginQuery(GLenum target, GLuint id GL_INFOP) {
+    gCalls++;
     glBeginQuery_(target, id);
     GL_CHECK("2b", target, id);
 }
 
 void EndQuery(GLenum target, GLuint id GL_INFOP) {
+    gCalls++;
     glEndQuery_(target, id);
     GL_CHECK("2b", target, id);
 }
 
 void DeleteQueries(GLsizei n, const GLuint* ids GL_INFOP) {
+    gCalls++;
     glDeleteQueries_(n, ids);
     GL_CHECK("8*b", n, ids);
 }
 
 void GetQueryObjectuiv(GLuint id, GLenum pname, GLuint* params GL_INFOP) {
+    gCalls++;
     glGetQueryObjectuiv_(id, pname, params);
     GL_CHECK("b2*b", id, pname, params);
 }
 
 void Flush(GL_INFO) {
+    gCalls++;
     glFlush_();
     GL_CHECK("",0);
 }
 
 void StencilFunc(GLenum func, GLint ref, GLuint mask GL_INFOP) {
+    gCalls++;
     glStencilFunc_(func, ref, mask);
     GL_CHECK("27b", func, ref, mask);
 }
 
 void StencilOp(GLenum sfail, GLenum dpfail, GLenum dppass GL_INFOP) {
+    gCalls++;
     glStencilOp_(sfail, dpfail, dppass);
     GL_CHECK("222", sfail, dpfail, dppass);
 }
 
 void TexImage3D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height, GLsizei depth, GLint border, GLenum format, GLenum type, const GLvoid* data GL_INFOP) {
+    gCalls++;
     glTexImage3D_(target, level, internalFormat, width, height, depth, border, format, type, data);
     GL_CHECK("277888722*0", target, level, internalFormat, width, height, depth, border, format, type, data);
 }
 
 void TexSubImage3D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLint zoffset, GLsizei width, GLsizei height, GLsizei depth, GLenum format, GLenum type, const GLvoid * data GL_INFOP) {
+    gCalls++;
     glTexSubImage3D_(target, level, xoffset, yoffset, zoffset, width, height, depth, format, type, data);
     GL_CHECK("2777788822*0", target, level, xoffset, yoffset, zoffset, width, height, depth, format, type, data);
 }
 
 void GetProgramInfoLog(GLuint program, GLsizei maxLength, GLsizei* length, GLchar* infoLog GL_INFOP) {
+    gCalls++;
     glGetProgramInfoLog_(program, maxLength, length, infoLog);
     GL_CHECK("b8*8*1", program, maxLength, length, infoLog);
 }
 
 void BindAttribLocation(GLuint program, GLuint index, const GLchar* name GL_INFOP) {
+    gCalls++;
     glBindAttribLocation_(program, index, name);
     GL_CHECK("bb*1", program, index, name);
 }
 
 void BindFragDataLocation(GLuint program, GLuint colorNumber, const GLchar* name GL_INFOP) {
+    gCalls++;
     glBindFragDataLocation_(program, colorNumber, name);
     GL_CHECK("bb*1", program, colorNumber, name);
 }
 
 void TexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLsizei width, GLsizei height, GLenum format, GLenum type, const GLvoid* data GL_INFOP) {
+    gCalls++;
     glTexSubImage2D_(target, level, xoffset, yoffset, width, height, format, type, data);
     GL_CHECK("27778822*0", target, level, xoffset, yoffset, width, height, format, type, data);
 }
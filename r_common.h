@@ -28,7 +28,9 @@ enum : size_t {
     ARB_texture_compression_bptc,
     ARB_texture_rectangle,
     ARB_debug_output,
-    ARB_half_float_vertex
+    ARB_half_float_vertex,
+    ARB_instanced_arrays,
+    ARB_draw_instanced
 };
 
 void init();
@@ -38,6 +40,12 @@ const char *glslVersionString();
 const u::set<size_t> &extensions();
 bool has(size_t ext);
 
+// Calls which reached the driver and calls dropped by the shadow state
+// because they would not have changed anything since the last resetStats
+size_t calls();
+size_t callsElided();
+void resetStats();
+
 GLuint CreateShader(GLenum shaderType GL_INFOP);
 void ShaderSource(GLuint shader, GLsizei count, const GLchar** string, const GLint* length GL_INFOP);
 void CompileShader(GLuint shader GL_INFOP);
@@ -52,6 +60,7 @@ void UniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const
 void BindBuffer(GLenum target, GLuint buffer GL_INFOP);
 void GenBuffers(GLsizei n, GLuint* buffers GL_INFOP);
 void VertexAttribPointer(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const GLvoid* pointer GL_INFOP);
+void VertexAttribDivisor(GLuint index, GLuint divisor GL_INFOP);
 void BufferData(GLenum target, GLsizeiptr size, const GLvoid* data, GLenum usage GL_INFOP);
 void ValidateProgram(GLuint program GL_INFOP);
 void GenVertexArrays(GLsizei n, GLuint* arrays GL_INFOP);
@@ -84,6 +93,8 @@ void CullFace(GLenum mode GL_INFOP);
 void Enable(GLenum cap GL_INFOP);
 void Disable(GLenum cap GL_INFOP);
 void DrawElements(GLenum mode, GLsizei count, GLenum type, const GLvoid* indices GL_INFOP);
+void MultiDrawElements(GLenum mode, const GLsizei* count, GLenum type, const GLvoid* const* indices, GLsizei drawcount GL_INFOP);
+void DrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const GLvoid* indices, GLsizei primcount GL_INFOP);
 void DepthMask(GLboolean flag GL_INFOP);
 void BindTexture(GLenum target, GLuint texture GL_INFOP);
 void TexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height, GLint border, GLenum format, GLenum type, const GLvoid* data GL_INFOP);
@@ -141,6 +152,7 @@ void TexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLs
 #   define BindBuffer(...)               BindBuffer(__VA_ARGS__, __FILE__, __LINE__)
 #   define GenBuffers(...)               GenBuffers(__VA_ARGS__, __FILE__, __LINE__)
 #   define VertexAttribPointer(...)      VertexAttribPointer(__VA_ARGS__, __FILE__, __LINE__)
+#   define VertexAttribDivisor(...)      VertexAttribDivisor(__VA_ARGS__, __FILE__, __LINE__)
 #   define BufferData(...)               BufferData(__VA_ARGS__, __FILE__, __LINE__)
 #   define ValidateProgram(...)          ValidateProgram(__VA_ARGS__, __FILE__, __LINE__)
 #   define GenVertexArrays(...)          GenVertexArrays(__VA_ARGS__, __FILE__, __LINE__)
@@ -173,6 +185,8 @@ void TexSubImage2D(GLenum target, GLint level, GLint xoffset, GLint yoffset, GLs
 #   define Enable(...)                   Enable(__VA_ARGS__, __FILE__, __LINE__)
 #   define Disable(...)                  Disable(__VA_ARGS__, __FILE__, __LINE__)
 #   define DrawElements(...)             DrawElements(__VA_ARGS__, __FILE__, __LINE__)
+#   define MultiDrawElements(...)        MultiDrawElements(__VA_ARGS__, __FILE__, __LINE__)
+#   define DrawElementsInstanced(...)    DrawElementsInstanced(__VA_ARGS__, __FILE__, __LINE__)
 #   define DepthMask(...)                DepthMask(__VA_ARGS__, __FILE__, __LINE__)
 #   define BindTexture(...)              BindTexture(__VA_ARGS__, __FILE__, __LINE__)
 #   define TexImage2D(...)               TexImage2D(__VA_ARGS__, __FILE__, __LINE__)
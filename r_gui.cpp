@@ -647,7 +647,7 @@ void gui::render(const pipeline &pl) {
             auto p = it.asModel.pipeline;
             gl::Viewport(it.asModel.x, it.asModel.y, it.asModel.w, it.asModel.h);
             m_modelMethod.setWorld(p.world());
-            m_modelMethod.setWVP(p.projection() * p.view() * p.world());
+            m_modelMethod.setWVP(p.worldViewProjection());
             mdl->render();
             gl::Disable(GL_DEPTH_TEST);
             gl::Viewport(0, 0, neoWidth(), neoHeight());
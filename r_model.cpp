@@ -31,7 +31,8 @@ bool geomMethod::init(const u::vector<const char *> &defines) {
                     { 2, "texCoord"   },
                     { 3, "tangent"    },
                     { 4, "weights"    },
-                    { 5, "bones"      } }
+                    { 5, "bones"      },
+                    { 6, "instanceWorld" } }
                 , { { 0, "diffuseOut" },
                     { 1, "normalOut"  } }))
     {
@@ -132,7 +133,8 @@ enum {
     kGeomPermSpecParams     = 1 << 3,
     kGeomPermParallax       = 1 << 4,
     kGeomPermSkeletal       = 1 << 5,
-    kGeomPermAnimated       = 1 << 6
+    kGeomPermAnimated       = 1 << 6,
+    kGeomPermInstance       = 1 << 7
 };
 
 ///! Geometry shading permutation singleton
@@ -184,7 +186,30 @@ static const geomPermutation kGeomPermutations[] = {
     { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecParams | kGeomPermSkeletal | kGeomPermAnimated,                     0,  1, -1, -1 },
     { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermParallax   | kGeomPermSkeletal | kGeomPermAnimated,                     0,  1, -1,  2 },
     { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecMap    | kGeomPermParallax | kGeomPermSkeletal | kGeomPermAnimated, 0,  1,  2,  3 },
-    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecParams | kGeomPermParallax | kGeomPermSkeletal | kGeomPermAnimated, 0,  1, -1,  2 }
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecParams | kGeomPermParallax | kGeomPermSkeletal | kGeomPermAnimated, 0,  1, -1,  2 },
+    // Instanced permutations (static)
+    { kGeomPermInstance,                                                                                                       -1, -1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermInstance,                                                                                     0, -1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermInstance,                                                               0,  1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermSpecMap    | kGeomPermInstance,                                                               0, -1,  1, -1 },
+    { kGeomPermDiffuse | kGeomPermSpecParams | kGeomPermInstance,                                                               0, -1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermInstance,                                                               0,  1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecMap    | kGeomPermInstance,                                         0,  1,  2, -1 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecParams | kGeomPermInstance,                                         0,  1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermParallax   | kGeomPermInstance,                                         0,  1, -1,  2 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecMap    | kGeomPermParallax | kGeomPermInstance,                     0,  1,  2,  3 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecParams | kGeomPermParallax | kGeomPermInstance,                     0,  1, -1,  2 },
+    // Instanced permutations (animated)
+    { kGeomPermDiffuse | kGeomPermAnimated   | kGeomPermInstance,                                                               0, -1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermAnimated   | kGeomPermInstance,                                         0,  1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermSpecMap    | kGeomPermAnimated   | kGeomPermInstance,                                         0, -1,  1, -1 },
+    { kGeomPermDiffuse | kGeomPermSpecParams | kGeomPermAnimated   | kGeomPermInstance,                                         0, -1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermAnimated   | kGeomPermInstance,                                         0,  1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecMap    | kGeomPermAnimated | kGeomPermInstance,                     0,  1,  2, -1 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecParams | kGeomPermAnimated | kGeomPermInstance,                     0,  1, -1, -1 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermParallax   | kGeomPermAnimated | kGeomPermInstance,                     0,  1, -1,  2 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecMap    | kGeomPermParallax | kGeomPermAnimated | kGeomPermInstance, 0,  1,  2,  3 },
+    { kGeomPermDiffuse | kGeomPermNormalMap  | kGeomPermSpecParams | kGeomPermParallax | kGeomPermAnimated | kGeomPermInstance, 0,  1, -1,  2 }
 };
 
 static const char *kGeomPermutationNames[] = {
@@ -194,12 +219,15 @@ static const char *kGeomPermutationNames[] = {
     "USE_SPECPARAMS",
     "USE_PARALLAX",
     "USE_SKELETAL",
-    "USE_ANIMATION"
+    "USE_ANIMATION",
+    "USE_INSTANCED"
 };
 
 ///! Singleton representing all the possible geometry methods (used by model and world.)
 geomMethods::geomMethods()
     : m_initialized(false)
+    , m_instancedTried(false)
+    , m_instanced(false)
 {
 }
 
@@ -207,6 +235,19 @@ void geomMethods::release() {
     delete m_geomMethods;
 }
 
+bool geomMethods::initPermutation(size_t index) {
+    const auto &p = kGeomPermutations[index];
+    auto &method = (*m_geomMethods)[index];
+    if (!method.init(generatePermutation(kGeomPermutationNames, p)))
+        return false;
+    method.enable();
+    if (p.color  != -1) method.setColorTextureUnit(p.color);
+    if (p.normal != -1) method.setNormalTextureUnit(p.normal);
+    if (p.spec   != -1) method.setSpecTextureUnit(p.spec);
+    if (p.disp   != -1) method.setDispTextureUnit(p.disp);
+    return true;
+}
+
 bool geomMethods::init() {
     if (m_initialized)
         return true;
@@ -215,20 +256,32 @@ bool geomMethods::init() {
     m_geomMethods = new u::vector<geomMethod>;
     static const size_t geomCount = sizeof(kGeomPermutations)/sizeof(kGeomPermutations[0]);
     (*m_geomMethods).resize(geomCount);
-    for (size_t i = 0; i < geomCount; i++) {
-        const auto &p = kGeomPermutations[i];
-        if (!(*m_geomMethods)[i].init(generatePermutation(kGeomPermutationNames, p)))
+    for (size_t i = 0; i < geomCount; i++)
+        if (!(kGeomPermutations[i].permute & kGeomPermInstance) && !initPermutation(i))
             return false;
-        (*m_geomMethods)[i].enable();
-        if (p.color  != -1) (*m_geomMethods)[i].setColorTextureUnit(p.color);
-        if (p.normal != -1) (*m_geomMethods)[i].setNormalTextureUnit(p.normal);
-        if (p.spec   != -1) (*m_geomMethods)[i].setSpecTextureUnit(p.spec);
-        if (p.disp   != -1) (*m_geomMethods)[i].setDispTextureUnit(p.disp);
-    }
+
+    // Without instancing in use the instanced permutations wait until it is
+    if (varGet<int>("r_instance").get() && !initInstanced())
+        u::print("[model] => instancing unavailable, drawing copies one at a time\n");
 
     return m_initialized = true;
 }
 
+bool geomMethods::initInstanced() {
+    if (m_instancedTried)
+        return m_instanced;
+    m_instancedTried = true;
+    if (!gl::has(gl::ARB_instanced_arrays) || !gl::has(gl::ARB_draw_instanced))
+        return false;
+
+    static const size_t geomCount = sizeof(kGeomPermutations)/sizeof(kGeomPermutations[0]);
+    for (size_t i = 0; i < geomCount; i++)
+        if ((kGeomPermutations[i].permute & kGeomPermInstance) && !initPermutation(i))
+            return false;
+
+    return m_instanced = true;
+}
+
 geomMethods geomMethods::m_instance;
 
 ///! Model Material Loading (used by model and world.)
@@ -315,31 +368,35 @@ bool material::load(u::map<u::string, texture2D*> &textures, const u::string &ma
         }
     }
 
-    auto loadTexture = [&](const u::string &ident, texture2D **store) {
+    // Animated materials need the dimensions of their textures right away, the
+    // rest decode on the worker pool and stand in with `placeholder' meanwhile
+    const bool async = !m_animFrames;
+    auto loadTexture = [&textures, colorized, async](const u::string &ident, texture2D **store, uint32_t placeholder) {
         if (ident.empty())
             return;
         if (textures.find(ident) != textures.end()) {
             *store = textures[ident];
         } else {
             u::unique_ptr<texture2D> tex(new texture2D);
-            if (tex->load(ident)) {
+            u::optional<uint32_t> colorize;
+            if (colorized != -1)
+                colorize = uint32_t(colorized);
+            if (async ? tex->loadAsync(ident, placeholder, colorize) : tex->load(ident, colorize)) {
                 auto release = tex.release();
                 textures[ident] = release;
                 *store = release;
-                if (colorized != -1) {
+                if (colorized != -1)
                     u::print("[material] => `%s' colorized with 0x%08X\n", ident, colorized);
-                    (*store)->colorize(colorized);
-                }
             } else {
                 *store = nullptr;
             }
         }
     };
 
-    loadTexture(diffuseName, &diffuse);
-    loadTexture(normalName, &normal);
-    loadTexture(specName, &spec);
-    loadTexture(displacementName, &displacement);
+    loadTexture(diffuseName, &diffuse, 0x808080FF);
+    loadTexture(normalName, &normal, 0x8080FFFF); // flat
+    loadTexture(specName, &spec, 0x000000FF);
+    loadTexture(displacementName, &displacement, 0x808080FF);
 
     // Sanitize animated inputs
     auto checkSize = [this, &fileName](texture2D *tex) {
@@ -404,13 +461,15 @@ bool material::upload() {
     return true;
 }
 
-void material::calculatePermutation(bool skeletal) {
+void material::calculatePermutation(bool skeletal, bool instanced) {
     var<int> &spec_ = varGet<int>("r_spec");
     var<int> &parallax_ = varGet<int>("r_parallax");
 
     int p = 0;
     if (skeletal)
         p |= kGeomPermSkeletal;
+    if (instanced)
+        p |= kGeomPermInstance;
     if (m_animFrames)
         p |= kGeomPermAnimated;
     if (diffuse)
@@ -431,16 +490,15 @@ void material::calculatePermutation(bool skeletal) {
     }
 }
 
-geomMethod *material::bind(const r::pipeline &pl, const m::mat4 &rw, bool skeletal) {
-    calculatePermutation(skeletal);
-    r::pipeline p = pl;
+geomMethod *material::bind(const r::pipeline &pl, const m::mat4 &rw, bool skeletal, bool instanced) {
+    calculatePermutation(skeletal, instanced);
     auto &permutation = kGeomPermutations[permute];
     auto &method = (*m_geomMethods)[permute];
     method.enable();
-    method.setWVP(p.projection() * p.view() * p.world());
+    method.setWVP(instanced ? pl.viewProjection() : pl.worldViewProjection());
     method.setWorld(rw);
     if (permutation.permute & kGeomPermParallax) {
-        method.setEyeWorldPos(p.position());
+        method.setEyeWorldPos(pl.position());
         method.setParallax(dispScale, dispBias);
     }
     if (permutation.permute & kGeomPermSpecParams) {
@@ -476,9 +534,15 @@ model::model()
     : m_geomMethods(&geomMethods::instance())
     , m_indices(0)
     , m_half(false)
+    , m_instanceBuffer(0)
 {
 }
 
+model::~model() {
+    if (m_instanceBuffer)
+        gl::DeleteBuffers(1, &m_instanceBuffer);
+}
+
 bool model::load(u::map<u::string, texture2D*> &textures, const u::string &file) {
     // Open the model file and look for a model configuration
     u::file fp = u::fopen(neoGamePath() + file + ".cfg", "r");
@@ -652,6 +716,23 @@ bool model::upload() {
     gl::BindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo);
     gl::BufferData(GL_ELEMENT_ARRAY_BUFFER, m_indices * sizeof(GLuint), &indices[0], GL_STATIC_DRAW);
 
+    // Skeletal models are posed one at a time so they are never instanced
+    const bool instancing = gl::has(gl::ARB_instanced_arrays) && gl::has(gl::ARB_draw_instanced);
+    if (!m_model.animated() && instancing) {
+        // One instance to begin with so draws which don't use it never read
+        // past the end
+        m::mat4 identity;
+        identity.loadIdentity();
+        gl::GenBuffers(1, &m_instanceBuffer);
+        gl::BindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+        gl::BufferData(GL_ARRAY_BUFFER, sizeof(m::mat4), &identity, GL_STREAM_DRAW);
+        for (size_t i = 0; i < 4; i++) {
+            gl::VertexAttribPointer(6 + i, 4, GL_FLOAT, GL_FALSE, sizeof(m::mat4), ATTRIB_OFFSET(i * 4));
+            gl::VertexAttribDivisor(6 + i, 1);
+            gl::EnableVertexAttribArray(6 + i);
+        }
+    }
+
     // Upload materials
     for (auto &mat : m_materials)
         if (!mat.upload())
@@ -677,6 +758,27 @@ void model::render(const r::pipeline &pl, const m::mat4 &w) {
     }
 }
 
+bool model::addInstance(const m::mat4 &world) {
+    if (!m_instanceBuffer || !m_geomMethods->initInstanced())
+        return false;
+    m_instances.push_back(world);
+    return true;
+}
+
+void model::renderInstances(const r::pipeline &pl, const m::mat4 &rw) {
+    if (m_instances.empty())
+        return;
+
+    gl::BindVertexArray(vao);
+    gl::BindBuffer(GL_ARRAY_BUFFER, m_instanceBuffer);
+    gl::BufferData(GL_ARRAY_BUFFER, sizeof(m::mat4) * m_instances.size(), &m_instances[0], GL_STREAM_DRAW);
+    for (const auto &it : m_batches) {
+        m_materials[it.material].bind(pl, rw, false, true);
+        gl::DrawElementsInstanced(GL_TRIANGLES, it.count, GL_UNSIGNED_INT, it.offset, m_instances.size());
+    }
+    m_instances.clear();
+}
+
 void model::render() {
     gl::BindVertexArray(vao);
     m_materials[0].diffuse->bind(GL_TEXTURE0);
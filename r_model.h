@@ -73,6 +73,9 @@ struct geomMethods {
     }
 
     bool init();
+    // The instanced permutations are only compiled when instancing is in use,
+    // false when it isn't supported or they don't compile
+    bool initInstanced();
     void release();
     geomMethod &operator[](size_t index);
     const geomMethod &operator[](size_t index) const;
@@ -82,8 +85,12 @@ private:
     geomMethods(const geomMethods &) = delete;
     void operator =(const geomMethods &) = delete;
 
+    bool initPermutation(size_t index);
+
     u::vector<geomMethod> *m_geomMethods;
     bool m_initialized;
+    bool m_instancedTried; // a failed compile isn't tried again
+    bool m_instanced;
     static geomMethods m_instance;
 };
 
@@ -109,8 +116,9 @@ struct material {
     float dispScale;
     float dispBias;
 
-    void calculatePermutation(bool skeletal = false);
-    geomMethod *bind(const r::pipeline &pl, const m::mat4 &rw, bool skeletal = false);
+    void calculatePermutation(bool skeletal = false, bool instanced = false);
+    // Instanced binds leave the world matrix to the instances
+    geomMethod *bind(const r::pipeline &pl, const m::mat4 &rw, bool skeletal = false, bool instanced = false);
     bool load(u::map<u::string, texture2D*> &textures, const u::string &file, const u::string &basePath);
     bool upload();
 
@@ -132,6 +140,7 @@ private:
 
 struct model : geom {
     model();
+    ~model();
 
     bool load(u::map<u::string, texture2D*> &textures, const u::string &file);
     bool upload();
@@ -139,6 +148,12 @@ struct model : geom {
     void render(const r::pipeline &pl, const m::mat4 &w);
     void render(); // GUI model rendering (diffuse only, single material, entire model)
 
+    // Queues a copy of the model at `world' for renderInstances. Returns false
+    // when the model can't be instanced, it has to be drawn with render then
+    bool addInstance(const m::mat4 &world);
+    // Draws the queued copies with one draw for every batch and empties the queue
+    void renderInstances(const r::pipeline &pl, const m::mat4 &rw);
+
     void animate(float curFrame);
     bool animated() const;
 
@@ -154,6 +169,8 @@ private:
     size_t m_indices;
     ::model m_model;
     bool m_half;
+    GLuint m_instanceBuffer; // world matrices of the instances, zero without instancing
+    u::vector<m::mat4> m_instances;
 };
 
 inline m::bbox model::bounds() const {
@@ -134,7 +134,7 @@ void particleSystem::render(const pipeline &pl) {
     gl::BufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indices.size(), &indices[0], GL_DYNAMIC_DRAW);
 
     m_method.enable();
-    m_method.setVP(p.projection() * p.view());
+    m_method.setVP(p.viewProjection());
     m_texture.bind(GL_TEXTURE0);
     gl::Disable(GL_CULL_FACE);
     gl::DepthMask(GL_FALSE);
@@ -4,8 +4,16 @@
 
 namespace r {
 
+// Products it took to build each matrix from nothing on every request, in
+// the order of pipeline::kWorld onwards
+static constexpr size_t kRequestMultiplies[] = { 2, 1, 0, 2, 5, 2 };
+
+static size_t gMultiplies = 0;
+static size_t gMultipliesRequested = 0;
+
 pipeline::pipeline()
-    : m_scale(1.0f, 1.0f, 1.0f)
+    : m_dirty(~0u)
+    , m_scale(1.0f, 1.0f, 1.0f)
     , m_time(0.0f)
     , m_delta(0.0f)
 {
@@ -14,26 +22,37 @@ pipeline::pipeline()
 
 void pipeline::setScale(const m::vec3 &scale) {
     m_scale = scale;
+    m_dirty |= kWorldDirty;
 }
 
 void pipeline::setWorld(const m::vec3 &world) {
     m_world = world;
+    m_dirty |= kWorldDirty;
 }
 
 void pipeline::setRotate(const m::mat4 &rotate) {
     m_rotate = rotate;
+    m_dirty |= kWorldDirty;
+}
+
+void pipeline::setWorldTransform(const m::mat4 &world) {
+    m_matrices[kWorld] = world;
+    m_dirty = (m_dirty | kWorldDirty) & ~(1u << kWorld);
 }
 
 void pipeline::setRotation(const m::quat &rotation) {
     m_rotation = rotation;
+    m_dirty |= kViewDirty;
 }
 
 void pipeline::setPosition(const m::vec3 &position) {
     m_position = position;
+    m_dirty |= kViewDirty;
 }
 
 void pipeline::setPerspective(const m::perspective &p) {
     m_perspective = p;
+    m_dirty |= kProjectionDirty;
 }
 
 void pipeline::setTime(float time) {
@@ -44,26 +63,91 @@ void pipeline::setDelta(float delta) {
     m_delta = delta;
 }
 
-const m::mat4 &pipeline::world() {
-    m::mat4 scale;
-    m::mat4 translate;
-    scale.setScaleTrans(m_scale.x, m_scale.y, m_scale.z);
-    translate.setTranslateTrans(m_world.x, m_world.y, m_world.z);
-    return m_matrices[kWorld] = translate * m_rotate * scale;
-}
-
-const m::mat4 &pipeline::view() {
-    m::mat4 translate;
-    m::mat4 rotate;
-    translate.setTranslateTrans(-m_position.x, -m_position.y, -m_position.z);
-    rotate.setCameraTrans(target(), up());
-    return m_matrices[kView] = rotate * translate;
-}
-
-const m::mat4 &pipeline::projection() {
-    m::mat4 perspective;
-    perspective.setPerspectiveTrans(m_perspective);
-    return m_matrices[kProjection] = perspective;
+const m::mat4 &pipeline::matrix(size_t index) const {
+    m::mat4 &result = m_matrices[index];
+    if (!(m_dirty & (1 << index)))
+        return result;
+    switch (index) {
+    case kWorld: {
+        m::mat4 scale;
+        m::mat4 translate;
+        scale.setScaleTrans(m_scale.x, m_scale.y, m_scale.z);
+        translate.setTranslateTrans(m_world.x, m_world.y, m_world.z);
+        result = translate * m_rotate * scale;
+        gMultiplies += 2;
+        break;
+    }
+    case kView: {
+        m::mat4 translate;
+        m::mat4 rotate;
+        translate.setTranslateTrans(-m_position.x, -m_position.y, -m_position.z);
+        rotate.setCameraTrans(target(), up());
+        result = rotate * translate;
+        gMultiplies++;
+        break;
+    }
+    case kProjection:
+        result.setPerspectiveTrans(m_perspective);
+        break;
+    case kViewProjection:
+        result = matrix(kProjection) * matrix(kView);
+        gMultiplies++;
+        break;
+    case kWorldViewProjection:
+        result = matrix(kViewProjection) * matrix(kWorld);
+        gMultiplies++;
+        break;
+    case kInverseViewProjection: {
+        m::mat4 viewProjection = matrix(kViewProjection);
+        result = viewProjection.inverse();
+        break;
+    }
+    }
+    m_dirty &= ~(1u << index);
+    return result;
+}
+
+const m::mat4 &pipeline::world() const {
+    gMultipliesRequested += kRequestMultiplies[kWorld];
+    return matrix(kWorld);
+}
+
+const m::mat4 &pipeline::view() const {
+    gMultipliesRequested += kRequestMultiplies[kView];
+    return matrix(kView);
+}
+
+const m::mat4 &pipeline::projection() const {
+    gMultipliesRequested += kRequestMultiplies[kProjection];
+    return matrix(kProjection);
+}
+
+const m::mat4 &pipeline::viewProjection() const {
+    gMultipliesRequested += kRequestMultiplies[kViewProjection];
+    return matrix(kViewProjection);
+}
+
+const m::mat4 &pipeline::worldViewProjection() const {
+    gMultipliesRequested += kRequestMultiplies[kWorldViewProjection];
+    return matrix(kWorldViewProjection);
+}
+
+const m::mat4 &pipeline::inverseViewProjection() const {
+    gMultipliesRequested += kRequestMultiplies[kInverseViewProjection];
+    return matrix(kInverseViewProjection);
+}
+
+size_t pipeline::multiplies() {
+    return gMultiplies;
+}
+
+size_t pipeline::multipliesSaved() {
+    return gMultipliesRequested > gMultiplies ? gMultipliesRequested - gMultiplies : 0;
+}
+
+void pipeline::resetStats() {
+    gMultiplies = 0;
+    gMultipliesRequested = 0;
 }
 
 const m::perspective &pipeline::perspective() const {
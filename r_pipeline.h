@@ -1,5 +1,7 @@
 #ifndef R_PIPELINE_HDR
 #define R_PIPELINE_HDR
+#include <stdint.h>
+
 #include "m_vec.h"
 #include "m_quat.h"
 #include "m_mat.h"
@@ -12,15 +14,24 @@ struct pipeline {
     void setScale(const m::vec3 &scale);
     void setWorld(const m::vec3 &worldPosition);
     void setRotate(const m::mat4 &rotate);
+    // Takes the place of the scale, world position and rotate until one of
+    // them is set again
+    void setWorldTransform(const m::mat4 &world);
     void setPosition(const m::vec3 &position);
     void setRotation(const m::quat &rotation);
     void setPerspective(const m::perspective &p);
     void setTime(float time);
     void setDelta(float delta);
 
-    const m::mat4 &world();
-    const m::mat4 &view();
-    const m::mat4 &projection();
+    // Matrices are built when first asked for after a change and cached until
+    // the next one. The combined ones multiply in the same order as callers
+    // used to: projection * view * world
+    const m::mat4 &world() const;
+    const m::mat4 &view() const;
+    const m::mat4 &projection() const;
+    const m::mat4 &viewProjection() const;
+    const m::mat4 &worldViewProjection() const;
+    const m::mat4 &inverseViewProjection() const;
 
     // camera accessors.
     const m::vec3 &position() const;
@@ -33,14 +44,36 @@ struct pipeline {
     float time() const;
     float delta() const;
 
+    // Matrix products done by every pipeline since the last resetStats and
+    // the ones the caches avoided compared to building each matrix on request
+    static size_t multiplies();
+    static size_t multipliesSaved();
+    static void resetStats();
+
 private:
     enum {
         kWorld,
         kView,
         kProjection,
+        kViewProjection,
+        kWorldViewProjection,
+        kInverseViewProjection,
         kCount
     };
-    m::mat4 m_matrices[kCount];
+
+    // The cached matrices each setter makes out of date
+    enum : uint32_t {
+        kWorldDirty = (1 << kWorld) | (1 << kWorldViewProjection),
+        kViewDirty = (1 << kView) | (1 << kViewProjection) | (1 << kWorldViewProjection)
+                   | (1 << kInverseViewProjection),
+        kProjectionDirty = (1 << kProjection) | (1 << kViewProjection) | (1 << kWorldViewProjection)
+                         | (1 << kInverseViewProjection)
+    };
+
+    const m::mat4 &matrix(size_t index) const;
+
+    mutable m::mat4 m_matrices[kCount];
+    mutable uint32_t m_dirty; // one bit for every matrix which is out of date
     m::perspective m_perspective;
 
     m::vec3 m_scale;
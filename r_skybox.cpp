@@ -107,7 +107,6 @@ bool skybox::upload() {
 
 void skybox::render(const pipeline &pl, const fog &f) {
     // Construct the matrix for the skybox
-    pipeline wpl = pl;
     pipeline p;
     p.setWorld(pl.position());
     p.setPosition(pl.position());
@@ -124,8 +123,8 @@ void skybox::render(const pipeline &pl, const fog &f) {
         renderMethod->enable();
     }
 
-    renderMethod->setWVP(p.projection() * p.view() * p.world());
-    renderMethod->setWorld(wpl.world());
+    renderMethod->setWVP(p.worldViewProjection());
+    renderMethod->setWorld(pl.world());
 
     // render skybox cube
     gl::DepthFunc(GL_LEQUAL);
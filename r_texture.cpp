@@ -1,4 +1,12 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <SDL2/SDL_timer.h>
 
 #include "engine.h"
 #include "cvar.h"
@@ -9,12 +17,14 @@
 #include "u_algorithm.h"
 #include "u_misc.h"
 #include "u_zlib.h"
+#include "u_thread.h"
 
 #include "m_const.h"
 
 VAR(int, r_tex_compress, "texture compression", 0, 1, 1);
 VAR(int, r_tex_compress_cache, "cache compressed textures", 0, 1, 1);
-VAR(int, r_tex_compress_cache_zlib, "zlib compress cached compressed textures", 0, 1, 1);
+VAR(int, r_tex_compress_cache_zlib, "zlib compress cached compressed textures", 0, 1, 0);
+VAR(int, r_tex_cache_budget, "texture cache size budget in megabytes", 16, 2048, 512);
 VAR(int, r_aniso, "anisotropic filtering", 0, 16, 4);
 VAR(int, r_bilinear, "bilinear filtering", 0, 1, 1);
 VAR(int, r_trilinear, "trilinear filtering", 0, 1, 1);
@@ -22,12 +32,14 @@ VAR(int, r_mipmaps, "mipmaps", 0, 1, 1);
 VAR(int, r_dxt_optimize, "DXT endpoints optimization", 0, 1, 1);
 
 #ifdef DXT_COMPRESSOR
-VAR(int, r_dxt_compressor, "DXT compressor", 0, 1, 1);
+VAR(int, r_dxt_compressor, "DXT and RGTC compressor", 0, 1, 1);
 #else
-VAR(int, r_dxt_compressor, "DXT compressor", 0, 0, 0);
+VAR(int, r_dxt_compressor, "DXT and RGTC compressor", 0, 0, 0);
 #endif
 
 VAR(float, r_texquality, "texture quality", 0.0f, 1.0f, 1.0f);
+VAR(int, r_tex_async, "decode textures on the worker pool", 0, 1, 1);
+VAR(float, r_tex_upload_budget, "milliseconds a frame spends uploading decoded textures", 0.0f, 100.0f, 2.0f);
 
 namespace r {
 
@@ -48,7 +60,9 @@ namespace r {
 
 enum dxtType {
     kDXT1,
-    kDXT5
+    kDXT5,
+    kBC4, // RGTC1, one DXT5 alpha block
+    kBC5  // RGTC2, two DXT5 alpha blocks
 };
 
 enum dxtColor {
@@ -175,7 +189,39 @@ typedef float real;
 // It's suggested you use #define DXT_HIGHP if you want to increase this.
 static constexpr size_t kRefineIterations = 3;
 
-template <size_t C>
+// Blocks are gathered as 16 pixels of four channels, for DXT1 the fourth is
+// ignored
+static constexpr size_t kBlockChannels = 4;
+
+#ifdef __SSE2__
+// A block is four registers, each holding a row of four pixels. Channels are
+// split out into 32-bit lanes
+static inline __m128i dxtChannel(__m128i row, int channel) {
+    const __m128i mask = _mm_set1_epi32(0xFF);
+    switch (channel) {
+    case 0: return _mm_and_si128(row, mask);
+    case 1: return _mm_and_si128(_mm_srli_epi32(row, 8), mask);
+    case 2: return _mm_and_si128(_mm_srli_epi32(row, 16), mask);
+    }
+    return _mm_srli_epi32(row, 24);
+}
+
+static inline int dxtHorizontalSum(__m128i x) {
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+    x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(x);
+}
+
+// Projects the pixels of a row onto `axis', the additions happen in the same
+// order as the scalar code so the results are identical
+static inline __m128 dxtProject(__m128i row, const __m128 (&axis)[3]) {
+    const __m128 r = _mm_cvtepi32_ps(dxtChannel(row, 0));
+    const __m128 g = _mm_cvtepi32_ps(dxtChannel(row, 1));
+    const __m128 b = _mm_cvtepi32_ps(dxtChannel(row, 2));
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(axis[0], r), _mm_mul_ps(axis[1], g)), _mm_mul_ps(axis[2], b));
+}
+#endif
+
 static inline void dxtComputeColorLine(const unsigned char *const uncompressed,
     float (&point)[3], float (&direction)[3])
 {
@@ -187,7 +233,38 @@ static inline void dxtComputeColorLine(const unsigned char *const uncompressed,
     real sumRR = kZero, sumGG = kZero, sumBB = kZero;
     real sumRG = kZero, sumRB = kZero, sumGB = kZero;
 
-    for (size_t i = 0; i < 16*C; i += C) {
+#ifdef __SSE2__
+    // The sums are of integers small enough to be exact either way. Every
+    // channel has a zero upper half in its lane so pmaddwd is a plain multiply
+    __m128i vR = _mm_setzero_si128(), vG = vR, vB = vR;
+    __m128i vRR = vR, vGG = vR, vBB = vR;
+    __m128i vRG = vR, vRB = vR, vGB = vR;
+    for (size_t i = 0; i < 4; i++) {
+        const __m128i row = _mm_loadu_si128((const __m128i *)(uncompressed + i*16));
+        const __m128i r = dxtChannel(row, 0);
+        const __m128i g = dxtChannel(row, 1);
+        const __m128i b = dxtChannel(row, 2);
+        vR = _mm_add_epi32(vR, r);
+        vG = _mm_add_epi32(vG, g);
+        vB = _mm_add_epi32(vB, b);
+        vRR = _mm_add_epi32(vRR, _mm_madd_epi16(r, r));
+        vGG = _mm_add_epi32(vGG, _mm_madd_epi16(g, g));
+        vBB = _mm_add_epi32(vBB, _mm_madd_epi16(b, b));
+        vRG = _mm_add_epi32(vRG, _mm_madd_epi16(r, g));
+        vRB = _mm_add_epi32(vRB, _mm_madd_epi16(r, b));
+        vGB = _mm_add_epi32(vGB, _mm_madd_epi16(g, b));
+    }
+    sumR = real(dxtHorizontalSum(vR));
+    sumG = real(dxtHorizontalSum(vG));
+    sumB = real(dxtHorizontalSum(vB));
+    sumRR = real(dxtHorizontalSum(vRR));
+    sumGG = real(dxtHorizontalSum(vGG));
+    sumBB = real(dxtHorizontalSum(vBB));
+    sumRG = real(dxtHorizontalSum(vRG));
+    sumRB = real(dxtHorizontalSum(vRB));
+    sumGB = real(dxtHorizontalSum(vGB));
+#else
+    for (size_t i = 0; i < 16*kBlockChannels; i += kBlockChannels) {
         sumR += uncompressed[i+0];
         sumG += uncompressed[i+1];
         sumB += uncompressed[i+2];
@@ -198,6 +275,7 @@ static inline void dxtComputeColorLine(const unsigned char *const uncompressed,
         sumRB += uncompressed[i+0] * uncompressed[i+2];
         sumGB += uncompressed[i+1] * uncompressed[i+2];
     }
+#endif
     // Average all sums
     sumR *= kInv16;
     sumG *= kInv16;
@@ -227,29 +305,45 @@ static inline void dxtComputeColorLine(const unsigned char *const uncompressed,
     }
 }
 
-template <size_t C>
 static inline void dxtLSEMasterColorsClamp(uint16_t (&colors)[2],
     const unsigned char *const uncompressed)
 {
     float sumx1[] = { 0.0f, 0.0f, 0.0f };
     float sumx2[] = { 0.0f, 0.0f, 0.0f };
-    dxtComputeColorLine<C>(uncompressed, sumx1, sumx2);
+    dxtComputeColorLine(uncompressed, sumx1, sumx2);
 
     float length = 1.0f / (0.00001f + sumx2[0]*sumx2[0] + sumx2[1]*sumx2[1] + sumx2[2]*sumx2[2]);
     // Calcualte range for vector values
+#ifdef __SSE2__
+    const __m128 axis[] = { _mm_set1_ps(sumx2[0]), _mm_set1_ps(sumx2[1]), _mm_set1_ps(sumx2[2]) };
+    __m128 vMin = dxtProject(_mm_loadu_si128((const __m128i *)uncompressed), axis);
+    __m128 vMax = vMin;
+    for (size_t i = 1; i < 4; i++) {
+        const __m128 dot = dxtProject(_mm_loadu_si128((const __m128i *)(uncompressed + i*16)), axis);
+        vMin = _mm_min_ps(vMin, dot);
+        vMax = _mm_max_ps(vMax, dot);
+    }
+    vMin = _mm_min_ps(vMin, _mm_shuffle_ps(vMin, vMin, _MM_SHUFFLE(1, 0, 3, 2)));
+    vMin = _mm_min_ps(vMin, _mm_shuffle_ps(vMin, vMin, _MM_SHUFFLE(2, 3, 0, 1)));
+    vMax = _mm_max_ps(vMax, _mm_shuffle_ps(vMax, vMax, _MM_SHUFFLE(1, 0, 3, 2)));
+    vMax = _mm_max_ps(vMax, _mm_shuffle_ps(vMax, vMax, _MM_SHUFFLE(2, 3, 0, 1)));
+    float dotMin = _mm_cvtss_f32(vMin);
+    float dotMax = _mm_cvtss_f32(vMax);
+#else
     float dotMax = sumx2[0] * uncompressed[0] +
                    sumx2[1] * uncompressed[1] +
                    sumx2[2] * uncompressed[2];
     float dotMin = dotMax;
     for (size_t i = 1; i < 16; ++i) {
-        const float dot = sumx2[0] * uncompressed[i*C+0] +
-                          sumx2[1] * uncompressed[i*C+1] +
-                          sumx2[2] * uncompressed[i*C+2];
+        const float dot = sumx2[0] * uncompressed[i*kBlockChannels+0] +
+                          sumx2[1] * uncompressed[i*kBlockChannels+1] +
+                          sumx2[2] * uncompressed[i*kBlockChannels+2];
         if (dot < dotMin)
             dotMin = dot;
         else if (dot > dotMax)
             dotMax = dot;
     }
+#endif
 
     // Calculate offset from the average location
     float dot = sumx2[0]*sumx1[0] + sumx2[1]*sumx1[1] + sumx2[2]*sumx1[2];
@@ -273,10 +367,9 @@ static inline void dxtLSEMasterColorsClamp(uint16_t (&colors)[2],
         colors[1] = i, colors[0] = j;
 }
 
-template <size_t C>
 static inline void dxtCompressColorBlock(const unsigned char *const uncompressed, unsigned char (&compressed)[8]) {
     uint16_t encodeColor[2];
-    dxtLSEMasterColorsClamp<C>(encodeColor, uncompressed);
+    dxtLSEMasterColorsClamp(encodeColor, uncompressed);
     // Store 565 color
     compressed[0] = encodeColor[0] & 255;
     compressed[1] = (encodeColor[0] >> 8) & 255;
@@ -309,9 +402,9 @@ static inline void dxtCompressColorBlock(const unsigned char *const uncompressed
     for (size_t i = 0; i < 16; ++i) {
         // Find the dot product for this color, to place it on the line with
         // A range of [-1, 1]
-        float dotProduct = colorLine[0] * uncompressed[i*C+0] +
-                           colorLine[1] * uncompressed[i*C+1] +
-                           colorLine[2] * uncompressed[i*C+2] - dotOffset;
+        float dotProduct = colorLine[0] * uncompressed[i*kBlockChannels+0] +
+                           colorLine[1] * uncompressed[i*kBlockChannels+1] +
+                           colorLine[2] * uncompressed[i*kBlockChannels+2] - dotOffset;
         // Map to [0, 3]
         int nextValue = m::clamp(int(dotProduct * 3.0f + 0.5f), 0, 3);
         compressed[nextBit >> 3] |= "\x0\x2\x3\x1"[nextValue] << (nextBit & 7);
@@ -319,10 +412,16 @@ static inline void dxtCompressColorBlock(const unsigned char *const uncompressed
     }
 }
 
-static inline void dxtCompressAlphaBlock(const unsigned char *const uncompressed, unsigned char (&compressed)[8]) {
-    unsigned char a0 = uncompressed[3];
-    unsigned char a1 = uncompressed[3];
-    for (size_t i = 4+3; i < 16*4; i += 4) {
+// DXT5 alpha, BC4 and both halves of BC5 share one single channel block. The
+// extremes of the block are the endpoints of the eight value mode and every
+// pixel picks the nearest step between them. That is done in integers so the
+// result does not depend on floating point settings.
+static inline void dxtCompressChannelBlock(const unsigned char *const uncompressed,
+    size_t channel, unsigned char (&compressed)[8])
+{
+    unsigned char a0 = uncompressed[channel];
+    unsigned char a1 = uncompressed[channel];
+    for (size_t i = kBlockChannels+channel; i < 16*kBlockChannels; i += kBlockChannels) {
         if (uncompressed[i] > a0) a0 = uncompressed[i];
         if (uncompressed[i] < a1) a1 = uncompressed[i];
     }
@@ -330,10 +429,15 @@ static inline void dxtCompressAlphaBlock(const unsigned char *const uncompressed
     compressed[1] = a1;
     for (size_t i = 2; i < 8; i++)
         compressed[i] = 0;
+    // Flat block, every index selects a0
+    if (a0 == a1)
+        return;
+    const int range = a0 - a1;
     size_t nextBit = 8*2;
-    const float scale = 7.9999f / (a0 - a1);
-    for (size_t i = 3; i < 16*4; i += 4) {
-        const unsigned char value = "\x1\x7\x6\x5\x4\x3\x2\x0"[size_t((uncompressed[i] - a1) * scale) & 7];
+    for (size_t i = channel; i < 16*kBlockChannels; i += kBlockChannels) {
+        // Sevenths of the range above a1, rounded to nearest
+        const int step = ((uncompressed[i] - a1) * 14 + range) / (2 * range);
+        const unsigned char value = "\x1\x7\x6\x5\x4\x3\x2\x0"[step];
         compressed[nextBit >> 3] |= value << (nextBit & 7);
         // Spans two bytes
         if ((nextBit & 7) > 5)
@@ -342,47 +446,78 @@ static inline void dxtCompressAlphaBlock(const unsigned char *const uncompressed
     }
 }
 
+// Gathers the 4x4 block at `x', `y' into 16 pixels of four channels. Pixels
+// past the edge of the image repeat the first one of the block
+static inline void dxtGatherBlock(const unsigned char *const uncompressed, size_t width,
+    size_t height, size_t channels, size_t x, size_t y, unsigned char (&ublock)[16*kBlockChannels])
+{
+    const size_t my = y + 4 >= height ? height - y : 4;
+    const size_t mx = x + 4 >= width ? width - x : 4;
+    const unsigned char *src = uncompressed + (y*width + x)*channels;
+    if (mx == 4 && my == 4 && channels == 4) {
+        for (size_t j = 0; j < 4; ++j)
+            memcpy(ublock + j*16, src + j*width*4, 16);
+        return;
+    }
+    const size_t chanStep = channels < 3 ? 0 : 1;
+    const int hasAlpha = 1 - (channels & 1);
+    size_t z = 0;
+    for (size_t j = 0; j < my; ++j) {
+        const unsigned char *row = src + j*width*channels;
+        for (size_t i = 0; i < mx; ++i) {
+            const unsigned char *pixel = row + i*channels;
+            for (size_t p = 0; p < 3; ++p)
+                ublock[z++] = pixel[chanStep * p];
+            ublock[z++] = hasAlpha * pixel[channels-1] + (1 - hasAlpha) * 255;
+        }
+        for (size_t i = mx; i < 4; ++i)
+            for (size_t p = 0; p < kBlockChannels; ++p)
+                ublock[z++] = ublock[p];
+    }
+    for (size_t j = my; j < 4; ++j)
+        for (size_t i = 0; i < 4; ++i)
+            for (size_t p = 0; p < kBlockChannels; ++p)
+                ublock[z++] = ublock[p];
+}
+
 template <dxtType T>
 static u::vector<unsigned char> dxtCompress(const unsigned char *const uncompressed,
     size_t width, size_t height, size_t channels)
 {
-    size_t index = 0;
-    const size_t chanStep = channels < 3 ? 0 : 1;
-    const int hasAlpha = 1 - (channels & 1);
-    const size_t outSize = ((width + 3) >> 2) * ((height + 3) >> 2) * (T == kDXT1 ? 8 : 16);
-    u::vector<unsigned char> compressed(outSize);
-    unsigned char ublock[16 * (T == kDXT1 ? 3 : 4)];
-    unsigned char cblock[8];
-    for (size_t j = 0; j < height; j += 4) {
-        for (size_t i = 0; i < width; i += 4) {
-            size_t z = 0;
-            const size_t my = j + 4 >= height ? height - j : 4;
-            const size_t mx = i + 4 >= width ? width - i : 4;
-            for (size_t y = 0; y < my; ++y) {
-                for (size_t x = 0; x < mx; ++x) {
-                    for (size_t p = 0; p < 3; ++p)
-                        ublock[z++] = uncompressed[((((j+y)*width)*channels)+((i+x)*channels))+(chanStep * p)];
-                    if (T == kDXT5)
-                        ublock[z++] = hasAlpha * uncompressed[(j+y)*width*channels+(i+x)*channels+channels-1] + (1 - hasAlpha) * 255;
+    static constexpr size_t kBlockSize = (T == kDXT1 || T == kBC4) ? 8 : 16;
+    const size_t blocksWide = (width + 3) >> 2;
+    const size_t blocksHigh = (height + 3) >> 2;
+    u::vector<unsigned char> compressed(blocksWide * blocksHigh * kBlockSize);
+    // Rows of blocks are independent of one another
+    u::parallelFor(blocksHigh, [&compressed, blocksWide, uncompressed, width, height, channels](size_t row) {
+        unsigned char *out = &compressed[row * blocksWide * kBlockSize];
+        unsigned char ublock[16*kBlockChannels];
+        unsigned char cblock[8];
+        for (size_t column = 0; column < blocksWide; column++) {
+            dxtGatherBlock(uncompressed, width, height, channels, column*4, row*4, ublock);
+            if (T == kBC4 || T == kBC5) {
+                // Red is in the first channel of the gathered block and green,
+                // as the second channel of two, ends up in the fourth
+                dxtCompressChannelBlock(ublock, 0, cblock);
+                memcpy(out, cblock, sizeof cblock);
+                out += sizeof cblock;
+                if (T == kBC5) {
+                    dxtCompressChannelBlock(ublock, 3, cblock);
+                    memcpy(out, cblock, sizeof cblock);
+                    out += sizeof cblock;
                 }
-                for (size_t x = mx; x < 4; ++x)
-                    for (size_t p = 0; p < (T == kDXT1 ? 3 : 4); ++p)
-                        ublock[z++] = ublock[p];
+                continue;
             }
-            for (size_t y = my; y < 4; ++y)
-                for (size_t x = 0; x < 4; ++x)
-                    for (size_t p = 0; p < (T == kDXT1 ? 3 : 4); ++p)
-                        ublock[z++] = ublock[p];
             if (T == kDXT5) {
-                dxtCompressAlphaBlock(ublock, cblock);
-                for (size_t x = 0; x < 8; ++x)
-                    compressed[index++] = cblock[x];
+                dxtCompressChannelBlock(ublock, 3, cblock);
+                memcpy(out, cblock, sizeof cblock);
+                out += sizeof cblock;
             }
-            dxtCompressColorBlock<(T == kDXT1 ? 3 : 4)>(ublock, cblock);
-            for (size_t x = 0; x < 8; ++x)
-                compressed[index++] = cblock[x];
+            dxtCompressColorBlock(ublock, cblock);
+            memcpy(out, cblock, sizeof cblock);
+            out += sizeof cblock;
         }
-    }
+    });
     return compressed;
 }
 
@@ -390,10 +525,14 @@ template u::vector<unsigned char> dxtCompress<kDXT1>(const unsigned char *const
     size_t width, size_t height, size_t channels);
 template u::vector<unsigned char> dxtCompress<kDXT5>(const unsigned char *const uncompressed,
     size_t width, size_t height, size_t channels);
+template u::vector<unsigned char> dxtCompress<kBC4>(const unsigned char *const uncompressed,
+    size_t width, size_t height, size_t channels);
+template u::vector<unsigned char> dxtCompress<kBC5>(const unsigned char *const uncompressed,
+    size_t width, size_t height, size_t channels);
 
 #endif //! DXT_COMPRESSOR
 
-static const unsigned char kTextureCacheVersion = 0x04;
+static const unsigned char kTextureCacheVersion = 0x05;
 
 struct textureCacheHeader {
     unsigned char version;
@@ -402,8 +541,40 @@ struct textureCacheHeader {
     GLuint internal;
     textureFormat format;
     uint8_t compressed;
+    uint8_t mips; // levels stored back to back, 0 for just the image
 };
 
+// Bytes in a 4x4 block of the compressed formats which are cached, zero for
+// anything else
+static size_t cacheBlockSize(GLuint internal) {
+    switch (internal) {
+    case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+    case GL_COMPRESSED_RED_RGTC1_EXT:
+        return 8;
+    case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+    case GL_COMPRESSED_RGBA_BPTC_UNORM_ARB:
+    case GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT_ARB:
+    case GL_COMPRESSED_RED_GREEN_RGTC2_EXT:
+        return 16;
+    }
+    return 0;
+}
+
+static size_t cacheLevelSize(GLuint internal, size_t width, size_t height) {
+    return ((width + 3) / 4) * ((height + 3) / 4) * cacheBlockSize(internal);
+}
+
+// Size of `mips' levels of compressed data, a single level when zero
+static size_t cacheChainSize(GLuint internal, size_t width, size_t height, size_t mips) {
+    size_t size = 0;
+    for (size_t i = 0; i < u::max(mips, size_t(1)); i++) {
+        size += cacheLevelSize(internal, width, height);
+        width = u::max(width >> 1, size_t(1));
+        height = u::max(height >> 1, size_t(1));
+    }
+    return size;
+}
+
 static const char *cacheFormat(GLuint internal) {
     switch (internal) {
     case GL_COMPRESSED_RGBA_BPTC_UNORM_ARB:
@@ -434,39 +605,409 @@ static u::string sizeMetric(size_t size) {
     return u::format("%.2f %s", float(size) + float(r) / 1024.0f, sizes[i]);
 }
 
-static bool readCache(texture &tex, GLuint &internal) {
-    if (!r_tex_compress)
+///! textureCachePack
+// Every cached texture lives in one append only pack. The pack starts with an
+// index, an open addressed table of slots keyed on texture::hashString,
+// followed by the entries back to back. It's mapped when first used and the
+// entries present at that point are handed out straight from the mapping,
+// those added since are read back through the file.
+//
+// Cleared entries leave dead space behind. A pack opened with too much dead
+// space, a nearly full index or more than r_tex_cache_budget in it is
+// compacted. The most recently used entries which fit the budget are copied
+// to a new pack whose index has room for twice as many.
+struct textureCachePackHeader {
+    uint32_t magic;
+    uint32_t version; // kTextureCacheVersion, entries of another version are useless
+    uint32_t slots; // size of the index, a power of two
+    uint32_t count; // slots in use
+    uint32_t session; // bumped every time the pack is opened
+    uint32_t padding;
+    uint64_t live; // bytes of the entries in the index
+
+    void endianSwap();
+};
+
+struct textureCacheSlot {
+    char name[32]; // texture::hashString, empty for a free slot
+    uint64_t offset;
+    uint32_t length;
+    uint32_t used; // session the entry was last read or written in
+
+    void endianSwap();
+};
+
+inline void textureCachePackHeader::endianSwap() {
+    magic = u::endianSwap(magic);
+    version = u::endianSwap(version);
+    slots = u::endianSwap(slots);
+    count = u::endianSwap(count);
+    session = u::endianSwap(session);
+    live = u::endianSwap(live);
+}
+
+inline void textureCacheSlot::endianSwap() {
+    offset = u::endianSwap(offset);
+    length = u::endianSwap(length);
+    used = u::endianSwap(used);
+}
+
+struct textureCachePack {
+    textureCachePack();
+    ~textureCachePack(); // writes back when entries were last used
+
+    // `data' points into the mapping or into `storage' for entries added
+    // after the pack was mapped
+    bool find(const u::string &name, const unsigned char *&data, size_t &length,
+        u::vector<unsigned char> &storage);
+    bool has(const u::string &name);
+    bool add(const u::string &name, const u::vector<unsigned char> &data);
+    void clear();
+
+    static constexpr uint32_t kMagic = 0x4B505854; // TXPK
+    static constexpr size_t kMinSlots = 1024;
+
+private:
+    // All of these expect m_lock to be held
+    bool open();
+    bool parse();
+    bool create(const u::string &file, size_t slots);
+    bool compact(const u::string &file);
+    size_t lookup(const char (&name)[32]) const;
+    static bool key(const u::string &name, char (&key)[32]);
+    bool writeHeader(FILE *fp);
+    bool writeSlot(size_t index);
+    bool writeIndex(FILE *fp);
+
+    u::mutex m_lock;
+    u::mappedFile m_map;
+    u::file m_file; // appends and index updates
+    textureCachePackHeader m_header;
+    u::vector<textureCacheSlot> m_slots;
+    uint64_t m_end;
+    bool m_failed;
+    bool m_dirty;
+};
+
+static textureCachePack gCachePack;
+
+textureCachePack::textureCachePack()
+    : m_end(0)
+    , m_failed(false)
+    , m_dirty(false)
+{
+    memset(&m_header, 0, sizeof m_header);
+}
+
+textureCachePack::~textureCachePack() {
+    if (m_file && m_dirty)
+        writeIndex(m_file.get());
+}
+
+bool textureCachePack::key(const u::string &name, char (&key)[32]) {
+    if (name.empty() || name.size() > sizeof key)
+        return false;
+    memset(key, 0, sizeof key);
+    memcpy(key, name.c_str(), name.size());
+    return true;
+}
+
+size_t textureCachePack::lookup(const char (&name)[32]) const {
+    // FNV-1a with 32-bit constants so every build probes the same way
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof name; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    // Never full so this finds either the name or a free slot
+    const size_t mask = m_slots.size() - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask)
+        if (!m_slots[i].name[0] || !memcmp(m_slots[i].name, name, sizeof name))
+            return i;
+}
+
+bool textureCachePack::parse() {
+    const size_t size = m_map.size();
+    if (size < sizeof m_header)
+        return false;
+    memcpy(&m_header, m_map.data(), sizeof m_header);
+    m_header.endianSwap();
+    if (m_header.magic != kMagic || m_header.version != kTextureCacheVersion)
+        return false;
+    const size_t slots = m_header.slots;
+    if (slots < kMinSlots || (slots & (slots - 1)))
+        return false;
+    const size_t indexEnd = sizeof m_header + slots * sizeof(textureCacheSlot);
+    if (size < indexEnd)
+        return false;
+    m_slots.resize(slots);
+    memcpy(&m_slots[0], m_map.data() + sizeof m_header, slots * sizeof(textureCacheSlot));
+    for (auto &it : m_slots) {
+        it.endianSwap();
+        if (it.name[0] && (it.offset < indexEnd || it.offset + it.length > size))
+            return false;
+    }
+    m_end = size;
+    return true;
+}
+
+bool textureCachePack::create(const u::string &file, size_t slots) {
+    memset(&m_header, 0, sizeof m_header);
+    m_header.magic = kMagic;
+    m_header.version = kTextureCacheVersion;
+    m_header.slots = slots;
+    m_slots.destroy();
+    m_slots.resize(slots);
+    memset(&m_slots[0], 0, slots * sizeof(textureCacheSlot));
+
+    auto fp = u::fopen(file, "wb");
+    return fp && writeIndex(fp.get());
+}
+
+bool textureCachePack::compact(const u::string &file) {
+    // Most recently used first
+    u::vector<textureCacheSlot> entries;
+    for (const auto &it : m_slots)
+        if (it.name[0])
+            entries.push_back(it);
+    if (!entries.empty()) {
+        qsort(&entries[0], entries.size(), sizeof(textureCacheSlot),
+            [](const void *a, const void *b) -> int {
+                const uint32_t lhs = ((const textureCacheSlot *)a)->used;
+                const uint32_t rhs = ((const textureCacheSlot *)b)->used;
+                return lhs > rhs ? -1 : lhs < rhs;
+            });
+    }
+
+    const uint64_t budget = uint64_t(r_tex_cache_budget) << 20;
+    size_t keep = 0;
+    uint64_t live = 0;
+    for (; keep < entries.size() && live + entries[keep].length <= budget; keep++)
+        live += entries[keep].length;
+    size_t slots = kMinSlots;
+    while (slots < keep * 2)
+        slots <<= 1;
+
+    const u::string temp = file + ".tmp";
+    const textureCachePackHeader header = m_header;
+    if (!create(temp, slots))
+        return false;
+    m_header.session = header.session;
+    {
+        auto fp = u::fopen(temp, "r+b");
+        if (!fp)
+            return false;
+        bool written = fseek(fp.get(), 0, SEEK_END) == 0;
+        uint64_t offset = sizeof m_header + slots * sizeof(textureCacheSlot);
+        for (size_t i = 0; written && i < keep; i++) {
+            textureCacheSlot entry = entries[i];
+            written = fwrite(m_map.data() + entry.offset, entry.length, 1, fp.get()) == 1;
+            entry.offset = offset;
+            offset += entry.length;
+            m_slots[lookup(entry.name)] = entry;
+        }
+        m_header.count = keep;
+        m_header.live = live;
+        if (!written || !writeIndex(fp.get()))
+            return false;
+    }
+
+    m_map.unmap();
+    if (!u::rename(temp, file))
+        return false;
+    u::print("[cache] => compacted pack to %zu textures (%s), evicted %zu\n",
+        keep, sizeMetric(live), entries.size() - keep);
+    return true;
+}
+
+bool textureCachePack::open() {
+    if (m_file)
+        return true;
+    if (m_failed)
+        return false;
+    m_failed = true; // only ever try once
+
+    const u::string file = neoUserPath() + u::format("cache%ctextures.pack", u::kPathSep);
+    if (!m_map.map(file) || !parse()) {
+        // Missing, damaged or holding an old version of the cache. Entries of
+        // the loose files from before there was a pack are gone as well.
+        m_map.unmap();
+        const u::string cachePath = neoUserPath() + "cache";
+        for (const auto &it : u::dir(cachePath))
+            u::remove(cachePath + u::kPathSep + it);
+        if (!create(file, kMinSlots) || !m_map.map(file) || !parse())
+            return false;
+    }
+
+    const uint64_t budget = uint64_t(r_tex_cache_budget) << 20;
+    const uint64_t index = sizeof m_header + m_slots.size() * sizeof(textureCacheSlot);
+    const uint64_t dead = m_end - index - m_header.live;
+    const bool full = m_header.count * 4 >= m_header.slots * 3;
+    if (m_header.live > budget || dead > m_header.live / 4 || full) {
+        if (!compact(file) || !m_map.map(file) || !parse())
+            return false;
+    }
+
+    m_file = u::fopen(file, "r+b");
+    if (!m_file)
+        return false;
+    m_header.session++;
+    if (!writeHeader(m_file.get()))
+        return false;
+    m_failed = false;
+    return true;
+}
+
+bool textureCachePack::writeHeader(FILE *fp) {
+    textureCachePackHeader header = m_header;
+    header.endianSwap();
+    return fseek(fp, 0, SEEK_SET) == 0
+        && fwrite(&header, sizeof header, 1, fp) == 1;
+}
+
+bool textureCachePack::writeSlot(size_t index) {
+    textureCacheSlot slot = m_slots[index];
+    slot.endianSwap();
+    return fseek(m_file.get(), sizeof m_header + index * sizeof slot, SEEK_SET) == 0
+        && fwrite(&slot, sizeof slot, 1, m_file.get()) == 1;
+}
+
+bool textureCachePack::writeIndex(FILE *fp) {
+    u::vector<textureCacheSlot> slots = m_slots;
+    for (auto &it : slots)
+        it.endianSwap();
+    if (!writeHeader(fp))
+        return false;
+    if (fwrite(&slots[0], sizeof(textureCacheSlot), slots.size(), fp) != slots.size())
+        return false;
+    m_dirty = false;
+    return fflush(fp) == 0;
+}
+
+bool textureCachePack::find(const u::string &name, const unsigned char *&data,
+    size_t &length, u::vector<unsigned char> &storage)
+{
+    char search[32];
+    if (!key(name, search))
+        return false;
+    m_lock.lock();
+    bool found = open();
+    if (found) {
+        textureCacheSlot &slot = m_slots[lookup(search)];
+        found = slot.name[0];
+        if (found) {
+            slot.used = m_header.session;
+            m_dirty = true;
+            length = slot.length;
+            if (slot.offset + slot.length <= m_map.size()) {
+                data = m_map.data() + slot.offset;
+            } else {
+                storage.resize(length);
+                found = fseek(m_file.get(), slot.offset, SEEK_SET) == 0
+                    && fread(&storage[0], length, 1, m_file.get()) == 1;
+                data = &storage[0];
+            }
+        }
+    }
+    m_lock.unlock();
+    return found;
+}
+
+bool textureCachePack::has(const u::string &name) {
+    char search[32];
+    if (!key(name, search))
+        return false;
+    m_lock.lock();
+    const bool found = open() && m_slots[lookup(search)].name[0];
+    m_lock.unlock();
+    return found;
+}
+
+bool textureCachePack::add(const u::string &name, const u::vector<unsigned char> &data) {
+    char search[32];
+    if (!key(name, search))
         return false;
+    m_lock.lock();
+    bool added = open();
+    if (added) {
+        const size_t index = lookup(search);
+        // Already there or no more room in the index until it's compacted
+        added = !m_slots[index].name[0] && (m_header.count + 1) * 4 < m_header.slots * 3;
+        added = added && fseek(m_file.get(), m_end, SEEK_SET) == 0
+                      && fwrite(&data[0], data.size(), 1, m_file.get()) == 1;
+        if (added) {
+            textureCacheSlot &slot = m_slots[index];
+            memcpy(slot.name, search, sizeof search);
+            slot.offset = m_end;
+            slot.length = data.size();
+            slot.used = m_header.session;
+            m_end += data.size();
+            m_header.count++;
+            m_header.live += data.size();
+            added = writeSlot(index) && writeHeader(m_file.get()) && fflush(m_file.get()) == 0;
+        }
+    }
+    m_lock.unlock();
+    return added;
+}
+
+void textureCachePack::clear() {
+    m_lock.lock();
+    if (open()) {
+        memset(&m_slots[0], 0, m_slots.size() * sizeof(textureCacheSlot));
+        m_header.count = 0;
+        m_header.live = 0;
+        writeIndex(m_file.get());
+    }
+    m_lock.unlock();
+}
+
+///! textureCacheEntry
+// A compressed texture from the cache. `data' points straight into the mapped
+// pack unless the entry had to be read or inflated into `storage'.
+struct textureCacheEntry {
+    GLuint internal;
+    size_t width;
+    size_t height;
+    size_t mips;
+    textureFormat format;
+    const unsigned char *data;
+    size_t size;
+    u::vector<unsigned char> storage;
+};
+
+static u::unique_ptr<textureCacheEntry> readCache(const texture &tex) {
+    if (!r_tex_compress)
+        return nullptr;
 
     // If the texture is not on disk then don't cache the compressed version
     // of it to disk.
     if (!(tex.flags() & kTexFlagDisk))
-        return false;
+        return nullptr;
 
     // If no compression was specified then don't read a cached compressed version
     // of it.
     if (tex.flags() & kTexFlagNoCompress)
-        return false;
+        return nullptr;
 
-    // Do we even have it in cache?
-    const u::string cacheString = u::format("cache%c%s", u::kPathSep, tex.hashString());
-    const u::string file = neoUserPath() + cacheString;
-    if (!u::exists(file))
-        return false;
+    // Already compressed on disk, it's never cached
+    if (tex.flags() & kTexFlagCompressed)
+        return nullptr;
 
-    // Found it in cache, unload the current texture and load the cache from disk.
-    auto load = u::read(file, "rb");
-    if (!load)
-        return false;
+    // Do we even have it in cache?
+    u::unique_ptr<textureCacheEntry> entry(new textureCacheEntry);
+    const unsigned char *payload = nullptr;
+    size_t length = 0;
+    if (!gCachePack.find(tex.hashString(), payload, length, entry->storage))
+        return nullptr;
 
     // Parse header
-    auto vec = *load;
     textureCacheHeader head;
-    memcpy(&head, &vec[0], sizeof(head));
-    if (head.version != kTextureCacheVersion) {
-        u::remove(file);
-        return false;
-    }
+    if (length < sizeof head)
+        return nullptr;
+    memcpy(&head, payload, sizeof head);
+    if (head.version != kTextureCacheVersion)
+        return nullptr;
     head.width = u::endianSwap(head.width);
     head.height = u::endianSwap(head.height);
     head.internal = u::endianSwap(head.internal);
@@ -477,55 +1018,79 @@ static bool readCache(texture &tex, GLuint &internal) {
     case GL_COMPRESSED_RGBA_BPTC_UNORM_ARB:
     case GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT_ARB:
         if (!gl::has(gl::ARB_texture_compression_bptc))
-            return false;
+            return nullptr;
         break;
 
     case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
     case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
         if (!gl::has(gl::EXT_texture_compression_s3tc))
-            return false;
+            return nullptr;
         break;
 
     case GL_COMPRESSED_RED_GREEN_RGTC2_EXT:
     case GL_COMPRESSED_RED_RGTC1_EXT:
         if (!gl::has(gl::EXT_texture_compression_rgtc))
-            return false;
+            return nullptr;
         break;
     }
 
-    const unsigned char *data = &vec[0] + sizeof(head);
-    const size_t length = vec.size() - sizeof(head);
+    const unsigned char *data = payload + sizeof head;
+    length -= sizeof head;
 
     // decompress
-    u::vector<unsigned char> decompress;
-    const unsigned char *fromData = nullptr;
-    size_t fromSize = 0;
     if (head.compressed) {
+        u::vector<unsigned char> decompress;
         u::zlib::decompress(decompress, data, length);
-        fromData = &decompress[0];
-        fromSize = decompress.size();
+        entry->storage = u::move(decompress);
+        entry->data = &entry->storage[0];
+        entry->size = entry->storage.size();
     } else {
-        fromData = data;
-        fromSize = length;
+        entry->data = data;
+        entry->size = length;
     }
 
-    internal = head.internal;
+    // A short entry is corrupt, e.g an interrupted write to the pack
+    if (!head.width || !head.height || !cacheBlockSize(head.internal))
+        return nullptr;
+    if (cacheChainSize(head.internal, head.width, head.height, head.mips) > entry->size)
+        return nullptr;
+
+    entry->internal = head.internal;
+    entry->width = head.width;
+    entry->height = head.height;
+    entry->mips = head.mips;
+    entry->format = head.format;
+    u::print("[cache] => read %.50s... %s (%s)\n", tex.hashString(),
+        cacheFormat(head.internal), sizeMetric(entry->size));
+    return entry;
+}
 
-    // Now swap!
-    tex.unload();
-    tex.from(fromData, fromSize, head.width, head.height, false, head.format);
-    u::print("[cache] => read %.50s... %s (%s)\n", cacheString,
-        cacheFormat(head.internal), sizeMetric(fromSize));
-    return true;
+// Uploads `mips' levels of compressed data, a single level when zero
+static void uploadCompressed(GLuint internal, const unsigned char *data, size_t size,
+    size_t width, size_t height, size_t mips)
+{
+    assert(cacheChainSize(internal, width, height, mips) <= size);
+    if (mips <= 1) {
+        gl::CompressedTexImage2D(GL_TEXTURE_2D, 0, internal, width, height, 0, size, data);
+        return;
+    }
+    for (size_t i = 0; i < mips; i++) {
+        const size_t levelSize = cacheLevelSize(internal, width, height);
+        gl::CompressedTexImage2D(GL_TEXTURE_2D, i, internal, width, height, 0, levelSize, data);
+        data += levelSize;
+        width = u::max(width >> 1, size_t(1));
+        height = u::max(height >> 1, size_t(1));
+    }
 }
 
 static bool writeCacheData(textureFormat format,
                            size_t texSize,
-                           const u::string &cacheString,
+                           const u::string &name,
                            unsigned char *compressedData,
                            size_t compressedWidth,
                            size_t compressedHeight,
                            size_t compressedSize,
+                           size_t compressedMips,
                            GLuint internal,
                            const char *from = "driver")
 {
@@ -537,16 +1102,27 @@ static bool writeCacheData(textureFormat format,
     head.internal = u::endianSwap(internal);
     head.format = u::endianSwap(format);
     head.compressed = r_tex_compress_cache_zlib;
+    head.mips = compressedMips;
 
     // Apply DXT optimizations if we can
     const bool dxt = internal == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ||
                      internal == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
 
     size_t dxtOptimCount = 0;
+    size_t dxtBlockCount = 0;
     if (r_dxt_optimize && dxt) {
-        dxtOptimCount = (internal == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT)
-            ? dxtOptimize<kDXT1>(compressedData, compressedWidth, compressedHeight)
-            : dxtOptimize<kDXT5>(compressedData, compressedWidth, compressedHeight);
+        unsigned char *level = compressedData;
+        size_t width = compressedWidth;
+        size_t height = compressedHeight;
+        for (size_t i = 0; i < u::max(compressedMips, size_t(1)); i++) {
+            dxtOptimCount += (internal == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT)
+                ? dxtOptimize<kDXT1>(level, width, height)
+                : dxtOptimize<kDXT5>(level, width, height);
+            dxtBlockCount += (width / 4) * (height / 4);
+            level += cacheLevelSize(internal, width, height);
+            width = u::max(width >> 1, size_t(1));
+            height = u::max(height >> 1, size_t(1));
+        }
     }
 
     // zlib compress the texture data
@@ -568,27 +1144,25 @@ static bool writeCacheData(textureFormat format,
     memcpy(&data[0] + sizeof(head), toData, toSize);
 
     u::print("[cache] => wrote %.50s... %s (compressed %s to %s with %s compressor)",
-        cacheString,
+        name,
         cacheFormat(internal),
         sizeMetric(texSize),
         sizeMetric(compressedSize),
         from
     );
 
+    if (compressedMips > 1)
+        u::print(" (%zu mips)", compressedMips);
     if (dxt && dxtOptimCount) {
-        const float blockCount = (compressedWidth / 4.0f) * (compressedHeight / 4.0f);
+        const float blockCount = dxtBlockCount;
         const float blockDifference = blockCount - dxtOptimCount;
         const float blockPercent = (blockDifference / blockCount) * 100.0f;
-        u::print(" (optimized endpoints in %.2f%% of blocks)",
-            sizeMetric(texSize),
-            sizeMetric(compressedSize),
-            blockPercent
-        );
+        u::print(" (optimized endpoints in %.2f%% of blocks)", blockPercent);
     }
     u::print("\n");
 
     // Write it out
-    return u::write(data, neoUserPath() + cacheString);
+    return gCachePack.add(name, data);
 }
 
 static bool writeCache(const texture &tex, GLuint internal, GLuint handle) {
@@ -600,17 +1174,8 @@ static bool writeCache(const texture &tex, GLuint internal, GLuint handle) {
         return false;
 
     // Only cache compressed textures
-    switch (internal) {
-    case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
-    case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
-    case GL_COMPRESSED_RGBA_BPTC_UNORM_ARB:
-    case GL_COMPRESSED_RGB_BPTC_SIGNED_FLOAT_ARB:
-    case GL_COMPRESSED_RED_GREEN_RGTC2_EXT:
-    case GL_COMPRESSED_RED_RGTC1_EXT:
-        break;
-    default:
+    if (!cacheBlockSize(internal))
         return false;
-    }
 
     // Some drivers just don't do online compression
     GLint compressed = 0;
@@ -619,30 +1184,29 @@ static bool writeCache(const texture &tex, GLuint internal, GLuint handle) {
         return false;
 
     // Don't bother caching if we already have it
-    const u::string cacheString = u::format("cache%c%s", u::kPathSep, tex.hashString());
-    const u::string file = neoUserPath() + cacheString;
-    if (u::exists(file))
+    if (gCachePack.has(tex.hashString()))
         return false;
 
-    // Query the compressed texture size
-    gl::BindTexture(GL_TEXTURE_2D, handle);
-    GLint compressedSize;
-    gl::GetTexLevelParameteriv(GL_TEXTURE_2D, 0,
-        GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &compressedSize);
-
     // Query the compressed height and width (driver may add padding)
+    gl::BindTexture(GL_TEXTURE_2D, handle);
     GLint compressedWidth;
     GLint compressedHeight;
     gl::GetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &compressedWidth);
     gl::GetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &compressedHeight);
 
-    // Read the compressed image
+    // Read the compressed image and every mip level below it
     u::vector<unsigned char> compressedData;
-    compressedData.resize(compressedSize);
-    gl::GetCompressedTexImage(GL_TEXTURE_2D, 0, &compressedData[0]);
+    for (size_t i = 0; i < u::max(tex.mips(), size_t(1)); i++) {
+        GLint compressedSize;
+        gl::GetTexLevelParameteriv(GL_TEXTURE_2D, i,
+            GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &compressedSize);
+        const size_t offset = compressedData.size();
+        compressedData.resize(offset + compressedSize);
+        gl::GetCompressedTexImage(GL_TEXTURE_2D, i, &compressedData[offset]);
+    }
 
-    return writeCacheData(tex.format(), tex.size(), cacheString, &compressedData[0],
-        compressedWidth, compressedHeight, compressedSize, internal);
+    return writeCacheData(tex.format(), tex.size(), tex.hashString(), &compressedData[0],
+        compressedWidth, compressedHeight, compressedData.size(), tex.mips(), internal);
 }
 
 struct queryFormat {
@@ -783,11 +1347,168 @@ static u::optional<queryFormat> getBestFormat(texture &tex) {
     return u::none;
 }
 
+#ifdef DXT_COMPRESSOR
+// Compresses every level of `tex' with our DXT and RGTC compressor and caches
+// the result, which is then uploaded like any other cache entry. Null when the
+// compressor doesn't handle `internal'.
+static u::unique_ptr<textureCacheEntry> compressTexture(const texture &tex, GLuint internal) {
+    if (!r_dxt_compressor)
+        return nullptr;
+    if (internal != GL_COMPRESSED_RGBA_S3TC_DXT1_EXT &&
+        internal != GL_COMPRESSED_RGBA_S3TC_DXT5_EXT &&
+        internal != GL_COMPRESSED_RED_RGTC1_EXT &&
+        internal != GL_COMPRESSED_RED_GREEN_RGTC2_EXT)
+    {
+        return nullptr;
+    }
+
+    u::unique_ptr<textureCacheEntry> entry(new textureCacheEntry);
+    u::vector<unsigned char> &compressed = entry->storage;
+    const unsigned char *data = tex.data();
+    size_t width = tex.width();
+    size_t height = tex.height();
+    const size_t bpp = tex.bpp();
+    for (size_t i = 0; i < u::max(tex.mips(), size_t(1)); i++) {
+        u::vector<unsigned char> level;
+        switch (internal) {
+        case GL_COMPRESSED_RGBA_S3TC_DXT1_EXT:
+            level = dxtCompress<kDXT1>(data, width, height, bpp);
+            break;
+        case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+            level = dxtCompress<kDXT5>(data, width, height, bpp);
+            break;
+        case GL_COMPRESSED_RED_RGTC1_EXT:
+            level = dxtCompress<kBC4>(data, width, height, bpp);
+            break;
+        case GL_COMPRESSED_RED_GREEN_RGTC2_EXT:
+            level = dxtCompress<kBC5>(data, width, height, bpp);
+            break;
+        }
+        const size_t offset = compressed.size();
+        compressed.resize(offset + level.size());
+        memcpy(&compressed[offset], &level[0], level.size());
+        data += width * height * bpp;
+        width = u::max(width >> 1, size_t(1));
+        height = u::max(height >> 1, size_t(1));
+    }
+
+    writeCacheData(tex.format(),
+                   tex.size(),
+                   tex.hashString(),
+                   &compressed[0],
+                   tex.width(),
+                   tex.height(),
+                   compressed.size(),
+                   tex.mips(),
+                   internal,
+                   "our");
+
+    entry->internal = internal;
+    entry->width = tex.width();
+    entry->height = tex.height();
+    entry->mips = tex.mips();
+    entry->format = tex.format();
+    entry->data = &compressed[0];
+    entry->size = compressed.size();
+    return entry;
+}
+#endif
+
+// Everything upload needs done to a decoded texture short of the GL calls:
+// the format conversion, the mip chain and the compression when it's ours.
+// The latter leaves a cache entry in place of the texture.
+static void prepareTexture(texture &tex, u::unique_ptr<textureCacheEntry> &cache) {
+    // Compressed on disk, uploaded as is
+    if (tex.flags() & kTexFlagCompressed)
+        return;
+    auto query = getBestFormat(tex);
+    if (!query)
+        return;
+    const GLuint internal = (*query).internal;
+    // Compressed textures are cached along with their mip chain. It's built
+    // here in linear light rather than by the driver on load.
+    if (r_mipmaps && cacheBlockSize(internal))
+        tex.generateMipChain();
+#ifdef DXT_COMPRESSOR
+    cache = compressTexture(tex, internal);
+    if (cache)
+        tex = texture();
+#else
+    (void)cache;
+#endif
+}
+
+///! textureJob
+// A texture decoding on the worker pool. The worker fills in `decoded' and
+// `loaded' and hands the job back through gDecodedJobs, everything else is
+// only ever touched by the render thread.
+struct textureJob {
+    ~textureJob();
+
+    texture2D *owner; // null once the texture is gone
+    u::string file;
+    u::optional<uint32_t> colorize;
+    texture decoded;
+    u::unique_ptr<textureCacheEntry> cache;
+    bool loaded;
+};
+
+// Shared by both texture2D::load and the worker pool
+static bool loadTexture(texture &tex, u::unique_ptr<textureCacheEntry> &cache,
+    const u::string &file, const u::optional<uint32_t> &colorize)
+{
+    if (!tex.open(file, r_texquality))
+        return false;
+    if (colorize)
+        tex.colorize(*colorize);
+    // Nothing to decode when the cache has it, the source can go
+    cache = readCache(tex);
+    if (cache) {
+        tex = texture();
+        return true;
+    }
+    if (!tex.decode())
+        return false;
+    prepareTexture(tex, cache);
+    return true;
+}
+
+// Jobs are owned by the worker pool until they're in gDecodedJobs and by the
+// render thread from there on. This is a locked vector rather than a lock-free
+// list as linked lists are not allowed here. The lock is only held for one
+// push_back per decoded texture and once a frame to take them all.
+static u::mutex gDecodedLock;
+static u::vector<textureJob *> gDecodedJobs;
+static u::vector<textureJob *> gReadyJobs; // taken off gDecodedJobs, waiting on the budget
+
+// Only runs on the render thread, either once the job is uploaded or when the
+// worker pool stops before getting to it
+textureJob::~textureJob() {
+    if (owner)
+        owner->m_job = nullptr;
+}
+
+// The closure handed to the worker pool, it owns the job until it's decoded
+struct textureDecode {
+    void operator()();
+    u::unique_ptr<textureJob> job;
+};
+
+void textureDecode::operator()() {
+    job->loaded = loadTexture(job->decoded, job->cache, job->file, job->colorize);
+    gDecodedLock.lock();
+    gDecodedJobs.push_back(job.release());
+    gDecodedLock.unlock();
+}
+
+///! texture2D
 texture2D::texture2D(bool mipmaps, int filter)
     : m_uploaded(false)
     , m_textureHandle(0)
     , m_mipmaps(mipmaps)
     , m_filter(filter)
+    , m_job(nullptr)
+    , m_placeholder(0)
 {
     //
 }
@@ -799,23 +1520,26 @@ texture2D::texture2D(texture &tex, bool mipmaps, int filter)
 }
 
 texture2D::~texture2D() {
-    if (m_uploaded)
+    // the job is freed once the worker pool hands it back
+    if (m_job)
+        m_job->owner = nullptr;
+    if (m_textureHandle)
         gl::DeleteTextures(1, &m_textureHandle);
 }
 
 bool texture2D::useCache() {
-    GLuint internalFormat = 0;
-    if (!readCache(m_texture, internalFormat))
+    if (!m_cache)
+        m_cache = readCache(m_texture);
+    if (!m_cache)
         return false;
-    gl::CompressedTexImage2D(GL_TEXTURE_2D, 0, internalFormat,
-        m_texture.width(), m_texture.height(), 0, m_texture.size(), m_texture.data());
+    uploadCompressed(m_cache->internal, m_cache->data, m_cache->size,
+        m_cache->width, m_cache->height, m_cache->mips);
+    // Only the description is needed from here on
+    m_cache->storage.destroy();
+    m_cache->data = nullptr;
     return true;
 }
 
-void texture2D::colorize(uint32_t color) {
-    m_texture.colorize(color);
-}
-
 static inline void getTexParams(bool bilinear, bool mipmaps, bool trilinear, GLenum &min, GLenum &mag) {
     const unsigned char index = bilinear | (mipmaps << 1) | (trilinear << 2);
 
@@ -848,15 +1572,98 @@ bool texture2D::cache(GLuint internal) {
     return writeCache(m_texture, internal, m_textureHandle);
 }
 
-bool texture2D::load(const u::string &file) {
-    return m_texture.load(file, r_texquality);
+bool texture2D::load(const u::string &file, const u::optional<uint32_t> &colorize) {
+    return loadTexture(m_texture, m_cache, file, colorize);
+}
+
+bool texture2D::loadAsync(const u::string &file, uint32_t placeholder,
+    const u::optional<uint32_t> &colorize)
+{
+    if (!r_tex_async)
+        return load(file, colorize);
+
+    // Missing files are caught here so they fail the same way load does
+    if (!texture::exists(file))
+        return false;
+
+    u::unique_ptr<textureJob> next(new textureJob);
+    next->owner = this;
+    next->file = file;
+    next->colorize = colorize;
+    next->loaded = false;
+    m_job = next.get();
+    m_placeholder = placeholder;
+
+    textureDecode decode;
+    decode.job = u::move(next);
+    u::async(u::move(decode));
+    return true;
+}
+
+void texture2D::uploadPlaceholder() {
+    if (m_textureHandle)
+        return;
+    const unsigned char texel[] = {
+        (unsigned char)(m_placeholder >> 24),
+        (unsigned char)(m_placeholder >> 16),
+        (unsigned char)(m_placeholder >> 8),
+        (unsigned char)m_placeholder
+    };
+    gl::GenTextures(1, &m_textureHandle);
+    gl::BindTexture(GL_TEXTURE_2D, m_textureHandle);
+    gl::TexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, texel);
+    gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+}
+
+void texture2D::uploadDecoded() {
+    gDecodedLock.lock();
+    gReadyJobs.reserve(gReadyJobs.size() + gDecodedJobs.size());
+    for (auto *it : gDecodedJobs)
+        gReadyJobs.push_back(it);
+    gDecodedJobs.clear();
+    gDecodedLock.unlock();
+
+    const uint64_t start = SDL_GetPerformanceCounter();
+    const uint64_t budget = uint64_t(SDL_GetPerformanceFrequency() * (r_tex_upload_budget / 1000.0f));
+
+    // At least one texture goes up every frame no matter the budget
+    size_t index = 0;
+    while (index < gReadyJobs.size()) {
+        u::unique_ptr<textureJob> job(gReadyJobs[index++]);
+        texture2D *owner = job->owner;
+        if (owner) {
+            owner->m_job = nullptr;
+            if (job->loaded) {
+                owner->m_texture = u::move(job->decoded);
+                owner->m_cache = u::move(job->cache);
+                // When the placeholder isn't in use yet upload() takes care of it
+                if (owner->m_textureHandle && !owner->upload())
+                    u::print("[texture] => failed to upload `%s'\n", job->file);
+            } else {
+                u::print("[texture] => failed to decode `%s' keeping placeholder\n", job->file);
+                owner->uploadPlaceholder();
+                owner->m_uploaded = true;
+            }
+        }
+        if (SDL_GetPerformanceCounter() - start >= budget)
+            break;
+    }
+    gReadyJobs.erase(gReadyJobs.begin(), gReadyJobs.begin() + index);
 }
 
 bool texture2D::upload() {
     if (m_uploaded)
         return true;
 
-    gl::GenTextures(1, &m_textureHandle);
+    // Still decoding, stand in with a single texel until uploadDecoded
+    if (m_job) {
+        uploadPlaceholder();
+        return true;
+    }
+
+    if (!m_textureHandle)
+        gl::GenTextures(1, &m_textureHandle);
     gl::BindTexture(GL_TEXTURE_2D, m_textureHandle);
 
     // If the texture is compressed on disk then load it in ignoring cache
@@ -914,37 +1721,16 @@ bool texture2D::upload() {
                 return false;
             format = *query;
 
+            // Only textures which didn't come through loadTexture get here
+            // unprepared, prepareTexture does the same
+            if (r_mipmaps && cacheBlockSize(format.internal))
+                m_texture.generateMipChain();
+
 #ifdef DXT_COMPRESSOR
-            // Use our DXT compressor instead of the driver
-            if (r_dxt_compressor &&
-                (format.internal == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ||
-                 format.internal == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT))
-            {
+            m_cache = compressTexture(m_texture, format.internal);
+            if (m_cache) {
                 needsCache = false;
-                u::vector<unsigned char> compressed;
-                if (format.internal == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
-                    compressed = dxtCompress<kDXT1>(m_texture.data(), m_texture.width(),
-                        m_texture.height(), m_texture.bpp());
-                } else {
-                    compressed = dxtCompress<kDXT5>(m_texture.data(), m_texture.width(),
-                        m_texture.height(), m_texture.bpp());
-                }
-
-                // Write cache data
-                const u::string cacheString = u::format("cache%c%s", u::kPathSep,
-                    m_texture.hashString());
-                if (!writeCacheData(m_texture.format(),
-                                    m_texture.size(),
-                                    cacheString,
-                                    &compressed[0],
-                                    m_texture.width(),
-                                    m_texture.height(),
-                                    compressed.size(),
-                                    format.internal,
-                                    "our") || !useCache())
-                {
-                    neoFatal("failed to cache");
-                }
+                useCache();
             }
             else
 #endif
@@ -954,20 +1740,37 @@ bool texture2D::upload() {
                 gl::TexImage2D(GL_TEXTURE_2D, 0, format.internal, m_texture.width(),
                     m_texture.height(), 0, format.format, format.data, m_texture.data());
                 gl::PixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+                // The levels below are tightly packed
+                if (m_texture.mips() > 1) {
+                    gl::PixelStorei(GL_UNPACK_ALIGNMENT, 1);
+                    const size_t bpp = m_texture.bpp();
+                    size_t width = m_texture.width();
+                    size_t height = m_texture.height();
+                    const unsigned char *data = m_texture.data() + m_texture.pitch() * height;
+                    for (size_t i = 1; i < m_texture.mips(); i++) {
+                        width = u::max(width >> 1, size_t(1));
+                        height = u::max(height >> 1, size_t(1));
+                        gl::TexImage2D(GL_TEXTURE_2D, i, format.internal, width, height,
+                            0, format.format, format.data, data);
+                        data += width * height * bpp;
+                    }
+                }
                 gl::PixelStorei(GL_UNPACK_ALIGNMENT, 8);
 
                 if (format.internal == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT ||
                     format.internal == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
                 {
                     needsCache = false;
-                    cache(format.internal);
-                    if (!useCache())
+                    if (cache(format.internal) && !useCache())
                         neoFatal("failed to cache");
                 }
             }
         }
 
-        if (r_mipmaps)
+        // Only when neither the cache nor the upload brought a mip chain along
+        const size_t mips = m_cache ? m_cache->mips : m_texture.mips();
+        if (r_mipmaps && mips <= 1)
             gl::GenerateMipmap(GL_TEXTURE_2D);
         gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
         gl::TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
@@ -991,7 +1794,19 @@ void texture2D::resize(size_t width, size_t height) {
 }
 
 textureFormat texture2D::format() const {
-  return m_texture.format();
+    return m_cache ? m_cache->format : m_texture.format();
+}
+
+size_t texture2D::width() const {
+    return m_cache ? m_cache->width : m_texture.width();
+}
+
+size_t texture2D::height() const {
+    return m_cache ? m_cache->height : m_texture.height();
+}
+
+void texture2D::clearCache() {
+    gCachePack.clear();
 }
 
 ///! texture3D
@@ -3,6 +3,8 @@
 #include "texture.h"
 #include "r_common.h"
 
+#include "u_memory.h"
+
 namespace r {
 
 enum {
@@ -12,14 +14,22 @@ enum {
     kFilterDefault   = kFilterBilinear | kFilterTrilinear | kFilterAniso
 };
 
+struct textureJob;
+struct textureCacheEntry;
+
 struct texture2D {
     texture2D(bool mipmaps = true, int filter = kFilterDefault);
     ~texture2D();
 
     texture2D(texture &tex, bool mipmaps = true, int filter = kFilterDefault);
 
-    void colorize(uint32_t color); // must be called before upload
-    bool load(const u::string &file);
+    // A compressed copy in the texture cache is used instead of decoding `file'
+    // when there is one
+    bool load(const u::string &file, const u::optional<uint32_t> &colorize = u::none);
+    // Loads `file' on the worker pool. Until the result is uploaded by
+    // uploadDecoded, upload() gives it a single texel of `placeholder' (RGBA)
+    bool loadAsync(const u::string &file, uint32_t placeholder,
+        const u::optional<uint32_t> &colorize = u::none);
     bool upload();
     bool cache(GLuint internal);
     void bind(GLenum unit);
@@ -28,24 +38,31 @@ struct texture2D {
     size_t width() const;
     size_t height() const;
 
+    // Uploads the textures the worker pool finished decoding. Called once a
+    // frame from the main loop, stops after r_tex_upload_budget milliseconds
+    // and leaves the rest for the next frame.
+    static void uploadDecoded();
+
+    // Drops every texture from the cache, the space is reclaimed when the
+    // cache is next compacted
+    static void clearCache();
+
 private:
+    friend struct textureJob;
+
     bool useCache();
     void applyFilter();
+    void uploadPlaceholder();
     bool m_uploaded;
     GLuint m_textureHandle;
     texture m_texture;
     bool m_mipmaps;
     int m_filter;
+    textureJob *m_job; // decoding on the worker pool
+    uint32_t m_placeholder;
+    u::unique_ptr<textureCacheEntry> m_cache; // used in place of m_texture when cached
 };
 
-inline size_t texture2D::width() const {
-    return m_texture.width();
-}
-
-inline size_t texture2D::height() const {
-    return m_texture.height();
-}
-
 struct texture3D {
     texture3D();
     ~texture3D();
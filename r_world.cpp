@@ -26,6 +26,8 @@ VAR(int, r_parallax, "parallax mapping", 0, 1, 1);
 VAR(int, r_ssao, "screen space ambient occlusion", 0, 1, 1);
 VAR(int, r_spec, "specularity mapping", 0, 1, 1);
 VAR(int, r_hoq, "hardware occlusion queries", 0, 1, 1);
+VAR(int, r_cull, "frustum cull world geometry with the kd-tree", 0, 1, 1);
+VAR(int, r_instance, "draw repeated map models with instancing", 0, 1, 0);
 VAR(int, r_fog, "fog", 0, 1, 1);
 NVAR(int, r_debug, "debug visualizations", 0, 4, 0);
 
@@ -298,6 +300,8 @@ void world::unload(bool destroy) {
         m_indices.destroy();
         m_vertices.destroy();
         m_textureBatches.destroy();
+        m_nodes.destroy();
+        m_leafRanges.destroy();
         m_textures2D.clear();
     }
 
@@ -342,25 +346,145 @@ void dustSystem::initParticle(particle &p, const m::vec3 &ownerPosition) {
     p.respawn = true;
 }
 
-bool world::load(const kdMap &map) {
-    // load skybox
-    if (!m_skybox.load("textures/sky01"))
-        return false;
+void world::buildNodes(const kdMap &map) {
+    // Leafs in the order a walk of the tree visiting front children first
+    // meets them, wherever the camera is. Culling walks the same fixed way so
+    // the ranges of neighbouring visible leafs merge
+    u::vector<size_t> order; // every node, parents before children
+    u::vector<size_t> leafs;
+    if (map.nodes.size()) {
+        u::vector<size_t> stack;
+        stack.push_back(0);
+        while (stack.size()) {
+            const size_t node = stack.back();
+            stack.pop_back();
+            order.push_back(node);
+            if (map.nodes[node].isLeaf()) {
+                leafs.push_back(node);
+            } else {
+                stack.push_back(map.nodes[node].children() + 1);
+                stack.push_back(map.nodes[node].children());
+            }
+        }
+    }
 
-    // make rendering batches for triangles which share the same texture
+    // Triangles straddling a splitting plane are in more than one leaf, the
+    // first leaf draws them. Without a tree everything is in one
+    const size_t leafCount = u::max(leafs.size(), size_t(1));
+    u::vector<u::vector<uint32_t>> owned(leafCount);
+    u::vector<bool> drawn(map.triangles.size(), false);
+    for (size_t i = 0; i < leafs.size(); i++) {
+        const kdMapNode &leaf = map.nodes[leafs[i]];
+        for (size_t j = 0; j < leaf.triangleCount(); j++) {
+            const uint32_t triangle = map.leafTriangles[leaf.firstTriangle + j];
+            if (drawn[triangle])
+                continue;
+            drawn[triangle] = true;
+            owned[i].push_back(triangle);
+        }
+    }
+    for (size_t i = 0; i < map.triangles.size(); i++)
+        if (!drawn[i])
+            owned[0].push_back(i);
+
+    // Within a batch the triangles of a leaf are adjacent
+    u::vector<u::vector<renderLeafRange>> ranges(leafCount);
     for (size_t i = 0; i < map.textures.size(); i++) {
         renderTextureBatch batch;
         batch.start = m_indices.size();
         batch.index = i;
-        for (size_t j = 0; j < map.triangles.size(); j++) {
-            if (map.triangles[j].texture == i)
-                for (size_t k = 0; k < 3; k++)
-                    m_indices.push_back(map.triangles[j].v[k]);
+        for (size_t j = 0; j < leafCount; j++) {
+            const size_t start = m_indices.size();
+            for (const auto triangle : owned[j]) {
+                if (map.triangles[triangle].texture == i)
+                    for (size_t k = 0; k < 3; k++)
+                        m_indices.push_back(map.triangles[triangle].v[k]);
+            }
+            if (m_indices.size() != start)
+                ranges[j].push_back({ uint32_t(i), uint32_t(start), uint32_t(m_indices.size() - start) });
         }
         batch.count = m_indices.size() - batch.start;
         m_textureBatches.push_back(batch);
     }
 
+    if (leafs.empty())
+        return;
+
+    // Children before parents so bounds can be merged upwards
+    m_nodes.resize(map.nodes.size());
+    for (size_t i = leafs.size(); i--; )
+        m_nodes[leafs[i]].first = i; // leaf index until filled in below
+    for (size_t i = order.size(); i--; ) {
+        const kdMapNode &node = map.nodes[order[i]];
+        renderNode &render = m_nodes[order[i]];
+        if (node.isLeaf()) {
+            const size_t leaf = render.first;
+            render.children = renderNode::kLeaf;
+            render.first = m_leafRanges.size();
+            render.count = ranges[leaf].size();
+            render.empty = owned[leaf].empty();
+            for (const auto &it : ranges[leaf])
+                m_leafRanges.push_back(it);
+            for (size_t j = 0; j < owned[leaf].size(); j++) {
+                const kdBinTriangle &triangle = map.triangles[owned[leaf][j]];
+                for (size_t k = 0; k < 3; k++) {
+                    const m::vec3 &vertex = map.vertices[triangle.v[k]].vertex;
+                    if (j == 0 && k == 0)
+                        render.bounds = m::bbox(vertex, vertex);
+                    else
+                        render.bounds.expand(vertex);
+                }
+            }
+        } else {
+            const renderNode &front = m_nodes[node.children()];
+            const renderNode &back = m_nodes[node.children() + 1];
+            render.children = node.children();
+            render.first = 0;
+            render.count = 0;
+            render.empty = front.empty && back.empty;
+            if (!front.empty) {
+                render.bounds = front.bounds;
+                if (!back.empty)
+                    render.bounds.expand(back.bounds);
+            } else if (!back.empty) {
+                render.bounds = back.bounds;
+            }
+        }
+    }
+}
+
+void world::cullNodes(const m::frustum &frustum, size_t index) {
+    const renderNode &node = m_nodes[index];
+    if (node.empty || !frustum.testBox(node.bounds))
+        return;
+    if (node.children != renderNode::kLeaf) {
+        cullNodes(frustum, node.children);
+        cullNodes(frustum, node.children + 1);
+        return;
+    }
+    for (size_t i = node.first; i < node.first + node.count; i++) {
+        const renderLeafRange &range = m_leafRanges[i];
+        auto &batch = m_textureBatches[range.batch];
+        const GLvoid *offset = (const GLvoid*)(sizeof(GLuint) * range.start);
+        if (batch.drawCounts.size() && (const unsigned char *)batch.drawOffsets.back()
+            + sizeof(GLuint) * batch.drawCounts.back() == offset)
+        {
+            batch.drawCounts.back() += range.count;
+        } else {
+            batch.drawCounts.push_back(range.count);
+            batch.drawOffsets.push_back(offset);
+        }
+    }
+}
+
+bool world::load(const kdMap &map) {
+    // load skybox
+    if (!m_skybox.load("textures/sky01"))
+        return false;
+
+    // make rendering batches for triangles which share the same texture
+    buildNodes(map);
+
 // TODO: Offline step in kdtree.cpp instead
 #if 0
     u::print("Optimizing world geometry (this could take awhile)\n");
@@ -553,6 +677,47 @@ bool world::upload(const m::perspective &p, ::world *map) {
     return m_uploaded = true;
 }
 
+// Map models only move when edited so their transforms are kept with them
+static void updateMapModel(mapModel &it, const model &mdl) {
+    if (!it.dirty)
+        return;
+
+    pipeline p;
+    p.setWorld(it.position);
+    p.setScale(it.scale + mdl.scale);
+    const m::vec3 rot = mdl.rotate + it.rotate;
+    m::quat rx(m::toRadian(rot.x), m::vec3::xAxis);
+    m::quat ry(m::toRadian(rot.y), m::vec3::yAxis);
+    m::quat rz(m::toRadian(rot.z), m::vec3::zAxis);
+    m::mat4 rotate;
+    (rz * ry * rx).getMatrix(&rotate);
+    p.setRotate(rotate);
+    it.transform = p.world();
+
+    const m::bbox bounds = mdl.bounds();
+    pipeline bp;
+    bp.setWorld(bounds.center());
+    bp.setScale(bounds.size());
+    it.boundsTransform = it.transform * bp.world();
+
+    // The world space box around the eight transformed corners
+    for (size_t i = 0; i < 8; i++) {
+        const m::vec3 corner(i & 1 ? bounds.max().x : bounds.min().x,
+                             i & 2 ? bounds.max().y : bounds.min().y,
+                             i & 4 ? bounds.max().z : bounds.min().z);
+        const m::mat4 &w = it.transform;
+        const m::vec3 point(w.a.x * corner.x + w.a.y * corner.y + w.a.z * corner.z + w.a.w,
+                            w.b.x * corner.x + w.b.y * corner.y + w.b.z * corner.z + w.b.w,
+                            w.c.x * corner.x + w.c.y * corner.y + w.c.z * corner.z + w.c.w);
+        if (i == 0)
+            it.bounds = m::bbox(point, point);
+        else
+            it.bounds.expand(point);
+    }
+
+    it.dirty = false;
+}
+
 void world::occlusionPass(const pipeline &pl, ::world *map) {
     if (!r_hoq)
         return;
@@ -565,23 +730,8 @@ void world::occlusionPass(const pipeline &pl, ::world *map) {
             continue;
 
         auto &mdl = m_models[it->name];
-
-        pipeline p = pl;
-        p.setWorld(it->position);
-        p.setScale(it->scale + mdl->scale);
-
-        const m::vec3 rot = mdl->rotate + it->rotate;
-        m::quat rx(m::toRadian(rot.x), m::vec3::xAxis);
-        m::quat ry(m::toRadian(rot.y), m::vec3::yAxis);
-        m::quat rz(m::toRadian(rot.z), m::vec3::zAxis);
-        m::mat4 rotate;
-        (rz * ry * rx).getMatrix(&rotate);
-        p.setRotate(rotate);
-
-        pipeline bp;
-        bp.setWorld(mdl->bounds().center());
-        bp.setScale(mdl->bounds().size());
-        const m::mat4 wvp = (p.projection() * p.view() * p.world()) * bp.world();
+        updateMapModel(*it, *mdl);
+        const m::mat4 wvp = pl.viewProjection() * it->boundsTransform;
 
         // Get an occlusion query slot
         auto occlusionQuery = m_queries.add(wvp);
@@ -612,13 +762,33 @@ void world::geometryPass(const pipeline &pl, ::world *map) {
     // Render the map
     const m::mat4 &rw = p.world();
     gl::BindVertexArray(vao);
-    for (auto &it : m_textureBatches) {
-        it.mat.bind(p, rw);
-        gl::DrawElements(GL_TRIANGLES, it.count, GL_UNSIGNED_INT,
-            (const GLvoid*)(sizeof(GLuint) * it.start));
+    if (r_cull && m_nodes.size()) {
+        // Only the leafs of the kd-tree in view, batches with none are skipped
+        for (auto &it : m_textureBatches) {
+            it.drawCounts.clear();
+            it.drawOffsets.clear();
+        }
+        m::frustum frustum;
+        frustum.setup(p.worldViewProjection());
+        cullNodes(frustum, 0);
+        for (auto &it : m_textureBatches) {
+            if (it.drawCounts.empty())
+                continue;
+            it.mat.bind(p, rw);
+            gl::MultiDrawElements(GL_TRIANGLES, &it.drawCounts[0], GL_UNSIGNED_INT,
+                &it.drawOffsets[0], it.drawCounts.size());
+        }
+    } else {
+        for (auto &it : m_textureBatches) {
+            it.mat.bind(p, rw);
+            gl::DrawElements(GL_TRIANGLES, it.count, GL_UNSIGNED_INT,
+                (const GLvoid*)(sizeof(GLuint) * it.start));
+        }
     }
 
     // Render map models
+    m::frustum modelFrustum;
+    modelFrustum.setup(p.viewProjection());
     for (auto &it : map->m_mapModels) {
         // Load map models on demand
         if (m_models.find(it->name) == m_models.end()) {
@@ -638,18 +808,16 @@ void world::geometryPass(const pipeline &pl, ::world *map) {
                 continue;
 
             auto &mdl = m_models[it->name];
+            updateMapModel(*it, *mdl);
+            if (r_cull && !modelFrustum.testBox(it->bounds))
+                continue;
 
-            pipeline pm = p;
-            pm.setWorld(it->position);
-            pm.setScale(it->scale + mdl->scale);
+            // Copies of a model are drawn together once every map model is seen
+            if (r_instance && mdl->addInstance(it->transform))
+                continue;
 
-            const m::vec3 rot = mdl->rotate + it->rotate;
-            m::quat rx(m::toRadian(rot.x), m::vec3::xAxis);
-            m::quat ry(m::toRadian(rot.y), m::vec3::yAxis);
-            m::quat rz(m::toRadian(rot.z), m::vec3::zAxis);
-            m::mat4 rotate;
-            (rz * ry * rx).getMatrix(&rotate);
-            pm.setRotate(rotate);
+            pipeline pm = p;
+            pm.setWorldTransform(it->transform);
 
             if (mdl->animated()) {
                 // HACK: Testing only
@@ -659,6 +827,8 @@ void world::geometryPass(const pipeline &pl, ::world *map) {
             mdl->render(pm, rw);
         }
     }
+    for (auto &it : m_models)
+        it.second->renderInstances(p, rw);
 
     // Only the scene pass needs to write to the depth buffer
     gl::Disable(GL_DEPTH_TEST);
@@ -683,7 +853,7 @@ void world::geometryPass(const pipeline &pl, ::world *map) {
 
         m_ssaoMethod.enable();
         m_ssaoMethod.setPerspective(p.perspective());
-        m_ssaoMethod.setInverse((p.projection() * p.view()).inverse());
+        m_ssaoMethod.setInverse(p.inverseViewProjection());
 
         m_quad.render();
 
@@ -732,7 +902,7 @@ void world::pointLightPass(const pipeline &pl, const ::world *const map) {
     method.enable();
     method.setPerspective(pl.perspective());
     method.setEyeWorldPos(pl.position());
-    method.setInverse((p.projection() * p.view()).inverse());
+    method.setInverse(p.inverseViewProjection());
 
     for (auto &it : map->m_pointLights) {
         float scale = it->radius * kLightRadiusTweak;
@@ -745,7 +915,7 @@ void world::pointLightPass(const pipeline &pl, const ::world *const map) {
         p.setWorld(it->position);
         p.setScale({scale, scale, scale});
 
-        const m::mat4 wvp = p.projection() * p.view() * p.world();
+        const m::mat4 wvp = p.worldViewProjection();
         method.setLight(*it);
         method.setWVP(wvp);
 
@@ -768,7 +938,7 @@ void world::spotLightPass(const pipeline &pl, const ::world *const map) {
     method.enable();
     method.setPerspective(pl.perspective());
     method.setEyeWorldPos(pl.position());
-    method.setInverse((p.projection() * p.view()).inverse());
+    method.setInverse(p.inverseViewProjection());
 
     for (auto &it : map->m_spotLights) {
         float scale = it->radius * kLightRadiusTweak;
@@ -781,7 +951,7 @@ void world::spotLightPass(const pipeline &pl, const ::world *const map) {
         p.setWorld(it->position);
         p.setScale({scale, scale, scale});
 
-        const m::mat4 wvp = p.projection() * p.view() * p.world();
+        const m::mat4 wvp = p.worldViewProjection();
         method.setLight(*it);
         method.setWVP(wvp);
 
@@ -862,7 +1032,7 @@ void world::lightingPass(const pipeline &pl, ::world *map) {
         method.setLight(map->getDirectionalLight());
         method.setPerspective(pl.perspective());
         method.setEyeWorldPos(pl.position());
-        method.setInverse((p.projection() * p.view()).inverse());
+        method.setInverse(p.inverseViewProjection());
         if (r_fog)
             method.setFog(map->m_fog);
         m_quad.render();
@@ -922,7 +1092,7 @@ void world::forwardPass(const pipeline &pl, ::world *map) {
                     bp.setScale(it.size);
                     m_bboxMethod.enable();
                     m_bboxMethod.setColor(kOutline);
-                    m_bboxMethod.setWVP((p.projection() * p.view() * p.world()) * bp.world());
+                    m_bboxMethod.setWVP(p.worldViewProjection() * bp.world());
                     m_bbox.render();
                 }
             }
@@ -937,25 +1107,11 @@ void world::forwardPass(const pipeline &pl, ::world *map) {
         // Map models
         for (auto &it : map->m_mapModels) {
             auto &mdl = m_models[it->name];
+            updateMapModel(*it, *mdl);
 
-            pipeline p = pl;
-            p.setWorld(it->position);
-            p.setScale(it->scale + mdl->scale);
-
-            const m::vec3 rot = mdl->rotate + it->rotate;
-            m::quat rx(m::toRadian(rot.x), m::vec3::xAxis);
-            m::quat ry(m::toRadian(rot.y), m::vec3::yAxis);
-            m::quat rz(m::toRadian(rot.z), m::vec3::zAxis);
-            m::mat4 rotate;
-            (rz * ry * rx).getMatrix(&rotate);
-            p.setRotate(rotate);
-
-            pipeline bp;
-            bp.setWorld(mdl->bounds().center());
-            bp.setScale(mdl->bounds().size());
             m_bboxMethod.enable();
             m_bboxMethod.setColor(it->highlight ? kHighlighted : kOutline);
-            m_bboxMethod.setWVP((p.projection() * p.view() * p.world()) * bp.world());
+            m_bboxMethod.setWVP(pl.viewProjection() * it->boundsTransform);
             m_bbox.render();
         }
 
@@ -972,7 +1128,7 @@ void world::forwardPass(const pipeline &pl, ::world *map) {
             pipeline p = pl;
             p.setWorld(it->position);
             p.setScale({scale, scale, scale});
-            m_bboxMethod.setWVP(p.projection() * p.view() * p.world());
+            m_bboxMethod.setWVP(p.worldViewProjection());
             m_sphere.render();
         }
         for (auto &it : map->m_spotLights) {
@@ -982,7 +1138,7 @@ void world::forwardPass(const pipeline &pl, ::world *map) {
             pipeline p = pl;
             p.setWorld(it->position);
             p.setScale({scale, scale, scale});
-            m_bboxMethod.setWVP(p.projection() * p.view() * p.world());
+            m_bboxMethod.setWVP(p.worldViewProjection());
             m_sphere.render();
         }
 
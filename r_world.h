@@ -91,6 +91,30 @@ struct renderTextureBatch {
     size_t count;
     size_t index;
     material mat; // Rendering material (world and models share this)
+
+    // Visible index ranges for this frame, adjacent ranges are merged
+    u::vector<GLsizei> drawCounts;
+    u::vector<const GLvoid*> drawOffsets;
+};
+
+// kd-tree node of the world for culling, one for every kdMap node. Every
+// triangle is drawn by the first leaf holding it and the bounds cover the
+// triangles drawn by the subtree.
+struct renderNode {
+    static constexpr uint32_t kLeaf = 0xFFFFFFFFu; // stored in place of the children
+
+    m::bbox bounds;
+    uint32_t children; // front child, the back child follows it
+    uint32_t first; // leafs: ranges in world::m_leafRanges
+    uint32_t count;
+    bool empty; // no triangles in the subtree
+};
+
+// Index range of one texture batch drawn by a leaf
+struct renderLeafRange {
+    uint32_t batch;
+    uint32_t start;
+    uint32_t count;
 };
 
 struct world : geom {
@@ -113,6 +137,11 @@ private:
     void pointLightPass(const pipeline &pl, const ::world *const map);
     void spotLightPass(const pipeline &pl, const ::world *const map);
 
+    // Builds the index buffer leaf by leaf within every texture batch
+    void buildNodes(const kdMap &map);
+    // Appends the ranges of the leafs under node `index' which `frustum' sees
+    void cullNodes(const m::frustum &frustum, size_t index);
+
     // world shading methods and permutations
     geomMethods *m_geomMethods;
     u::vector<directionalLightMethod> m_directionalLightMethods;
@@ -141,6 +170,8 @@ private:
     u::vector<uint32_t> m_indices;
     u::vector<kdBinVertex> m_vertices;
     u::vector<renderTextureBatch> m_textureBatches;
+    u::vector<renderNode> m_nodes; // m_nodes[0] is the root, empty without a tree
+    u::vector<renderLeafRange> m_leafRanges;
     u::map<u::string, texture2D*> m_textures2D;
 
     aa m_aa;
@@ -1,5 +1,12 @@
 #include <assert.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+
 #include "engine.h"
 #include "texture.h"
 #include "cvar.h"
@@ -8,12 +15,14 @@
 #include "u_file.h"
 #include "u_algorithm.h"
 #include "u_misc.h"
-#include "u_sha512.h"
+#include "u_murmur3.h"
 #include "u_traits.h"
+#include "u_thread.h"
 
 #include "m_const.h"
 
 VAR(int, tex_jpg_chroma, "chroma filtering method", 0, 1, 0);
+VAR(int, tex_jpg_threads, "decode large JPEG images on multiple threads", 0, 1, 1);
 VAR(int, tex_tga_compress, "compress TGA", 0, 1, 1);
 VAR(int, tex_png_compress_quality, "compression quality for PNG", 5, 128, 16);
 
@@ -130,15 +139,13 @@ struct jpeg : decoder {
         , m_mbheight(0)
         , m_mbsizex(0)
         , m_mbsizey(0)
-        , m_buf(0)
-        , m_bufbits(0)
         , m_exifLittleEndian(false)
         , m_coSitedChroma(false)
+        , m_parallel(tex_jpg_threads.get())
     {
         memset(m_comp, 0, sizeof(m_comp));
         memset(m_vlctab, 0, sizeof(m_vlctab));
         memset(m_qtab, 0, sizeof(m_qtab));
-        memset(m_block, 0, sizeof(m_block));
 
         decode(data, chromaFilter(tex_jpg_chroma.get()));
 
@@ -183,11 +190,42 @@ private:
         size_t qtsel;
         size_t actabsel;
         size_t dctabsel;
-        size_t dcpred;
 
         u::vector<unsigned char> pixels;
     };
 
+    // Entropy decoder state. A sequential decode uses one for the whole scan,
+    // a parallel one gets one for every restart interval.
+    struct scanReader {
+        const unsigned char *position;
+        int size;
+        int buf;
+        int bufbits;
+        result error;
+        size_t dcpred[3];
+        int block[64];
+    };
+
+    static constexpr size_t kParallelPixels = 512 * 512; // smaller images are decoded on the calling thread
+
+    bool parallel() const {
+        return m_parallel && u::cpuCount() > 1 && m_width * m_height >= kParallelPixels;
+    }
+
+    // Calls function(first, last) over bands of [0, count), on the worker pool
+    // if parallel()
+    template <typename F>
+    void bands(size_t count, const F &function) {
+        if (!parallel() || count < 2) {
+            function(0, count);
+            return;
+        }
+        const size_t tasks = u::min(count, u::cpuCount() * 4);
+        u::parallelFor(tasks, [count, tasks, &function](size_t index) {
+            function(count * index / tasks, count * (index + 1) / tasks);
+        });
+    }
+
     unsigned char clip(const int x) {
         return (x < 0) ? 0 : ((x > 0xFF) ? 0xFF : (unsigned char)x);
     }
@@ -290,59 +328,207 @@ private:
         *out = clip(((x7 - x1) >> 14) + 128);
     }
 
-    int viewBits(int bits) {
+#ifdef __SSE2__
+    // low 32 bits of the lane products, like int multiplication
+    static __m128i mul32(__m128i a, int b) {
+#ifdef __SSE4_1__
+        return _mm_mullo_epi32(a, _mm_set1_epi32(b));
+#else
+        const __m128i k = _mm_set1_epi32(b);
+        const __m128i even = _mm_mul_epu32(a, k);
+        const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), k);
+        return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                                  _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+#endif
+    }
+
+    static void transpose4x4(__m128i &a, __m128i &b, __m128i &c, __m128i &d) {
+        const __m128i ab0 = _mm_unpacklo_epi32(a, b);
+        const __m128i ab1 = _mm_unpackhi_epi32(a, b);
+        const __m128i cd0 = _mm_unpacklo_epi32(c, d);
+        const __m128i cd1 = _mm_unpackhi_epi32(c, d);
+        a = _mm_unpacklo_epi64(ab0, cd0);
+        b = _mm_unpackhi_epi64(ab0, cd0);
+        c = _mm_unpacklo_epi64(ab1, cd1);
+        d = _mm_unpackhi_epi64(ab1, cd1);
+    }
+
+    // v[row][half] <-> v[column][half]
+    static void transpose8x8(__m128i (&v)[8][2]) {
+        transpose4x4(v[0][0], v[1][0], v[2][0], v[3][0]);
+        transpose4x4(v[4][1], v[5][1], v[6][1], v[7][1]);
+        transpose4x4(v[0][1], v[1][1], v[2][1], v[3][1]);
+        transpose4x4(v[4][0], v[5][0], v[6][0], v[7][0]);
+        for (size_t i = 0; i < 4; i++)
+            u::swap(v[i][1], v[i + 4][0]);
+    }
+
+    // rowIDCT on four rows at once, lane i of b[k] holding blk[k] of row i.
+    // The shortcut for blocks without AC terms gives the same result as the
+    // full transform so it is not needed.
+    static void rowIDCT(__m128i (&b)[8]) {
+        __m128i x0 = _mm_add_epi32(_mm_slli_epi32(b[0], 11), _mm_set1_epi32(128));
+        __m128i x1 = _mm_slli_epi32(b[4], 11);
+        __m128i x2 = b[6], x3 = b[2], x4 = b[1], x5 = b[7], x6 = b[5], x7 = b[3];
+        __m128i x8 = mul32(_mm_add_epi32(x4, x5), kW7);
+        x4 = _mm_add_epi32(x8, mul32(x4, kW1 - kW7));
+        x5 = _mm_sub_epi32(x8, mul32(x5, kW1 + kW7));
+        x8 = mul32(_mm_add_epi32(x6, x7), kW3);
+        x6 = _mm_sub_epi32(x8, mul32(x6, kW3 - kW5));
+        x7 = _mm_sub_epi32(x8, mul32(x7, kW3 + kW5));
+        x8 = _mm_add_epi32(x0, x1);
+        x0 = _mm_sub_epi32(x0, x1);
+        x1 = mul32(_mm_add_epi32(x3, x2), kW6);
+        x2 = _mm_sub_epi32(x1, mul32(x2, kW2 + kW6));
+        x3 = _mm_add_epi32(x1, mul32(x3, kW2 - kW6));
+        x1 = _mm_add_epi32(x4, x6);
+        x4 = _mm_sub_epi32(x4, x6);
+        x6 = _mm_add_epi32(x5, x7);
+        x5 = _mm_sub_epi32(x5, x7);
+        x7 = _mm_add_epi32(x8, x3);
+        x8 = _mm_sub_epi32(x8, x3);
+        x3 = _mm_add_epi32(x0, x2);
+        x0 = _mm_sub_epi32(x0, x2);
+        const __m128i round = _mm_set1_epi32(128);
+        x2 = _mm_srai_epi32(_mm_add_epi32(mul32(_mm_add_epi32(x4, x5), 181), round), 8);
+        x4 = _mm_srai_epi32(_mm_add_epi32(mul32(_mm_sub_epi32(x4, x5), 181), round), 8);
+        b[0] = _mm_srai_epi32(_mm_add_epi32(x7, x1), 8);
+        b[1] = _mm_srai_epi32(_mm_add_epi32(x3, x2), 8);
+        b[2] = _mm_srai_epi32(_mm_add_epi32(x0, x4), 8);
+        b[3] = _mm_srai_epi32(_mm_add_epi32(x8, x6), 8);
+        b[4] = _mm_srai_epi32(_mm_sub_epi32(x8, x6), 8);
+        b[5] = _mm_srai_epi32(_mm_sub_epi32(x0, x4), 8);
+        b[6] = _mm_srai_epi32(_mm_sub_epi32(x3, x2), 8);
+        b[7] = _mm_srai_epi32(_mm_sub_epi32(x7, x1), 8);
+    }
+
+    // columnIDCT on four columns at once, lane i of b[k] holding blk[8*k] of
+    // column i. The results are left before the final shift and clip.
+    static void columnIDCT(__m128i (&b)[8]) {
+        const __m128i four = _mm_set1_epi32(4);
+        __m128i x0 = _mm_add_epi32(_mm_slli_epi32(b[0], 8), _mm_set1_epi32(8192));
+        __m128i x1 = _mm_slli_epi32(b[4], 8);
+        __m128i x2 = b[6], x3 = b[2], x4 = b[1], x5 = b[7], x6 = b[5], x7 = b[3];
+        __m128i x8 = _mm_add_epi32(mul32(_mm_add_epi32(x4, x5), kW7), four);
+        x4 = _mm_srai_epi32(_mm_add_epi32(x8, mul32(x4, kW1 - kW7)), 3);
+        x5 = _mm_srai_epi32(_mm_sub_epi32(x8, mul32(x5, kW1 + kW7)), 3);
+        x8 = _mm_add_epi32(mul32(_mm_add_epi32(x6, x7), kW3), four);
+        x6 = _mm_srai_epi32(_mm_sub_epi32(x8, mul32(x6, kW3 - kW5)), 3);
+        x7 = _mm_srai_epi32(_mm_sub_epi32(x8, mul32(x7, kW3 + kW5)), 3);
+        x8 = _mm_add_epi32(x0, x1);
+        x0 = _mm_sub_epi32(x0, x1);
+        x1 = _mm_add_epi32(mul32(_mm_add_epi32(x3, x2), kW6), four);
+        x2 = _mm_srai_epi32(_mm_sub_epi32(x1, mul32(x2, kW2 + kW6)), 3);
+        x3 = _mm_srai_epi32(_mm_add_epi32(x1, mul32(x3, kW2 - kW6)), 3);
+        x1 = _mm_add_epi32(x4, x6);
+        x4 = _mm_sub_epi32(x4, x6);
+        x6 = _mm_add_epi32(x5, x7);
+        x5 = _mm_sub_epi32(x5, x7);
+        x7 = _mm_add_epi32(x8, x3);
+        x8 = _mm_sub_epi32(x8, x3);
+        x3 = _mm_add_epi32(x0, x2);
+        x0 = _mm_sub_epi32(x0, x2);
+        const __m128i round = _mm_set1_epi32(128);
+        x2 = _mm_srai_epi32(_mm_add_epi32(mul32(_mm_add_epi32(x4, x5), 181), round), 8);
+        x4 = _mm_srai_epi32(_mm_add_epi32(mul32(_mm_sub_epi32(x4, x5), 181), round), 8);
+        b[0] = _mm_add_epi32(x7, x1);
+        b[1] = _mm_add_epi32(x3, x2);
+        b[2] = _mm_add_epi32(x0, x4);
+        b[3] = _mm_add_epi32(x8, x6);
+        b[4] = _mm_sub_epi32(x8, x6);
+        b[5] = _mm_sub_epi32(x0, x4);
+        b[6] = _mm_sub_epi32(x3, x2);
+        b[7] = _mm_sub_epi32(x7, x1);
+    }
+
+    // both passes over a whole block, bit exact with the scalar ones
+    static void blockIDCT(const int *blk, unsigned char *out, int stride) {
+        __m128i v[8][2];
+        for (size_t i = 0; i < 8; i++) {
+            v[i][0] = _mm_loadu_si128((const __m128i *)&blk[i*8]);
+            v[i][1] = _mm_loadu_si128((const __m128i *)&blk[i*8 + 4]);
+        }
+        // rows
+        transpose8x8(v);
+        for (size_t h = 0; h < 2; h++) {
+            __m128i b[8];
+            for (size_t k = 0; k < 8; k++)
+                b[k] = v[k][h];
+            rowIDCT(b);
+            for (size_t k = 0; k < 8; k++)
+                v[k][h] = b[k];
+        }
+        transpose8x8(v);
+        // columns
+        for (size_t h = 0; h < 2; h++) {
+            __m128i b[8];
+            for (size_t k = 0; k < 8; k++)
+                b[k] = v[k][h];
+            columnIDCT(b);
+            for (size_t k = 0; k < 8; k++)
+                v[k][h] = _mm_add_epi32(_mm_srai_epi32(b[k], 14), _mm_set1_epi32(128));
+        }
+        // the saturating packs do the clipping
+        for (size_t k = 0; k < 8; k++) {
+            const __m128i words = _mm_packs_epi32(v[k][0], v[k][1]);
+            _mm_storel_epi64((__m128i *)(out + k*stride), _mm_packus_epi16(words, words));
+        }
+    }
+#endif
+
+    int viewBits(scanReader *scan, int bits) {
         unsigned char newbyte;
         if (!bits)
             return 0;
-        while (m_bufbits < bits) {
-            if (m_size <= 0) {
-                m_buf = u::sls(m_buf, 8) | 0xFF;
-                m_bufbits += 8;
+        while (scan->bufbits < bits) {
+            if (scan->size <= 0) {
+                scan->buf = u::sls(scan->buf, 8) | 0xFF;
+                scan->bufbits += 8;
                 continue;
             }
-            newbyte = *m_position++;
-            m_size--;
-            m_bufbits += 8;
-            m_buf = u::sls(m_buf, 8) | newbyte;
+            newbyte = *scan->position++;
+            scan->size--;
+            scan->bufbits += 8;
+            scan->buf = u::sls(scan->buf, 8) | newbyte;
             if (newbyte == 0xFF) {
-                if (m_size) {
-                    unsigned char marker = *m_position++;
-                    m_size--;
+                if (scan->size) {
+                    unsigned char marker = *scan->position++;
+                    scan->size--;
                     switch (marker) {
                     case 0:
                         break;
                     case 0xD9:
-                        m_size = 0;
+                        scan->size = 0;
                         break;
                     default:
                         if ((marker & 0xF8) != 0xD0)
-                            m_error = kMalformatted;
+                            scan->error = kMalformatted;
                         else {
-                            m_buf = u::sls(m_buf, 8) | marker;
-                            m_bufbits += 8;
+                            scan->buf = u::sls(scan->buf, 8) | marker;
+                            scan->bufbits += 8;
                         }
                     }
                 } else
-                    m_error = kMalformatted;
+                    scan->error = kMalformatted;
             }
         }
-        return (m_buf >> (m_bufbits - bits)) & ((1 << bits) - 1);
+        return (scan->buf >> (scan->bufbits - bits)) & ((1 << bits) - 1);
     }
 
-    void skipBits(int bits) {
-        if (m_bufbits < bits)
-            viewBits(bits);
-        m_bufbits -= bits;
+    void skipBits(scanReader *scan, int bits) {
+        if (scan->bufbits < bits)
+            viewBits(scan, bits);
+        scan->bufbits -= bits;
     }
 
-    int getBits(int bits) {
-        int res = viewBits(bits);
-        skipBits(bits);
+    int getBits(scanReader *scan, int bits) {
+        int res = viewBits(scan, bits);
+        skipBits(scan, bits);
         return res;
     }
 
-    void alignBits() {
-        m_bufbits &= 0xF8;
+    void alignBits(scanReader *scan) {
+        scan->bufbits &= 0xF8;
     }
 
     void skip(int count) {
@@ -509,51 +695,111 @@ private:
         skip(m_length);
     }
 
-    int getCoding(vlcCode* vlc, unsigned char* code) {
-        int value = viewBits(16);
+    int getCoding(scanReader *scan, vlcCode* vlc, unsigned char* code) {
+        int value = viewBits(scan, 16);
         int bits = vlc[value].bits;
         if (!bits) {
-            m_error = kMalformatted;
+            scan->error = kMalformatted;
             return 0;
         }
-        skipBits(bits);
+        skipBits(scan, bits);
         value = vlc[value].code;
         if (code)
             *code = (unsigned char) value;
         if (!(bits = value & 15))
             return 0;
-        if ((value = getBits(bits)) < (1 << (bits - 1)))
+        if ((value = getBits(scan, bits)) < (1 << (bits - 1)))
             value += u::sls(-1, bits) + 1;
         return value;
     }
 
-    void decodeBlock(component* c, unsigned char* out) {
+    void decodeBlock(scanReader *scan, size_t index, unsigned char* out) {
+        const component *c = &m_comp[index];
+        int *block = scan->block;
         unsigned char code = 0;
         int coef = 0;
-        memset(m_block, 0, sizeof(m_block));
-        c->dcpred += getCoding(&m_vlctab[c->dctabsel][0], NULL);
-        m_block[0] = (c->dcpred) * m_qtab[c->qtsel][0];
+        memset(block, 0, sizeof(scan->block));
+        scan->dcpred[index] += getCoding(scan, &m_vlctab[c->dctabsel][0], NULL);
+        block[0] = (scan->dcpred[index]) * m_qtab[c->qtsel][0];
         do {
-            int value = getCoding(&m_vlctab[c->actabsel][0], &code);
+            int value = getCoding(scan, &m_vlctab[c->actabsel][0], &code);
             if (!code)
                 break; // EOB
-            if (!(code & 0x0F) && (code != 0xF0))
-                returnResult(kMalformatted);
+            if (!(code & 0x0F) && (code != 0xF0)) {
+                scan->error = kMalformatted;
+                return;
+            }
             coef += (code >> 4) + 1;
-            if (coef > 63)
-                returnResult(kMalformatted);
-            m_block[(size_t)m_zz[coef]] = value * m_qtab[c->qtsel][coef];
+            if (coef > 63) {
+                scan->error = kMalformatted;
+                return;
+            }
+            block[(size_t)m_zz[coef]] = value * m_qtab[c->qtsel][coef];
         } while (coef < 63);
+#ifdef __SSE2__
+        blockIDCT(block, out, c->stride);
+#else
         for (coef = 0;  coef < 64;  coef += 8)
-            rowIDCT(&m_block[coef]);
+            rowIDCT(&block[coef]);
         for (coef = 0;  coef < 8;  ++coef)
-            columnIDCT(&m_block[coef], &out[coef], c->stride);
+            columnIDCT(&block[coef], &out[coef], c->stride);
+#endif
+    }
+
+    // decode the MCUs [first, last) of the scan
+    void decodeMCUs(scanReader *scan, size_t first, size_t last) {
+        for (size_t mcu = first; mcu < last; mcu++) {
+            const size_t mbx = mcu % m_mbwidth;
+            const size_t mby = mcu / m_mbwidth;
+            for (size_t i = 0; i < m_bpp; ++i) {
+                component *c = &m_comp[i];
+                for (int sby = 0; sby < c->ssy; ++sby) {
+                    for (int sbx = 0; sbx < c->ssx; ++sbx) {
+                        decodeBlock(scan, i, &c->pixels[((mby * c->ssy + sby) * c->stride + mbx * c->ssx + sbx) << 3]);
+                        if (scan->error)
+                            return;
+                    }
+                }
+            }
+        }
+    }
+
+    // Find where every restart interval of the entropy coded data starts. Only
+    // a well formed stream with markers in sequence is accepted, anything else
+    // is left to the sequential decoder to diagnose.
+    bool findRestartIntervals(u::vector<const unsigned char *> *starts, u::vector<const unsigned char *> *ends,
+        size_t intervals)
+    {
+        const unsigned char *position = m_position;
+        const unsigned char *const end = m_position + m_size;
+        starts->push_back(position);
+        while (position + 1 < end) {
+            const unsigned char *marker = (const unsigned char *)memchr(position, 0xFF, end - position - 1);
+            if (!marker)
+                break;
+            const unsigned char next = marker[1];
+            if (next == 0x00 || next == 0xFF) {
+                position = marker + 1 + (next == 0x00);
+                continue;
+            }
+            ends->push_back(marker);
+            if ((next & 0xF8) != 0xD0)
+                break; // end of the scan
+            if ((size_t)(next & 7) != ((starts->size() - 1) & 7))
+                return false;
+            position = marker + 2;
+            starts->push_back(position);
+        }
+        // some encoders emit a marker after the last interval as well
+        if (starts->size() == intervals + 1 && ends->size() == intervals + 1) {
+            starts->pop_back();
+            ends->pop_back();
+        }
+        return starts->size() == intervals && ends->size() == intervals;
     }
 
     void decodeScanlines() {
         size_t i;
-        size_t rstcount = m_rstinterval;
-        size_t nextrst = 0;
         component* c;
         decodeLength();
         if (m_length < int(4 + 2 * m_bpp))
@@ -573,27 +819,46 @@ private:
         if (m_position[0] || (m_position[1] != 63) || m_position[2])
             returnResult(kUnsupported);
         skip(m_length);
-        for (int mby = 0; mby < m_mbheight; ++mby) {
-            for (int mbx = 0; mbx < m_mbwidth; ++mbx) {
-                for (i = 0, c = m_comp; i < m_bpp; ++i, ++c) {
-                    for (int sby = 0; sby < c->ssy; ++sby) {
-                        for (int sbx = 0; sbx < c->ssx; ++sbx) {
-                            decodeBlock(c, &c->pixels[((mby * c->ssy + sby) * c->stride + mbx * c->ssx + sbx) << 3]);
-                            if (m_error)
-                                return;
-                        }
+
+        const size_t mcus = m_mbwidth * m_mbheight;
+        if (m_rstinterval && parallel()) {
+            const size_t intervals = (mcus + m_rstinterval - 1) / m_rstinterval;
+            u::vector<const unsigned char *> starts;
+            u::vector<const unsigned char *> ends;
+            if (intervals > 1 && findRestartIntervals(&starts, &ends, intervals)) {
+                // every interval starts with fresh predictors and bit buffer so
+                // they can be decoded independently into the component planes
+                u::vector<result> errors(intervals, kSuccess);
+                bands(intervals, [this, mcus, &starts, &ends, &errors](size_t first, size_t last) {
+                    for (size_t k = first; k < last; k++) {
+                        scanReader scan = { starts[k], int(ends[k] - starts[k]), 0, 0, kSuccess, { 0, 0, 0 }, { 0 } };
+                        decodeMCUs(&scan, k * m_rstinterval, u::min((k + 1) * m_rstinterval, mcus));
+                        errors[k] = scan.error;
                     }
-                }
-                if (m_rstinterval && !(--rstcount)) {
-                    alignBits();
-                    i = getBits(16);
-                    if (((i & 0xFFF8) != 0xFFD0) || ((i & 7) != nextrst))
-                        returnResult(kMalformatted);
-                    nextrst = (nextrst + 1) & 7;
-                    rstcount = m_rstinterval;
-                    for (i = 0;  i < 3;  ++i)
-                        m_comp[i].dcpred = 0;
-                }
+                });
+                for (const auto &it : errors)
+                    if (it != kSuccess)
+                        returnResult(it);
+                returnResult(kFinished);
+            }
+        }
+
+        scanReader scan = { m_position, m_size, 0, 0, kSuccess, { 0, 0, 0 }, { 0 } };
+        size_t nextrst = 0;
+        for (size_t mcu = 0; mcu < mcus; ) {
+            const size_t next = m_rstinterval ? u::min(mcu + m_rstinterval, mcus) : mcus;
+            decodeMCUs(&scan, mcu, next);
+            if (scan.error)
+                returnResult(scan.error);
+            mcu = next;
+            if (m_rstinterval && mcu < mcus) {
+                alignBits(&scan);
+                i = getBits(&scan, 16);
+                if (((i & 0xFFF8) != 0xFFD0) || ((i & 7) != nextrst))
+                    returnResult(kMalformatted);
+                nextrst = (nextrst + 1) & 7;
+                for (i = 0;  i < 3;  ++i)
+                    scan.dcpred[i] = 0;
             }
         }
         m_error = kFinished;
@@ -674,27 +939,89 @@ private:
         return clipGen<8, 4>(x);
     }
 
+#ifdef __SSE2__
+    // two 16-bit taps for _mm_madd_epi16
+    static __m128i tapPair(int a, int b) {
+        return _mm_set1_epi32((int)(((uint32_t)b << 16) | (uint16_t)a));
+    }
+
+    // CF(k0*a0 + k1*a1 + k2*a2 + k3*a3) for eight 16-bit lanes, where k01
+    // and k23 are tap pairs; the result is in the low eight bytes
+    static __m128i filterCF(__m128i a0, __m128i a1, __m128i a2, __m128i a3, __m128i k01, __m128i k23) {
+        const __m128i round = _mm_set1_epi32(64);
+        const __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a0, a1), k01),
+                                         _mm_madd_epi16(_mm_unpacklo_epi16(a2, a3), k23));
+        const __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a0, a1), k01),
+                                         _mm_madd_epi16(_mm_unpackhi_epi16(a2, a3), k23));
+        const __m128i words = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(lo, round), 7),
+                                              _mm_srai_epi32(_mm_add_epi32(hi, round), 7));
+        return _mm_packus_epi16(words, words);
+    }
+
+    static __m128i load8(const unsigned char *in) {
+        return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)in), _mm_setzero_si128());
+    }
+#endif
+
+    // out[x] = CF(k0*r0[x] + k1*r1[x] + k2*r2[x] + k3*r3[x])
+    void filterRow(unsigned char *out, const unsigned char *r0, const unsigned char *r1,
+        const unsigned char *r2, const unsigned char *r3, int k0, int k1, int k2, int k3, size_t width)
+    {
+        size_t x = 0;
+#ifdef __SSE2__
+        const __m128i k01 = tapPair(k0, k1);
+        const __m128i k23 = tapPair(k2, k3);
+        for (; x + 8 <= width; x += 8) {
+            const __m128i result = filterCF(load8(r0 + x), load8(r1 + x), load8(r2 + x), load8(r3 + x), k01, k23);
+            _mm_storel_epi64((__m128i *)(out + x), result);
+        }
+#endif
+        for (; x < width; x++)
+            out[x] = CF(k0 * r0[x] + k1 * r1[x] + k2 * r2[x] + k3 * r3[x]);
+    }
+
     // bicubic chroma upsampler
     void upSampleCenteredH(component* c) {
         const size_t xmax = c->width - 3;
         u::vector<unsigned char> out;
         out.resize((c->width * c->height) << 1);
-        unsigned char *lin = &c->pixels[0];
-        unsigned char *lout = &out[0];
-        for (size_t y = c->height; y; --y) {
-            lout[0] = CF(kCF2A * lin[0] + kCF2B * lin[1]);
-            lout[1] = CF(kCF3X * lin[0] + kCF3Y * lin[1] + kCF3Z * lin[2]);
-            lout[2] = CF(kCF3A * lin[0] + kCF3B * lin[1] + kCF3C * lin[2]);
-            for (size_t x = 0; x < xmax; ++x) {
-                lout[(x << 1) + 3] = CF(kCF4A * lin[x] + kCF4B * lin[x + 1] + kCF4C * lin[x + 2] + kCF4D * lin[x + 3]);
-                lout[(x << 1) + 4] = CF(kCF4D * lin[x] + kCF4C * lin[x + 1] + kCF4B * lin[x + 2] + kCF4A * lin[x + 3]);
+        bands(c->height, [this, c, xmax, &out](size_t first, size_t last) {
+            unsigned char *lin = &c->pixels[first * c->stride];
+            unsigned char *lout = &out[first * (c->width << 1)];
+#ifdef __SSE2__
+            const __m128i k4AB = tapPair(kCF4A, kCF4B);
+            const __m128i k4CD = tapPair(kCF4C, kCF4D);
+            const __m128i k4DC = tapPair(kCF4D, kCF4C);
+            const __m128i k4BA = tapPair(kCF4B, kCF4A);
+#endif
+            for (size_t y = last - first; y; --y) {
+                lout[0] = CF(kCF2A * lin[0] + kCF2B * lin[1]);
+                lout[1] = CF(kCF3X * lin[0] + kCF3Y * lin[1] + kCF3Z * lin[2]);
+                lout[2] = CF(kCF3A * lin[0] + kCF3B * lin[1] + kCF3C * lin[2]);
+                size_t x = 0;
+#ifdef __SSE2__
+                // eight input pixels make sixteen output pixels
+                for (; x + 11 <= c->width; x += 8) {
+                    const __m128i a0 = load8(lin + x);
+                    const __m128i a1 = load8(lin + x + 1);
+                    const __m128i a2 = load8(lin + x + 2);
+                    const __m128i a3 = load8(lin + x + 3);
+                    const __m128i even = filterCF(a0, a1, a2, a3, k4AB, k4CD);
+                    const __m128i odd = filterCF(a0, a1, a2, a3, k4DC, k4BA);
+                    _mm_storeu_si128((__m128i *)&lout[(x << 1) + 3], _mm_unpacklo_epi8(even, odd));
+                }
+#endif
+                for (; x < xmax; ++x) {
+                    lout[(x << 1) + 3] = CF(kCF4A * lin[x] + kCF4B * lin[x + 1] + kCF4C * lin[x + 2] + kCF4D * lin[x + 3]);
+                    lout[(x << 1) + 4] = CF(kCF4D * lin[x] + kCF4C * lin[x + 1] + kCF4B * lin[x + 2] + kCF4A * lin[x + 3]);
+                }
+                lin += c->stride;
+                lout += c->width << 1;
+                lout[-3] = CF(kCF3A * lin[-1] + kCF3B * lin[-2] + kCF3C * lin[-3]);
+                lout[-2] = CF(kCF3X * lin[-1] + kCF3Y * lin[-2] + kCF3Z * lin[-3]);
+                lout[-1] = CF(kCF2A * lin[-1] + kCF2B * lin[-2]);
             }
-            lin += c->stride;
-            lout += c->width << 1;
-            lout[-3] = CF(kCF3A * lin[-1] + kCF3B * lin[-2] + kCF3C * lin[-3]);
-            lout[-2] = CF(kCF3X * lin[-1] + kCF3Y * lin[-2] + kCF3Z * lin[-3]);
-            lout[-1] = CF(kCF2A * lin[-1] + kCF2B * lin[-2]);
-        }
+        });
         c->width <<= 1;
         c->stride = c->width;
         c->pixels = u::move(out);
@@ -704,34 +1031,35 @@ private:
         const size_t w = c->width;
         const size_t s1 = c->stride;
         const size_t s2 = s1 + s1;
+        const size_t s3 = s2 + s1;
 
         u::vector<unsigned char> out;
         out.resize((c->width * c->height) << 1);
 
-        for (size_t x = 0; x < w; ++x) {
-            unsigned char *cin = &c->pixels[x];
-            unsigned char *cout = &out[x];
-            *cout = CF(kCF2A * cin[0] + kCF2B * cin[s1]);
-            cout += w;
-            *cout = CF(kCF3X * cin[0] + kCF3Y * cin[s1] + kCF3Z * cin[s2]);
-            cout += w;
-            *cout = CF(kCF3A * cin[0] + kCF3B * cin[s1] + kCF3C * cin[s2]);
-            cout += w;
-            cin += s1;
-            for (size_t y = c->height - 3; y; --y) {
-                *cout = CF(kCF4A * cin[-s1] + kCF4B * cin[0] + kCF4C * cin[s1] + kCF4D * cin[s2]);
-                cout += w;
-                *cout = CF(kCF4D * cin[-s1] + kCF4C * cin[0] + kCF4B * cin[s1] + kCF4A * cin[s2]);
-                cout += w;
-                cin += s1;
+        // a row at a time, unused taps have a weight of zero
+        const unsigned char *cin = &c->pixels[0];
+        unsigned char *cout = &out[0];
+        filterRow(cout, cin, cin + s1, cin, cin, kCF2A, kCF2B, 0, 0, w);
+        cout += w;
+        filterRow(cout, cin, cin + s1, cin + s2, cin, kCF3X, kCF3Y, kCF3Z, 0, w);
+        cout += w;
+        filterRow(cout, cin, cin + s1, cin + s2, cin, kCF3A, kCF3B, kCF3C, 0, w);
+        cout += w;
+        bands(c->height - 3, [this, cin, cout, w, s1, s2, s3](size_t first, size_t last) {
+            for (size_t y = first; y < last; y++) {
+                const unsigned char *row = cin + y * s1;
+                unsigned char *rowOut = cout + (y << 1) * w;
+                filterRow(rowOut, row, row + s1, row + s2, row + s3, kCF4A, kCF4B, kCF4C, kCF4D, w);
+                filterRow(rowOut + w, row, row + s1, row + s2, row + s3, kCF4D, kCF4C, kCF4B, kCF4A, w);
             }
-            cin += s1;
-            *cout = CF(kCF3A * cin[0] + kCF3B * cin[-s1] + kCF3C * cin[-s2]);
-            cout += w;
-            *cout = CF(kCF3X * cin[0] + kCF3Y * cin[-s1] + kCF3Z * cin[-s2]);
-            cout += w;
-            *cout = CF(kCF2A * cin[0] + kCF2B * cin[-s1]);
-        }
+        });
+        cout += ((c->height - 3) << 1) * w;
+        cin += (c->height - 1) * s1;
+        filterRow(cout, cin, cin - s1, cin - s2, cin, kCF3A, kCF3B, kCF3C, 0, w);
+        cout += w;
+        filterRow(cout, cin, cin - s1, cin - s2, cin, kCF3X, kCF3Y, kCF3Z, 0, w);
+        cout += w;
+        filterRow(cout, cin, cin - s1, cin, cin, kCF2A, kCF2B, 0, 0, w);
 
         c->height <<= 1;
         c->stride = c->width;
@@ -743,23 +1071,24 @@ private:
         u::vector<unsigned char> out;
         out.resize((c->width * c->height) << 1);
 
-        unsigned char *lin = &c->pixels[0];
-        unsigned char *lout = &out[0];
-
-        for (size_t y = c->height; y; --y) {
-            lout[0] = lin[0];
-            lout[1] = SF((lin[0] << 3) + 9 * lin[1] - lin[2]);
-            lout[2] = lin[1];
-            for (size_t x = 2; x < xmax; ++x) {
-                lout[(x << 1) - 1] = SF(9 * (lin[x - 1] + lin[x]) - (lin[x - 2] + lin[x + 1]));
-                lout[x << 1] = lin[x];
+        bands(c->height, [this, c, xmax, &out](size_t first, size_t last) {
+            unsigned char *lin = &c->pixels[first * c->stride];
+            unsigned char *lout = &out[first * (c->width << 1)];
+            for (size_t y = last - first; y; --y) {
+                lout[0] = lin[0];
+                lout[1] = SF((lin[0] << 3) + 9 * lin[1] - lin[2]);
+                lout[2] = lin[1];
+                for (size_t x = 2; x < xmax; ++x) {
+                    lout[(x << 1) - 1] = SF(9 * (lin[x - 1] + lin[x]) - (lin[x - 2] + lin[x + 1]));
+                    lout[x << 1] = lin[x];
+                }
+                lin += c->stride;
+                lout += c->width << 1;
+                lout[-3] = SF((lin[-1] << 3) + 9 * lin[-2] - lin[-3]);
+                lout[-2] = lin[-1];
+                lout[-1] = SF(17 * lin[-1] - lin[-2]);
             }
-            lin += c->stride;
-            lout += c->width << 1;
-            lout[-3] = SF((lin[-1] << 3) + 9 * lin[-2] - lin[-3]);
-            lout[-2] = lin[-1];
-            lout[-1] = SF(17 * lin[-1] - lin[-2]);
-        }
+        });
         c->width <<= 1;
         c->stride = c->width;
         c->pixels = u::move(out);
@@ -773,27 +1102,29 @@ private:
         u::vector<unsigned char> out;
         out.resize((c->width * c->height) << 1);
 
-        for (size_t x = 0; x < w; ++x) {
-            unsigned char *cin = &c->pixels[x];
-            unsigned char *cout = &out[x];
-            *cout = cin[0];
-            cout += w;
-            *cout = SF((cin[0] << 3) + 9 * cin[s1] - cin[s2]);
-            cout += w;
-            *cout = cin[s1];
-            cout += w;
-            cin += s1;
-            for (size_t y = c->height - 3; y; --y) {
-                *cout = SF(9 * (cin[0] + cin[s1]) - (cin[-s1] + cin[s2]));
+        bands(w, [this, c, w, s1, s2, &out](size_t first, size_t last) {
+            for (size_t x = first; x < last; ++x) {
+                unsigned char *cin = &c->pixels[x];
+                unsigned char *cout = &out[x];
+                *cout = cin[0];
+                cout += w;
+                *cout = SF((cin[0] << 3) + 9 * cin[s1] - cin[s2]);
+                cout += w;
+                *cout = cin[s1];
                 cout += w;
-                *cout = cin[s1];  cout += w;
                 cin += s1;
+                for (size_t y = c->height - 3; y; --y) {
+                    *cout = SF(9 * (cin[0] + cin[s1]) - (cin[-s1] + cin[s2]));
+                    cout += w;
+                    *cout = cin[s1];  cout += w;
+                    cin += s1;
+                }
+                *cout = SF((cin[s1] << 3) + 9 * cin[0] - cin[-s1]);
+                cout += w;
+                *cout = cin[-s1];  cout += w;
+                *cout = SF(17 * cin[s1] - cin[0]);
             }
-            *cout = SF((cin[s1] << 3) + 9 * cin[0] - cin[-s1]);
-            cout += w;
-            *cout = cin[-s1];  cout += w;
-            *cout = SF(17 * cin[s1] - cin[0]);
-        }
+        });
         c->height <<= 1;
         c->stride = c->width;
         c->pixels = u::move(out);
@@ -810,18 +1141,62 @@ private:
         u::vector<unsigned char> out;
         out.resize(c->width * c->height);
 
-        unsigned char *lout = &out[0];
-        for (size_t y = 0; y < c->height; ++y) {
-            const unsigned char *lin = &c->pixels[(y >> yshift) * c->stride];
-            for (size_t x = 0; x < c->width; ++x)
-                lout[x] = lin[x >> xshift];
-            lout += c->width;
-        }
+        bands(c->height, [c, xshift, yshift, &out](size_t first, size_t last) {
+            unsigned char *lout = &out[first * c->width];
+            for (size_t y = first; y < last; ++y) {
+                const unsigned char *lin = &c->pixels[(y >> yshift) * c->stride];
+                for (size_t x = 0; x < c->width; ++x)
+                    lout[x] = lin[x >> xshift];
+                lout += c->width;
+            }
+        });
 
         c->stride = c->width;
         c->pixels = u::move(out);
     }
 
+#ifdef __SSE2__
+    // YCbCr to RGB24 eight pixels at a time, returns how many were converted
+    size_t convertRow(unsigned char *rgb, const unsigned char *py, const unsigned char *pcb,
+        const unsigned char *pcr, size_t width)
+    {
+        const __m128i bias = _mm_set1_epi16(128);
+        const __m128i round = _mm_set1_epi32(128);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i kR = tapPair(256, 359); // y, cr
+        const __m128i kG = tapPair(256, -88); // y, cb
+        const __m128i kGCr = tapPair(-183, 0); // cr, 0
+        const __m128i kB = tapPair(256, 454); // y, cb
+        size_t x = 0;
+        for (; x + 8 <= width; x += 8) {
+            const __m128i y = load8(py + x);
+            const __m128i cb = _mm_sub_epi16(load8(pcb + x), bias);
+            const __m128i cr = _mm_sub_epi16(load8(pcr + x), bias);
+            __m128i channel[3][2];
+            for (size_t h = 0; h < 2; h++) {
+                const __m128i ycb = h ? _mm_unpackhi_epi16(y, cb) : _mm_unpacklo_epi16(y, cb);
+                const __m128i ycr = h ? _mm_unpackhi_epi16(y, cr) : _mm_unpacklo_epi16(y, cr);
+                const __m128i cr0 = h ? _mm_unpackhi_epi16(cr, zero) : _mm_unpacklo_epi16(cr, zero);
+                channel[0][h] = _mm_add_epi32(_mm_madd_epi16(ycr, kR), round);
+                channel[1][h] = _mm_add_epi32(_mm_add_epi32(_mm_madd_epi16(ycb, kG), _mm_madd_epi16(cr0, kGCr)), round);
+                channel[2][h] = _mm_add_epi32(_mm_madd_epi16(ycb, kB), round);
+            }
+            alignas(16) unsigned char bytes[3][16];
+            for (size_t i = 0; i < 3; i++) {
+                const __m128i words = _mm_packs_epi32(_mm_srai_epi32(channel[i][0], 8),
+                                                      _mm_srai_epi32(channel[i][1], 8));
+                _mm_store_si128((__m128i *)bytes[i], _mm_packus_epi16(words, words));
+            }
+            for (size_t i = 0; i < 8; i++) {
+                *rgb++ = bytes[0][i];
+                *rgb++ = bytes[1][i];
+                *rgb++ = bytes[2][i];
+            }
+        }
+        return x;
+    }
+#endif
+
     void convert(chromaFilter filter) {
         size_t i;
         component* c;
@@ -856,23 +1231,30 @@ private:
         }
         if (m_bpp == 3) {
             // convert to RGB24
-            unsigned char *prgb = &m_rgb[0];
-            const unsigned char *py  = &m_comp[0].pixels[0];
-            const unsigned char *pcb = &m_comp[1].pixels[0];
-            const unsigned char *pcr = &m_comp[2].pixels[0];
-            for (size_t yy = m_height; yy; --yy) {
-                for (size_t x = 0; x < m_width; ++x) {
-                    int y = py[x] << 8;
-                    int cb = pcb[x] - 128;
-                    int cr = pcr[x] - 128;
-                    *prgb++ = clip((y            + 359 * cr + 128) >> 8);
-                    *prgb++ = clip((y -  88 * cb - 183 * cr + 128) >> 8);
-                    *prgb++ = clip((y + 454 * cb            + 128) >> 8);
+            bands(m_height, [this](size_t first, size_t last) {
+                unsigned char *prgb = &m_rgb[first * m_width * 3];
+                const unsigned char *py  = &m_comp[0].pixels[first * m_comp[0].stride];
+                const unsigned char *pcb = &m_comp[1].pixels[first * m_comp[1].stride];
+                const unsigned char *pcr = &m_comp[2].pixels[first * m_comp[2].stride];
+                for (size_t yy = last - first; yy; --yy) {
+                    size_t x = 0;
+#ifdef __SSE2__
+                    x = convertRow(prgb, py, pcb, pcr, m_width);
+                    prgb += x * 3;
+#endif
+                    for (; x < m_width; ++x) {
+                        int y = py[x] << 8;
+                        int cb = pcb[x] - 128;
+                        int cr = pcr[x] - 128;
+                        *prgb++ = clip((y            + 359 * cr + 128) >> 8);
+                        *prgb++ = clip((y -  88 * cb - 183 * cr + 128) >> 8);
+                        *prgb++ = clip((y + 454 * cb            + 128) >> 8);
+                    }
+                    py += m_comp[0].stride;
+                    pcb += m_comp[1].stride;
+                    pcr += m_comp[2].stride;
                 }
-                py += m_comp[0].stride;
-                pcb += m_comp[1].stride;
-                pcr += m_comp[2].stride;
-            }
+            });
         } else if (m_comp[0].width != m_comp[0].stride) {
             // grayscale -> only remove stride
             unsigned char *pin = &m_comp[0].pixels[0] + m_comp[0].stride;
@@ -952,11 +1334,9 @@ private:
     int m_mbheight;
     int m_mbsizex;
     int m_mbsizey;
-    int m_buf;
-    int m_bufbits;
-    int m_block[64];
     bool m_exifLittleEndian;
     bool m_coSitedChroma;
+    bool m_parallel;
     static const unsigned char m_zz[64];
 };
 
@@ -1024,9 +1404,33 @@ private:
         if (m_error)
             return;
 
+        const size_t bpp = calculateBitsPerPixel();
+        m_bpp = bpp / 8;
+
+        const size_t linelength = (m_width * bpp + 7) / 8;
+        const size_t outlength = (m_height * m_width * bpp + 7) / 8;
+
+        out.resize(outlength);
+        unsigned char* out_ = outlength ? &out[0] : 0;
+
+        // IDAT chunks are inflated as they're found instead of being concatenated.
+        // Without interlacing every scanline is unfiltered as soon as it has been
+        // inflated, so only the current one and the previous reconstructed one
+        // are kept around. The adam7 passes are inflated whole instead.
+        const bool interlaced = m_interlaceMethod != 0;
+        u::vector<unsigned char> scanlines(interlaced
+            ? ((m_width * (m_height * bpp + 7)) / 8) + m_height
+            : 1 + linelength);
+        unfilterState state;
+        if (!interlaced && bpp < 8) {
+            state.lines[0].resize(linelength);
+            state.lines[1].resize(linelength);
+        }
+        u::zlib::inflateStream stream;
+        size_t inflated = 0;
+
         bool IEND = false;
         size_t pos = 33;
-        u::vector<unsigned char> idat;
 
         while (!IEND) {
             if (pos + 8 >= invec.size())
@@ -1041,7 +1445,29 @@ private:
 
             pos += 4;
             if (!memcmp(in + pos, "IDAT", 4)) {
-                idat.insert(idat.end(), &in[pos + 4], &in[pos + 4 + chunkLength]);
+                stream.input(&in[pos + 4], chunkLength);
+                for (bool more = !stream.finished(); more; ) {
+                    size_t written;
+                    const auto status = stream.inflate(&scanlines[inflated],
+                        scanlines.size() - inflated, &written);
+                    inflated += written;
+                    if (status == u::zlib::inflateStream::kError)
+                        returnResult(kMalformatted);
+                    if (!interlaced && inflated == scanlines.size()) {
+                        // anything after the last scanline is ignored
+                        if (state.y < m_height)
+                            unfilterRow(out_, &scanlines[0], &state, bpp);
+                        if (m_error)
+                            return;
+                        inflated = 0;
+                    }
+                    if (status == u::zlib::inflateStream::kNeedOutput) {
+                        if (interlaced)
+                            scanlines.resize(scanlines.size() * 2);
+                    } else {
+                        more = false;
+                    }
+                }
                 pos += (4 + chunkLength);
             } else if (!memcmp(in + pos, "IEND", 4)) {
                 pos += 4;
@@ -1094,48 +1520,15 @@ private:
             pos += 4; // step over CRC
         }
 
-        const size_t bpp = calculateBitsPerPixel();
-        m_bpp = bpp / 8;
-        u::vector<unsigned char> scanlines(((m_width * (m_height * bpp + 7)) / 8) + m_height);
-        if (!u::zlib::decompress(scanlines, idat))
+        if (!stream.finished())
             returnResult(kMalformatted);
 
-        const size_t bytewidth = (bpp + 7) / 8;
-        const size_t outlength = (m_height * m_width * bpp + 7) / 8;
-
-        out.resize(outlength);
-        unsigned char* out_ = outlength ? &out[0] : 0;
-
-        // no interlace, just filter
-        if (m_interlaceMethod == 0) {
-            size_t linestart = 0;
-            const size_t linelength = (m_width * bpp + 7) / 8;
-            if (bpp >= 8) {
-                for (size_t y = 0; y < m_height; y++) {
-                    const size_t filterType = scanlines[linestart];
-                    const unsigned char *prevline = (y == 0)
-                        ? 0 : &out_[(y - 1) * m_width * bytewidth];
-                    unfilterScanline(&out_[linestart - y], &scanlines[linestart + 1],
-                        prevline, bytewidth, filterType, linelength);
-                    if (m_error)
-                        return;
-                    linestart += (1 + linelength);
-                }
-            } else {
-                u::vector<unsigned char> templine((m_width * bpp + 7) >> 3);
-                for (size_t y = 0, obp = 0; y < m_height; y++) {
-                    const size_t filterType = scanlines[linestart];
-                    const unsigned char* prevline = (y == 0) ? 0 : &out_[(y - 1) * m_width * bytewidth];
-                    unfilterScanline(&templine[0], &scanlines[linestart + 1],
-                        prevline, bytewidth, filterType, linelength);
-                    if (m_error)
-                        return;
-                    for (size_t bp = 0; bp < m_width * bpp;)
-                        setBitReversed(obp, out_, readBitReverse(bp, &templine[0]));
-                    linestart += (1 + linelength);
-                }
-            }
+        if (!interlaced) {
+            if (state.y != m_height)
+                returnResult(kMalformatted);
         } else {
+            scanlines.resize(inflated);
+
             // adam7 interlaced
             size_t passw[7] = {
                 (m_width + 7) / 8, (m_width + 3) / 8,
@@ -1225,9 +1618,156 @@ private:
         m_error = validateColor(m_colorType, m_bitDepth);
     }
 
+    struct unfilterState {
+        unfilterState()
+            : y(0)
+            , obp(0)
+        {
+        }
+
+        size_t y; // next row
+        size_t obp; // output bit position for bit depths under 8
+        u::vector<unsigned char> lines[2]; // current and previous row under 8 bits
+    };
+
+    // Reconstruct the next row of a non-interlaced image from its scanline
+    void unfilterRow(unsigned char *out, const unsigned char *scanline, unfilterState *state, size_t bpp) {
+        const size_t bytewidth = (bpp + 7) / 8;
+        const size_t linelength = (m_width * bpp + 7) / 8;
+        const size_t y = state->y++;
+        const size_t filterType = scanline[0];
+        if (bpp >= 8) {
+            unsigned char *recon = &out[y * linelength];
+            const unsigned char *prevline = y ? recon - linelength : nullptr;
+            unfilterScanline(recon, scanline + 1, prevline, bytewidth, filterType, linelength);
+            return;
+        }
+        // bit packed rows are reconstructed aside and then appended
+        u::vector<unsigned char> &recon = state->lines[y & 1];
+        const unsigned char *prevline = y ? &state->lines[(y - 1) & 1][0] : nullptr;
+        unfilterScanline(&recon[0], scanline + 1, prevline, bytewidth, filterType, linelength);
+        if (m_error)
+            return;
+        for (size_t bp = 0; bp < m_width * bpp;)
+            setBitReversed(state->obp, out, readBitReverse(bp, &recon[0]));
+    }
+
+#ifdef __SSE2__
+    // Pixels of three and four bytes live in the low lanes of a register.
+    // The Sub, Average and Paeth filters depend on the previous pixel of the
+    // same row so they are done a pixel at a time, which still does all the
+    // bytes of a pixel at once.
+    template <size_t N>
+    static __m128i loadPixel(const unsigned char *p) {
+        uint32_t value = 0;
+        memcpy(&value, p, N);
+        return _mm_cvtsi32_si128(value);
+    }
+
+    template <size_t N>
+    static void storePixel(unsigned char *p, __m128i v) {
+        const uint32_t value = _mm_cvtsi128_si32(v);
+        memcpy(p, &value, N);
+    }
+
+    template <size_t N>
+    static void unfilterSub(unsigned char *recon, const unsigned char *scanline, size_t length) {
+        __m128i a = _mm_setzero_si128();
+        for (size_t i = 0; i < length; i += N) {
+            a = _mm_add_epi8(a, loadPixel<N>(scanline + i));
+            storePixel<N>(recon + i, a);
+        }
+    }
+
+    template <size_t N>
+    static void unfilterAverage(unsigned char *recon, const unsigned char *scanline,
+        const unsigned char *precon, size_t length)
+    {
+        const __m128i one = _mm_set1_epi8(1);
+        __m128i a = _mm_setzero_si128();
+        for (size_t i = 0; i < length; i += N) {
+            const __m128i b = loadPixel<N>(precon + i);
+            // pavgb rounds up, take the carry back out
+            const __m128i average = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            a = _mm_add_epi8(average, loadPixel<N>(scanline + i));
+            storePixel<N>(recon + i, a);
+        }
+    }
+
+    static __m128i absolute16(__m128i x) {
+        return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+    }
+
+    static __m128i selectBits(__m128i mask, __m128i a, __m128i b) {
+        return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+    }
+
+    template <size_t N>
+    static void unfilterPaeth(unsigned char *recon, const unsigned char *scanline,
+        const unsigned char *precon, size_t length)
+    {
+        // a: left, b: up, c: up left, all widened to 16 bits
+        const __m128i zero = _mm_setzero_si128();
+        __m128i a = zero;
+        __m128i c = zero;
+        for (size_t i = 0; i < length; i += N) {
+            const __m128i b = _mm_unpacklo_epi8(loadPixel<N>(precon + i), zero);
+            const __m128i pa = _mm_sub_epi16(b, c); // p - a
+            const __m128i pb = _mm_sub_epi16(a, c); // p - b
+            const __m128i pc = absolute16(_mm_add_epi16(pa, pb)); // p - c
+            const __m128i absa = absolute16(pa);
+            const __m128i absb = absolute16(pb);
+            const __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(absa, absb));
+            const __m128i predictor = selectBits(_mm_cmpeq_epi16(smallest, absa), a,
+                                             selectBits(_mm_cmpeq_epi16(smallest, absb), b, c));
+            const __m128i value = _mm_add_epi8(_mm_packus_epi16(predictor, predictor), loadPixel<N>(scanline + i));
+            storePixel<N>(recon + i, value);
+            a = _mm_unpacklo_epi8(value, zero);
+            c = b;
+        }
+    }
+
+    // Returns false for the cases left to the scalar code
+    static bool unfilterScanlineSSE2(unsigned char* recon, const unsigned char* scanline,
+        const unsigned char* precon, size_t bytewidth, size_t filterType, size_t length)
+    {
+        if (!precon || filterType == 0 || filterType > 4)
+            return false;
+        if (filterType == 2) {
+            size_t i = 0;
+            for (; i + 16 <= length; i += 16) {
+                const __m128i up = _mm_loadu_si128((const __m128i *)(precon + i));
+                const __m128i value = _mm_loadu_si128((const __m128i *)(scanline + i));
+                _mm_storeu_si128((__m128i *)(recon + i), _mm_add_epi8(value, up));
+            }
+            for (; i < length; i++)
+                recon[i] = scanline[i] + precon[i];
+            return true;
+        }
+        // the scalar Sub and Average loops are as fast for three byte pixels
+        if (bytewidth == 3 && filterType == 4) {
+            unfilterPaeth<3>(recon, scanline, precon, length);
+            return true;
+        }
+        if (bytewidth == 4) {
+            switch (filterType) {
+            case 1: unfilterSub<4>(recon, scanline, length); break;
+            case 3: unfilterAverage<4>(recon, scanline, precon, length); break;
+            case 4: unfilterPaeth<4>(recon, scanline, precon, length); break;
+            }
+            return true;
+        }
+        return false;
+    }
+#endif
+
     void unfilterScanline(unsigned char* recon, const unsigned char* scanline,
         const unsigned char* precon, size_t bytewidth, size_t filterType, size_t length)
     {
+#ifdef __SSE2__
+        if (unfilterScanlineSSE2(recon, scanline, precon, bytewidth, filterType, length))
+            return;
+#endif
         switch (filterType) {
         case 0:
             for (size_t i = 0; i < length; i++)
@@ -1764,119 +2304,470 @@ private:
 
 ///
 /// Texture utilities:
-///   halve (useful for generating mipmaps), shift, scale and reorient.
+///   resample (scaling and mipmaps) and reorient.
 ///
 
-template <size_t S>
-void texture::halve(unsigned char *src, size_t sw, size_t sh, size_t stride, unsigned char *dst) {
-    for (unsigned char *yend = src + sh * stride; src < yend;) {
-        for (unsigned char *xend = src + sw * S, *xsrc = src; xsrc < xend; xsrc += 2 * S, dst += S) {
-            for (size_t i = 0; i < S; i++)
-                dst[i] = (size_t(xsrc[i]) + size_t(xsrc[i+S]) + size_t(xsrc[stride+i]) + size_t(xsrc[stride+i+S])) >> 2;
+// sRGB to linear light on a 16-bit scale
+static constexpr uint16_t kSRGBToLinear[256] = {
+        0,    20,    40,    60,    80,    99,   119,   139,   159,   179,   199,   219,
+      241,   264,   288,   313,   340,   367,   396,   427,   458,   491,   526,   562,
+      599,   637,   677,   718,   761,   805,   851,   898,   947,   997,  1048,  1101,
+     1156,  1212,  1270,  1330,  1391,  1453,  1517,  1583,  1651,  1720,  1790,  1863,
+     1937,  2013,  2090,  2170,  2250,  2333,  2418,  2504,  2592,  2681,  2773,  2866,
+     2961,  3058,  3157,  3258,  3360,  3464,  3570,  3678,  3788,  3900,  4014,  4129,
+     4247,  4366,  4488,  4611,  4736,  4864,  4993,  5124,  5257,  5392,  5530,  5669,
+     5810,  5953,  6099,  6246,  6395,  6547,  6700,  6856,  7014,  7174,  7335,  7500,
+     7666,  7834,  8004,  8177,  8352,  8528,  8708,  8889,  9072,  9258,  9445,  9635,
+     9828, 10022, 10219, 10417, 10619, 10822, 11028, 11235, 11446, 11658, 11873, 12090,
+    12309, 12530, 12754, 12980, 13209, 13440, 13673, 13909, 14146, 14387, 14629, 14874,
+    15122, 15371, 15623, 15878, 16135, 16394, 16656, 16920, 17187, 17456, 17727, 18001,
+    18277, 18556, 18837, 19121, 19407, 19696, 19987, 20281, 20577, 20876, 21177, 21481,
+    21787, 22096, 22407, 22721, 23038, 23357, 23678, 24002, 24329, 24658, 24990, 25325,
+    25662, 26001, 26344, 26688, 27036, 27386, 27739, 28094, 28452, 28813, 29176, 29542,
+    29911, 30282, 30656, 31033, 31412, 31794, 32179, 32567, 32957, 33350, 33745, 34143,
+    34544, 34948, 35355, 35764, 36176, 36591, 37008, 37429, 37852, 38278, 38706, 39138,
+    39572, 40009, 40449, 40891, 41337, 41785, 42236, 42690, 43147, 43606, 44069, 44534,
+    45002, 45473, 45947, 46423, 46903, 47385, 47871, 48359, 48850, 49344, 49841, 50341,
+    50844, 51349, 51858, 52369, 52884, 53401, 53921, 54445, 54971, 55500, 56032, 56567,
+    57105, 57646, 58190, 58737, 59287, 59840, 60396, 60955, 61517, 62082, 62650, 63221,
+    63795, 64372, 64952, 65535
+};
+
+// The nearest sRGB value to the sum of four kSRGBToLinear entries. The
+// decision points are the midpoints between neighbouring entries.
+static unsigned char searchSRGB(uint32_t sum) {
+    size_t lo = 0;
+    size_t hi = 255;
+    while (lo < hi) {
+        const size_t mid = (lo + hi) >> 1;
+        if (sum >= 2 * (uint32_t(kSRGBToLinear[mid]) + kSRGBToLinear[mid + 1]))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static struct srgbTables {
+    srgbTables() {
+        for (size_t i = 0; i < 256; i++)
+            decode[i] = kSRGBToLinear[i];
+        for (size_t i = 0; i < 255; i++)
+            midpoint[i] = 2 * (uint32_t(kSRGBToLinear[i]) + kSRGBToLinear[i + 1]);
+        midpoint[255] = 0xFFFFFFFFu;
+        for (size_t i = 0; i < 4096; i++)
+            encode[i] = searchSRGB(i << 6);
+    }
+    float decode[256]; // kSRGBToLinear as floats
+    uint32_t midpoint[256]; // decision points of searchSRGB
+    unsigned char encode[4096]; // searchSRGB of every multiple of 64
+} gSRGB;
+
+// searchSRGB without the search. Neighbouring entries of kSRGBToLinear are
+// further apart than a step of the table so at most one decision point lies
+// between a sum and the step below it
+static inline unsigned char linearToSRGB(uint32_t sum) {
+    sum = u::min(sum, uint32_t(4 * 65535));
+    const unsigned char value = gSRGB.encode[sum >> 6];
+    return value + (sum >= gSRGB.midpoint[value]);
+}
+
+// Source pixels and weights of every destination pixel along one axis. Each
+// destination pixel has `taps' weights starting at first[pixel], unused ones
+// are zero so the filter loops never depend on the pixel. Taps which fall off
+// the image are folded onto the edge.
+struct resampleAxis {
+    resampleAxis(size_t source, size_t destination, resizeFilter filter);
+    u::vector<size_t> first;
+    u::vector<float> weights;
+    size_t taps;
+
+private:
+    static float evaluate(resizeFilter filter, float x, float scale);
+};
+
+inline float resampleAxis::evaluate(resizeFilter filter, float x, float scale) {
+    switch (filter) {
+    case kResizeBox:
+        // Coverage of the source pixel by the destination pixel footprint
+        return u::max(0.0f, u::min(x + 0.5f, scale * 0.5f) - u::max(x - 0.5f, scale * -0.5f));
+    case kResizeBilinear:
+        return u::max(0.0f, 1.0f - m::abs(x) / scale);
+    case kResizeLanczos:
+        x /= scale;
+        if (m::abs(x) < m::kEpsilon)
+            return 1.0f;
+        if (m::abs(x) >= 3.0f)
+            return 0.0f;
+        return 3.0f * m::sin(m::kPi * x) * m::sin(m::kPi * x / 3.0f) / (m::kPi * m::kPi * x * x);
+    }
+    return 0.0f;
+}
+
+resampleAxis::resampleAxis(size_t source, size_t destination, resizeFilter filter)
+    : first(destination)
+{
+    // Filters widen by the scale factor when shrinking so every source pixel
+    // contributes; the box footprint is the destination pixel itself
+    const float ratio = float(source) / float(destination);
+    const float scale = filter == kResizeBox ? ratio : u::max(ratio, 1.0f);
+    const float radius = filter == kResizeBox ? scale * 0.5f + 0.5f
+                       : filter == kResizeBilinear ? scale : scale * 3.0f;
+    taps = u::min(size_t(m::ceil(radius * 2.0f)) + 1, source);
+    weights.resize(destination * taps, 0.0f);
+
+    const int last = int(source) - 1;
+    for (size_t i = 0; i < destination; i++) {
+        const float center = (i + 0.5f) * ratio - 0.5f;
+        const int lo = int(m::floor(center - radius));
+        first[i] = m::clamp(lo, 0, int(source - taps));
+        float *weight = &weights[i * taps];
+        float total = 0.0f;
+        for (int j = lo; j <= int(m::ceil(center + radius)); j++) {
+            const float w = evaluate(filter, j - center, scale);
+            if (w == 0.0f)
+                continue;
+            weight[m::clamp(j, 0, last) - first[i]] += w;
+            total += w;
+        }
+        if (total > 0.0f) {
+            for (size_t j = 0; j < taps; j++)
+                weight[j] /= total;
+        } else {
+            weight[m::clamp(int(center + 0.5f), 0, last) - first[i]] = 1.0f;
         }
-        src += 2 * stride;
     }
 }
 
+// Filters source rows `rows' with `weights' into `sum'. Channels below `srgb'
+// are taken to linear light on a 16-bit scale, the rest stay on their 8-bit
+// scale.
+static void resampleColumn(const unsigned char *const *rows, const float *weights,
+    size_t taps, size_t width, size_t bpp, size_t srgb, float *sum)
+{
+    const size_t count = width * bpp;
+    if (srgb) {
+        for (size_t i = 0; i < count; i++)
+            sum[i] = 0.0f;
+        for (size_t t = 0; t < taps; t++) {
+            const unsigned char *const row = rows[t];
+            const float weight = weights[t];
+            for (size_t i = 0; i < count; i += bpp) {
+                for (size_t k = 0; k < srgb; k++)
+                    sum[i+k] += weight * gSRGB.decode[row[i+k]];
+                for (size_t k = srgb; k < bpp; k++)
+                    sum[i+k] += weight * row[i+k];
+            }
+        }
+        return;
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    // Sixteen channels at a time with no regard for where pixels start
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128 a0 = _mm_setzero_ps();
+        __m128 a1 = _mm_setzero_ps();
+        __m128 a2 = _mm_setzero_ps();
+        __m128 a3 = _mm_setzero_ps();
+        for (size_t t = 0; t < taps; t++) {
+            const __m128 w = _mm_set1_ps(weights[t]);
+            const __m128i bytes = _mm_loadu_si128((const __m128i *)(rows[t] + i));
+            const __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+            const __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+            a0 = _mm_add_ps(a0, _mm_mul_ps(w, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero))));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(w, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero))));
+            a2 = _mm_add_ps(a2, _mm_mul_ps(w, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero))));
+            a3 = _mm_add_ps(a3, _mm_mul_ps(w, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero))));
+        }
+        _mm_storeu_ps(sum + i, a0);
+        _mm_storeu_ps(sum + i + 4, a1);
+        _mm_storeu_ps(sum + i + 8, a2);
+        _mm_storeu_ps(sum + i + 12, a3);
+    }
+#endif
+    for (; i < count; i++) {
+        float value = 0.0f;
+        for (size_t t = 0; t < taps; t++)
+            value += weights[t] * rows[t][i];
+        sum[i] = value;
+    }
+}
+
+// Filters the output of resampleColumn along the row into `dst'. `sum' must
+// have room for one channel past the end of the row
 template <size_t S>
-void texture::shift(unsigned char *src, size_t sw, size_t sh, size_t stride, unsigned char *dst, size_t dw, size_t dh) {
-    size_t wfrac = sw/dw, hfrac = sh/dh, wshift = 0, hshift = 0;
-    while (dw << wshift < sw) wshift++;
-    while (dh << hshift < sh) hshift++;
-    size_t tshift = wshift + hshift;
-    for (unsigned char *yend = src + sh * stride; src < yend; ) {
-        for (unsigned char *xend = src + sw * S, *xsrc = src; xsrc < xend; xsrc += wfrac * S, dst += S) {
-            size_t r[S] = {0};
-            for (unsigned char *ycur = xsrc, *xend = ycur + wfrac * S,
-                    *yend = src + hfrac * stride; ycur<yend; ycur += stride, xend += stride) {
-                for (unsigned char *xcur = ycur; xcur < xend; xcur += S) {
-                    for (size_t i = 0; i < S; i++)
-                        r[i] += xcur[i];
-                }
+static void resampleRow(const float *sum, const resampleAxis &axis, size_t width,
+    size_t srgb, unsigned char *dst)
+{
+    const size_t taps = axis.taps;
+    const size_t *const first = &axis.first[0];
+    for (size_t x = 0; x < width; x++, dst += S) {
+        const float *const weights = &axis.weights[x * taps];
+        const float *const src = sum + first[x] * S;
+        float value[4];
+#ifdef __SSE2__
+        if (S >= 3) {
+            // One pixel to a register, the fourth lane of three channels is
+            // the next pixel along and ignored
+            __m128 a = _mm_setzero_ps();
+            for (size_t t = 0; t < taps; t++)
+                a = _mm_add_ps(a, _mm_mul_ps(_mm_set1_ps(weights[t]), _mm_loadu_ps(src + t * S)));
+            if (!srgb) {
+                const __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_setzero_si128());
+                const uint32_t packed = _mm_cvtsi128_si32(_mm_packus_epi16(words, words));
+                memcpy(dst, &packed, S);
+                continue;
             }
-            for (size_t i = 0; i < S; i++)
-                dst[i] = (r[i]) >> tshift;
+            _mm_storeu_ps(value, a);
+        } else
+#endif
+        {
+            for (size_t k = 0; k < S; k++) {
+                value[k] = 0.0f;
+                for (size_t t = 0; t < taps; t++)
+                    value[k] += weights[t] * src[t * S + k];
+            }
+        }
+        for (size_t k = 0; k < S; k++) {
+            dst[k] = k < srgb
+                ? linearToSRGB(uint32_t(u::max(value[k] * 4.0f + 0.5f, 0.0f)))
+                : (unsigned char)m::clamp(int(value[k] + 0.5f), 0, 255);
         }
-        src += hfrac*stride;
     }
 }
 
+// Sums every channel of `width' pixels over `rows' rows into `sum'. Channels
+// below `srgb' are summed in linear light on a 16-bit scale
 template <size_t S>
-void texture::scale(unsigned char *src, size_t sw, size_t sh, size_t stride, unsigned char *dst, size_t dw, size_t dh) {
-    size_t wfrac = (sw << 12) / dw;
-    size_t hfrac = (sh << 12) / dh;
-    size_t darea = dw * dh;
-    size_t sarea = sw * sh;
-    int over, under;
-    for (over = 0; (darea >> over) > sarea; over++);
-    for (under = 0; (darea << under) < sarea; under++);
-    size_t cscale = m::clamp(under, over - 12, 12);
-    size_t ascale = m::clamp(12 + under - over, 0, 24);
-    size_t dscale = ascale + 12 - cscale;
-    size_t area = size_t((unsigned long long)darea << ascale) / sarea;
-    dw *= wfrac;
-    dh *= hfrac;
-    for (size_t y = 0; y < dh; y += hfrac) {
-        const size_t yn = y + hfrac - 1;
-        const size_t yi = y >> 12;
-        const size_t h = (yn >> 12) - yi;
-        const size_t ylow = ((yn | (-int(h) >> 24)) & 0xFFFU) + 1 - (y & 0xFFFU);
-        const size_t yhigh = (yn & 0xFFFU) + 1;
-        const unsigned char *ysrc = src + yi * stride;
-        for (size_t x = 0; x < dw; x += wfrac, dst += S) {
-            const size_t xn = x + wfrac - 1;
-            const size_t xi = x >> 12;
-            const size_t w = (xn >> 12) - xi;
-            const size_t xlow = ((w + 0xFFFU) & 0x1000U) - (x & 0xFFFU);
-            const size_t xhigh = (xn & 0xFFFU) + 1;
-            const unsigned char *xsrc = ysrc + xi * S;
-            const unsigned char *xend = xsrc + w * S;
-            size_t r[S] = {0};
-            for (const unsigned char *xcur = xsrc + S; xcur < xend; xcur += S)
-                for (size_t i = 0; i < S; i++)
-                    r[i] += xcur[i];
-            for (size_t i = 0; i < S; i++)
-                r[i] = (ylow * (r[i] + ((xsrc[i] * xlow + xend[i] * xhigh) >> 12))) >> cscale;
-            if (h) {
-                xsrc += stride;
-                xend += stride;
-                for (size_t hcur = h; --hcur; xsrc += stride, xend += stride) {
-                    size_t p[S] = {0};
-                    for (const unsigned char *xcur = xsrc + S; xcur < xend; xcur += S)
-                        for (size_t i = 0; i < S; i++)
-                            p[i] += xcur[i];
-                    for (size_t i = 0; i < S; i++)
-                        r[i] += ((p[i] << 12) + xsrc[i] * xlow + xend[i] * xhigh) >> cscale;
-                }
-                size_t p[S] = {0};
-                for (const unsigned char *xcur = xsrc + S; xcur < xend; xcur += S)
-                    for (size_t i = 0; i < S; i++)
-                        p[i] += xcur[i];
-                for (size_t i = 0; i < S; i++)
-                    r[i] += (yhigh * (p[i] + ((xsrc[i] * xlow + xend[i] * xhigh) >> 12))) >> cscale;
+static void sumBlockRows(const unsigned char *src, size_t pitch, size_t rows,
+    size_t width, size_t srgb, uint32_t *sum)
+{
+    const size_t count = width * S;
+    if (srgb) {
+        for (size_t i = 0; i < count; i++)
+            sum[i] = 0;
+        for (size_t r = 0; r < rows; r++, src += pitch) {
+            for (size_t i = 0; i < count; i += S) {
+                for (size_t k = 0; k < S; k++)
+                    sum[i+k] += k < srgb ? kSRGBToLinear[src[i+k]] : src[i+k];
             }
-            for (size_t i = 0; i < S; i++)
-                dst[i] = (r[i] * area) >> dscale;
+        }
+        return;
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    // Sixteen bit sums do for up to 256 rows
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        for (size_t r = 0; r < rows; r++) {
+            const __m128i bytes = _mm_loadu_si128((const __m128i *)(src + r * pitch + i));
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(bytes, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(bytes, zero));
+        }
+        _mm_storeu_si128((__m128i *)(sum + i), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(sum + i + 4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128((__m128i *)(sum + i + 8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128((__m128i *)(sum + i + 12), _mm_unpackhi_epi16(hi, zero));
+    }
+#endif
+    for (; i < count; i++) {
+        uint32_t value = 0;
+        for (size_t r = 0; r < rows; r++)
+            value += src[r * pitch + i];
+        sum[i] = value;
+    }
+}
+
+// Averages `columns' pixels of the output of sumBlockRows into every pixel of
+// `dst'. The blocks are 1 << shift pixels big
+template <size_t S>
+static void sumBlockColumns(const uint32_t *sum, size_t width, size_t columns,
+    size_t shift, size_t srgb, unsigned char *dst)
+{
+    const uint32_t round = (1u << shift) >> 1;
+    for (size_t x = 0; x < width; x++, dst += S, sum += columns * S) {
+        uint32_t value[S] = { 0 };
+        for (size_t j = 0; j < columns; j++)
+            for (size_t k = 0; k < S; k++)
+                value[k] += sum[j * S + k];
+        for (size_t k = 0; k < S; k++) {
+            if (k >= srgb)
+                dst[k] = (value[k] + round) >> shift;
+            else if (shift > 2)
+                dst[k] = linearToSRGB((value[k] + (round >> 2)) >> (shift - 2));
+            else
+                dst[k] = linearToSRGB(value[k] << (2 - shift));
         }
     }
 }
 
-void texture::scale(unsigned char *src, size_t sw, size_t sh, size_t bpp, size_t pitch, unsigned char *dst, size_t dw, size_t dh) {
-    if (sw == dw * 2 && sh == dh * 2) {
-        switch (bpp) {
-        case 3: return halve<3>(src, sw, sh, pitch, dst);
-        case 4: return halve<4>(src, sw, sh, pitch, dst);
+// Two by two blocks straight from the source rows into `dst', the common case
+// of mipmaps and halving texture quality. Returns the number of destination
+// pixels written, the rest are left to the caller
+template <size_t S>
+static size_t halveBlockRows(const unsigned char *row0, const unsigned char *row1,
+    size_t width, size_t srgb, unsigned char *dst)
+{
+    if (srgb) {
+        for (size_t x = 0; x < width; x++, row0 += 2 * S, row1 += 2 * S, dst += S) {
+            for (size_t k = 0; k < srgb; k++) {
+                dst[k] = linearToSRGB(uint32_t(kSRGBToLinear[row0[k]]) + kSRGBToLinear[row0[k+S]] +
+                    kSRGBToLinear[row1[k]] + kSRGBToLinear[row1[k+S]]);
+            }
+            for (size_t k = srgb; k < S; k++)
+                dst[k] = (uint32_t(row0[k]) + row0[k+S] + row1[k] + row1[k+S] + 2) >> 2;
         }
-    } else if (sw < dw || sh < dh || sw&(sw-1) || sh&(sh-1) || dw&(dw-1) || dh&(dh-1)) {
-        switch (bpp) {
-        case 3: return scale<3>(src, sw, sh, pitch, dst, dw, dh);
-        case 4: return scale<4>(src, sw, sh, pitch, dst, dw, dh);
+        return width;
+    }
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i two = _mm_set1_epi16(2);
+    const size_t count = width * 2 * S;
+    size_t i = 0;
+    if (S == 3) {
+        // Twelve source channels make six destination ones, the loads read
+        // four past those
+        const __m128i low = _mm_set_epi32(0, 0, 0xFFFF, -1);
+        for (; i + 16 <= count; i += 12, dst += 6) {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(row0 + i));
+            const __m128i b = _mm_loadu_si128((const __m128i *)(row1 + i));
+            const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            // The second pair of pixels starts at the seventh word
+            const __m128i next = _mm_or_si128(_mm_srli_si128(lo, 12), _mm_slli_si128(hi, 4));
+            const __m128i first = _mm_add_epi16(lo, _mm_srli_si128(lo, 6));
+            const __m128i second = _mm_add_epi16(next, _mm_srli_si128(next, 6));
+            __m128i sum = _mm_or_si128(_mm_and_si128(first, low), _mm_slli_si128(second, 6));
+            sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+            const __m128i bytes = _mm_packus_epi16(sum, sum);
+            const uint32_t head = _mm_cvtsi128_si32(bytes);
+            const uint16_t tail = _mm_extract_epi16(bytes, 2);
+            memcpy(dst, &head, 4);
+            memcpy(dst + 4, &tail, 2);
+        }
+        return i / 6;
+    }
+    // Sixteen source channels make eight destination ones
+    for (; i + 16 <= count; i += 16, dst += 8) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(row0 + i));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(row1 + i));
+        const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+        const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+        __m128i sum;
+        if (S == 1) {
+            sum = _mm_packs_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones));
+        } else if (S == 2) {
+            // Pixels are dwords, gather the even and odd ones
+            const __m128i l = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+            const __m128i h = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+            sum = _mm_add_epi16(_mm_unpacklo_epi64(l, h), _mm_unpackhi_epi64(l, h));
+        } else {
+            // Pixels are quadwords
+            sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
         }
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        _mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(sum, sum));
+    }
+    return i / (2 * S);
+#else
+    (void)row0;
+    (void)row1;
+    (void)dst;
+    return 0;
+#endif
+}
+
+// One row of fx by fy blocks from `src' into `dst'
+template <size_t S>
+static void sumBlocks(const unsigned char *src, size_t pitch, size_t width, size_t fx,
+    size_t fy, size_t shift, size_t srgb, uint32_t *sum, unsigned char *dst)
+{
+    size_t x = 0;
+    if (fx == 2 && fy == 2)
+        x = halveBlockRows<S>(src, src + pitch, width, srgb, dst);
+    if (x == width)
+        return;
+    src += x * fx * S;
+    dst += x * S;
+    sumBlockRows<S>(src, pitch, fy, (width - x) * fx, srgb, sum);
+    sumBlockColumns<S>(sum, width - x, fx, shift, srgb, dst);
+}
+
+static constexpr size_t kParallelResample = 256 * 256; // smaller images are resampled on the calling thread
+
+// Calls function(first, last) over bands of the dh destination rows, on the
+// worker pool for large images
+template <typename F>
+static void resampleBands(size_t dw, size_t dh, const F &function) {
+    if (u::cpuCount() < 2 || dw * dh < kParallelResample || dh < 2) {
+        function(0, dh);
+        return;
     }
-    switch(bpp) {
-    case 3: return shift<3>(src, sw, sh, pitch, dst, dw, dh);
-    case 4: return shift<4>(src, sw, sh, pitch, dst, dw, dh);
+    const size_t tasks = u::min(dh, u::cpuCount() * 4);
+    u::parallelFor(tasks, [dh, tasks, &function](size_t index) {
+        function(dh * index / tasks, dh * (index + 1) / tasks);
+    });
+}
+
+void texture::resample(const unsigned char *src, size_t sw, size_t sh, size_t bpp,
+    size_t pitch, unsigned char *dst, size_t dw, size_t dh, resizeFilter filter,
+    size_t srgb)
+{
+    assert(bpp >= 1 && bpp <= 4 && srgb <= bpp);
+
+    // Shrinking by powers of two with the box filter, as mipmaps and texture
+    // quality do, is an exact average of blocks of pixels in integers
+    const size_t fx = sw / dw;
+    const size_t fy = sh / dh;
+    if (filter == kResizeBox && fx * dw == sw && fy * dh == sh && !(fx & (fx - 1))
+        && !(fy & (fy - 1)) && fx * fy <= 65536 && (srgb || fy <= 256))
+    {
+        size_t shift = 0;
+        while ((size_t(1) << shift) < fx * fy)
+            shift++;
+        auto band = [src, sw, bpp, pitch, dst, dw, fx, fy, shift, srgb](size_t begin, size_t end) {
+            u::vector<uint32_t> sum(sw * bpp);
+            for (size_t y = begin; y < end; y++) {
+                const unsigned char *const in = src + y * fy * pitch;
+                unsigned char *const out = dst + y * dw * bpp;
+                switch (bpp) {
+                case 1: sumBlocks<1>(in, pitch, dw, fx, fy, shift, srgb, &sum[0], out); break;
+                case 2: sumBlocks<2>(in, pitch, dw, fx, fy, shift, srgb, &sum[0], out); break;
+                case 3: sumBlocks<3>(in, pitch, dw, fx, fy, shift, srgb, &sum[0], out); break;
+                case 4: sumBlocks<4>(in, pitch, dw, fx, fy, shift, srgb, &sum[0], out); break;
+                }
+            }
+        };
+        resampleBands(dw, dh, band);
+        return;
     }
+
+    const resampleAxis columns(sw, dw, filter);
+    const resampleAxis rows(sh, dh, filter);
+
+    // Columns first: they run over whole rows and are vectorized regardless
+    // of the channel count
+    auto band = [src, sw, bpp, pitch, dst, dw, srgb, &columns, &rows](size_t begin, size_t end) {
+        u::vector<float> sum(sw * bpp + 1);
+        u::vector<const unsigned char *> taps(rows.taps);
+        for (size_t y = begin; y < end; y++) {
+            for (size_t t = 0; t < rows.taps; t++)
+                taps[t] = src + (rows.first[y] + t) * pitch;
+            resampleColumn(&taps[0], &rows.weights[y * rows.taps], rows.taps, sw, bpp, srgb, &sum[0]);
+            unsigned char *const out = dst + y * dw * bpp;
+            switch (bpp) {
+            case 1: resampleRow<1>(&sum[0], columns, dw, srgb, out); break;
+            case 2: resampleRow<2>(&sum[0], columns, dw, srgb, out); break;
+            case 3: resampleRow<3>(&sum[0], columns, dw, srgb, out); break;
+            case 4: resampleRow<4>(&sum[0], columns, dw, srgb, out); break;
+            }
+        }
+    };
+    resampleBands(dw, dh, band);
 }
 
 void texture::reorient(unsigned char *src, size_t sw, size_t sh, size_t bpp, size_t stride, unsigned char *dst, bool flipx, bool flipy, bool swapxy) {
@@ -1898,6 +2789,41 @@ void texture::reorient(unsigned char *src, size_t sw, size_t sh, size_t bpp, siz
     }
 }
 
+void texture::generateMipChain() {
+    if (m_mips > 1)
+        return;
+    assert(m_pitch == m_width * m_bpp);
+
+    // Colour is stored in sRGB while normal maps, greyscale data and alpha are
+    // linear
+    const bool linear = (m_flags & (kTexFlagNormal | kTexFlagGrey)) || m_bpp < 3;
+    const size_t srgb = linear ? 0 : 3;
+
+    // Size the whole chain up front so the data only grows once
+    size_t size = m_width * m_height * m_bpp;
+    size_t levels = 1;
+    for (size_t w = m_width, h = m_height; w > 1 || h > 1; levels++) {
+        w = u::max(w >> 1, size_t(1));
+        h = u::max(h >> 1, size_t(1));
+        size += w * h * m_bpp;
+    }
+    m_data.resize(size);
+
+    // Each level is box filtered from the one above; odd sides average three
+    // source pixels into two
+    unsigned char *src = &m_data[0];
+    for (size_t w = m_width, h = m_height; w > 1 || h > 1; ) {
+        unsigned char *dst = src + w * h * m_bpp;
+        const size_t dw = u::max(w >> 1, size_t(1));
+        const size_t dh = u::max(h >> 1, size_t(1));
+        resample(src, w, h, m_bpp, w * m_bpp, dst, dw, dh, kResizeBox, srgb);
+        w = dw;
+        h = dh;
+        src = dst;
+    }
+    m_mips = levels;
+}
+
 template <textureFormat F>
 void texture::convert() {
     if (F == m_format)
@@ -2021,15 +2947,25 @@ bool texture::decode(const u::vector<unsigned char> &data, const char *name, flo
             m_data.destroy();
             m_data.swap(rework);
         }
-
-        // Hash the contents as well to generate a hash string
-        u::sha512 hash(&m_data[0], m_data.size());
-        m_hashString = hash.hex();
     }
     return true;
 }
 
+// Cache keys are the hash of a description of the texture
+static u::string cacheKey(const u::string &description) {
+    u::murmur3 hash((const unsigned char *)description.c_str(), description.size());
+    return hash.hex();
+}
+
 void texture::colorize(uint32_t color) {
+    m_hashString = cacheKey(u::format("%s:%08x", m_hashString, color));
+    if (m_source.empty())
+        colorizePixels(color);
+    else
+        m_colorize = color;
+}
+
+void texture::colorizePixels(uint32_t color) {
     const uint8_t alpha = color & 0xFF;
     auto blend = [&alpha](uint32_t a, uint32_t b) {
         const uint32_t rb1 = ((0x100 - alpha) * (a & 0xFF00FF)) >> 8;
@@ -2063,10 +2999,6 @@ void texture::colorize(uint32_t color) {
         *G = (RGB >> 8) & 0xFF;
         *B = RGB & 0xFF;
     }
-
-    // Hash the contents as well to generate a hash string
-    u::sha512 hash(&m_data[0], m_data.size());
-    m_hashString = hash.hex();
 }
 
 u::optional<u::string> texture::find(const u::string &infile) {
@@ -2110,6 +3042,10 @@ u::optional<u::string> texture::find(const u::string &infile) {
 
 bool texture::load(const u::string &file, float quality) {
     // Construct a texture from a file
+    return open(file, quality) && decode();
+}
+
+bool texture::open(const u::string &file, float quality) {
     auto name = find(neoGamePath() + file);
     if (!name)
         return false;
@@ -2118,17 +3054,53 @@ bool texture::load(const u::string &file, float quality) {
     auto load = u::read(fileName, "rb");
     if (!load)
         return false;
-    u::vector<unsigned char> data = *load;
+    u::vector<unsigned char> &data = *load;
+    if (dds::test(data)) {
+        m_flags |= kTexFlagCompressed;
+    } else if (!jpeg::test(data) && !png::test(data) && !tga::test(data)) {
+        u::print("no decoder found for `%s'\n", fileName);
+        return false;
+    }
+
+    // The key covers the file contents and everything decode does to them
+    u::murmur3 hash(&data[0], data.size());
+    m_hashString = cacheKey(u::format("%s:%d:%d", hash.hex(), int(quality * 1000.0f),
+        m_flags & (kTexFlagNormal | kTexFlagGrey | kTexFlagPremul)));
+
+    m_flags |= kTexFlagDisk;
+    m_source = u::move(data);
+    m_sourceName = *name;
+    m_quality = quality;
+    m_colorize = u::none;
+    return true;
+}
+
+bool texture::decode() {
+    if (m_source.empty())
+        return false;
+
+    const u::vector<unsigned char> data = u::move(m_source);
+    const char *fileName = m_sourceName.c_str();
+    bool decoded = false;
     if (jpeg::test(data))
-        return decode<jpeg>(data, fileName, quality);
+        decoded = decode<jpeg>(data, fileName, m_quality);
     else if (png::test(data))
-        return decode<png>(data, fileName, quality);
+        decoded = decode<png>(data, fileName, m_quality);
     else if (tga::test(data))
-        return decode<tga>(data, fileName, quality);
+        decoded = decode<tga>(data, fileName, m_quality);
     else if (dds::test(data))
-        return decode<dds>(data, fileName, quality);
-    u::print("no decoder found for `%s'\n", fileName);
-    return false;
+        decoded = decode<dds>(data, fileName, m_quality);
+    if (decoded && m_colorize)
+        colorizePixels(*m_colorize);
+    m_colorize = u::none;
+    return decoded;
+}
+
+bool texture::exists(const u::string &file) {
+    texture probe;
+    if (!probe.find(neoGamePath() + file))
+        return false;
+    return true;
 }
 
 texture::texture(const unsigned char *const data, size_t length, size_t width,
@@ -2467,16 +3439,17 @@ bool texture::save(const u::string &file, saveFormat format, float quality) {
 }
 
 bool texture::from(const unsigned char *const data, size_t length, size_t width,
-    size_t height, bool normal, textureFormat format)
+    size_t height, bool normal, textureFormat format, size_t mips)
 {
     *this = u::move(texture(data, length, width, height, normal, format));
+    m_mips = mips;
     return true;
 }
 
-void texture::resize(size_t width, size_t height) {
+void texture::resize(size_t width, size_t height, resizeFilter filter) {
     u::vector<unsigned char> data;
     data.resize(m_bpp * width * height);
-    scale(&m_data[0], m_width, m_height, m_bpp, m_pitch, &data[0], width, height);
+    resample(&m_data[0], m_width, m_height, m_bpp, m_pitch, &data[0], width, height, filter);
     m_data = u::move(data);
     m_width = width;
     m_height = height;
@@ -29,6 +29,12 @@ enum textureFormat {
     kTexFormatBC5S
 };
 
+enum resizeFilter {
+    kResizeBox,      // average of the covered area
+    kResizeBilinear, // tent, widened when shrinking
+    kResizeLanczos   // three lobes, sharpest
+};
+
 enum saveFormat {
     kSaveBMP,
     kSaveTGA,
@@ -44,6 +50,7 @@ struct texture {
         , m_mips(0)
         , m_flags(0)
         , m_format(kTexFormatLuminance)
+        , m_quality(1.0f)
     {
     }
 
@@ -51,31 +58,35 @@ struct texture {
         size_t height, bool normal, textureFormat format);
 
     bool load(const u::string &file, float quality = 1.0f);
+    static bool exists(const u::string &file); // can it be loaded by load
+
+    // load in two steps: open reads the file and works out hashString() from
+    // its contents and the load parameters so a cached copy can be looked up
+    // before paying for decode
+    bool open(const u::string &file, float quality = 1.0f);
+    bool decode();
+    // `mips' is the number of levels back to back in data, 0 for just the image
     bool from(const unsigned char *const data, size_t length, size_t width,
-        size_t height, bool normal, textureFormat format);
+        size_t height, bool normal, textureFormat format, size_t mips = 0);
 
     bool save(const u::string &file, saveFormat save = kSaveBMP, float quality = 1.0f);
 
-    void colorize(uint32_t color);
-
-    template <size_t S>
-    static void halve(unsigned char *src, size_t sw, size_t sh, size_t stride,
-        unsigned char *dst);
+    void colorize(uint32_t color); // deferred to decode when only opened
 
-    template <size_t S>
-    static void shift(unsigned char *src, size_t sw, size_t sh, size_t stride,
-        unsigned char *dst, size_t dw, size_t dh);
-
-    template <size_t S>
-    static void scale(unsigned char *src, size_t sw, size_t sh, size_t stride,
-        unsigned char *dst, size_t dw, size_t dh);
-
-    static void scale(unsigned char *src, size_t sw, size_t sh, size_t bpp,
-        size_t pitch, unsigned char *dst, size_t dw, size_t dh);
+    // Resamples `src' to dw by dh. The first `srgb' channels are filtered in
+    // linear light
+    static void resample(const unsigned char *src, size_t sw, size_t sh, size_t bpp,
+        size_t pitch, unsigned char *dst, size_t dw, size_t dh,
+        resizeFilter filter = kResizeBox, size_t srgb = 0);
     static void reorient(unsigned char *src, size_t sw, size_t sh, size_t bpp,
         size_t stride, unsigned char *dst, bool flipx, bool flipy, bool swapxy);
 
-    void resize(size_t width, size_t height);
+    void resize(size_t width, size_t height, resizeFilter filter = kResizeBox);
+
+    // appends the levels below the image, each half the size of the one above
+    // down to 1x1, and sets mips() to the number of levels. Colour is filtered
+    // in linear light; normal maps, greyscale data and alpha as they are stored
+    void generateMipChain();
 
     template <textureFormat F>
     void convert();
@@ -106,6 +117,7 @@ private:
     template <typename T>
     bool decode(const u::vector<unsigned char> &data, const char *fileName,
         float quality = 1.0f);
+    void colorizePixels(uint32_t color);
 
     u::string m_hashString;
     u::vector<unsigned char> m_data;
@@ -116,6 +128,12 @@ private:
     size_t m_mips;
     int m_flags;
     textureFormat m_format;
+
+    // opened but not decoded yet
+    u::vector<unsigned char> m_source;
+    u::string m_sourceName;
+    float m_quality;
+    u::optional<uint32_t> m_colorize;
 };
 
 #endif
@@ -27,6 +27,22 @@ types = [
     {'name': 'GLsizeiptr', 'format': '%p',   'promote': 'intptr_t',     'spec': 'f' }
 ]
 
+# Functions whose redundant calls are dropped by the shadow state. Each one has
+# a `stateName' function in the generated source which records the call and
+# returns false when the driver already has that state
+cached = [
+    'UseProgram', 'Uniform1i', 'Uniform2i', 'Uniform1f', 'Uniform2f',
+    'Uniform3fv', 'UniformMatrix4fv', 'UniformMatrix3x4fv', 'ActiveTexture',
+    'BindTexture', 'CullFace', 'Enable', 'Disable', 'DepthMask',
+    'BlendEquation', 'BlendFunc', 'DepthFunc'
+]
+
+# Functions which invalidate part of the shadow state. Each one has a
+# `stateName' function in the generated source called before the driver call
+invalidates = [
+    'LinkProgram', 'DeleteProgram', 'DeleteTextures'
+]
+
 # Read a list of extensions from an extension file and return a list of strings
 # of such extensions
 def readExtensions(extensionFile):
@@ -100,6 +116,12 @@ def genHeader(functionList, extensionList, headerFile):
         const u::set<size_t> &extensions();
         bool has(size_t ext);
 
+        // Calls which reached the driver and calls dropped by the shadow state
+        // because they would not have changed anything since the last resetStats
+        size_t calls();
+        size_t callsElided();
+        void resetStats();
+
         """))
         # Generate the function prototypes
         for function in functionList:
@@ -135,6 +157,8 @@ def genSource(functionList, extensionList, sourceFile):
 
         #include "u_string.h"
         #include "u_set.h"
+        #include "u_map.h"
+        #include "u_vector.h"
         #include "u_misc.h"
 
         #include "engine.h"
@@ -343,6 +367,201 @@ def genSource(functionList, extensionList, sourceFile):
             return gExtensions.find(ext) != gExtensions.end();
         }
 
+        ///! Shadow state
+        // Mirrors the state last handed to the driver so redundant calls can be
+        // dropped. Anything which is not known yet is kUnknown which never
+        // compares equal to a real value.
+        static constexpr GLuint kUnknown = ~0u;
+        static constexpr size_t kTextureUnits = 32;
+        static constexpr size_t kTextureTargets = 4;
+
+        static constexpr GLenum kCapabilities[] = {
+            GL_BLEND, GL_CULL_FACE, GL_DEPTH_TEST, GL_SCISSOR_TEST,
+            GL_STENCIL_TEST, GL_LINE_SMOOTH
+        };
+
+        static constexpr size_t kCapabilityCount = sizeof kCapabilities / sizeof *kCapabilities;
+
+        static struct {
+            GLuint program;
+            GLuint textureUnit;
+            GLuint textures[kTextureUnits][kTextureTargets];
+            GLuint capabilities[kCapabilityCount];
+            GLuint cullFace;
+            GLuint depthMask;
+            GLuint blendEquation;
+            GLuint blendSource;
+            GLuint blendDestination;
+            GLuint depthFunc;
+        } gState;
+
+        // Uniform values per program, indexed by location. The first byte of
+        // every value is the transpose flag for matrices and zero otherwise.
+        static u::map<GLuint, u::vector<u::vector<unsigned char>>> gUniforms;
+
+        static size_t gCalls = 0;
+        static size_t gCallsElided = 0;
+
+        size_t calls() {
+            return gCalls;
+        }
+
+        size_t callsElided() {
+            return gCallsElided;
+        }
+
+        void resetStats() {
+            gCalls = 0;
+            gCallsElided = 0;
+        }
+
+        static void stateReset() {
+            memset(&gState, 0xFF, sizeof gState);
+            gUniforms.clear();
+        }
+
+        // Records `value' and returns true when it differs from `state'
+        static inline bool stateChange(GLuint &state, GLuint value) {
+            if (state == value)
+                return false;
+            state = value;
+            return true;
+        }
+
+        static inline size_t stateTextureTarget(GLenum target) {
+            switch (target) {
+            case GL_TEXTURE_2D:        return 0;
+            case GL_TEXTURE_3D:        return 1;
+            case GL_TEXTURE_RECTANGLE: return 2;
+            case GL_TEXTURE_CUBE_MAP:  return 3;
+            }
+            return kTextureTargets;
+        }
+
+        static inline bool stateCapability(GLenum cap, GLuint enabled) {
+            for (size_t i = 0; i < kCapabilityCount; i++)
+                if (kCapabilities[i] == cap)
+                    return stateChange(gState.capabilities[i], enabled);
+            return true;
+        }
+
+        static bool stateUniform(GLint location, const void *data, size_t size, unsigned char transpose = 0) {
+            if (location < 0 || gState.program == kUnknown)
+                return true;
+            auto &values = gUniforms[gState.program];
+            if (size_t(location) >= values.size())
+                values.resize(location + 1);
+            auto &value = values[location];
+            if (value.size() == size + 1 && value[0] == transpose && !memcmp(&value[1], data, size))
+                return false;
+            value.resize(size + 1);
+            value[0] = transpose;
+            memcpy(&value[1], data, size);
+            return true;
+        }
+
+        static inline bool stateUseProgram(GLuint program) {
+            return stateChange(gState.program, program);
+        }
+
+        static inline bool stateUniform1i(GLint location, GLint v0) {
+            return stateUniform(location, &v0, sizeof v0);
+        }
+
+        static inline bool stateUniform2i(GLint location, GLint v0, GLint v1) {
+            const GLint v[] = { v0, v1 };
+            return stateUniform(location, v, sizeof v);
+        }
+
+        static inline bool stateUniform1f(GLint location, GLfloat v0) {
+            return stateUniform(location, &v0, sizeof v0);
+        }
+
+        static inline bool stateUniform2f(GLint location, GLfloat v0, GLfloat v1) {
+            const GLfloat v[] = { v0, v1 };
+            return stateUniform(location, v, sizeof v);
+        }
+
+        static inline bool stateUniform3fv(GLint location, GLsizei count, const GLfloat *value) {
+            return stateUniform(location, value, sizeof(GLfloat) * 3 * count);
+        }
+
+        static inline bool stateUniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value) {
+            return stateUniform(location, value, sizeof(GLfloat) * 16 * count, transpose);
+        }
+
+        static inline bool stateUniformMatrix3x4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat *value) {
+            return stateUniform(location, value, sizeof(GLfloat) * 12 * count, transpose);
+        }
+
+        static inline bool stateActiveTexture(GLenum texture) {
+            return stateChange(gState.textureUnit, texture - GL_TEXTURE0);
+        }
+
+        static inline bool stateBindTexture(GLenum target, GLuint texture) {
+            const size_t index = stateTextureTarget(target);
+            if (gState.textureUnit >= kTextureUnits || index == kTextureTargets)
+                return true;
+            return stateChange(gState.textures[gState.textureUnit][index], texture);
+        }
+
+        static inline bool stateCullFace(GLenum mode) {
+            return stateChange(gState.cullFace, mode);
+        }
+
+        static inline bool stateEnable(GLenum cap) {
+            return stateCapability(cap, GL_TRUE);
+        }
+
+        static inline bool stateDisable(GLenum cap) {
+            return stateCapability(cap, GL_FALSE);
+        }
+
+        static inline bool stateDepthMask(GLboolean flag) {
+            return stateChange(gState.depthMask, flag);
+        }
+
+        static inline bool stateBlendEquation(GLenum mode) {
+            return stateChange(gState.blendEquation, mode);
+        }
+
+        static inline bool stateBlendFunc(GLenum sfactor, GLenum dfactor) {
+            // Evaluate both to record them
+            const bool source = stateChange(gState.blendSource, sfactor);
+            const bool destination = stateChange(gState.blendDestination, dfactor);
+            return source || destination;
+        }
+
+        static inline bool stateDepthFunc(GLenum func) {
+            return stateChange(gState.depthFunc, func);
+        }
+
+        static inline void stateForgetUniforms(GLuint program) {
+            auto find = gUniforms.find(program);
+            if (find != gUniforms.end())
+                gUniforms.erase(find);
+        }
+
+        // Linking resets every uniform of the program to zero
+        static inline void stateLinkProgram(GLuint program) {
+            stateForgetUniforms(program);
+        }
+
+        // The name can be handed out again for a different program
+        static inline void stateDeleteProgram(GLuint program) {
+            stateForgetUniforms(program);
+            if (gState.program == program)
+                gState.program = kUnknown;
+        }
+
+        static inline void stateDeleteTextures(GLsizei n, const GLuint *textures) {
+            for (GLsizei i = 0; i < n; i++)
+                for (auto &unit : gState.textures)
+                    for (auto &bound : unit)
+                        if (bound == textures[i])
+                            bound = kUnknown;
+        }
+
         void init() {
         """))
         for f in functionList:
@@ -361,6 +580,17 @@ def genSource(functionList, extensionList, sourceFile):
                     if (!strcmp(kExtensions[j], (const char *)glGetStringi_(GL_EXTENSIONS, i)))
                         gExtensions.insert(j);
 
+            // The instancing entry points are core from 3.1 and 3.3 on, older contexts
+            // only have the ARB ones. Without either the extension is as good as missing
+            if (!glVertexAttribDivisor_)
+                glVertexAttribDivisor_ = (MYPFNGLVERTEXATTRIBDIVISORPROC)neoGetProcAddress("glVertexAttribDivisorARB");
+            if (!glDrawElementsInstanced_)
+                glDrawElementsInstanced_ = (MYPFNGLDRAWELEMENTSINSTANCEDPROC)neoGetProcAddress("glDrawElementsInstancedARB");
+            if (!glVertexAttribDivisor_)
+                gExtensions.erase(gl::ARB_instanced_arrays);
+            if (!glDrawElementsInstanced_)
+                gExtensions.erase(gl::ARB_draw_instanced);
+
             auto &aniso = varGet<int>("r_aniso");
             if (has(gl::EXT_texture_filter_anisotropic)) {
                 float largest;
@@ -391,6 +621,8 @@ def genSource(functionList, extensionList, sourceFile):
             if (gGLSLVersion == -1)
                 neoFatal("Failed to initialize OpenGL\\n");
 
+            stateReset();
+
         #ifdef DEBUG_GL
             if (has(gl::ARB_debug_output)) {
                 glEnable_(GL_DEBUG_OUTPUT_SYNCHRONOUS_ARB);
@@ -405,6 +637,16 @@ def genSource(functionList, extensionList, sourceFile):
             source.write('\n%s %s' % (f.type, f.name))
             printFormals(source, f, True, True, True, infoTag(f))
             source.write(' {\n    ')
+            if f.name in cached:
+                # Drop the call when the state would not change
+                source.write('if (!state%s' % (f.name))
+                printFormals(source, f, True, False)
+                source.write(') {\n        gCallsElided++;\n        return;\n    }\n    ')
+            elif f.name in invalidates:
+                source.write('state%s' % (f.name))
+                printFormals(source, f, True, False)
+                source.write(';\n    ')
+            source.write('gCalls++;\n    ')
             if f.type != 'void':
                 # Local backup result and then return it
                 source.write('%s result = gl%s_' % (f.type, f.name))
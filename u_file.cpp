@@ -12,7 +12,9 @@
 #   include <direct.h>  // rmdir, mkdir
 #else
 #   include <dirent.h>  // opendir, readir, DIR
-#   include <unistd.h>  // rmdir, mkdir
+#   include <unistd.h>  // rmdir, mkdir, close
+#   include <fcntl.h>   // open
+#   include <sys/mman.h> // mmap, munmap
 #endif
 
 #include "u_file.h"
@@ -30,11 +32,26 @@ file::file(FILE *fp)
 {
 }
 
+file::file(file &&other)
+    : m_handle(other.m_handle)
+{
+    other.m_handle = nullptr;
+}
+
 file::~file() {
     if (m_handle)
         fclose(m_handle);
 }
 
+file &file::operator=(file &&other) {
+    if (this != &other) {
+        if (m_handle)
+            fclose(m_handle);
+        m_handle = other.m_handle;
+        other.m_handle = nullptr;
+    }
+    return *this;
+}
 
 file::operator FILE*() {
     return m_handle;
@@ -44,6 +61,72 @@ FILE *file::get() {
     return m_handle;
 }
 
+///! mappedFile
+mappedFile::mappedFile()
+    : m_data(nullptr)
+    , m_size(0)
+{
+}
+
+mappedFile::~mappedFile() {
+    unmap();
+}
+
+bool mappedFile::map(const u::string &file) {
+    unmap();
+    const u::string fix = fixPath(file);
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(fix.c_str(), GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart <= 0) {
+        CloseHandle(handle);
+        return false;
+    }
+    // The view keeps the mapping and the file alive
+    HANDLE mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(handle);
+    if (!mapping)
+        return false;
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!data)
+        return false;
+    m_size = size_t(size.QuadPart);
+#else
+    const int fd = ::open(fix.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+    // The mapping keeps the file alive
+    void *data = ::mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    m_size = size_t(info.st_size);
+#endif
+    m_data = data;
+    return true;
+}
+
+void mappedFile::unmap() {
+    if (!m_data)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+#else
+    ::munmap(m_data, m_size);
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
+
 u::string fixPath(const u::string &path) {
     u::string fix = path;
     for (auto &it : fix)
@@ -104,6 +187,17 @@ bool mkdir(const u::string &dir) {
 #endif
 }
 
+bool rename(const u::string &from, const u::string &to) {
+    const u::string fixFrom = fixPath(from);
+    const u::string fixTo = fixPath(to);
+#ifdef _WIN32
+    // rename doesn't replace an existing file on Windows
+    return MoveFileExA(fixFrom.c_str(), fixTo.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    return ::rename(fixFrom.c_str(), fixTo.c_str()) == 0;
+#endif
+}
+
 u::file fopen(const u::string& infile, const char *type) {
     return ::fopen(fixPath(infile).c_str(), type);
 }
@@ -19,15 +19,41 @@ static constexpr char kPathSep = '/';
 struct file {
     file();
     file(FILE *fp);
+    file(file &&other);
     ~file();
 
+    file &operator=(file &&other);
+
     operator FILE*();
     FILE *get();
 
 private:
+    file(const file &) = delete;
+    void operator =(const file &) = delete;
+
     FILE *m_handle;
 };
 
+// Read only mapping of a whole file. Writes made through other handles are
+// seen in the mapped range but the mapping doesn't grow with the file.
+struct mappedFile {
+    mappedFile();
+    ~mappedFile();
+
+    bool map(const u::string &file);
+    void unmap();
+
+    const unsigned char *data() const;
+    size_t size() const;
+
+private:
+    mappedFile(const mappedFile &) = delete;
+    void operator =(const mappedFile &) = delete;
+
+    void *m_data;
+    size_t m_size;
+};
+
 u::string fixPath(const u::string &path);
 
 enum pathType {
@@ -77,6 +103,17 @@ u::optional<u::vector<unsigned char>> read(const u::string &file, const char *mo
 bool write(const u::vector<unsigned char> &data, const u::string &file, const char *mode = "wb");
 // make a directory
 bool mkdir(const u::string &dir);
+// rename a file, replacing `to' if it exists
+bool rename(const u::string &from, const u::string &to);
+
+///! mappedFile
+inline const unsigned char *mappedFile::data() const {
+    return (const unsigned char *)m_data;
+}
+
+inline size_t mappedFile::size() const {
+    return m_size;
+}
 
 ///! dir
 inline dir::dir(const u::string &where)
@@ -0,0 +1,64 @@
+#include <string.h>
+
+#include "u_murmur3.h"
+
+namespace u {
+
+murmur3::murmur3(const unsigned char *buf, size_t length, uint32_t seed) {
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+
+    // body
+    const size_t blocks = length / 16;
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k1;
+        uint64_t k2;
+        memcpy(&k1, buf + i*16, sizeof k1);
+        memcpy(&k2, buf + i*16 + 8, sizeof k2);
+
+        k1 *= kC1; k1 = rotl(k1, 31); k1 *= kC2; h1 ^= k1;
+        h1 = rotl(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+
+        k2 *= kC2; k2 = rotl(k2, 33); k2 *= kC1; h2 ^= k2;
+        h2 = rotl(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    }
+
+    // tail
+    const unsigned char *tail = buf + blocks*16;
+    const size_t remain = length & 15;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    for (size_t i = remain; i > 8; i--)
+        k2 ^= uint64_t(tail[i - 1]) << ((i - 9) * 8);
+    if (remain > 8) {
+        k2 *= kC2; k2 = rotl(k2, 33); k2 *= kC1; h2 ^= k2;
+    }
+    for (size_t i = remain > 8 ? 8 : remain; i > 0; i--)
+        k1 ^= uint64_t(tail[i - 1]) << ((i - 1) * 8);
+    if (remain) {
+        k1 *= kC1; k1 = rotl(k1, 31); k1 *= kC2; h1 ^= k1;
+    }
+
+    // finalization
+    h1 ^= length;
+    h2 ^= length;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix(h1);
+    h2 = fmix(h2);
+    h1 += h2;
+    h2 += h1;
+
+    m_hash[0] = h1;
+    m_hash[1] = h2;
+    m_string[128 / 8 * 2] = '\0';
+}
+
+const char *murmur3::hex() {
+    static const char *kNibbleHexMap = "0123456789abcdef";
+    for (size_t i = 0; i != 128 / 4; ++i)
+        m_string[i] = kNibbleHexMap[(m_hash[i / 16] >> ((15 - i % 16) * 4)) & 0x0F];
+    return m_string;
+}
+
+}
@@ -0,0 +1,38 @@
+#ifndef U_MURMUR3_HDR
+#define U_MURMUR3_HDR
+#include <stddef.h>
+#include <stdint.h>
+
+namespace u {
+
+// 128-bit MurmurHash3 (x64 variant). Much faster than sha512 but not
+// cryptographic, meant for naming content rather than protecting it.
+struct murmur3 {
+    murmur3(const unsigned char *buf, size_t length, uint32_t seed = 0);
+
+    const char *hex();
+
+private:
+    static inline uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static inline uint64_t fmix(uint64_t k) {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+        return k;
+    }
+
+    static constexpr uint64_t kC1 = 0x87c37b91114253d5ULL;
+    static constexpr uint64_t kC2 = 0x4cf5ad432745937fULL;
+
+    uint64_t m_hash[2];
+    char m_string[128 / 8 * 2 + 1];
+};
+
+}
+
+#endif
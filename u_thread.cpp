@@ -0,0 +1,249 @@
+#include <SDL2/SDL_thread.h>
+#include <SDL2/SDL_mutex.h>
+#include <SDL2/SDL_atomic.h>
+#include <SDL2/SDL_cpuinfo.h>
+
+#include "u_thread.h"
+#include "u_vector.h"
+
+namespace u {
+
+///! mutex
+mutex::mutex()
+    : m_handle((void *)SDL_CreateMutex())
+{
+}
+
+mutex::~mutex() {
+    SDL_DestroyMutex((SDL_mutex *)m_handle);
+}
+
+void mutex::lock() {
+    SDL_LockMutex((SDL_mutex *)m_handle);
+}
+
+void mutex::unlock() {
+    SDL_UnlockMutex((SDL_mutex *)m_handle);
+}
+
+///! condition
+condition::condition()
+    : m_handle((void *)SDL_CreateCond())
+{
+}
+
+condition::~condition() {
+    SDL_DestroyCond((SDL_cond *)m_handle);
+}
+
+void condition::wait(mutex *m) {
+    SDL_CondWait((SDL_cond *)m_handle, (SDL_mutex *)m->m_handle);
+}
+
+void condition::signal() {
+    SDL_CondSignal((SDL_cond *)m_handle);
+}
+
+void condition::broadcast() {
+    SDL_CondBroadcast((SDL_cond *)m_handle);
+}
+
+size_t cpuCount() {
+    const int count = SDL_GetCPUCount();
+    return count > 0 ? count : 1;
+}
+
+///! worker pool
+// A batch is the unit of work handed to the pool by parallelFor; indices are
+// handed out one at a time and the batch leaves the queue once the last one
+// has been claimed. The submitting thread waits for `pending' to drain, unless
+// the batch is detached in which case the worker finishing it frees it.
+struct batch {
+    void (*function)(const void *, size_t);
+    void (*cancel)(const void *); // detached batches, frees `data' unrun
+    const void *data;
+    size_t count;
+    size_t next;
+    size_t pending;
+    bool detached;
+    condition done;
+};
+
+struct workerPool {
+    workerPool();
+    ~workerPool();
+
+    // stops the workers, queued batches are freed unrun
+    void stop();
+
+    // claim the next index of the front batch, the pool must be locked
+    batch *claim(size_t *index);
+    void finish(batch *b);
+
+    static int work(void *data);
+
+    mutex lock;
+    condition wake;
+    condition stopped;
+    u::vector<batch *> queue;
+    size_t workers;
+    bool quit;
+};
+
+workerPool::workerPool()
+    : workers(cpuCount() - 1) // the thread calling parallelFor works too
+    , quit(false)
+{
+    for (size_t i = 0; i < workers; i++)
+        SDL_DetachThread(SDL_CreateThread(&workerPool::work, "worker", (void *)this));
+}
+
+workerPool::~workerPool() {
+    stop();
+}
+
+void workerPool::stop() {
+    lock.lock();
+    quit = true;
+    wake.broadcast();
+    while (workers)
+        stopped.wait(&lock);
+    lock.unlock();
+    // with the workers gone the batches of parallelFor are done as well, only
+    // detached ones can be left
+    for (auto *it : queue) {
+        u::unique_ptr<batch> b(it);
+        b->cancel(b->data);
+    }
+    queue.clear();
+}
+
+batch *workerPool::claim(size_t *index) {
+    batch *b = queue[0];
+    *index = b->next++;
+    if (b->next == b->count)
+        queue.erase(queue.begin());
+    return b;
+}
+
+void workerPool::finish(batch *b) {
+    lock.lock();
+    const bool last = --b->pending == 0;
+    // detached batches belong to the pool, the last one out frees it. Others
+    // belong to the thread in parallelFor and are gone as soon as the lock
+    // is let go, so they aren't touched after that
+    const bool detached = last && b->detached;
+    if (last && !detached)
+        b->done.broadcast();
+    lock.unlock();
+    u::unique_ptr<batch> free(detached ? b : nullptr);
+}
+
+int workerPool::work(void *data) {
+    workerPool *pool = (workerPool *)data;
+    for (;;) {
+        pool->lock.lock();
+        while (pool->queue.empty() && !pool->quit)
+            pool->wake.wait(&pool->lock);
+        if (pool->quit) {
+            pool->workers--;
+            pool->stopped.signal();
+            pool->lock.unlock();
+            return 0;
+        }
+        size_t index;
+        batch *b = pool->claim(&index);
+        pool->lock.unlock();
+        b->function(b->data, index);
+        pool->finish(b);
+    }
+}
+
+static SDL_SpinLock gPoolLock = 0;
+static u::unique_ptr<workerPool> gPool;
+
+static workerPool *pool() {
+    SDL_AtomicLock(&gPoolLock);
+    if (!gPool)
+        gPool.reset(new workerPool);
+    SDL_AtomicUnlock(&gPoolLock);
+    return gPool.get();
+}
+
+void stopWorkers() {
+    // work in flight may still reach the pool through parallelFor, it stays
+    // around until the workers are gone
+    if (!gPool)
+        return;
+    gPool->stop();
+    gPool.reset(nullptr);
+}
+
+void detail::parallelFor(size_t count, void (*function)(const void *, size_t), const void *data) {
+    if (count == 0)
+        return;
+    if (count == 1) {
+        function(data, 0);
+        return;
+    }
+
+    workerPool *p = pool();
+
+    batch b;
+    b.function = function;
+    b.data = data;
+    b.count = count;
+    b.next = 0;
+    b.pending = count;
+    b.detached = false;
+    b.cancel = nullptr;
+
+    p->lock.lock();
+    p->queue.push_back(&b);
+    p->wake.broadcast();
+    // help out with our own batch; when called from a worker this is also
+    // what keeps nested batches from dead locking the pool
+    while (b.next < b.count) {
+        size_t index = b.next++;
+        if (b.next == b.count) {
+            for (size_t i = 0; i < p->queue.size(); i++) {
+                if (p->queue[i] != &b)
+                    continue;
+                p->queue.erase(p->queue.begin() + i);
+                break;
+            }
+        }
+        p->lock.unlock();
+        function(data, index);
+        p->lock.lock();
+        b.pending--;
+    }
+    while (b.pending)
+        b.done.wait(&p->lock);
+    p->lock.unlock();
+}
+
+void detail::async(void (*function)(const void *, size_t), void (*cancel)(const void *), const void *data) {
+    if (cpuCount() == 1) {
+        function(data, 0);
+        return;
+    }
+
+    workerPool *p = pool();
+
+    u::unique_ptr<batch> b(new batch);
+    b->function = function;
+    b->data = data;
+    b->count = 1;
+    b->next = 0;
+    b->pending = 1;
+    b->detached = true;
+    b->cancel = cancel;
+
+    p->lock.lock();
+    p->queue.push_back(b.release());
+    p->wake.signal();
+    p->lock.unlock();
+}
+
+}
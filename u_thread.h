@@ -0,0 +1,82 @@
+#ifndef U_THREAD_HDR
+#define U_THREAD_HDR
+#include <stddef.h>
+
+#include "u_memory.h"
+
+namespace u {
+
+struct mutex {
+    mutex();
+    ~mutex();
+
+    void lock();
+    void unlock();
+
+private:
+    friend struct condition;
+    void *m_handle;
+};
+
+struct condition {
+    condition();
+    ~condition();
+
+    // the mutex must be locked by the calling thread
+    void wait(mutex *m);
+    void signal();
+    void broadcast();
+
+private:
+    void *m_handle;
+};
+
+// number of logical processors
+size_t cpuCount();
+
+// Stops the worker pool, waiting for the work in flight. Whatever async queued
+// and no worker picked up yet is freed without being run. Called once on the
+// way out, before anything the workers use is destroyed.
+void stopWorkers();
+
+namespace detail {
+    void parallelFor(size_t count, void (*function)(const void *, size_t), const void *data);
+
+    template <typename F>
+    void parallelForThunk(const void *function, size_t index) {
+        (*(const F *)function)(index);
+    }
+
+    void async(void (*function)(const void *, size_t), void (*cancel)(const void *), const void *data);
+
+    template <typename F>
+    void asyncThunk(const void *function, size_t) {
+        u::unique_ptr<F> f((F *)function);
+        (*f)();
+    }
+
+    template <typename F>
+    void asyncCancel(const void *function) {
+        u::unique_ptr<F> f((F *)function);
+    }
+}
+
+// Invokes function(index) for every index in [0, count) on the shared worker
+// pool, the calling thread helps out. Returns once every invocation finished.
+template <typename F>
+inline void parallelFor(size_t count, const F &function) {
+    detail::parallelFor(count, &detail::parallelForThunk<F>, (const void *)&function);
+}
+
+// Invokes function() on the shared worker pool and returns without waiting for
+// it. Without any workers to hand it to it runs on the calling thread instead.
+// The closure is destroyed once it ran, or unrun when the pool stops first.
+template <typename F>
+inline void async(F function) {
+    u::unique_ptr<F> closure(new F(u::move(function)));
+    detail::async(&detail::asyncThunk<F>, &detail::asyncCancel<F>, (const void *)closure.release());
+}
+
+}
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "u_zlib.h"
 #include "u_misc.h"
+#include "u_algorithm.h"
+#include "u_thread.h"
 
 #define returnError() \
     do { \
@@ -39,326 +41,347 @@ static constexpr size_t kCodeLengthCodeLengths[] = {
 };
 
 // zlib decompression
-size_t zlib::readBitFromStream(size_t &bitp, const unsigned char *bits) {
-    size_t r = (bits[bitp >> 3] >> (bitp & 0x7)) & 1;
-    bitp++;
-    return r;
-}
+static constexpr size_t kPrimaryBits = 9;
+static constexpr uint32_t kSubTable = 0x100;
 
-size_t zlib::readBitsFromStream(size_t &bitp, const unsigned char *bits, size_t nbits) {
-    size_t r = 0;
-    for(size_t i = 0; i < nbits; i++)
-        r += (readBitFromStream(bitp, bits)) << i;
-    return r;
+static inline uint32_t reverseBits(uint32_t code, size_t length) {
+    uint32_t result = 0;
+    while (length--) {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return result;
 }
 
-bool zlib::huffmanTree::make(const u::vector<size_t> &bitlen, size_t maxbitlen) {
-    //make tree given the lengths
-    size_t numcodes = (size_t)(bitlen.size());
-    size_t treepos = 0;
-    size_t nodefilled = 0;
-
-    u::vector<size_t> tree1D(numcodes);
-    u::vector<size_t> blcount(maxbitlen + 1, 0);
-    u::vector<size_t> nextcode(maxbitlen + 1, 0);
+bool zlib::huffmanTree::make(const unsigned char *lengths, size_t count) {
+    size_t blcount[16] = { 0 };
+    uint32_t nextcode[16] = { 0 };
 
     // count number of instances of each code length
-    for(size_t bits = 0; bits < numcodes; bits++)
-        blcount[bitlen[bits]]++;
-    for(size_t bits = 1; bits <= maxbitlen; bits++)
+    size_t maxLength = 0;
+    for (size_t i = 0; i < count; i++) {
+        blcount[lengths[i]]++;
+        if (lengths[i] > maxLength)
+            maxLength = lengths[i];
+    }
+    blcount[0] = 0;
+
+    // reject over-subscribed codes, incomplete ones are fine (single distance code)
+    int left = 1;
+    for (size_t bits = 1; bits <= 15; bits++) {
+        left <<= 1;
+        left -= blcount[bits];
+        if (left < 0)
+            return false;
+    }
+    for (size_t bits = 1; bits <= 15; bits++)
         nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
-    for (size_t n = 0; n < numcodes; n++)
-        if (bitlen[n] != 0)
-            tree1D[n] = nextcode[bitlen[n]]++;
-
-    m_tree2D.clear();
-    m_tree2D.resize(numcodes * 2, 32767); // 32767 here means the tree2d isn't filled there yet
-
-    for (size_t n = 0; n < numcodes; n++) {
-        for (size_t i = 0; i < bitlen[n]; i++) {
-            size_t bit = (tree1D[n] >> (bitlen[n] - i - 1)) & 1;
-            if (treepos > numcodes - 2)
-                return false;
-            if (m_tree2D[2 * treepos + bit] == 32767) {
-                if (i + 1 == bitlen[n]) {
-                    m_tree2D[2 * treepos + bit] = n;
-                    treepos = 0;
-                } else {
-                    m_tree2D[2 * treepos + bit] = ++nodefilled + numcodes;
-                    treepos = nodefilled;
-                }
-            } else {
-                treepos = m_tree2D[2 * treepos + bit] - numcodes;
-            }
+
+    m_bits = maxLength < kPrimaryBits ? maxLength : kPrimaryBits;
+    if (m_bits == 0)
+        m_bits = 1;
+
+    const size_t primarySize = size_t(1) << m_bits;
+    const uint32_t primaryMask = primarySize - 1;
+
+    // codes are stored bit-reversed since deflate emits them most significant bit first
+    uint32_t codes[288];
+    for (size_t i = 0; i < count; i++)
+        if (lengths[i])
+            codes[i] = reverseBits(nextcode[lengths[i]]++, lengths[i]);
+
+    // size of the subtable hanging off each primary slot; it has to be wide
+    // enough for the longest code sharing that prefix
+    unsigned char subBits[1 << kPrimaryBits] = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        if (lengths[i] <= m_bits)
+            continue;
+        const size_t extra = lengths[i] - m_bits;
+        unsigned char &bits = subBits[codes[i] & primaryMask];
+        if (extra > bits)
+            bits = extra;
+    }
+
+    size_t tableSize = primarySize;
+    for (size_t i = 0; i < primarySize; i++)
+        if (subBits[i])
+            tableSize += size_t(1) << subBits[i];
+
+    m_table.clear();
+    m_table.resize(tableSize, 0);
+
+    size_t offset = primarySize;
+    for (size_t i = 0; i < primarySize; i++) {
+        if (!subBits[i])
+            continue;
+        m_table[i] = (offset << 16) | kSubTable | subBits[i];
+        offset += size_t(1) << subBits[i];
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const size_t length = lengths[i];
+        if (!length)
+            continue;
+        const uint32_t entry = (uint32_t(i) << 16) | length;
+        if (length <= m_bits) {
+            // replicate across every slot whose low bits match the code
+            for (size_t j = codes[i]; j < primarySize; j += size_t(1) << length)
+                m_table[j] = entry;
+        } else {
+            const uint32_t link = m_table[codes[i] & primaryMask];
+            const size_t base = link >> 16;
+            const size_t size = size_t(1) << (link & 0xF);
+            for (size_t j = codes[i] >> m_bits; j < size; j += size_t(1) << (length - m_bits))
+                m_table[base + j] = entry;
         }
     }
     return true;
 }
 
-// Decodes a symbol from the tree
-bool zlib::huffmanTree::decode(bool &decoded, size_t &r, size_t &treepos, size_t bit) const {
-    size_t numcodes = m_tree2D.size() / 2;
-    if (treepos >= numcodes)
-        return false;
+inline uint32_t zlib::huffmanTree::lookup(uint64_t bits) const {
+    const uint32_t entry = m_table[bits & ((uint64_t(1) << m_bits) - 1)];
+    if (!(entry & kSubTable))
+        return entry;
+    const uint64_t index = (bits >> m_bits) & ((uint64_t(1) << (entry & 0xF)) - 1);
+    return m_table[(entry >> 16) + index];
+}
 
-    r = m_tree2D[2 * treepos + bit];
-    decoded = (r < numcodes);
-    treepos = decoded ? 0 : r - numcodes;
-    return true;
+inline void zlib::inflator::refill() {
+    while (m_bitCount <= 56) {
+        if (m_in < m_end) {
+            m_bitBuffer |= uint64_t(*m_in++) << m_bitCount;
+        } else if (++m_overrun > 8) {
+            // consumed past the end of the stream without an end code
+            m_error = true;
+            return;
+        }
+        m_bitCount += 8;
+    }
 }
 
-bool zlib::inflator::inflate(u::vector<unsigned char> &out, const unsigned char *in, size_t length, size_t inpos) {
-    size_t bp = 0;
+inline void zlib::inflator::dropBits(size_t nbits) {
+    m_bitBuffer >>= nbits;
+    m_bitCount -= nbits;
+}
+
+inline size_t zlib::inflator::readBits(size_t nbits) {
+    const size_t r = m_bitBuffer & ((uint64_t(1) << nbits) - 1);
+    dropBits(nbits);
+    return r;
+}
+
+bool zlib::inflator::inflate(u::vector<unsigned char> &out, const unsigned char *in, size_t length) {
+    m_in = in;
+    m_end = in + length;
+
+    // most streams compress well, avoid a few rounds of regrowing
+    if (out.size() < length * 4)
+        out.resize(length * 4);
+
     size_t pos = 0;
     size_t bfinal = 0;
     while (!bfinal && !m_error) {
-        if (bp >> 3 >= length)
+        refill();
+        if (m_error)
             return false;
 
-        bfinal = readBitFromStream(bp, &in[inpos]);
-        size_t btype = readBitFromStream(bp, &in[inpos]);
-        btype += 2 * readBitFromStream(bp, &in[inpos]);
+        bfinal = readBits(1);
+        const size_t btype = readBits(2);
 
         if (btype == 3)
             return false;
         else if (btype == 0)
-            inflateNoCompression(out, &in[inpos], bp, pos, length);
+            inflateNoCompression(out, pos);
         else
-            inflateHuffmanBlock(out, &in[inpos], bp, pos, length, btype);
+            inflateHuffmanBlock(out, pos, btype);
     }
-    if (m_error)
+    // consumed zero padding which was never in the stream
+    if (m_error || m_overrun * 8 > m_bitCount)
         return false;
     out.resize(pos);
     return true;
 }
 
 // get the tree of a deflated block with fixed tree
-void zlib::inflator::generateFixedTrees(huffmanTree& tree, huffmanTree& treeD) {
-    u::vector<size_t> bitlen(288, 8);
-    u::vector<size_t> bitlenD(32, 5);
+void zlib::inflator::generateFixedTrees(huffmanTree &tree, huffmanTree &treeD) {
+    unsigned char bitlen[288];
+    unsigned char bitlenD[32];
 
-    for(size_t i = 144; i <= 255; i++)
+    for (size_t i = 0; i <= 143; i++)
+        bitlen[i] = 8;
+    for (size_t i = 144; i <= 255; i++)
         bitlen[i] = 9;
-    for(size_t i = 256; i <= 279; i++)
+    for (size_t i = 256; i <= 279; i++)
         bitlen[i] = 7;
+    for (size_t i = 280; i <= 287; i++)
+        bitlen[i] = 8;
+    for (size_t i = 0; i < 32; i++)
+        bitlenD[i] = 5;
 
-    tree.make(bitlen, 15);
-    treeD.make(bitlenD, 15);
+    tree.make(bitlen, 288);
+    treeD.make(bitlenD, 32);
 }
 
-size_t zlib::inflator::huffmanDecodeSymbol(const unsigned char *in, size_t &bp, const huffmanTree &m_codeTree, size_t inlength) {
-    bool decoded;
-    size_t ct;
-    for (size_t treepos = 0;;) {
-        // error: end reached without endcode
-        if ((bp & 0x07) == 0 && (bp >> 3) > inlength) {
-            m_error = true;
-            return 0;
-        }
-        if (!m_codeTree.decode(decoded, ct, treepos, readBitFromStream(bp, in))) {
-            m_error = true;
-            return 0;
-        }
-        if (decoded)
-            return ct;
+// the bit buffer must hold at least 15 bits
+inline size_t zlib::inflator::huffmanDecodeSymbol(const huffmanTree &codeTree) {
+    const uint32_t entry = codeTree.lookup(m_bitBuffer);
+    const size_t length = entry & 0xF;
+    if (length == 0) {
+        m_error = true;
+        return 0;
     }
-    return 0;
+    dropBits(length);
+    return entry >> 16;
 }
 
 // get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree
-void zlib::inflator::getTreeInflateDynamic(huffmanTree &tree, huffmanTree &treeD,
-    const unsigned char *in, size_t &bp, size_t inlength)
-{
-    u::vector<size_t> bitlen(288, 0);
-    u::vector<size_t> bitlenD(32, 0);
+void zlib::inflator::getTreeInflateDynamic(huffmanTree &tree, huffmanTree &treeD) {
+    unsigned char bitlen[288 + 32] = { 0 };
 
-    if (bp >> 3 >= inlength - 2)
-        returnError();
+    refill();
+    if (m_error)
+        return;
 
-    const size_t literals = readBitsFromStream(bp, in, 5) + 257; // number of literal/length codes + 257
-    const size_t distance = readBitsFromStream(bp, in, 5) + 1; // number of dist codes + 1
-    const size_t codeLengths = readBitsFromStream(bp, in, 4) + 4; // number of code length codes + 4
+    const size_t literals = readBits(5) + 257; // number of literal/length codes + 257
+    const size_t distance = readBits(5) + 1; // number of dist codes + 1
+    const size_t codeLengths = readBits(4) + 4; // number of code length codes + 4
 
-    u::vector<size_t> codelengthcode(19);
-    for (size_t i = 0; i < 19; i++)
-        codelengthcode[kCodeLengthCodeLengths[i]] = (i < codeLengths)
-            ? readBitsFromStream(bp, in, 3) : 0;
+    if (literals > 286 || distance > 30)
+        returnError();
 
-    if (!m_codeLengthCodeTree.make(codelengthcode, 7))
+    unsigned char codelengthcode[19] = { 0 };
+    for (size_t i = 0; i < codeLengths; i++) {
+        refill();
+        codelengthcode[kCodeLengthCodeLengths[i]] = readBits(3);
+    }
+
+    if (!m_codeLengthCodeTree.make(codelengthcode, 19))
         returnError();
 
+    // literal and distance lengths are one sequence, repeats may cross between them
     size_t i = 0;
-    size_t replength;
-
     while (i < literals + distance) {
-        size_t code = huffmanDecodeSymbol(in, bp, m_codeLengthCodeTree, inlength);
+        refill();
+        const size_t code = huffmanDecodeSymbol(m_codeLengthCodeTree);
         if (m_error)
             return;
 
-        // length code
+        size_t replength = 0;
+        unsigned char value = 0;
         if (code <= 15) {
-            if (i < literals)
-                bitlen[i++] = code;
-            else
-                bitlenD[i++ - literals] = code;
-        }
-
-        // repeat previous
-        else if (code == 16) {
-            if (bp >> 3 >= inlength)
+            // length code
+            bitlen[i++] = code;
+            continue;
+        } else if (code == 16) {
+            // repeat previous
+            if (i == 0)
                 returnError();
-            replength = 3 + readBitsFromStream(bp, in, 2);
-            size_t value; // set value to the previous code
-            if((i - 1) < literals)
-                value = bitlen[i - 1];
-            else
-                value = bitlenD[i - literals - 1];
-
-            for (size_t n = 0; n < replength; n++) {
-                if (i >= literals + distance)
-                    returnError();
-                if (i < literals)
-                    bitlen[i++] = value;
-                else
-                    bitlenD[i++ - literals] = value;
-            }
-        }
-
-        // repeat "0" 3-10 times
-        else if(code == 17) {
-            if (bp >> 3 >= inlength)
-                returnError();
-            replength = 3 + readBitsFromStream(bp, in, 3);
-            for (size_t n = 0; n < replength; n++) {
-                if (i >= literals + distance)
-                    returnError();
-                if (i < literals)
-                    bitlen[i++] = 0;
-                else
-                    bitlenD[i++ - literals] = 0;
-            }
-        }
-
-        // repeat "0" 11-138 times
-        else if (code == 18) {
-            if (bp >> 3 >= inlength) {
-                m_error = true;
-                return;
-            }
-            replength = 11 + readBitsFromStream(bp, in, 7);
-            for (size_t n = 0; n < replength; n++) {
-                if (i >= literals + distance) {
-                    m_error = true;
-                    return;
-                }
-                if (i < literals)
-                    bitlen[i++] = 0;
-                else
-                    bitlenD[i++ - literals] = 0;
-            }
+            replength = 3 + readBits(2);
+            value = bitlen[i - 1];
+        } else if (code == 17) {
+            // repeat "0" 3-10 times
+            replength = 3 + readBits(3);
         } else {
-            m_error = true;
-            return;
+            // repeat "0" 11-138 times
+            replength = 11 + readBits(7);
         }
+
+        if (i + replength > literals + distance)
+            returnError();
+        for (size_t n = 0; n < replength; n++)
+            bitlen[i++] = value;
     }
     // the length of the end code 256 must be larger than 0
     if (bitlen[256] == 0)
         returnError();
-    if (!tree.make(bitlen, 15))
+    if (!tree.make(bitlen, literals))
         returnError();
-    if (!treeD.make(bitlenD, 15))
+    if (!treeD.make(bitlen + literals, distance))
         returnError();
 }
 
-void zlib::inflator::inflateHuffmanBlock(u::vector<unsigned char> &out, const unsigned char *in,
-    size_t &bp, size_t &pos, size_t inlength, size_t btype)
-{
-    if(btype == 1)
+void zlib::inflator::inflateHuffmanBlock(u::vector<unsigned char> &out, size_t &pos, size_t btype) {
+    if (btype == 1)
         generateFixedTrees(m_codeTree, m_codeTreeDistance);
-    else if(btype == 2) {
-        getTreeInflateDynamic(m_codeTree, m_codeTreeDistance, in, bp, inlength);
+    else if (btype == 2) {
+        getTreeInflateDynamic(m_codeTree, m_codeTreeDistance);
         if (m_error)
             return;
     }
     for (;;) {
-        size_t code = huffmanDecodeSymbol(in, bp, m_codeTree, inlength);
+        // a length/distance pair needs at most 15+5+15+13 bits, one refill covers it
+        refill();
         if (m_error)
             return;
 
-        // end code
-        if (code == 256)
+        const size_t code = huffmanDecodeSymbol(m_codeTree);
+        if (m_error)
             return;
 
-        // literal symbol
-        else if(code <= 255) {
+        if (code <= 255) {
+            // literal symbol
             if (pos >= out.size())
                 out.resize((pos + 1) * 2);
-            out[pos++] = (unsigned char)(code);
-        }
-
-        // length code
-        else if(code >= 257 && code <= 285) {
-            size_t length = kLengthBases[code - 257];
-            size_t numextrabits = kLengthExtras[code - 257];
-
-            if ((bp >> 3) >= inlength)
+            out[pos++] = (unsigned char)code;
+        } else if (code == 256) {
+            // end code
+            return;
+        } else {
+            // length code
+            if (code > 285)
                 returnError();
 
-            length += readBitsFromStream(bp, in, numextrabits);
-            size_t codeD = huffmanDecodeSymbol(in, bp, m_codeTreeDistance, inlength);
+            const size_t length = kLengthBases[code - 257] + readBits(kLengthExtras[code - 257]);
+            const size_t codeD = huffmanDecodeSymbol(m_codeTreeDistance);
             if (m_error)
                 return;
 
             if (codeD > 29)
                 returnError();
 
-            size_t dist = kDistanceBases[codeD];
-            size_t numextrabitsD = kDistanceExtras[codeD];
-
-            if ((bp >> 3) >= inlength)
+            const size_t dist = kDistanceBases[codeD] + readBits(kDistanceExtras[codeD]);
+            if (dist > pos)
                 returnError();
 
-            dist += readBitsFromStream(bp, in, numextrabitsD);
-            size_t start = pos;
-            size_t back = start - dist; // backwards
-
             if (pos + length >= out.size())
                 out.resize((pos + length) * 2);
-            for (size_t i = 0; i < length; i++) {
-                out[pos++] = out[back++];
-                if(back >= start)
-                    back = start - dist;
-            }
+
+            // overlapping copies repeat the last `dist' bytes, so go forwards
+            unsigned char *dst = &out[pos];
+            const unsigned char *src = dst - dist;
+            for (size_t i = 0; i < length; i++)
+                dst[i] = src[i];
+            pos += length;
         }
     }
 }
 
-void zlib::inflator::inflateNoCompression(u::vector<unsigned char> &out,
-    const unsigned char *in, size_t &bp, size_t &pos, size_t inlength)
-{
+void zlib::inflator::inflateNoCompression(u::vector<unsigned char> &out, size_t &pos) {
     // go to first boundary of byte
-    while ((bp & 0x7) != 0)
-        bp++;
+    dropBits(m_bitCount & 7);
 
-    size_t p = bp / 8;
     // error: bit pointer will jump past memory
-    if (p >= inlength - 4)
+    if (m_overrun * 8 + 32 > m_bitCount)
         returnError();
 
-    size_t length = in[p] + 256 * in[p + 1];
-    size_t numberOfLengths = in[p + 2] + 256 * in[p + 3];
-
-    p += 4;
+    const size_t length = readBits(16);
+    const size_t numberOfLengths = readBits(16);
     if (length + numberOfLengths != 65535)
         returnError();
 
+    // hand the bytes still sitting in the bit buffer back to the input
+    m_in -= m_bitCount / 8 - m_overrun;
+    m_bitBuffer = 0;
+    m_bitCount = 0;
+    m_overrun = 0;
+
+    if (length > size_t(m_end - m_in))
+        returnError();
     if (pos + length >= out.size())
         out.resize(pos + length);
-    if (p + length > inlength)
-        returnError();
-    for (size_t n = 0; n < length; n++)
-        out[pos++] = in[p++];
-    bp = p * 8;
+    memcpy(&out[pos], m_in, length);
+    m_in += length;
+    pos += length;
 }
 
 bool zlib::decompress(u::vector<unsigned char> &out, const u::vector<unsigned char> &in) {
@@ -380,7 +403,365 @@ bool zlib::decompress(u::vector<unsigned char> &out, const unsigned char *in, si
     // "The additional flags shall not specify a preset dictionary."
     if (fdict != 0)
         return false;
-    return inflator().inflate(out, in, length, 2);
+    return inflator().inflate(out, in + 2, length - 2);
+}
+
+///! inflateStream
+static constexpr int kSymbolNeedInput = -1;
+static constexpr int kSymbolError = -2;
+
+zlib::inflateStream::inflateStream()
+    : m_state(kHeader)
+    , m_final(false)
+    , m_in(nullptr)
+    , m_end(nullptr)
+    , m_bitBuffer(0)
+    , m_bitCount(0)
+    , m_out(nullptr)
+    , m_outPos(0)
+    , m_outLength(0)
+    , m_checked(0)
+    , m_window(kWindowSize)
+    , m_total(0)
+    , m_length(0)
+    , m_distance(0)
+    , m_literals(0)
+    , m_distances(0)
+    , m_codeLengths(0)
+    , m_index(0)
+    , m_s1(1)
+    , m_s2(0)
+{
+    memset(m_lengths, 0, sizeof m_lengths);
+}
+
+void zlib::inflateStream::input(const unsigned char *data, size_t length) {
+    m_in = data;
+    m_end = data + length;
+}
+
+inline void zlib::inflateStream::refill() {
+    while (m_bitCount <= 56 && m_in < m_end) {
+        m_bitBuffer |= uint64_t(*m_in++) << m_bitCount;
+        m_bitCount += 8;
+    }
+}
+
+inline void zlib::inflateStream::dropBits(size_t nbits) {
+    m_bitBuffer >>= nbits;
+    m_bitCount -= nbits;
+}
+
+inline size_t zlib::inflateStream::readBits(size_t nbits) {
+    const size_t r = m_bitBuffer & ((uint64_t(1) << nbits) - 1);
+    dropBits(nbits);
+    return r;
+}
+
+inline bool zlib::inflateStream::need(size_t nbits) {
+    refill();
+    return m_bitCount >= nbits;
+}
+
+// decode the next symbol from `count' bits without consuming them
+inline int zlib::inflateStream::peekSymbol(const huffmanTree &tree, uint64_t bits, size_t count, size_t *length) const {
+    const uint32_t entry = tree.lookup(bits);
+    *length = entry & 0xF;
+    if (*length && *length <= count)
+        return entry >> 16;
+    // with fewer bits than the longest code it may still become valid
+    return count < 15 ? kSymbolNeedInput : kSymbolError;
+}
+
+inline void zlib::inflateStream::emit(unsigned char byte) {
+    m_window[m_total++ & (kWindowSize - 1)] = byte;
+    m_out[m_outPos++] = byte;
+}
+
+void zlib::inflateStream::emit(const unsigned char *data, size_t length) {
+    memcpy(m_out + m_outPos, data, length);
+    m_outPos += length;
+    // only the tail can ever be referenced again
+    if (length > kWindowSize) {
+        m_total += length - kWindowSize;
+        data += length - kWindowSize;
+        length = kWindowSize;
+    }
+    while (length) {
+        const size_t offset = m_total & (kWindowSize - 1);
+        const size_t count = u::min(length, kWindowSize - offset);
+        memcpy(&m_window[offset], data, count);
+        m_total += count;
+        data += count;
+        length -= count;
+    }
+}
+
+void zlib::inflateStream::checksum() {
+    const unsigned char *data = m_out + m_checked;
+    size_t length = m_outPos - m_checked;
+    while (length) {
+        const size_t count = u::min(length, size_t(5552));
+        for (size_t i = 0; i < count; i++) {
+            m_s1 += data[i];
+            m_s2 += m_s1;
+        }
+        m_s1 %= 65521;
+        m_s2 %= 65521;
+        data += count;
+        length -= count;
+    }
+    m_checked = m_outPos;
+}
+
+zlib::inflateStream::status zlib::inflateStream::inflate(unsigned char *out, size_t length, size_t *written) {
+    m_out = out;
+    m_outPos = 0;
+    m_outLength = length;
+    m_checked = 0;
+    const status result = run();
+    checksum();
+    *written = m_outPos;
+    if (result == kError)
+        m_state = kFailed;
+    return result;
+}
+
+zlib::inflateStream::status zlib::inflateStream::run() {
+    for (;;) {
+        switch (m_state) {
+        case kHeader:
+            if (!need(16))
+                return kNeedInput;
+            {
+                const size_t cmf = readBits(8);
+                const size_t flg = readBits(8);
+                // same restrictions as zlib::decompress
+                if ((cmf * 256 + flg) % 31 != 0)
+                    return kError;
+                if ((cmf & 15) != 8 || ((cmf >> 4) & 15) > 7 || ((flg >> 5) & 1) != 0)
+                    return kError;
+            }
+            m_state = kBlockHeader;
+            break;
+
+        case kBlockHeader:
+            if (!need(3))
+                return kNeedInput;
+            m_final = readBits(1);
+            switch (readBits(2)) {
+            case 0:
+                m_state = kStoredHeader;
+                break;
+            case 1:
+                inflator::generateFixedTrees(m_codeTree, m_codeTreeDistance);
+                m_state = kCodes;
+                break;
+            case 2:
+                m_state = kTableHeader;
+                break;
+            default:
+                return kError;
+            }
+            break;
+
+        case kStoredHeader:
+            // go to first boundary of byte
+            dropBits(m_bitCount & 7);
+            if (!need(32))
+                return kNeedInput;
+            m_length = readBits(16);
+            if (m_length + readBits(16) != 65535)
+                return kError;
+            m_state = kStored;
+            break;
+
+        case kStored:
+            // whatever is left in the bit buffer comes first
+            while (m_length && m_bitCount) {
+                if (m_outPos == m_outLength)
+                    return kNeedOutput;
+                emit((unsigned char)readBits(8));
+                m_length--;
+            }
+            while (m_length) {
+                if (m_outPos == m_outLength)
+                    return kNeedOutput;
+                if (m_in == m_end)
+                    return kNeedInput;
+                const size_t count = u::min(u::min(m_length, size_t(m_end - m_in)), m_outLength - m_outPos);
+                emit(m_in, count);
+                m_in += count;
+                m_length -= count;
+            }
+            m_state = m_final ? kChecksum : kBlockHeader;
+            break;
+
+        case kTableHeader:
+            if (!need(14))
+                return kNeedInput;
+            m_literals = readBits(5) + 257;
+            m_distances = readBits(5) + 1;
+            m_codeLengths = readBits(4) + 4;
+            if (m_literals > 286 || m_distances > 30)
+                return kError;
+            memset(m_lengths, 0, sizeof m_lengths);
+            m_index = 0;
+            m_state = kCodeLengthCodes;
+            break;
+
+        case kCodeLengthCodes:
+            {
+                unsigned char codelengthcode[19] = { 0 };
+                for (; m_index < m_codeLengths; m_index++) {
+                    if (!need(3))
+                        return kNeedInput;
+                    m_lengths[m_index] = readBits(3);
+                }
+                for (size_t i = 0; i < m_codeLengths; i++)
+                    codelengthcode[kCodeLengthCodeLengths[i]] = m_lengths[i];
+                if (!m_codeLengthCodeTree.make(codelengthcode, 19))
+                    return kError;
+            }
+            memset(m_lengths, 0, sizeof m_lengths);
+            m_index = 0;
+            m_state = kCodeLengths;
+            break;
+
+        case kCodeLengths:
+            while (m_index < m_literals + m_distances) {
+                refill();
+                size_t length;
+                const int code = peekSymbol(m_codeLengthCodeTree, m_bitBuffer, m_bitCount, &length);
+                if (code == kSymbolNeedInput)
+                    return kNeedInput;
+                if (code == kSymbolError)
+                    return kError;
+                if (code <= 15) {
+                    dropBits(length);
+                    m_lengths[m_index++] = code;
+                    continue;
+                }
+                // the repeat count follows the code, take both or neither
+                static constexpr size_t kRepeatBits[] = { 2, 3, 7 };
+                static constexpr size_t kRepeatBase[] = { 3, 3, 11 };
+                const size_t extra = kRepeatBits[code - 16];
+                if (m_bitCount < length + extra)
+                    return kNeedInput;
+                if (code == 16 && m_index == 0)
+                    return kError;
+                dropBits(length);
+                const size_t replength = kRepeatBase[code - 16] + readBits(extra);
+                const unsigned char value = code == 16 ? m_lengths[m_index - 1] : 0;
+                if (m_index + replength > m_literals + m_distances)
+                    return kError;
+                for (size_t n = 0; n < replength; n++)
+                    m_lengths[m_index++] = value;
+            }
+            // the length of the end code 256 must be larger than 0
+            if (m_lengths[256] == 0)
+                return kError;
+            if (!m_codeTree.make(m_lengths, m_literals))
+                return kError;
+            if (!m_codeTreeDistance.make(m_lengths + m_literals, m_distances))
+                return kError;
+            m_state = kCodes;
+            break;
+
+        case kCodes:
+            for (;;) {
+                refill();
+                size_t length;
+                const int code = peekSymbol(m_codeTree, m_bitBuffer, m_bitCount, &length);
+                if (code == kSymbolNeedInput)
+                    return kNeedInput;
+                if (code == kSymbolError)
+                    return kError;
+
+                if (code <= 255) {
+                    // literal symbol
+                    if (m_outPos == m_outLength)
+                        return kNeedOutput;
+                    dropBits(length);
+                    emit((unsigned char)code);
+                    continue;
+                }
+
+                if (code == 256) {
+                    // end code
+                    dropBits(length);
+                    m_state = m_final ? kChecksum : kBlockHeader;
+                    break;
+                }
+
+                if (code > 285)
+                    return kError;
+
+                // peek the whole length/distance pair before consuming any of it
+                const size_t lengthExtra = kLengthExtras[code - 257];
+                size_t used = length + lengthExtra;
+                if (m_bitCount < used)
+                    return kNeedInput;
+                uint64_t bits = m_bitBuffer >> length;
+                const size_t matchLength = kLengthBases[code - 257] + (bits & ((uint64_t(1) << lengthExtra) - 1));
+                bits >>= lengthExtra;
+
+                size_t lengthD;
+                const int codeD = peekSymbol(m_codeTreeDistance, bits, m_bitCount - used, &lengthD);
+                if (codeD == kSymbolNeedInput)
+                    return kNeedInput;
+                if (codeD == kSymbolError || codeD > 29)
+                    return kError;
+
+                const size_t distanceExtra = kDistanceExtras[codeD];
+                used += lengthD + distanceExtra;
+                if (m_bitCount < used)
+                    return kNeedInput;
+                bits >>= lengthD;
+                const size_t distance = kDistanceBases[codeD] + (bits & ((uint64_t(1) << distanceExtra) - 1));
+                if (distance > m_total)
+                    return kError;
+
+                dropBits(used);
+                m_length = matchLength;
+                m_distance = distance;
+                m_state = kCopy;
+                break;
+            }
+            break;
+
+        case kCopy:
+            for (; m_length; m_length--) {
+                if (m_outPos == m_outLength)
+                    return kNeedOutput;
+                emit(m_window[(m_total - m_distance) & (kWindowSize - 1)]);
+            }
+            m_state = kCodes;
+            break;
+
+        case kChecksum:
+            // go to first boundary of byte
+            dropBits(m_bitCount & 7);
+            if (!need(32))
+                return kNeedInput;
+            checksum();
+            {
+                uint32_t adler = 0;
+                for (size_t i = 0; i < 4; i++)
+                    adler = (adler << 8) | readBits(8);
+                if (adler != ((m_s2 << 16) | m_s1))
+                    return kError;
+            }
+            m_state = kDone;
+            break;
+
+        case kDone:
+            return kFinished;
+
+        default:
+            return kError;
+        }
+    }
 }
 
 // zlib compression (fixed huffman only)
@@ -393,8 +774,8 @@ int zlib::deflator::bitReverse(int code, int codeBits) {
     return result;
 }
 
-size_t zlib::deflator::countMatches(const unsigned char *a, const unsigned char *b, int limit) {
-    int i;
+size_t zlib::deflator::countMatches(const unsigned char *a, const unsigned char *b, size_t limit) {
+    size_t i;
     for (i = 0; i < limit && i < 258; ++i)
         if (a[i] != b[i])
             break;
@@ -458,33 +839,47 @@ void zlib::deflator::huff(int n) {
         huffSwitch<4>(n);
 }
 
-void zlib::deflator::deflate(u::vector<unsigned char> &out, const unsigned char *in, size_t length, int quality) {
+void zlib::deflator::deflate(u::vector<unsigned char> &out, const unsigned char *in,
+    size_t start, size_t end, bool final, int quality)
+{
     static constexpr size_t kHashSize = 16384;
+    static constexpr size_t kWindowSize = 32768;
     m_data = &out;
 
     if (quality < 5)
         quality = 5;
 
-    out.push_back(0x78); // DEFLATE 32K window
-    out.push_back(0x5E); // FLEVEL = 1
-
-    add(1, 1); // BFINAL = 1
+    add(final ? 1 : 0, 1); // BFINAL
     add(1, 2); // BTYPE = 1 (fixed huffman)
 
     // Flat hash table
-    u::vector<unsigned char *> hashTable[kHashSize];
+    u::vector<u::vector<const unsigned char *>> hashTable(kHashSize);
 
-    int i = 0;
-    int dataLength = length;
-    while (i < dataLength - 3) {
-        auto h = hash(&in[0] + i) & (kHashSize - 1);
-        size_t best = 3;
-        unsigned char *bestLocation = nullptr;
+    const auto insert = [&hashTable, quality](const unsigned char *where, unsigned int h) {
         auto &hashList = hashTable[h];
+        if (hashList.size() == size_t(2*quality)) {
+            // hash table entry too long, delete half the entries
+            u::moveMemory(&hashList[0], &hashList[0]+quality, sizeof(hashList[0])*quality);
+            hashList.resize(quality);
+        }
+        hashList.push_back(where);
+    };
+
+    // prime the hash table with the window preceding this run
+    const size_t dictionary = start > kWindowSize ? start - kWindowSize : 0;
+    for (size_t i = dictionary; i < start && i + 3 < end; ++i)
+        insert(in + i, hash(in + i) & (kHashSize - 1));
+
+    size_t i = start;
+    while (i + 3 < end) {
+        auto h = hash(in + i) & (kHashSize - 1);
+        size_t best = 3;
+        const unsigned char *bestLocation = nullptr;
+        const auto &hashList = hashTable[h];
         for (size_t j = 0; j < hashList.size(); ++j) {
-            if (hashList[j] - &in[0] > i-32768) {
+            if (size_t(in + i - hashList[j]) < kWindowSize) {
                 // entry lies within a window
-                const size_t distance = countMatches(hashList[j], &in[0]+i, dataLength-i);
+                const size_t distance = countMatches(hashList[j], in + i, end - i);
                 if (distance >= best) {
                     best = distance;
                     bestLocation = hashList[j];
@@ -492,22 +887,16 @@ void zlib::deflator::deflate(u::vector<unsigned char> &out, const unsigned char
             }
         }
 
-        if (hashList.size() == size_t(2*quality)) {
-            // hash table entry too long, delete half the entries
-            unsigned char **dst = &hashTable[h][0];
-            unsigned char **src = (&hashTable[h][0])+quality;
-            u::moveMemory(dst, src, sizeof(hashTable[h][0])*quality);
-            hashTable[h].resize(quality);
-        }
-
-        hashList.push_back((unsigned char *)&in[0]+i);
+        insert(in + i, h);
 
         if (bestLocation) {
             // lazy matching
-            h = hash(&in[0]+i+1) & (kHashSize - 1);
-            hashList = hashTable[h];
-            for (size_t j = 0; j < hashList.size(); ++j) {
-                const size_t dist = countMatches(hashList[j], &in[0]+i+1, dataLength-i-1);
+            h = hash(in + i + 1) & (kHashSize - 1);
+            const auto &lazyList = hashTable[h];
+            for (size_t j = 0; j < lazyList.size(); ++j) {
+                if (size_t(in + i + 1 - lazyList[j]) >= kWindowSize)
+                    continue;
+                const size_t dist = countMatches(lazyList[j], in + i + 1, end - i - 1);
                 if (dist > best) {
                     bestLocation = nullptr;
                     break;
@@ -517,7 +906,7 @@ void zlib::deflator::deflate(u::vector<unsigned char> &out, const unsigned char
 
         if (bestLocation) {
             // distance back
-            int distance = int(&in[0]+i-bestLocation);
+            int distance = int(in + i - bestLocation);
             assert(distance <= 32767);
             assert(best <= 258);
             int j;
@@ -537,32 +926,59 @@ void zlib::deflator::deflate(u::vector<unsigned char> &out, const unsigned char
     }
 
     // write out final bytes
-    for (; i < dataLength; ++i)
+    for (; i < end; ++i)
         huffB(in[i]);
     huff(256); // end of block
 
+    if (!final) {
+        // an empty stored block byte aligns the run so the next one can
+        // follow directly
+        add(0, 1); // BFINAL = 0
+        add(0, 2); // BTYPE = 0 (no compression)
+        while (m_bitCount & 7)
+            add(0, 1);
+        add(0x0000, 16); // LEN
+        add(0xFFFF, 16); // NLEN
+    }
+
     // pad with "zero-bits"
     while (m_bitCount)
         add(0, 1);
+}
 
-    // compute adler32
-    unsigned int s1 = 1;
-    unsigned int s2 = 0;
-    unsigned int blockLength = dataLength % 5552;
-    for (int j = 0; j < dataLength; ) {
-        for (unsigned int i = 0; i < blockLength; ++i) {
-            s1 += in[j+i];
+uint32_t zlib::adler32(const unsigned char *in, size_t length) {
+    uint32_t s1 = 1;
+    uint32_t s2 = 0;
+    while (length) {
+        const size_t blockLength = u::min(length, size_t(5552));
+        for (size_t i = 0; i < blockLength; ++i) {
+            s1 += in[i];
             s2 += s1;
         }
         s1 %= 65521;
         s2 %= 65521;
-        j += blockLength;
-        blockLength = 5552;
+        in += blockLength;
+        length -= blockLength;
     }
-    out.push_back((unsigned char)(s2 >> 8));
-    out.push_back((unsigned char)(s2));
-    out.push_back((unsigned char)(s1 >> 8));
-    out.push_back((unsigned char)(s1));
+    return (s2 << 16) | s1;
+}
+
+uint32_t zlib::adler32Combine(uint32_t adler1, uint32_t adler2, size_t length2) {
+    static constexpr uint32_t kBase = 65521;
+    const uint32_t remainder = length2 % kBase;
+    uint32_t sum1 = adler1 & 0xFFFF;
+    uint32_t sum2 = (remainder * sum1) % kBase;
+    sum1 += (adler2 & 0xFFFF) + kBase - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + kBase - remainder;
+    if (sum1 >= kBase)
+        sum1 -= kBase;
+    if (sum1 >= kBase)
+        sum1 -= kBase;
+    if (sum2 >= kBase * 2)
+        sum2 -= kBase * 2;
+    if (sum2 >= kBase)
+        sum2 -= kBase;
+    return (sum2 << 16) | sum1;
 }
 
 bool zlib::compress(u::vector<unsigned char> &out, const u::vector<unsigned char> &in, int quality) {
@@ -570,7 +986,40 @@ bool zlib::compress(u::vector<unsigned char> &out, const u::vector<unsigned char
 }
 
 bool zlib::compress(u::vector<unsigned char> &out, const unsigned char *in, size_t length, int quality) {
-    deflator().deflate(out, in, length, quality);
+    // The input is split into fixed size runs which are compressed on the
+    // worker pool (pigz style.) Since the split doesn't depend on the amount
+    // of threads the output is the same on every machine.
+    static constexpr size_t kBlockSize = 128 << 10;
+    const size_t blocks = length ? (length + kBlockSize - 1) / kBlockSize : 1;
+
+    u::vector<u::vector<unsigned char>> compressed(blocks);
+    u::vector<uint32_t> checksums(blocks);
+    u::parallelFor(blocks, [in, length, quality, blocks, &compressed, &checksums](size_t index) {
+        const size_t start = index * kBlockSize;
+        const size_t end = u::min(start + kBlockSize, length);
+        deflator().deflate(compressed[index], in, start, end, index == blocks - 1, quality);
+        checksums[index] = adler32(in + start, end - start);
+    });
+
+    size_t size = 6;
+    for (const auto &it : compressed)
+        size += it.size();
+    out.reserve(out.size() + size);
+
+    out.push_back(0x78); // DEFLATE 32K window
+    out.push_back(0x5E); // FLEVEL = 1
+
+    uint32_t adler = checksums[0];
+    for (size_t i = 0; i < blocks; i++) {
+        out.insert(out.end(), compressed[i].begin(), compressed[i].end());
+        if (i)
+            adler = adler32Combine(adler, checksums[i], u::min(kBlockSize, length - i * kBlockSize));
+    }
+
+    out.push_back((unsigned char)(adler >> 24));
+    out.push_back((unsigned char)(adler >> 16));
+    out.push_back((unsigned char)(adler >> 8));
+    out.push_back((unsigned char)(adler));
     return true;
 }
 
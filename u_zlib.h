@@ -1,6 +1,7 @@
 #ifndef U_ZLIB_HDR
 #define U_ZLIB_HDR
 #include <stddef.h>
+#include <stdint.h>
 #include "u_vector.h"
 
 namespace u {
@@ -11,21 +12,34 @@ struct zlib {
     static bool compress(u::vector<unsigned char> &out, const u::vector<unsigned char> &in, int quality = 5);
     static bool compress(u::vector<unsigned char> &out, const unsigned char *in, size_t length, int quality = 5);
 
-private:
-    static size_t readBitFromStream(size_t &bitp, const unsigned char *bits);
-    static size_t readBitsFromStream(size_t &bitp, const unsigned char *bits, size_t nbits);
+    struct inflateStream;
 
+private:
     struct huffmanTree {
-        bool make(const u::vector<size_t> &bitlen, size_t maxbitlen);
-        // Decodes a symbol from the tree
-        bool decode(bool& decoded, size_t &r, size_t &treepos, size_t bit) const;
+        huffmanTree()
+            : m_bits(0)
+        {
+        }
+
+        // Build the decoding tables from a list of code lengths
+        bool make(const unsigned char *lengths, size_t count);
+
+        // Table entry for the code in the least significant bits of `bits'
+        // Symbol lives in the upper 16 bits, code length in the lower 4
+        // bits. An entry with a zero length is an invalid code.
+        uint32_t lookup(uint64_t bits) const;
 
     private:
-        // 2D representation of a huffman tree: The one dimension is "0" or "1",
-        // the other contains all nodes and leaves of the tree.
-        u::vector<size_t> m_tree2D;
+        // Multi-level lookup table: a primary table indexed by the first
+        // `m_bits' bits of a code, followed by subtables for longer codes.
+        u::vector<uint32_t> m_table;
+        size_t m_bits;
     };
 
+    static uint32_t adler32(const unsigned char *in, size_t length);
+    // checksum of two concatenated runs given the length of the second
+    static uint32_t adler32Combine(uint32_t adler1, uint32_t adler2, size_t length2);
+
     struct deflator {
         deflator()
             : m_data(nullptr)
@@ -34,11 +48,15 @@ private:
         {
         }
 
-        void deflate(u::vector<unsigned char> &out, const unsigned char *in, size_t length, int quality = 5);
+        // Compress in[start, end) as a run of fixed huffman blocks. Up to 32 KiB
+        // before `start' primes the match finder so independently compressed
+        // runs can be concatenated; a non-final run ends byte aligned.
+        void deflate(u::vector<unsigned char> &out, const unsigned char *in,
+            size_t start, size_t end, bool final, int quality = 5);
 
     protected:
         int bitReverse(int code, int codeBits);
-        size_t countMatches(const unsigned char *a, const unsigned char *b, int limit);
+        size_t countMatches(const unsigned char *a, const unsigned char *b, size_t limit);
         unsigned int hash(const unsigned char *data);
 
         void flush();
@@ -59,30 +77,47 @@ private:
     };
 
     struct inflator {
-        inflator() :
-            m_error(false)
+        inflator()
+            : m_error(false)
+            , m_in(nullptr)
+            , m_end(nullptr)
+            , m_bitBuffer(0)
+            , m_bitCount(0)
+            , m_overrun(0)
         {
         }
 
-        bool inflate(u::vector<unsigned char> &out, const unsigned char *in, size_t length, size_t inpos = 0);
+        bool inflate(u::vector<unsigned char> &out, const unsigned char *in, size_t length);
 
         // get the tree of a deflated block with fixed tree
-        void generateFixedTrees(huffmanTree& tree, huffmanTree& treeD);
+        static void generateFixedTrees(huffmanTree &tree, huffmanTree &treeD);
 
-        // decode a single symbol from given list of bits with given code tree. return value is the symbol
-        size_t huffmanDecodeSymbol(const unsigned char *in, size_t &bp, const huffmanTree &codetree, size_t inlength);
+        // decode a single symbol from the bit buffer with given code tree. return value is the symbol
+        size_t huffmanDecodeSymbol(const huffmanTree &codeTree);
 
         // get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree
-        void getTreeInflateDynamic(huffmanTree &tree, huffmanTree &treeD, const unsigned char *in, size_t &bp, size_t inlength);
+        void getTreeInflateDynamic(huffmanTree &tree, huffmanTree &treeD);
 
-        void inflateHuffmanBlock(u::vector<unsigned char> &out, const unsigned char *in, size_t &bp, size_t &pos, size_t inlength, size_t btype);
-        void inflateNoCompression(u::vector<unsigned char> &out, const unsigned char *in, size_t &bp, size_t &pos, size_t inlength);
+        void inflateHuffmanBlock(u::vector<unsigned char> &out, size_t &pos, size_t btype);
+        void inflateNoCompression(u::vector<unsigned char> &out, size_t &pos);
+
+    protected:
+        // 64-bit bit buffer, refilled a byte at a time from the input
+        void refill();
+        size_t readBits(size_t nbits);
+        void dropBits(size_t nbits);
 
     private:
         friend struct zlib;
 
         bool m_error;
 
+        const unsigned char *m_in;
+        const unsigned char *m_end;
+        uint64_t m_bitBuffer;
+        size_t m_bitCount;
+        size_t m_overrun; // zero bytes shifted in past the end of the input
+
         // the code tree for Huffman codes, dist codes, and code length codes
         huffmanTree m_codeTree;
         huffmanTree m_codeTreeDistance;
@@ -90,5 +125,93 @@ private:
     };
 };
 
+// Resumable inflater. Compressed input is handed over in arbitrary chunks
+// and output is produced into a caller provided buffer; back references are
+// resolved against a 32 KiB sliding window so neither side has to be resident.
+struct zlib::inflateStream {
+    enum status {
+        kError,
+        kNeedInput, // all input consumed, hand over the next chunk with input()
+        kNeedOutput, // output buffer full, call inflate() again
+        kFinished
+    };
+
+    inflateStream();
+
+    // the data must stay valid until kNeedInput is returned
+    void input(const unsigned char *data, size_t length);
+    status inflate(unsigned char *out, size_t length, size_t *written);
+
+    bool finished() const;
+
+protected:
+    enum {
+        kHeader,
+        kBlockHeader,
+        kStoredHeader,
+        kStored,
+        kTableHeader,
+        kCodeLengthCodes,
+        kCodeLengths,
+        kCodes,
+        kCopy,
+        kChecksum,
+        kDone,
+        kFailed
+    };
+
+    status run();
+
+    void refill();
+    size_t readBits(size_t nbits);
+    void dropBits(size_t nbits);
+    bool need(size_t nbits);
+
+    int peekSymbol(const huffmanTree &tree, uint64_t bits, size_t count, size_t *length) const;
+
+    void emit(unsigned char byte);
+    void emit(const unsigned char *data, size_t length);
+    void checksum();
+
+private:
+    static constexpr size_t kWindowSize = 32768;
+
+    int m_state;
+    bool m_final;
+
+    const unsigned char *m_in;
+    const unsigned char *m_end;
+    uint64_t m_bitBuffer;
+    size_t m_bitCount;
+
+    unsigned char *m_out;
+    size_t m_outPos;
+    size_t m_outLength;
+    size_t m_checked;
+
+    u::vector<unsigned char> m_window;
+    size_t m_total; // bytes produced over the life of the stream
+
+    size_t m_length; // stored bytes or match length left to copy
+    size_t m_distance;
+
+    size_t m_literals;
+    size_t m_distances;
+    size_t m_codeLengths;
+    size_t m_index;
+    unsigned char m_lengths[288 + 32];
+
+    uint32_t m_s1; // adler32
+    uint32_t m_s2;
+
+    huffmanTree m_codeTree;
+    huffmanTree m_codeTreeDistance;
+    huffmanTree m_codeLengthCodeTree;
+};
+
+inline bool zlib::inflateStream::finished() const {
+    return m_state == kDone;
+}
+
 }
 #endif
@@ -62,11 +62,11 @@ world::~world() {
     unload(false);
 }
 
-bool world::load(const u::vector<unsigned char> &data) {
+bool world::load(u::file &fp) {
     // Unload any loaded ones before loading in the new one
     if (isLoaded())
         unload();
-    if (!m_map.load(data))
+    if (!m_map.load(fp))
         return false;
     m_billboards.resize(kBillboardCount);
     m_billboards[kBillboardJumpPad] = { "textures/icons/jumppad", 5.0f, true, { } };
@@ -81,8 +81,8 @@ bool world::isLoaded() const {
 }
 
 bool world::load(const u::string &file) {
-    auto read = u::read(neoGamePath() + "maps/" + file, "rb");
-    return read && load(*read) && m_renderer.load(m_map);
+    auto fp = u::fopen(neoGamePath() + "maps/" + file, "rb");
+    return fp && load(fp) && m_renderer.load(m_map);
 }
 
 bool world::upload(const m::perspective &p) {
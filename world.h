@@ -82,12 +82,20 @@ struct mapModel {
     bool highlight;
     r::occlusionQueries::ref occlusionQuery;
     float curFrame;
+
+    // Built by the renderer from the fields above and the model. Anything which
+    // changes those fields sets `dirty' to have them built again
+    m::mat4 transform; // model to world space
+    m::mat4 boundsTransform; // unit cube to the model bounds in world space
+    m::bbox bounds; // world space bounds
+    bool dirty;
 };
 
 inline mapModel::mapModel()
     : highlight(false)
     , occlusionQuery(size_t(-1))
     , curFrame(0.0f)
+    , dirty(true)
 {
 }
 
@@ -180,8 +188,8 @@ protected:
 
     static constexpr float kMaxTraceDistance = 99999.9f;
 
-    // Load from compressed data
-    bool load(const u::vector<unsigned char> &data);
+    // Load from compressed map file
+    bool load(u::file &fp);
 
 private:
     kdMap m_map; // The map for this world